@@ -0,0 +1,123 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Raw analog samples (SR_DF_ANALOG_RAW).
+ *
+ * Drivers send ADC values as they come from the hardware, plus a scale and
+ * offset per probe, instead of converting every value to a float. That's
+ * a quarter of the data for 8-bit ADCs, and consumers which don't need
+ * floats (or only some of them) never pay for the conversion.
+ */
+
+/*
+ * The conversion loops: one probe is a plain multiply-add over the array,
+ * more probes cycle through their scales and offsets. Both vectorize.
+ */
+#define CONVERT(type) do { \
+	const type *in = (const type *)raw->data + start * num_probes; \
+	if (num_probes == 1) { \
+		for (i = 0; i < num_samples; i++) \
+			data_out[i] = in[i] * scale[0] + offset[0]; \
+	} else { \
+		for (i = 0; i < num_samples; i++) \
+			for (p = 0; p < num_probes; p++) \
+				data_out[i * num_probes + p] = \
+					in[i * num_probes + p] * scale[p] \
+					+ offset[p]; \
+	} \
+} while (0)
+
+/**
+ * Get the size of one raw analog value.
+ *
+ * @param encoding One of SR_ANALOG_U8, SR_ANALOG_S8 or SR_ANALOG_S16.
+ *
+ * @return The size in bytes, or 0 for an unknown encoding.
+ */
+SR_API int sr_analog_raw_unitsize(int encoding)
+{
+	switch (encoding) {
+	case SR_ANALOG_U8:
+	case SR_ANALOG_S8:
+		return 1;
+	case SR_ANALOG_S16:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Convert raw analog samples to floats, as in an SR_DF_ANALOG packet.
+ *
+ * @param raw The samples. Must not be NULL.
+ * @param start The first sample to convert.
+ * @param num_samples The number of samples to convert.
+ * @param data_out Where to put the values. Must have room for
+ *                 num_samples * raw->num_probes floats.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_analog_raw_to_float(const struct sr_datafeed_analog_raw *raw,
+				  uint64_t start, uint64_t num_samples,
+				  float *data_out)
+{
+	const float *scale, *offset;
+	uint64_t i;
+	int num_probes, p;
+
+	if (!raw || !data_out) {
+		sr_err("analog: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	num_probes = raw->num_probes;
+	if (num_probes < 1 || num_probes > SR_ANALOG_RAW_MAX_PROBES
+	    || start + num_samples > (uint64_t)raw->num_samples) {
+		sr_err("analog: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	scale = raw->scale;
+	offset = raw->offset;
+
+	switch (raw->encoding) {
+	case SR_ANALOG_U8:
+		CONVERT(uint8_t);
+		break;
+	case SR_ANALOG_S8:
+		CONVERT(int8_t);
+		break;
+	case SR_ANALOG_S16:
+		CONVERT(int16_t);
+		break;
+	default:
+		sr_err("analog: %s: unknown encoding %d", __func__,
+		       raw->encoding);
+		return SR_ERR_ARG;
+	}
+
+	return SR_OK;
+}
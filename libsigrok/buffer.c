@@ -0,0 +1,233 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Reference-counted data buffers.
+ *
+ * Drivers fill an sr_buffer and attach it to the datafeed packet they send
+ * (e.g. sr_datafeed_logic.buffer). Any datafeed callback which wants to
+ * keep the data around after it returns can take its own reference with
+ * sr_buffer_ref(), instead of copying the data. Once the last reference is
+ * dropped, the buffer goes back to the pool it came from (if any), so the
+ * next packet can reuse it without another malloc.
+ *
+ * All functions in here are thread-safe.
+ */
+
+static void pool_unref(struct sr_buffer_pool *pool);
+
+static struct sr_buffer *buffer_alloc(size_t size)
+{
+	struct sr_buffer *buf;
+
+	/* The data lives right behind the struct, in the same allocation. */
+	if (!(buf = g_try_malloc(sizeof(struct sr_buffer) + size))) {
+		sr_err("buffer: %s: buf malloc failed", __func__);
+		return NULL;
+	}
+
+	buf->data = (uint8_t *)(buf + 1);
+	buf->size = size;
+	buf->refcount = 1;
+	buf->pool = NULL;
+
+	return buf;
+}
+
+/**
+ * Allocate a new, unpooled buffer.
+ *
+ * The buffer starts out with a reference count of 1, owned by the caller.
+ *
+ * @param size The size of the buffer's data area, in bytes.
+ *
+ * @return The new buffer, or NULL upon memory allocation errors.
+ */
+SR_API struct sr_buffer *sr_buffer_new(size_t size)
+{
+	return buffer_alloc(size);
+}
+
+/**
+ * Take an additional reference to a buffer.
+ *
+ * @param buf The buffer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_ref(struct sr_buffer *buf)
+{
+	if (!buf) {
+		sr_err("buffer: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_atomic_int_inc(&buf->refcount);
+
+	return SR_OK;
+}
+
+/**
+ * Drop a reference to a buffer.
+ *
+ * When the last reference is dropped, the buffer is either returned to
+ * the pool it was taken from, or freed.
+ *
+ * @param buf The buffer. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_unref(struct sr_buffer *buf)
+{
+	struct sr_buffer_pool *pool;
+
+	if (!buf) {
+		sr_err("buffer: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!g_atomic_int_dec_and_test(&buf->refcount))
+		return SR_OK;
+
+	if (!(pool = buf->pool)) {
+		g_free(buf);
+		return SR_OK;
+	}
+
+	if (!g_atomic_int_get(&pool->destroyed)
+	    && g_async_queue_length(pool->free_buffers) < (gint)pool->max_free)
+		g_async_queue_push(pool->free_buffers, buf);
+	else
+		g_free(buf);
+
+	/* Every buffer handed out holds a reference to its pool. */
+	pool_unref(pool);
+
+	return SR_OK;
+}
+
+/**
+ * Create a new buffer pool.
+ *
+ * A pool hands out buffers of a fixed size, and keeps up to 'max_free'
+ * released buffers around for reuse.
+ *
+ * @param buffer_size The size of each buffer's data area, in bytes.
+ * @param max_free The maximum number of unused buffers to keep around.
+ *
+ * @return The new pool, or NULL upon memory allocation errors.
+ */
+SR_API struct sr_buffer_pool *sr_buffer_pool_new(size_t buffer_size,
+						 unsigned int max_free)
+{
+	struct sr_buffer_pool *pool;
+
+	if (!(pool = g_try_malloc0(sizeof(struct sr_buffer_pool)))) {
+		sr_err("buffer: %s: pool malloc failed", __func__);
+		return NULL;
+	}
+
+	pool->buffer_size = buffer_size;
+	pool->max_free = max_free;
+	pool->free_buffers = g_async_queue_new();
+	/* This reference is dropped by sr_buffer_pool_destroy(). */
+	pool->refcount = 1;
+
+	return pool;
+}
+
+/**
+ * Destroy a buffer pool.
+ *
+ * Buffers from this pool which are still referenced somewhere stay valid;
+ * they are freed (rather than recycled) once their last reference is gone.
+ *
+ * @param pool The pool. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_buffer_pool_destroy(struct sr_buffer_pool *pool)
+{
+	struct sr_buffer *buf;
+
+	if (!pool) {
+		sr_err("buffer: %s: pool was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_atomic_int_set(&pool->destroyed, TRUE);
+	while ((buf = g_async_queue_try_pop(pool->free_buffers)))
+		g_free(buf);
+	pool_unref(pool);
+
+	return SR_OK;
+}
+
+/**
+ * Get a buffer from a pool.
+ *
+ * A previously released buffer is reused if available, otherwise a new one
+ * is allocated. The buffer starts out with a reference count of 1, owned by
+ * the caller. Its contents are undefined.
+ *
+ * @param pool The pool. Must not be NULL.
+ *
+ * @return The buffer, or NULL upon errors.
+ */
+SR_API struct sr_buffer *sr_buffer_pool_get(struct sr_buffer_pool *pool)
+{
+	struct sr_buffer *buf;
+
+	if (!pool) {
+		sr_err("buffer: %s: pool was NULL", __func__);
+		return NULL;
+	}
+
+	if ((buf = g_async_queue_try_pop(pool->free_buffers))) {
+		buf->refcount = 1;
+	} else {
+		if (!(buf = buffer_alloc(pool->buffer_size)))
+			return NULL;
+		buf->pool = pool;
+	}
+	g_atomic_int_inc(&pool->refcount);
+
+	return buf;
+}
+
+static void pool_unref(struct sr_buffer_pool *pool)
+{
+	struct sr_buffer *buf;
+
+	if (!g_atomic_int_dec_and_test(&pool->refcount))
+		return;
+
+	/* Buffers released after sr_buffer_pool_destroy() may still be here. */
+	while ((buf = g_async_queue_try_pop(pool->free_buffers)))
+		g_free(buf);
+	g_async_queue_unref(pool->free_buffers);
+	g_free(pool);
+}
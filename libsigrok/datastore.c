@@ -20,11 +20,20 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <glib.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
-static gpointer new_chunk(struct sr_datastore **ds);
+static gpointer new_chunk(struct sr_datastore *ds);
+static int spill_chunk(struct sr_datastore *ds);
+
+/* Initial number of slots in a datastore's chunk index. */
+#define CHUNK_INDEX_INITIAL_SIZE 16
 
 /**
  * Create a new datastore with the specified unit size.
@@ -68,16 +77,88 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
 
 	(*ds)->ds_unitsize = unitsize;
 	(*ds)->num_units = 0;
-	(*ds)->chunklist = NULL;
+	(*ds)->chunks = NULL;
+	(*ds)->num_chunks = 0;
+	(*ds)->chunks_allocated = 0;
+	(*ds)->backend = SR_DATASTORE_MEMORY;
+	(*ds)->max_resident = 0;
+	(*ds)->num_spilled = 0;
+	(*ds)->spill_fd = -1;
 
 	return SR_OK;
 }
 
+/**
+ * Create a new datastore which spills its data to disk.
+ *
+ * This works like sr_datastore_new(), but only keeps (approximately)
+ * 'ram_budget' bytes of sample data on the heap. Whenever that budget is
+ * exceeded, the oldest full chunk is written to an (already unlinked)
+ * temporary file and mapped back into memory read-only via mmap(). This
+ * way the kernel's paging, not malloc(), decides how long a capture can be.
+ *
+ * Readers do not need to care about this, sr_datastore_get() and
+ * sr_datastore_chunk_get() work the same way for both kinds of datastores.
+ * Only the chunk pointers sr_datastore_chunk_get() returns are shorter
+ * lived, see there.
+ *
+ * @param unitsize The unit size (>= 1) to be used for this datastore.
+ * @param ram_budget The maximum number of bytes of sample data to keep in
+ *                   RAM. This is rounded down to a whole number of chunks,
+ *                   but at least one chunk is always kept in RAM.
+ * @param ds Pointer to a variable which will hold the newly created
+ *           datastore structure.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         SR_ERR_ARG upon invalid arguments, or SR_ERR if the temporary file
+ *         could not be created (or spilling is not supported on this
+ *         platform). If something other than SR_OK is returned, the value
+ *         of 'ds' is undefined.
+ */
+SR_API int sr_datastore_new_spill(int unitsize, uint64_t ram_budget,
+				  struct sr_datastore **ds)
+{
+#ifndef _WIN32
+	char *filename;
+	int ret, fd;
+
+	if ((ret = sr_datastore_new(unitsize, ds)) != SR_OK)
+		return ret;
+
+	if ((fd = g_file_open_tmp("sigrok-datastore-XXXXXX",
+				  &filename, NULL)) == -1) {
+		sr_err("ds: %s: failed to create temporary file", __func__);
+		sr_datastore_destroy(*ds);
+		return SR_ERR;
+	}
+	/* Nobody else needs to see the file, it's gone once we close it. */
+	unlink(filename);
+	g_free(filename);
+
+	(*ds)->backend = SR_DATASTORE_SPILL;
+	(*ds)->spill_fd = fd;
+	(*ds)->max_resident = MAX(1, ram_budget /
+			(DATASTORE_CHUNKSIZE * (uint64_t)unitsize));
+
+	sr_dbg("ds: keeping at most %u chunks in RAM", (*ds)->max_resident);
+
+	return SR_OK;
+#else
+	(void)unitsize;
+	(void)ram_budget;
+	(void)ds;
+
+	sr_err("ds: %s: spilling is not supported on this platform",
+	       __func__);
+	return SR_ERR;
+#endif
+}
+
 /**
  * Destroy the specified datastore and free the memory used by it.
  *
- * This will free the memory used by the data in the datastore's 'chunklist',
- * by the chunklist data structure itself, and by the datastore struct.
+ * This will free the memory used by the data in the datastore's chunks,
+ * by the chunk index itself, and by the datastore struct.
  *
  * @param ds The datastore to destroy.
  *
@@ -85,16 +166,26 @@ SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds)
  */
 SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 {
-	GSList *chunk;
+	unsigned int i;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	for (chunk = ds->chunklist; chunk; chunk = chunk->next)
-		g_free(chunk->data);
-	g_slist_free(ds->chunklist);
+	for (i = 0; i < ds->num_chunks; i++) {
+#ifndef _WIN32
+		if (i < ds->num_spilled) {
+			munmap(ds->chunks[i],
+			       DATASTORE_CHUNKSIZE * ds->ds_unitsize);
+			continue;
+		}
+#endif
+		g_free(ds->chunks[i]);
+	}
+	g_free(ds->chunks);
+	if (ds->spill_fd != -1)
+		close(ds->spill_fd);
 	g_free(ds);
 	ds = NULL;
 
@@ -104,7 +195,9 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 /**
  * Append some data to the specified datastore.
  *
- * TODO: More elaborate function description.
+ * The data is copied into the datastore's chunks, new chunks are allocated
+ * as needed. Appending is O(1) with respect to the amount of data which is
+ * already stored in the datastore.
  *
  * TODO: This function should use the (not yet available) 'chunksize' field
  *       of struct sr_datastore (instead of hardcoding DATASTORE_CHUNKSIZE).
@@ -115,9 +208,10 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
  * @param ds Pointer to the datastore which shall receive the data.
  *           Must not be NULL.
  * @param data Pointer to the memory buffer containing the data to add.
- *             Must not be NULL. TODO: Data format?
- * @param length Length of the data to add (in number of bytes).
- *               TODO: Should 0 be allowed as length?
+ *             Must not be NULL. The data must consist of samples with the
+ *             datastore's unit size.
+ * @param length Length of the data to add (in number of bytes). This must
+ *               be a multiple of the datastore's unit size.
  * @param in_unitsize The unit size (>= 1) of the input data.
  * @param probelist Pointer to a list of integers (probe numbers). The probe
  *                  numbers in this list are 1-based, i.e. the first probe
@@ -130,9 +224,9 @@ SR_API int sr_datastore_destroy(struct sr_datastore *ds)
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		unsigned int length, int in_unitsize, const int *probelist)
 {
-	unsigned int stored;
-	int capacity, size, num_chunks, chunk_bytes_free, chunk_offset;
-	gpointer chunk;
+	unsigned int stored, size, chunk_index, chunk_bytes_free;
+	uint64_t chunk_offset;
+	uint8_t *chunk;
 
 	if (!ds) {
 		sr_err("ds: %s: ds was NULL", __func__);
@@ -161,83 +255,339 @@ SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 		return SR_ERR_ARG;
 	}
 
-	/* Get the last chunk in the list, or create a new one if needed. */
-	if (ds->chunklist == NULL) {
-		if (!(chunk = new_chunk(&ds))) {
-			sr_err("ds: %s: couldn't allocate new chunk", __func__);
-			return SR_ERR_MALLOC;
-		}
-	} else {
-		chunk = g_slist_last(ds->chunklist)->data;
+	if (length % ds->ds_unitsize) {
+		sr_err("ds: %s: length %u is not a multiple of the unit "
+		       "size (%d)", __func__, length, ds->ds_unitsize);
+		return SR_ERR_ARG;
 	}
 
-	/* Get/calculate number of chunks, free space, etc. */
-	num_chunks = g_slist_length(ds->chunklist);
-	capacity = (num_chunks * DATASTORE_CHUNKSIZE);
-	chunk_bytes_free = capacity - (ds->ds_unitsize * ds->num_units);
-	chunk_offset = capacity - (DATASTORE_CHUNKSIZE * (num_chunks - 1))
-		       - chunk_bytes_free;
-
 	stored = 0;
 	while (stored < length) {
-		/* No more free space left, allocate a new chunk. */
-		if (chunk_bytes_free == 0) {
-			if (!(chunk = new_chunk(&ds))) {
+		/* The chunk holding the next unit, and where it goes in there. */
+		chunk_index = ds->num_units / DATASTORE_CHUNKSIZE;
+		chunk_offset = (ds->num_units % DATASTORE_CHUNKSIZE)
+			       * ds->ds_unitsize;
+
+		/* The last chunk is full (or there is none yet), add one. */
+		if (chunk_index == ds->num_chunks) {
+			if (!(chunk = new_chunk(ds))) {
 				sr_err("ds: %s: couldn't allocate new chunk",
 				       __func__);
 				return SR_ERR_MALLOC;
 			}
-			chunk_bytes_free = DATASTORE_CHUNKSIZE;
-			chunk_offset = 0;
+		} else {
+			chunk = ds->chunks[chunk_index];
 		}
 
-		if (length - stored > (unsigned int)chunk_bytes_free)
+		chunk_bytes_free = DATASTORE_CHUNKSIZE * ds->ds_unitsize
+				   - chunk_offset;
+		if (length - stored > chunk_bytes_free)
 			size = chunk_bytes_free;
 		else
 			/* Last part, won't fill up this chunk. */
 			size = length - stored;
 
-		memcpy(chunk + chunk_offset, data + stored, size);
-		chunk_bytes_free -= size;
+		memcpy(chunk + chunk_offset, (uint8_t *)data + stored, size);
 		stored += size;
+		ds->num_units += size / ds->ds_unitsize;
 	}
 
-	ds->num_units += stored / ds->ds_unitsize;
+	return SR_OK;
+}
+
+/**
+ * Append run-length encoded samples to the specified datastore.
+ *
+ * The runs are expanded straight into the datastore's chunks, without
+ * an intermediate buffer of plain samples.
+ *
+ * @param ds Pointer to the datastore which shall receive the data.
+ *           Must not be NULL.
+ * @param rle The samples, see rle.c. Must not be NULL. Their unit size
+ *            must be the datastore's unit size.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments. If something other than SR_OK
+ *         is returned, the value/state of 'ds' is undefined.
+ */
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+		const struct sr_datafeed_logic_rle *rle)
+{
+	unsigned int chunk_index;
+	uint64_t run, left, chunk_units, n, i;
+	const uint8_t *value;
+	uint8_t *chunk;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!rle) {
+		sr_err("ds: %s: rle was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (rle->unitsize != ds->ds_unitsize) {
+		sr_err("ds: %s: unit size %d doesn't match the datastore's "
+		       "(%d)", __func__, rle->unitsize, ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	for (run = 0; run < rle->num_runs; run++) {
+		value = (const uint8_t *)rle->values + run * ds->ds_unitsize;
+		for (left = rle->lengths[run]; left; left -= n) {
+			chunk_index = ds->num_units / DATASTORE_CHUNKSIZE;
+			chunk_units = ds->num_units % DATASTORE_CHUNKSIZE;
+
+			/* The last chunk is full (or there is none yet). */
+			if (chunk_index == ds->num_chunks) {
+				if (!(chunk = new_chunk(ds))) {
+					sr_err("ds: %s: couldn't allocate new "
+					       "chunk", __func__);
+					return SR_ERR_MALLOC;
+				}
+			} else {
+				chunk = ds->chunks[chunk_index];
+			}
+
+			n = MIN(left, DATASTORE_CHUNKSIZE - chunk_units);
+			chunk += chunk_units * ds->ds_unitsize;
+			if (ds->ds_unitsize == 1) {
+				memset(chunk, *value, n);
+			} else {
+				for (i = 0; i < n; i++)
+					memcpy(chunk + i * ds->ds_unitsize,
+					       value, ds->ds_unitsize);
+			}
+			ds->num_units += n;
+		}
+	}
 
 	return SR_OK;
 }
 
 /**
- * Allocate a new memory chunk, append it to the datastore's chunklist.
+ * Copy a range of samples out of the specified datastore.
+ *
+ * Any sample range which has been stored in the datastore can be
+ * retrieved, in any order. The cost of this function only depends on
+ * the number of units requested, not on their position in the datastore.
  *
- * The newly allocated chunk is added to the datastore's chunklist by this
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param start_unit The number of the first unit (sample) to copy.
+ * @param num_units The number of units (samples) to copy.
+ * @param buf The buffer where the data will be copied to. It must be at
+ *            least num_units * unitsize bytes large. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments (this
+ *         includes requesting samples which are not in the datastore).
+ */
+SR_API int sr_datastore_get(const struct sr_datastore *ds,
+		uint64_t start_unit, uint64_t num_units, void *buf)
+{
+	uint64_t unit, chunk_units, n;
+	unsigned int chunk_index;
+	uint8_t *dst;
+
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!buf) {
+		sr_err("ds: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (start_unit > ds->num_units
+	    || num_units > ds->num_units - start_unit) {
+		sr_err("ds: %s: units %" PRIu64 "-%" PRIu64 " requested, but "
+		       "the datastore only holds %" PRIu64 " units", __func__,
+		       start_unit, start_unit + num_units, ds->num_units);
+		return SR_ERR_ARG;
+	}
+
+	dst = buf;
+	unit = start_unit;
+	while (unit < start_unit + num_units) {
+		chunk_index = unit / DATASTORE_CHUNKSIZE;
+		chunk_units = DATASTORE_CHUNKSIZE - (unit % DATASTORE_CHUNKSIZE);
+		n = MIN(chunk_units, start_unit + num_units - unit);
+		memcpy(dst, (uint8_t *)ds->chunks[chunk_index]
+		       + (unit % DATASTORE_CHUNKSIZE) * ds->ds_unitsize,
+		       n * ds->ds_unitsize);
+		dst += n * ds->ds_unitsize;
+		unit += n;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get direct access to one of the chunks of the specified datastore.
+ *
+ * This can be used to iterate over all data in a datastore without copying
+ * it: call it with chunk_index 0, 1, 2, ... until it no longer returns
+ * SR_OK.
+ *
+ * The data pointer remains valid until data is added to the datastore
+ * again, or it is destroyed. Adding data to a spilling datastore moves its
+ * oldest chunks out of RAM, so get the chunk again after that.
+ *
+ * @param ds The datastore to read from. Must not be NULL.
+ * @param chunk_index The index of the requested chunk.
+ * @param data Pointer to a variable which will point to the chunk's data.
+ *             Must not be NULL.
+ * @param num_units Pointer to a variable which will hold the number of
+ *                  units (samples) stored in that chunk. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments or if
+ *         there is no chunk with the given index.
+ */
+SR_API int sr_datastore_chunk_get(const struct sr_datastore *ds,
+		unsigned int chunk_index, const void **data,
+		uint64_t *num_units)
+{
+	if (!ds) {
+		sr_err("ds: %s: ds was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!data || !num_units) {
+		sr_err("ds: %s: data/num_units was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	/* Not an error per se, this is how iterations end. */
+	if (chunk_index >= ds->num_chunks)
+		return SR_ERR_ARG;
+
+	*data = ds->chunks[chunk_index];
+	if (chunk_index == ds->num_chunks - 1
+	    && ds->num_units % DATASTORE_CHUNKSIZE)
+		*num_units = ds->num_units % DATASTORE_CHUNKSIZE;
+	else
+		*num_units = DATASTORE_CHUNKSIZE;
+
+	return SR_OK;
+}
+
+/**
+ * Allocate a new memory chunk, append it to the datastore's chunk index.
+ *
+ * The newly allocated chunk is added to the datastore's chunk index by this
  * function, and the return value additionally points to the new chunk.
+ * The index grows geometrically, so adding a chunk is amortized O(1).
  *
  * The allocated memory is guaranteed to be cleared.
  *
+ * For spilling datastores, the oldest chunk still in RAM is spilled to
+ * disk first if the RAM budget would be exceeded otherwise.
+ *
  * TODO: This function should use the datastore's 'chunksize' field instead
  *       of hardcoding DATASTORE_CHUNKSIZE.
  * TODO: Return int, so we can return SR_OK / SR_ERR_ARG / SR_ERR_MALLOC?
  *
- * @param ds Pointer to a variable which holds the datastore structure.
- *           Must not be NULL. The contents of 'ds' are modified in-place.
+ * @param ds Pointer to the datastore structure. Must not be NULL.
+ *           The contents of 'ds' are modified in-place.
  *
  * @return Pointer to the newly allocated chunk, or NULL upon failure.
  */
-static gpointer new_chunk(struct sr_datastore **ds)
+static gpointer new_chunk(struct sr_datastore *ds)
 {
-	gpointer chunk;
+	gpointer chunk, *new_chunks;
+	unsigned int new_size;
 
 	/* Note: Caller checked that ds != NULL. */
 
-	chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * (*ds)->ds_unitsize);
+	if (ds->backend == SR_DATASTORE_SPILL
+	    && ds->num_chunks - ds->num_spilled >= ds->max_resident) {
+		if (spill_chunk(ds) != SR_OK)
+			return NULL;
+	}
+
+	if (ds->num_chunks == ds->chunks_allocated) {
+		new_size = ds->chunks_allocated ? ds->chunks_allocated * 2
+						: CHUNK_INDEX_INITIAL_SIZE;
+		new_chunks = g_try_realloc(ds->chunks,
+					   new_size * sizeof(gpointer));
+		if (!new_chunks) {
+			sr_err("ds: %s: chunk index realloc failed", __func__);
+			return NULL;
+		}
+		ds->chunks = new_chunks;
+		ds->chunks_allocated = new_size;
+	}
+
+	chunk = g_try_malloc0(DATASTORE_CHUNKSIZE * ds->ds_unitsize);
 	if (!chunk) {
 		sr_err("ds: %s: chunk malloc failed (ds_unitsize was %u)",
-		       __func__, (*ds)->ds_unitsize);
+		       __func__, ds->ds_unitsize);
 		return NULL; /* TODO: SR_ERR_MALLOC later? */
 	}
 
-	(*ds)->chunklist = g_slist_append((*ds)->chunklist, chunk);
+	ds->chunks[ds->num_chunks++] = chunk;
 
 	return chunk; /* TODO: SR_OK later? */
 }
+
+/**
+ * Move the oldest chunk which is still in RAM to the spill file.
+ *
+ * The chunk is written to the file at the offset corresponding to its index,
+ * then that file region is mapped into memory and replaces the heap copy in
+ * the chunk index. Only full chunks are ever spilled, so the mapped region
+ * never needs to be written to again. The heap copy is freed, which is why
+ * sr_datastore_chunk_get() pointers don't outlive the next put.
+ *
+ * @param ds The datastore. Must not be NULL, must be a spilling datastore
+ *           with at least one full chunk in RAM.
+ *
+ * @return SR_OK upon success, SR_ERR upon I/O or mmap() errors.
+ */
+static int spill_chunk(struct sr_datastore *ds)
+{
+#ifndef _WIN32
+	uint64_t chunk_bytes, written;
+	off_t offset;
+	ssize_t ret;
+	uint8_t *chunk;
+	void *map;
+
+	chunk_bytes = DATASTORE_CHUNKSIZE * ds->ds_unitsize;
+	chunk = ds->chunks[ds->num_spilled];
+	offset = (off_t)ds->num_spilled * chunk_bytes;
+
+	for (written = 0; written < chunk_bytes; written += ret) {
+		ret = pwrite(ds->spill_fd, chunk + written,
+			     chunk_bytes - written, offset + written);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			sr_err("ds: %s: write to spill file failed: %s",
+			       __func__, strerror(errno));
+			return SR_ERR;
+		}
+	}
+
+	map = mmap(NULL, chunk_bytes, PROT_READ, MAP_SHARED,
+		   ds->spill_fd, offset);
+	if (map == MAP_FAILED) {
+		sr_err("ds: %s: mmap of spill file failed: %s",
+		       __func__, strerror(errno));
+		return SR_ERR;
+	}
+
+	g_free(chunk);
+	ds->chunks[ds->num_spilled++] = map;
+
+	return SR_OK;
+#else
+	(void)ds;
+
+	return SR_ERR;
+#endif
+}
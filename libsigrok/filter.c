@@ -22,6 +22,344 @@
 #include <string.h>
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
+#if defined(__BMI2__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_PEXT 1
+#endif
+
+/* Kernels used by sr_filter_plan_run(). */
+enum {
+	/* Probes 1..n in order, nothing to do but copy. */
+	FILTER_KERNEL_COPY,
+	/* Probes 1..n in order, keep the low bits, drop the rest. */
+	FILTER_KERNEL_TRUNCATE,
+	/* Probes in ascending order, extract them with PEXT (x86 BMI2). */
+	FILTER_KERNEL_PEXT,
+	/* Anything else: one table lookup per input byte. */
+	FILTER_KERNEL_LUT,
+};
+
+static inline uint64_t load_le(const uint8_t *p, int size)
+{
+	uint64_t v;
+	int i;
+
+	v = 0;
+	for (i = 0; i < size; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+
+	return v;
+}
+
+static inline void store_le(uint8_t *p, uint64_t v, int size)
+{
+	int i;
+
+	for (i = 0; i < size; i++)
+		p[i] = v >> (8 * i);
+}
+
+/*
+ * The kernels are instantiated for every combination of the common unit
+ * sizes 1, 2, 4 and 8, so the compiler can turn load_le()/store_le() into
+ * single loads/stores and fully unroll the per-byte table lookups.
+ */
+#define DEFINE_KERNELS(IN, OUT) \
+static void lut_##IN##_##OUT(const struct sr_filter_plan *plan, \
+		const uint8_t *in, uint8_t *out, uint64_t n) \
+{ \
+	uint64_t i, v; \
+	int b; \
+	for (i = 0; i < n; i++, in += IN, out += OUT) { \
+		v = 0; \
+		for (b = 0; b < IN; b++) \
+			v |= plan->lut[b][in[b]]; \
+		store_le(out, v, OUT); \
+	} \
+} \
+static void truncate_##IN##_##OUT(const struct sr_filter_plan *plan, \
+		const uint8_t *in, uint8_t *out, uint64_t n) \
+{ \
+	uint64_t i; \
+	for (i = 0; i < n; i++, in += IN, out += OUT) \
+		store_le(out, load_le(in, IN) & plan->mask, OUT); \
+}
+
+#define KERNEL_ROW(IN) \
+	DEFINE_KERNELS(IN, 1) DEFINE_KERNELS(IN, 2) \
+	DEFINE_KERNELS(IN, 4) DEFINE_KERNELS(IN, 8)
+KERNEL_ROW(1)
+KERNEL_ROW(2)
+KERNEL_ROW(4)
+KERNEL_ROW(8)
+
+typedef void (*filter_kernel_t)(const struct sr_filter_plan *plan,
+				const uint8_t *in, uint8_t *out, uint64_t n);
+
+#define KERNEL_TABLE_ROW(PREFIX, IN) \
+	{ PREFIX##_##IN##_1, PREFIX##_##IN##_2, NULL, \
+	  PREFIX##_##IN##_4, NULL, NULL, NULL, PREFIX##_##IN##_8 }
+#define KERNEL_TABLE(PREFIX) { \
+	KERNEL_TABLE_ROW(PREFIX, 1), KERNEL_TABLE_ROW(PREFIX, 2), \
+	{ NULL }, KERNEL_TABLE_ROW(PREFIX, 4), { NULL }, { NULL }, { NULL }, \
+	KERNEL_TABLE_ROW(PREFIX, 8) }
+
+/* Indexed by [in_unitsize - 1][out_unitsize - 1]. */
+static const filter_kernel_t lut_kernels[8][8] = KERNEL_TABLE(lut);
+static const filter_kernel_t truncate_kernels[8][8] = KERNEL_TABLE(truncate);
+
+/* Fallbacks for odd unit sizes (3, 5, 6, 7). */
+static void lut_generic(const struct sr_filter_plan *plan,
+		const uint8_t *in, uint8_t *out, uint64_t n)
+{
+	uint64_t i, v;
+	int b;
+
+	for (i = 0; i < n; i++) {
+		v = 0;
+		for (b = 0; b < plan->in_unitsize; b++)
+			v |= plan->lut[b][in[b]];
+		store_le(out, v, plan->out_unitsize);
+		in += plan->in_unitsize;
+		out += plan->out_unitsize;
+	}
+}
+
+static void truncate_generic(const struct sr_filter_plan *plan,
+		const uint8_t *in, uint8_t *out, uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		store_le(out, load_le(in, plan->in_unitsize) & plan->mask,
+			 plan->out_unitsize);
+		in += plan->in_unitsize;
+		out += plan->out_unitsize;
+	}
+}
+
+#ifdef HAVE_PEXT
+static void pext_generic(const struct sr_filter_plan *plan,
+		const uint8_t *in, uint8_t *out, uint64_t n)
+{
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		store_le(out, _pext_u64(load_le(in, plan->in_unitsize),
+			 plan->mask), plan->out_unitsize);
+		in += plan->in_unitsize;
+		out += plan->out_unitsize;
+	}
+}
+#endif
+
+/**
+ * Compile a probe list into a filter plan.
+ *
+ * A filter plan does the same as sr_filter_probes(), but all the per-probe
+ * work is done once, up front: sr_filter_plan_run() then only needs a few
+ * table lookups (or a single bit extract/mask) per sample, and doesn't
+ * allocate any memory. Frontends should create a plan once per acquisition
+ * (i.e. when the unit size of the incoming data is known) and reuse it for
+ * every SR_DF_LOGIC packet.
+ *
+ * See sr_filter_probes() for the meaning of the parameters.
+ *
+ * @param in_unitsize The unit size (1-8) of the input data.
+ * @param out_unitsize The unit size (1-8) the output shall have.
+ * @param probelist Pointer to a 0-terminated list of integers (1-based probe
+ *                  numbers). Must not be NULL.
+ * @param plan Pointer to a variable which will hold the new plan. It must
+ *             be freed via sr_filter_plan_destroy(). Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_new(int in_unitsize, int out_unitsize,
+			      const int *probelist,
+			      struct sr_filter_plan **plan)
+{
+	struct sr_filter_plan *p;
+	gboolean in_order, ascending;
+	int num_enabled_probes, probe, i, v;
+
+	if (!probelist) {
+		sr_err("filter: %s: probelist was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (!plan) {
+		sr_err("filter: %s: plan was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (in_unitsize < 1 || in_unitsize > 8
+	    || out_unitsize < 1 || out_unitsize > 8) {
+		sr_err("filter: %s: unsupported unit sizes %d/%d", __func__,
+		       in_unitsize, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	in_order = ascending = TRUE;
+	num_enabled_probes = 0;
+	for (i = 0; probelist[i]; i++) {
+		probe = probelist[i];
+		if (probe < 1 || probe > in_unitsize * 8) {
+			sr_err("filter: %s: probe %d doesn't fit into unit "
+			       "size %d", __func__, probe, in_unitsize);
+			return SR_ERR_ARG;
+		}
+		if (probe != i + 1)
+			in_order = FALSE;
+		if (i > 0 && probe <= probelist[i - 1])
+			ascending = FALSE;
+		num_enabled_probes++;
+	}
+
+	/* Are there more probes than the target unit size supports? */
+	if (num_enabled_probes > out_unitsize * 8) {
+		sr_err("filter: %s: too many probes (%d) for the target unit "
+		       "size (%d)", __func__, num_enabled_probes, out_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (!(p = g_try_malloc0(sizeof(struct sr_filter_plan)))) {
+		sr_err("filter: %s: plan malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	p->in_unitsize = in_unitsize;
+	p->out_unitsize = out_unitsize;
+	p->num_probes = num_enabled_probes;
+
+	for (i = 0; probelist[i]; i++)
+		p->mask |= (uint64_t)1 << (probelist[i] - 1);
+
+	if (in_order && num_enabled_probes == in_unitsize * 8
+	    && in_unitsize == out_unitsize) {
+		p->kernel = FILTER_KERNEL_COPY;
+	} else if (in_order) {
+		p->kernel = FILTER_KERNEL_TRUNCATE;
+#ifdef HAVE_PEXT
+	} else if (ascending) {
+		p->kernel = FILTER_KERNEL_PEXT;
+#endif
+	} else {
+		p->kernel = FILTER_KERNEL_LUT;
+	}
+#ifndef HAVE_PEXT
+	(void)ascending;
+#endif
+
+	/*
+	 * lut[b][v] holds the output bits contributed by input byte b having
+	 * the value v, so a sample's output is the OR of one entry per byte.
+	 */
+	if (p->kernel == FILTER_KERNEL_LUT) {
+		for (i = 0; probelist[i]; i++) {
+			probe = probelist[i] - 1;
+			for (v = 0; v < 256; v++) {
+				if (v & (1 << (probe % 8)))
+					p->lut[probe / 8][v] |= (uint64_t)1 << i;
+			}
+		}
+	}
+
+	*plan = p;
+
+	return SR_OK;
+}
+
+/**
+ * Destroy a filter plan.
+ *
+ * @param plan The plan to destroy. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_destroy(struct sr_filter_plan *plan)
+{
+	if (!plan) {
+		sr_err("filter: %s: plan was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	g_free(plan);
+
+	return SR_OK;
+}
+
+/**
+ * Remove unused probes from samples, according to a filter plan.
+ *
+ * The output is written to a caller-supplied buffer, which must be able to
+ * hold (length_in / in_unitsize) * out_unitsize bytes. If the plan's output
+ * unit size is not bigger than its input unit size, data_out can be the
+ * same as data_in, i.e. the data is filtered in place.
+ *
+ * Any trailing partial sample in data_in is ignored.
+ *
+ * @param plan The filter plan, see sr_filter_plan_new(). Must not be NULL.
+ * @param data_in Pointer to the input data buffer. Must not be NULL.
+ * @param length_in The input data length, in number of bytes.
+ * @param data_out Pointer to the output data buffer. Must not be NULL.
+ * @param length_out Pointer to the variable which will contain the output
+ *                   data length (in number of bytes) when the function
+ *                   returns SR_OK. Must not be NULL.
+ *
+ * @return SR_OK upon success, or SR_ERR_ARG upon invalid arguments.
+ */
+SR_API int sr_filter_plan_run(const struct sr_filter_plan *plan,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out)
+{
+	filter_kernel_t kernel;
+	uint64_t num_samples;
+	int in, out;
+
+	if (!plan || !data_in || !data_out || !length_out) {
+		sr_err("filter: %s: invalid (NULL) argument", __func__);
+		return SR_ERR_ARG;
+	}
+
+	in = plan->in_unitsize;
+	out = plan->out_unitsize;
+
+	if (data_in == data_out && out > in) {
+		sr_err("filter: %s: can't filter in place from unit size %d "
+		       "to %d", __func__, in, out);
+		return SR_ERR_ARG;
+	}
+
+	num_samples = length_in / in;
+	*length_out = num_samples * out;
+
+	switch (plan->kernel) {
+	case FILTER_KERNEL_COPY:
+		if (data_out != data_in)
+			memcpy(data_out, data_in, *length_out);
+		return SR_OK;
+	case FILTER_KERNEL_TRUNCATE:
+		kernel = truncate_kernels[in - 1][out - 1];
+		if (!kernel)
+			kernel = truncate_generic;
+		break;
+#ifdef HAVE_PEXT
+	case FILTER_KERNEL_PEXT:
+		kernel = pext_generic;
+		break;
+#endif
+	default:
+		kernel = lut_kernels[in - 1][out - 1];
+		if (!kernel)
+			kernel = lut_generic;
+		break;
+	}
+
+	kernel(plan, data_in, data_out, num_samples);
+
+	return SR_OK;
+}
 
 /**
  * Remove unused probes from samples.
@@ -51,6 +389,10 @@
  * actually allocated for the input data (data_in), as this function does
  * not check that.
  *
+ * This allocates a new output buffer on every call. Frontends filtering a
+ * stream of packets should use sr_filter_plan_new() and
+ * sr_filter_plan_run() instead.
+ *
  * @param in_unitsize The unit size (>= 1) of the input (data_in).
  * @param out_unitsize The unit size (>= 1) the output shall have (data_out).
  *                     The requested unit size must be big enough to hold as
@@ -78,14 +420,8 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out)
 {
-	unsigned int in_offset, out_offset;
-	int num_enabled_probes, out_bit, i;
-	uint64_t sample_in, sample_out;
-
-	if (!probelist) {
-		sr_err("filter: %s: probelist was NULL", __func__);
-		return SR_ERR_ARG;
-	}
+	struct sr_filter_plan *plan;
+	int ret;
 
 	if (!data_in) {
 		sr_err("filter: %s: data_in was NULL", __func__);
@@ -102,44 +438,20 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 		return SR_ERR_ARG;
 	}
 
-	num_enabled_probes = 0;
-	for (i = 0; probelist[i]; i++)
-		num_enabled_probes++;
+	if ((ret = sr_filter_plan_new(in_unitsize, out_unitsize, probelist,
+				      &plan)) != SR_OK)
+		return ret;
 
-	/* Are there more probes than the target unit size supports? */
-	if (num_enabled_probes > out_unitsize * 8) {
-		sr_err("filter: %s: too many probes (%d) for the target unit "
-		       "size (%d)", num_enabled_probes, out_unitsize, __func__);
-		return SR_ERR_ARG;
-	}
-
-	if (!(*data_out = g_try_malloc(length_in))) {
+	if (!(*data_out = g_try_malloc(MAX(length_in / in_unitsize
+				* out_unitsize, 1)))) {
 		sr_err("filter: %s: data_out malloc failed", __func__);
+		sr_filter_plan_destroy(plan);
 		return SR_ERR_MALLOC;
 	}
 
-	if (num_enabled_probes == in_unitsize * 8) {
-		/* All probes are used -- no need to compress anything. */
-		memcpy(*data_out, data_in, length_in);
-		*length_out = length_in;
-		return SR_OK;
-	}
-
-	/* If we reached this point, not all probes are used, so "compress". */
-	in_offset = out_offset = 0;
-	while (in_offset <= length_in - in_unitsize) {
-		memcpy(&sample_in, data_in + in_offset, in_unitsize);
-		sample_out = out_bit = 0;
-		for (i = 0; probelist[i]; i++) {
-			if (sample_in & (1 << (probelist[i] - 1)))
-				sample_out |= (1 << out_bit);
-			out_bit++;
-		}
-		memcpy((*data_out) + out_offset, &sample_out, out_unitsize);
-		in_offset += in_unitsize;
-		out_offset += out_unitsize;
-	}
-	*length_out = out_offset;
+	ret = sr_filter_plan_run(plan, data_in, length_in, *data_out,
+				 length_out);
+	sr_filter_plan_destroy(plan);
 
-	return SR_OK;
+	return ret;
 }
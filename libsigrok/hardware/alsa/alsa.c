@@ -29,19 +29,9 @@
 
 #define NUM_PROBES 2
 #define SAMPLE_WIDTH 16
+#define SAMPLES_PER_READ 1024
 #define AUDIO_DEV "plughw:0,0"
 
-struct sr_analog_probe {
-	uint8_t att;
-	uint8_t res;    /* Needs to be a power of 2, FIXME */
-	uint16_t val;   /* Max hardware ADC width is 16bits */
-};
-
-struct sr_analog_sample {
-	uint8_t num_probes; /* Max hardware probes is 256 */
-	struct sr_analog_probe probes[];
-};
-
 static const int hwcaps[] = {
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_LIMIT_SAMPLES,
@@ -240,55 +230,51 @@ static int receive_data(int fd, int revents, void *cb_data)
 	struct sr_dev_inst *sdi = cb_data;
 	struct context *ctx = sdi->priv;
 	struct sr_datafeed_packet packet;
-	struct sr_analog_sample *sample;
-	unsigned int sample_size = sizeof(struct sr_analog_sample) +
-		(NUM_PROBES * sizeof(struct sr_analog_probe));
-	char *outb;
-	char inb[4096];
-	int i, x, count;
+	struct sr_datafeed_analog_raw analog;
+	struct sr_buffer *buf;
+	int i, count;
 
 	fd = fd;
 	revents = revents;
 
 	do {
-		memset(inb, 0, sizeof(inb));
-		count = snd_pcm_readi(ctx->capture_handle, inb,
-			MIN(4096 / 4, ctx->limit_samples));
-		if (count < 1) {
-			sr_err("alsa: Failed to read samples");
+		/* The samples are passed on as they come, no conversion. */
+		if (!(buf = sr_session_buffer_get(SAMPLES_PER_READ * NUM_PROBES
+						  * sizeof(int16_t)))) {
+			sr_err("alsa: %s: buf malloc failed", __func__);
 			return FALSE;
 		}
 
-		if (!(outb = g_try_malloc(sample_size * count))) {
-			sr_err("alsa: %s: outb malloc failed", __func__);
+		count = snd_pcm_readi(ctx->capture_handle, buf->data,
+			MIN(SAMPLES_PER_READ, ctx->limit_samples));
+		if (count < 1) {
+			sr_err("alsa: Failed to read samples");
+			sr_buffer_unref(buf);
 			return FALSE;
 		}
 
-		for (i = 0; i < count; i++) {
-			sample = (struct sr_analog_sample *)
-						(outb + (i * sample_size));
-			sample->num_probes = NUM_PROBES;
-
-			for (x = 0; x < NUM_PROBES; x++) {
-				sample->probes[x].val =
-					*(uint16_t *)(inb + (i * 4) + (x * 2));
-				sample->probes[x].val &= ((1 << 16) - 1);
-				sample->probes[x].res = 16;
-			}
+		packet.type = SR_DF_ANALOG_RAW;
+		packet.payload = &analog;
+		analog.num_samples = count;
+		analog.num_probes = NUM_PROBES;
+		analog.mq = SR_MQ_VOLTAGE;
+		analog.unit = SR_UNIT_VOLT;
+		analog.encoding = SR_ANALOG_S16;
+		for (i = 0; i < NUM_PROBES; i++) {
+			/* No calibration, full scale is +/-1. */
+			analog.scale[i] = 1.0 / (1 << (SAMPLE_WIDTH - 1));
+			analog.offset[i] = 0;
 		}
-
-		packet.type = SR_DF_ANALOG;
-		packet.length = count * sample_size;
-		packet.unitsize = sample_size;
-		packet.payload = outb;
-		sr_session_send(sdi, &packet);
-		g_free(outb);
+		analog.data = buf->data;
+		analog.buffer = buf;
+		sr_session_send(ctx->session_dev_id, &packet);
+		sr_buffer_unref(buf);
 		ctx->limit_samples -= count;
 
 	} while (ctx->limit_samples > 0);
 
 	packet.type = SR_DF_END;
-	sr_session_send(sdi, &packet);
+	sr_session_send(ctx->session_dev_id, &packet);
 
 	return TRUE;
 }
@@ -299,6 +285,7 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	struct context *ctx;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_header header;
+	struct sr_datafeed_meta_analog meta;
 	struct pollfd *ufds;
 	int count;
 	int ret;
@@ -314,9 +301,9 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
-	/* FIXME: Hardcoded for 16bits */
+	/* FIXME: Hardcoded for 16bits, in host byte order (SR_ANALOG_S16) */
 	ret = snd_pcm_hw_params_set_format(ctx->capture_handle,
-			ctx->hw_params, SND_PCM_FORMAT_S16_LE);
+			ctx->hw_params, SND_PCM_FORMAT_S16);
 	if (ret < 0) {
 		sr_err("alsa: can't set sample format (%s)", snd_strerror(ret));
 		return SR_ERR;
@@ -372,14 +359,15 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	sr_source_add(ufds[0].fd, ufds[0].events, 10, receive_data, sdi);
 
 	packet.type = SR_DF_HEADER;
-	packet.length = sizeof(struct sr_datafeed_header);
-	packet.payload = (unsigned char *)&header;
+	packet.payload = &header;
 	header.feed_version = 1;
 	gettimeofday(&header.starttime, NULL);
-	header.samplerate = ctx->cur_rate;
-	header.num_analog_probes = NUM_PROBES;
-	header.num_logic_probes = 0;
-	header.protocol_id = SR_PROTO_RAW;
+	sr_session_send(cb_data, &packet);
+
+	/* Send metadata about the SR_DF_ANALOG_RAW packets to come. */
+	packet.type = SR_DF_META_ANALOG;
+	packet.payload = &meta;
+	meta.num_probes = NUM_PROBES;
 	sr_session_send(cb_data, &packet);
 	g_free(ufds);
 
@@ -123,6 +123,7 @@ static const char *firmware_files[] = {
 };
 
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data);
+static void dram_reader_stop(struct context *ctx);
 
 static int sigma_read(void *buf, size_t size, struct context *ctx)
 {
@@ -448,8 +449,15 @@ static int hw_init(const char *devinfo)
 	ctx->cur_firmware = -1;
 	ctx->num_probes = 0;
 	ctx->samples_per_event = 0;
+	ctx->sample_buf = NULL;
+	ctx->sample_buf_len = 0;
 	ctx->capture_ratio = 50;
 	ctx->use_triggers = 0;
+	ctx->dram_reader = NULL;
+	ctx->dram_batches = NULL;
+	ctx->dram_free = NULL;
+	ctx->dram_full = NULL;
+	ctx->dram_abort = 0;
 
 	/* Register SIGMA device. */
 	if (!(sdi = sr_dev_inst_new(0, SR_ST_INITIALIZING, USB_VENDOR_NAME,
@@ -592,6 +600,31 @@ static int hw_dev_open(int dev_index)
 	return SR_OK;
 }
 
+/*
+ * In 100 and 200 MHz mode, event bit (probe * samples_per_event + k) holds
+ * sample k of a probe. Precompute the samples each byte of an event
+ * contributes to, so an event is de-interleaved with two lookups.
+ */
+static void build_deinterleave_table(struct context *ctx)
+{
+	int half, value, bit, pos;
+	uint64_t entry;
+
+	for (half = 0; half < 2; half++) {
+		for (value = 0; value < 256; value++) {
+			entry = 0;
+			for (bit = 0; bit < 8; bit++) {
+				if (!(value & (1 << bit)))
+					continue;
+				pos = half * 8 + bit;
+				entry |= (uint64_t)1 << ((pos % ctx->samples_per_event)
+					* 16 + pos / ctx->samples_per_event);
+			}
+			ctx->deinterleave[half][value] = entry;
+		}
+	}
+}
+
 static int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate)
 {
 	int i, ret;
@@ -620,6 +653,7 @@ static int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate)
 	ctx->cur_samplerate = samplerate;
 	ctx->period_ps = 1000000000000 / samplerate;
 	ctx->samples_per_event = 16 / ctx->num_probes;
+	build_deinterleave_table(ctx);
 	ctx->state.state = SIGMA_IDLE;
 
 	return ret;
@@ -735,6 +769,7 @@ static int hw_cleanup(void)
 {
 	GSList *l;
 	struct sr_dev_inst *sdi;
+	struct context *ctx;
 	int ret = SR_OK;
 
 	/* Properly close all devices. */
@@ -745,6 +780,10 @@ static int hw_cleanup(void)
 			ret = SR_ERR_BUG;
 			continue;
 		}
+		if ((ctx = sdi->priv)) {
+			dram_reader_stop(ctx);
+			g_free(ctx->sample_buf);
+		}
 		sr_dev_inst_free(sdi);
 	}
 	g_slist_free(dev_insts);
@@ -871,6 +910,59 @@ static int get_trigger_offset(uint16_t *samples, uint16_t last_sample,
 	return i & 0x7;
 }
 
+/* Send the first 'count' buffered samples, and keep the rest. */
+static void samples_flush(struct context *ctx, int count)
+{
+	struct sr_datafeed_logic logic;
+
+	if (count <= 0)
+		return;
+
+	logic.length = count * sizeof(uint16_t);
+	logic.unitsize = 2;
+	logic.data = ctx->sample_buf;
+	logic.buffer = NULL;
+	sr_session_send_logic(ctx->session_dev_id, &logic);
+
+	ctx->sample_buf_len -= count;
+	memmove(ctx->sample_buf, ctx->sample_buf + count,
+		ctx->sample_buf_len * sizeof(uint16_t));
+}
+
+/* Repeat a sample 'count' times. */
+static void samples_pad(struct context *ctx, uint16_t sample, int count)
+{
+	int i, n;
+
+	while (count > 0) {
+		if (ctx->sample_buf_len == SAMPLE_BUF_SAMPLES)
+			samples_flush(ctx, ctx->sample_buf_len);
+
+		n = MIN(count, SAMPLE_BUF_SAMPLES - ctx->sample_buf_len);
+		for (i = 0; i < n; i++)
+			ctx->sample_buf[ctx->sample_buf_len + i] = sample;
+		ctx->sample_buf_len += n;
+		count -= n;
+	}
+}
+
+/* De-interleave the events of a cluster into samples. */
+static void decode_cluster(const struct context *ctx, const uint8_t *events,
+			   uint16_t *samples)
+{
+	uint64_t word;
+	uint16_t event;
+	int j, k;
+
+	for (j = 0; j < EVENTS_PER_CLUSTER; j++) {
+		event = *(const uint16_t *)&events[j * 2];
+		word = ctx->deinterleave[0][event & 0xff]
+		       | ctx->deinterleave[1][event >> 8];
+		for (k = 0; k < ctx->samples_per_event; k++)
+			*samples++ = word >> (k * 16);
+	}
+}
+
 /*
  * Decode chunk of 1024 bytes, 64 clusters, 7 events per cluster.
  * Each event is 20ns apart, and can contain multiple samples.
@@ -879,6 +971,10 @@ static int get_trigger_offset(uint16_t *samples, uint16_t last_sample,
  * For 100 MHz, events contain 2 samples for each channel, spread 10 ns apart.
  * For 50 MHz and below, events contain one sample for each channel,
  * spread 20 ns apart.
+ *
+ * The samples are collected in ctx->sample_buf, and only sent when it
+ * fills up, at the trigger point, or by samples_flush() at the end of a
+ * DRAM read.
  */
 static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			   uint16_t *lastsample, int triggerpos,
@@ -886,15 +982,10 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 {
 	struct sr_dev_inst *sdi = cb_data;
 	struct context *ctx = sdi->priv;
-	uint16_t tsdiff, ts;
-	uint16_t samples[65536 * ctx->samples_per_event];
+	uint16_t tsdiff, ts, last;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	int i, j, k, l, numpad, tosend;
-	size_t n = 0, sent = 0;
+	int i, numpad, start;
 	int clustersize = EVENTS_PER_CLUSTER * ctx->samples_per_event;
-	uint16_t *event;
-	uint16_t cur_sample;
 	int triggerts = -1;
 
 	/* Check if trigger is in this chunk. */
@@ -921,50 +1012,18 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 
 		/* Pad last sample up to current point. */
 		numpad = tsdiff * ctx->samples_per_event - clustersize;
-		if (numpad > 0) {
-			for (j = 0; j < numpad; ++j)
-				samples[j] = *lastsample;
+		if (numpad > 0)
+			samples_pad(ctx, *lastsample, numpad);
 
-			n = numpad;
-		}
-
-		/* Send samples between previous and this timestamp to sigrok. */
-		sent = 0;
-		while (sent < n) {
-			tosend = MIN(2048, n - sent);
-
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = tosend * sizeof(uint16_t);
-			logic.unitsize = 2;
-			logic.data = samples + sent;
-			sr_session_send(ctx->session_dev_id, &packet);
-
-			sent += tosend;
-		}
-		n = 0;
-
-		event = (uint16_t *) &buf[i * 16 + 2];
-		cur_sample = 0;
-
-		/* For each event in cluster. */
-		for (j = 0; j < 7; ++j) {
-
-			/* For each sample in event. */
-			for (k = 0; k < ctx->samples_per_event; ++k) {
-				cur_sample = 0;
-
-				/* For each probe. */
-				for (l = 0; l < ctx->num_probes; ++l)
-					cur_sample |= (!!(event[j] & (1 << (l *
-					   ctx->samples_per_event + k)))) << l;
-
-				samples[n++] = cur_sample;
-			}
-		}
+		if (ctx->sample_buf_len + clustersize > SAMPLE_BUF_SAMPLES)
+			samples_flush(ctx, ctx->sample_buf_len);
+		start = ctx->sample_buf_len;
+		decode_cluster(ctx, &buf[i * 16 + 2], ctx->sample_buf + start);
+		ctx->sample_buf_len += clustersize;
+		/* The trigger flush below may move the cluster. */
+		last = ctx->sample_buf[start + clustersize - 1];
 
 		/* Send data up to trigger point (if triggered). */
-		sent = 0;
 		if (i == triggerts) {
 			/*
 			 * Trigger is not always accurate to sample because of
@@ -972,19 +1031,9 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			 * the actual event. We therefore look at the next
 			 * samples to pinpoint the exact position of the trigger.
 			 */
-			tosend = get_trigger_offset(samples, *lastsample,
-						    &ctx->trigger);
-
-			if (tosend > 0) {
-				packet.type = SR_DF_LOGIC;
-				packet.payload = &logic;
-				logic.length = tosend * sizeof(uint16_t);
-				logic.unitsize = 2;
-				logic.data = samples;
-				sr_session_send(ctx->session_dev_id, &packet);
-
-				sent += tosend;
-			}
+			samples_flush(ctx, start + get_trigger_offset(
+					ctx->sample_buf + start, *lastsample,
+					&ctx->trigger));
 
 			/* Only send trigger if explicitly enabled. */
 			if (ctx->use_triggers) {
@@ -993,20 +1042,155 @@ static int decode_chunk_ts(uint8_t *buf, uint16_t *lastts,
 			}
 		}
 
-		/* Send rest of the chunk to sigrok. */
-		tosend = n - sent;
+		*lastsample = last;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Read the DRAM on a thread of its own, so the FTDI transfers overlap
+ * with decoding. The reader fills batches from 'dram_free' and passes
+ * them on through 'dram_full'; receive_data() decodes them and hands them
+ * back. The reader thread owns the FTDI until it exits.
+ */
+static gpointer dram_reader_thread(gpointer data)
+{
+	struct context *ctx = data;
+	struct dram_batch *batch;
+	int numchunks, chunk, n;
+
+	numchunks = (ctx->state.stoppos + 511) / 512;
+	for (chunk = 0; chunk < numchunks; chunk += n) {
+		batch = g_async_queue_pop(ctx->dram_free);
+		if (g_atomic_int_get(&ctx->dram_abort)) {
+			g_async_queue_push(ctx->dram_free, batch);
+			break;
+		}
+
+		n = MIN(DRAM_CHUNKS_PER_READ, numchunks - chunk);
+		batch->first_chunk = chunk;
+		batch->num_chunks = n;
+		batch->bytes = sigma_read_dram(chunk, n, batch->data, ctx);
+		g_async_queue_push(ctx->dram_full, batch);
+	}
+
+	return NULL;
+}
+
+static void dram_reader_stop(struct context *ctx)
+{
+	struct dram_batch *batch;
+
+	if (!ctx->dram_reader)
+		return;
+
+	/*
+	 * The decoder doesn't hold any batches here, so handing back the
+	 * queued up ones makes sure the reader isn't stuck waiting for one.
+	 */
+	g_atomic_int_set(&ctx->dram_abort, 1);
+	while ((batch = g_async_queue_try_pop(ctx->dram_full)))
+		g_async_queue_push(ctx->dram_free, batch);
+	g_thread_join(ctx->dram_reader);
+	ctx->dram_reader = NULL;
+
+	g_async_queue_unref(ctx->dram_free);
+	g_async_queue_unref(ctx->dram_full);
+	ctx->dram_free = ctx->dram_full = NULL;
+	g_free(ctx->dram_batches);
+	ctx->dram_batches = NULL;
+}
+
+static int dram_reader_start(struct context *ctx)
+{
+	int i;
+
+	if (!(ctx->dram_batches = g_try_malloc(NUM_DRAM_BATCHES *
+					       sizeof(struct dram_batch)))) {
+		sr_err("sigma: %s: dram_batches malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	ctx->dram_free = g_async_queue_new();
+	ctx->dram_full = g_async_queue_new();
+	for (i = 0; i < NUM_DRAM_BATCHES; i++)
+		g_async_queue_push(ctx->dram_free, &ctx->dram_batches[i]);
+	ctx->dram_abort = 0;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (!(ctx->dram_reader = g_thread_create(dram_reader_thread, ctx,
+						 TRUE, NULL))) {
+		sr_err("sigma: %s: g_thread_create failed", __func__);
+		g_async_queue_unref(ctx->dram_free);
+		g_async_queue_unref(ctx->dram_full);
+		ctx->dram_free = ctx->dram_full = NULL;
+		g_free(ctx->dram_batches);
+		ctx->dram_batches = NULL;
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/* Stop the reader thread, and tell the session we're done. */
+static void download_end(struct sr_dev_inst *sdi)
+{
+	struct context *ctx = sdi->priv;
+	struct sr_datafeed_packet packet;
+
+	dram_reader_stop(ctx);
+	ctx->state.state = SIGMA_IDLE;
 
-		if (tosend > 0) {
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = tosend * sizeof(uint16_t);
-			logic.unitsize = 2;
-			logic.data = samples + sent;
-			sr_session_send(ctx->session_dev_id, &packet);
+	packet.type = SR_DF_END;
+	sr_session_send(ctx->session_dev_id, &packet);
+}
+
+/* Decode the chunks of a DRAM read and send them to sigrok. */
+static int decode_batch(struct sr_dev_inst *sdi, struct dram_batch *batch,
+			int numchunks)
+{
+	struct context *ctx = sdi->priv;
+	int i, chunk, limit_chunk;
+
+	/* Whatever is in the buffer after a failed read isn't sample data. */
+	if (batch->bytes != batch->num_chunks * CHUNK_SIZE) {
+		sr_session_stats_transfer(0);
+		sr_err("sigma: %s: DRAM read of chunks %d-%d returned %d "
+		       "bytes instead of %d", __func__, batch->first_chunk,
+		       batch->first_chunk + batch->num_chunks - 1,
+		       batch->bytes, batch->num_chunks * CHUNK_SIZE);
+		return SR_ERR;
+	}
+	sr_session_stats_transfer(batch->bytes);
+
+	/* Find first ts. */
+	if (batch->first_chunk == 0) {
+		ctx->state.lastts = *(uint16_t *) batch->data - 1;
+		ctx->state.lastsample = 0;
+	}
+
+	for (i = 0; i < batch->num_chunks; ++i) {
+		chunk = batch->first_chunk + i;
+		limit_chunk = 0;
+
+		/* The last chunk may potentially be only in part. */
+		if (chunk == numchunks - 1) {
+			/* Find the last valid timestamp */
+			limit_chunk = ctx->state.stoppos % 512 + ctx->state.lastts;
 		}
 
-		*lastsample = samples[n - 1];
+		decode_chunk_ts(batch->data + (i * CHUNK_SIZE),
+				&ctx->state.lastts, &ctx->state.lastsample,
+				chunk == ctx->state.triggerchunk ?
+				(int)(ctx->state.triggerpos & 0x1ff) : -1,
+				limit_chunk, sdi);
+
+		++ctx->state.chunks_downloaded;
 	}
+	samples_flush(ctx, ctx->sample_buf_len);
 
 	return SR_OK;
 }
@@ -1015,26 +1199,24 @@ static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_dev_inst *sdi = cb_data;
 	struct context *ctx = sdi->priv;
-	struct sr_datafeed_packet packet;
-	const int chunks_per_read = 32;
-	unsigned char buf[chunks_per_read * CHUNK_SIZE];
-	int bufsz, numchunks, i, newchunks;
+	struct dram_batch *batch;
+	int numchunks, ret;
 	uint64_t running_msec;
 	struct timeval tv;
+	GTimeVal timeout;
 
 	/* Avoid compiler warnings. */
 	(void)fd;
 	(void)revents;
 
-	/* Get the current position. */
-	sigma_read_pos(&ctx->state.stoppos, &ctx->state.triggerpos, ctx);
-
-	numchunks = (ctx->state.stoppos + 511) / 512;
-
 	if (ctx->state.state == SIGMA_IDLE)
 		return TRUE;
 
 	if (ctx->state.state == SIGMA_CAPTURE) {
+		/* Get the current position. */
+		sigma_read_pos(&ctx->state.stoppos, &ctx->state.triggerpos, ctx);
+		numchunks = (ctx->state.stoppos + 511) / 512;
+
 		/* Check if the timer has expired, or memory is full. */
 		gettimeofday(&tv, 0);
 		running_msec = (tv.tv_sec - ctx->start_tv.tv_sec) * 1000 +
@@ -1046,56 +1228,32 @@ static int receive_data(int fd, int revents, void *cb_data)
 			hw_dev_acquisition_stop(sdi->index, sdi);
 
 	} else if (ctx->state.state == SIGMA_DOWNLOAD) {
+		/* The reader thread owns the FTDI, stoppos is final. */
+		numchunks = (ctx->state.stoppos + 511) / 512;
+
 		if (ctx->state.chunks_downloaded >= numchunks) {
 			/* End of samples. */
-			packet.type = SR_DF_END;
-			sr_session_send(ctx->session_dev_id, &packet);
-
-			ctx->state.state = SIGMA_IDLE;
-
+			download_end(sdi);
 			return TRUE;
 		}
 
-		newchunks = MIN(chunks_per_read,
-				numchunks - ctx->state.chunks_downloaded);
-
-		sr_info("sigma: Downloading sample data: %.0f %%",
-			100.0 * ctx->state.chunks_downloaded / numchunks);
-
-		bufsz = sigma_read_dram(ctx->state.chunks_downloaded,
-					newchunks, buf, ctx);
-		/* TODO: Check bufsz. For now, just avoid compiler warnings. */
-		(void)bufsz;
-
-		/* Find first ts. */
-		if (ctx->state.chunks_downloaded == 0) {
-			ctx->state.lastts = *(uint16_t *) buf - 1;
-			ctx->state.lastsample = 0;
-		}
-
-		/* Decode chunks and send them to sigrok. */
-		for (i = 0; i < newchunks; ++i) {
-			int limit_chunk = 0;
-
-			/* The last chunk may potentially be only in part. */
-			if (ctx->state.chunks_downloaded == numchunks - 1) {
-				/* Find the last valid timestamp */
-				limit_chunk = ctx->state.stoppos % 512 + ctx->state.lastts;
+		/* Give the reader a moment if it has nothing for us yet. */
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, 10000);
+		batch = g_async_queue_timed_pop(ctx->dram_full, &timeout);
+
+		while (batch) {
+			sr_info("sigma: Downloading sample data: %.0f %%",
+				100.0 * ctx->state.chunks_downloaded / numchunks);
+
+			ret = decode_batch(sdi, batch, numchunks);
+			g_async_queue_push(ctx->dram_free, batch);
+			if (ret != SR_OK) {
+				/* The samples would have a gap, give up. */
+				download_end(sdi);
+				return TRUE;
 			}
-
-			if (ctx->state.chunks_downloaded + i == ctx->state.triggerchunk)
-				decode_chunk_ts(buf + (i * CHUNK_SIZE),
-						&ctx->state.lastts,
-						&ctx->state.lastsample,
-						ctx->state.triggerpos & 0x1ff,
-						limit_chunk, sdi);
-			else
-				decode_chunk_ts(buf + (i * CHUNK_SIZE),
-						&ctx->state.lastts,
-						&ctx->state.lastsample,
-						-1, limit_chunk, sdi);
-
-			++ctx->state.chunks_downloaded;
+			batch = g_async_queue_try_pop(ctx->dram_full);
 		}
 	}
 
@@ -1357,6 +1515,14 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 
 	ctx->session_dev_id = cb_data;
 
+	/* get_trigger_offset() may look one sample past a cluster. */
+	if (!ctx->sample_buf && !(ctx->sample_buf = g_try_malloc(
+			(SAMPLE_BUF_SAMPLES + 1) * sizeof(uint16_t)))) {
+		sr_err("sigma: %s: sample_buf malloc failed.", __func__);
+		return SR_ERR_MALLOC;
+	}
+	ctx->sample_buf_len = 0;
+
 	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
 		sr_err("sigma: %s: packet malloc failed.", __func__);
 		return SR_ERR_MALLOC;
@@ -1397,6 +1563,7 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
 	uint8_t modestatus;
+	int ret;
 
 	/* Avoid compiler warnings. */
 	(void)cb_data;
@@ -1411,6 +1578,14 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 		return SR_ERR_BUG;
 	}
 
+	/* A download in progress is aborted, otherwise we're done already. */
+	if (ctx->state.state == SIGMA_DOWNLOAD) {
+		download_end(sdi);
+		return SR_OK;
+	} else if (ctx->state.state != SIGMA_CAPTURE) {
+		return SR_OK;
+	}
+
 	/* Stop acquisition. */
 	sigma_set_register(WRITE_MODE, 0x11, ctx);
 
@@ -1429,6 +1604,12 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 
 	ctx->state.chunks_downloaded = 0;
 
+	/* Stream the DRAM in while receive_data() decodes it. */
+	if ((ret = dram_reader_start(ctx)) != SR_OK) {
+		ctx->state.state = SIGMA_IDLE;
+		return ret;
+	}
+
 	ctx->state.state = SIGMA_DOWNLOAD;
 
 	return SR_OK;
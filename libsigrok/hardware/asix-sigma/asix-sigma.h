@@ -74,6 +74,15 @@ enum sigma_read_register {
 
 #define CHUNK_SIZE		1024
 
+/* Decoded samples are batched up to this many per packet. */
+#define SAMPLE_BUF_SAMPLES	(64 * 1024)
+
+/* DRAM chunks read at a time. */
+#define DRAM_CHUNKS_PER_READ	32
+
+/* DRAM reads which can be buffered ahead of the decoder. */
+#define NUM_DRAM_BATCHES	3
+
 struct clockselect_50 {
 	uint8_t async;
 	uint8_t fraction;
@@ -173,6 +182,14 @@ struct sigma_state {
 	int chunks_downloaded;
 };
 
+/* A DRAM read, passed from the reader thread to the decoder. */
+struct dram_batch {
+	int first_chunk;
+	int num_chunks;
+	int bytes;
+	uint8_t data[DRAM_CHUNKS_PER_READ * CHUNK_SIZE];
+};
+
 /* Private, per-device-instance driver context. */
 struct context {
 	struct ftdi_context ftdic;
@@ -183,11 +200,26 @@ struct context {
 	int cur_firmware;
 	int num_probes;
 	int samples_per_event;
+	/*
+	 * Samples of an event for each value of its low and high byte,
+	 * sample k of the event in bits 16k..16k+15.
+	 */
+	uint64_t deinterleave[2][256];
+	/* Decoded samples which haven't been sent yet. */
+	uint16_t *sample_buf;
+	int sample_buf_len;
 	int capture_ratio;
 	struct sigma_trigger trigger;
 	int use_triggers;
 	struct sigma_state state;
 	void *session_dev_id;
+
+	/* DRAM readout, see dram_reader_thread(). */
+	GThread *dram_reader;
+	struct dram_batch *dram_batches;
+	GAsyncQueue *dram_free;
+	GAsyncQueue *dram_full;
+	volatile gint dram_abort;
 };
 
 #endif
@@ -62,7 +62,7 @@ static int hw_init(const char *devinfo)
 	ctx->limit_samples = 0;
 	ctx->session_dev_id = NULL;
 	memset(ctx->mangled_buf, 0, BS);
-	ctx->final_buf = NULL;
+	ctx->segments = NULL;
 	ctx->trigger_pattern = 0x00; /* Value irrelevant, see trigger_mask. */
 	ctx->trigger_mask = 0x00; /* All probes are "don't care". */
 	ctx->trigger_timeout = 10; /* Default to 10s trigger timeout. */
@@ -72,16 +72,10 @@ static int hw_init(const char *devinfo)
 	ctx->divcount = 0; /* 10ns sample period == 100MHz samplerate */
 	ctx->usb_pid = 0;
 
-	/* Allocate memory where we'll store the de-mangled data. */
-	if (!(ctx->final_buf = g_try_malloc(SDRAM_SIZE))) {
-		sr_err("la8: %s: final_buf malloc failed", __func__);
-		goto err_free_ctx;
-	}
-
 	/* Allocate memory for the FTDI context (ftdic) and initialize it. */
 	if (!(ctx->ftdic = ftdi_new())) {
 		sr_err("la8: %s: ftdi_new failed", __func__);
-		goto err_free_final_buf;
+		goto err_free_ctx;
 	}
 
 	/* Check for the device and temporarily open it. */
@@ -123,8 +117,6 @@ err_close_ftdic:
 	(void) la8_close(ctx); /* Log, but ignore errors. */
 err_free_ftdic:
 	free(ctx->ftdic); /* NOT g_free()! */
-err_free_final_buf:
-	g_free(ctx->final_buf);
 err_free_ctx:
 	g_free(ctx);
 err_free_nothing:
@@ -218,9 +210,6 @@ static int hw_dev_close(int dev_index)
 
 	sdi->status = SR_ST_INACTIVE;
 
-	sr_dbg("la8: Freeing sample buffer.");
-	g_free(ctx->final_buf);
-
 	return SR_OK;
 }
 
@@ -384,9 +373,10 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 
 static int receive_data(int fd, int revents, void *cb_data)
 {
-	int i, ret;
+	int ret;
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
+	struct sr_buffer *buf;
 
 	/* Avoid compiler errors. */
 	(void)fd;
@@ -414,17 +404,25 @@ static int receive_data(int fd, int revents, void *cb_data)
 		return FALSE;
 	}
 
+	/* Blocks of the last segment complete NUM_SEGMENTS blocks' worth. */
+	if (ctx->block_counter >= (NUM_SEGMENTS - 1) * BLOCKS_PER_SEGMENT) {
+		if (!(buf = sr_session_buffer_get(NUM_SEGMENTS * BS))) {
+			sr_err("la8: %s: buf malloc failed", __func__);
+			hw_dev_acquisition_stop(sdi->index, sdi);
+			return FALSE;
+		}
+		la8_demangle_block(ctx, buf->data);
+		send_block_to_session_bus(ctx, buf, NUM_SEGMENTS * BS);
+		sr_buffer_unref(buf);
+	}
+
 	/* We need to get exactly NUM_BLOCKS blocks (i.e. 8MB) of data. */
 	if (ctx->block_counter != (NUM_BLOCKS - 1)) {
 		ctx->block_counter++;
 		return TRUE;
 	}
 
-	sr_dbg("la8: Sampling finished, sending data to session bus now.");
-
-	/* All data was received and demangled, send it to the session bus. */
-	for (i = 0; i < NUM_BLOCKS; i++)
-		send_block_to_session_bus(ctx, i);
+	sr_dbg("la8: Sampling finished.");
 
 	hw_dev_acquisition_stop(sdi->index, sdi);
 
@@ -463,6 +461,14 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR;
 	}
 
+	/* Room for the blocks of all but the last segment. */
+	g_free(ctx->segments);
+	ctx->segments = g_try_malloc((NUM_SEGMENTS - 1) * SEGMENT_SIZE);
+	if (!ctx->segments) {
+		sr_err("la8: %s: segments malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
 	sr_dbg("la8: Starting acquisition.");
 
 	/* Fill acquisition parameters into buf[]. */
@@ -536,6 +542,9 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 	packet.type = SR_DF_END;
 	sr_session_send(cb_data, &packet);
 
+	g_free(ctx->segments);
+	ctx->segments = NULL;
+
 	return SR_OK;
 }
 
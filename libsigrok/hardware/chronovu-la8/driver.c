@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
  */
 
+#include <string.h>
 #include <ftdi.h>
 #include <glib.h>
 #include "libsigrok.h"
@@ -405,31 +406,42 @@ SR_PRIV int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate)
 /**
  * Get a block of data from the LA8.
  *
+ * Blocks of all but the last segment are stored in ctx->segments, a block
+ * of the last segment ends up in ctx->mangled_buf.
+ *
  * @param ctx The struct containing private per-device-instance data. Must not
  *            be NULL. ctx->ftdic must not be NULL either.
  * @return SR_OK upon success, or SR_ERR upon errors.
  */
 SR_PRIV int la8_read_block(struct context *ctx)
 {
-	int i, byte_offset, m, mi, p, index, bytes_read;
+	int bytes_read;
+	uint8_t *buf;
 	time_t now;
 
 	/* Note: Caller checked that ctx and ctx->ftdic != NULL. */
 
 	sr_spew("la8: Reading block %d.", ctx->block_counter);
 
-	bytes_read = la8_read(ctx, ctx->mangled_buf, BS);
+	if (ctx->block_counter < (NUM_SEGMENTS - 1) * BLOCKS_PER_SEGMENT)
+		buf = ctx->segments + ctx->block_counter * BS;
+	else
+		buf = ctx->mangled_buf;
+
+	bytes_read = la8_read(ctx, buf, BS);
 
 	/* If first block read got 0 bytes, retry until success or timeout. */
 	if ((bytes_read == 0) && (ctx->block_counter == 0)) {
 		do {
 			sr_spew("la8: Reading block 0 (again).");
-			bytes_read = la8_read(ctx, ctx->mangled_buf, BS);
+			bytes_read = la8_read(ctx, buf, BS);
 			/* TODO: How to handle read errors here? */
 			now = time(NULL);
 		} while ((ctx->done > now) && (bytes_read == 0));
 	}
 
+	sr_session_stats_transfer(MAX(bytes_read, 0));
+
 	/* Check if block read was successful or a timeout occured. */
 	if (bytes_read != BS) {
 		sr_err("la8: Trigger timed out. Bytes read: %d.", bytes_read);
@@ -437,67 +449,121 @@ SR_PRIV int la8_read_block(struct context *ctx)
 		return SR_ERR;
 	}
 
-	/* De-mangle the data. */
+	return SR_OK;
+}
+
+/**
+ * De-mangle the NUM_SEGMENTS * BS samples completed by the block of the
+ * last segment which was just read.
+ *
+ * Sample i * 16 + m * 2 (+ 1) of these is byte i * 2 (+ 1) of the block
+ * at the same position in segment m, so this is a transpose of 16-bit
+ * words, which the compiler can vectorize.
+ *
+ * @param ctx The struct containing private per-device-instance data. Must not
+ *            be NULL.
+ * @param out Where to put the samples. Must have room for
+ *            NUM_SEGMENTS * BS bytes.
+ */
+SR_PRIV void la8_demangle_block(struct context *ctx, uint8_t *out)
+{
+	const uint8_t *seg[NUM_SEGMENTS];
+	uint8_t tmp;
+	int i, m, offset;
+
 	sr_spew("la8: Demangling block %d.", ctx->block_counter);
-	byte_offset = ctx->block_counter * BS;
-	m = byte_offset / (1024 * 1024);
-	mi = m * (1024 * 1024);
-	for (i = 0; i < BS; i++) {
-		p = i & (1 << 0);
-		index = m * 2 + (((byte_offset + i) - mi) / 2) * 16;
-		index += (ctx->divcount == 0) ? p : (1 - p);
-		ctx->final_buf[index] = ctx->mangled_buf[i];
+
+	offset = (ctx->block_counter % BLOCKS_PER_SEGMENT) * BS;
+	for (m = 0; m < NUM_SEGMENTS - 1; m++)
+		seg[m] = ctx->segments + m * SEGMENT_SIZE + offset;
+	seg[NUM_SEGMENTS - 1] = ctx->mangled_buf;
+
+	for (i = 0; i < BS / 2; i++) {
+		for (m = 0; m < NUM_SEGMENTS; m++)
+			memcpy(out + (i * NUM_SEGMENTS + m) * 2,
+			       seg[m] + i * 2, 2);
 	}
 
-	return SR_OK;
+	/* At all but the highest samplerate, each pair comes in swapped. */
+	if (ctx->divcount != 0) {
+		for (i = 0; i < NUM_SEGMENTS * BS; i += 2) {
+			tmp = out[i];
+			out[i] = out[i + 1];
+			out[i + 1] = tmp;
+		}
+	}
 }
 
-SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
+/*
+ * Find the first sample matching the trigger, or return -1. Checks eight
+ * samples at a time: a byte of ((word ^ pattern) & mask) is zero where a
+ * sample matches.
+ */
+static int find_trigger(const struct context *ctx, const uint8_t *data,
+			int length)
 {
+	uint64_t word, mask, pattern, x;
 	int i;
-	uint8_t sample, expected_sample;
-	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
-	int trigger_point; /* Relative trigger point (in this block). */
 
-	/* Note: No sanity checks on ctx/block, caller is responsible. */
+	mask = ctx->trigger_mask * 0x0101010101010101ULL;
+	pattern = (ctx->trigger_pattern & ctx->trigger_mask)
+		  * 0x0101010101010101ULL;
 
-	/* Check if we can find the trigger condition in this block. */
-	trigger_point = -1;
-	expected_sample = ctx->trigger_pattern & ctx->trigger_mask;
-	for (i = 0; i < BS; i++) {
-		/* Don't continue if the trigger was found previously. */
-		if (ctx->trigger_found)
+	for (i = 0; i + 8 <= length; i += 8) {
+		memcpy(&word, data + i, sizeof(word));
+		x = (word ^ pattern) & mask;
+		if (((x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL))
 			break;
+	}
 
-		/*
-		 * Also, don't continue if triggers are "don't care", i.e. if
-		 * no trigger conditions were specified by the user. In that
-		 * case we don't want to send an SR_DF_TRIGGER packet at all.
-		 */
-		if (ctx->trigger_mask == 0x00)
-			break;
+	for (; i < length; i++) {
+		if ((data[i] & ctx->trigger_mask) == (pattern & 0xff))
+			return i;
+	}
+
+	return -1;
+}
+
+static void send_logic(struct context *ctx, struct sr_buffer *buf,
+		       int offset, int length)
+{
+	struct sr_datafeed_logic logic;
 
-		sample = *(ctx->final_buf + (block * BS) + i);
+	logic.length = length;
+	logic.unitsize = 1;
+	logic.data = buf->data + offset;
+	logic.buffer = buf;
+	sr_session_send_logic(ctx->session_dev_id, &logic);
+}
+
+SR_PRIV void send_block_to_session_bus(struct context *ctx,
+				       struct sr_buffer *buf, int length)
+{
+	struct sr_datafeed_packet packet;
+	int trigger_point; /* Relative trigger point (in this block). */
+
+	/* Note: No sanity checks on ctx/buf, caller is responsible. */
 
-		if ((sample & ctx->trigger_mask) == expected_sample) {
-			trigger_point = i;
+	/*
+	 * Check if we can find the trigger condition in this block. Don't
+	 * look if the trigger was found previously, or if triggers are
+	 * "don't care", i.e. if no trigger conditions were specified by the
+	 * user. In that case we don't want to send an SR_DF_TRIGGER packet
+	 * at all.
+	 */
+	trigger_point = -1;
+	if (!ctx->trigger_found && ctx->trigger_mask != 0x00) {
+		trigger_point = find_trigger(ctx, buf->data, length);
+		if (trigger_point != -1)
 			ctx->trigger_found = 1;
-			break;
-		}
 	}
 
 	/* If no trigger was found, send one SR_DF_LOGIC packet. */
 	if (trigger_point == -1) {
 		/* Send an SR_DF_LOGIC packet to the session bus. */
 		sr_spew("la8: sending SR_DF_LOGIC packet (%d bytes) for "
-		        "block %d", BS, block);
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = BS;
-		logic.unitsize = 1;
-		logic.data = ctx->final_buf + (block * BS);
-		sr_session_send(ctx->session_dev_id, &packet);
+		        "block %d", length, ctx->block_counter);
+		send_logic(ctx, buf, 0, length);
 		return;
 	}
 
@@ -514,33 +580,23 @@ SR_PRIV void send_block_to_session_bus(struct context *ctx, int block)
 	if (trigger_point > 0) {
 		/* Send pre-trigger SR_DF_LOGIC packet to the session bus. */
 		sr_spew("la8: sending pre-trigger SR_DF_LOGIC packet, "
-			"start = %d, length = %d", block * BS, trigger_point);
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = trigger_point;
-		logic.unitsize = 1;
-		logic.data = ctx->final_buf + (block * BS);
-		sr_session_send(ctx->session_dev_id, &packet);
+			"length = %d", trigger_point);
+		send_logic(ctx, buf, 0, trigger_point);
 	}
 
 	/* Send the SR_DF_TRIGGER packet to the session bus. */
 	sr_spew("la8: sending SR_DF_TRIGGER packet, sample = %d",
-		(block * BS) + trigger_point);
+		trigger_point);
 	packet.type = SR_DF_TRIGGER;
 	packet.payload = NULL;
 	sr_session_send(ctx->session_dev_id, &packet);
 
 	/* If at least one sample is located after the trigger... */
-	if (trigger_point < (BS - 1)) {
+	if (trigger_point < (length - 1)) {
 		/* Send post-trigger SR_DF_LOGIC packet to the session bus. */
 		sr_spew("la8: sending post-trigger SR_DF_LOGIC packet, "
 			"start = %d, length = %d",
-			(block * BS) + trigger_point, BS - trigger_point);
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = BS - trigger_point;
-		logic.unitsize = 1;
-		logic.data = ctx->final_buf + (block * BS) + trigger_point;
-		sr_session_send(ctx->session_dev_id, &packet);
+			trigger_point, length - trigger_point);
+		send_logic(ctx, buf, trigger_point, length - trigger_point);
 	}
 }
@@ -41,6 +41,15 @@
 #define BS				4096 /* Block size */
 #define NUM_BLOCKS			2048 /* Number of blocks */
 
+/*
+ * The SDRAM is read out as NUM_SEGMENTS segments of 1MB each, and every
+ * segment holds two of each 16 consecutive samples. So samples only become
+ * complete while the last segment comes in, 8 blocks' worth at a time.
+ */
+#define SEGMENT_SIZE			(1024 * 1024)
+#define NUM_SEGMENTS			(SDRAM_SIZE / SEGMENT_SIZE)
+#define BLOCKS_PER_SEGMENT		(SEGMENT_SIZE / BS)
+
 /* Private, per-device-instance driver context. */
 struct context {
 	/** FTDI device context (used by libftdi). */
@@ -65,10 +74,11 @@ struct context {
 	uint8_t mangled_buf[BS];
 
 	/**
-	 * An 8MB buffer where we'll store the de-mangled samples.
-	 * Format: Each sample is 1 byte, MSB is channel 7, LSB is channel 0.
+	 * A 7MB buffer holding the (mangled) blocks of all but the last
+	 * segment, until the last segment completes their samples.
+	 * Only allocated while an acquisition is running.
 	 */
-	uint8_t *final_buf;
+	uint8_t *segments;
 
 	/**
 	 * Trigger pattern (MSB = channel 7, LSB = channel 0).
@@ -118,6 +128,8 @@ SR_PRIV int la8_reset(struct context *ctx);
 SR_PRIV int configure_probes(struct context *ctx, const GSList *probes);
 SR_PRIV int set_samplerate(struct sr_dev_inst *sdi, uint64_t samplerate);
 SR_PRIV int la8_read_block(struct context *ctx);
-SR_PRIV void send_block_to_session_bus(struct context *ctx, int block);
+SR_PRIV void la8_demangle_block(struct context *ctx, uint8_t *out);
+SR_PRIV void send_block_to_session_bus(struct context *ctx,
+				       struct sr_buffer *buf, int length);
 
 #endif
@@ -20,24 +20,41 @@
  */
 
 #include <stdlib.h>
-#include <unistd.h>
 #include <string.h>
-#ifdef _WIN32
-#include <io.h>
-#include <fcntl.h>
-#define pipe(fds) _pipe(fds, 4096, _O_BINARY)
-#endif
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
-/* TODO: Number of probes should be configurable. */
-#define NUM_PROBES             8
-
 #define DEMONAME               "Demo device"
 
-/* The size of chunks to send through the session bus. */
-/* TODO: Should be configurable. */
-#define BUFSIZE                4096
+/* Number of probes we generate by default. */
+#define DEFAULT_NUM_PROBES     8
+
+/* Default size of the chunks sent through the session bus. */
+#define DEFAULT_PACKET_SIZE    4096
+
+/* Largest configurable packet size. */
+#define MAX_PACKET_SIZE        (64 * 1024 * 1024)
+
+/* Number of generator threads (only one is used in realtime mode). */
+#define NUM_WORKERS            4
+
+/* Number of packets which can be generated ahead of the session thread. */
+#define QUEUE_DEPTH            16
+
+/* Poll interval in realtime mode, and max wait for a packet (in ms). */
+#define TICK                   10
+
+/*
+ * The protocol patterns below run at a fixed number of samples per bit,
+ * i.e. decode the UART with a baudrate of samplerate / UART_BIT_SAMPLES.
+ */
+#define UART_BIT_SAMPLES       16
+#define UART_FRAME_BITS        11 /* 1 bit idle, start, 8 data, stop. */
+#define SPI_HALF_SAMPLES       4
+#define SPI_FRAME_BITS         10 /* 8 data bits, 2 bits with CS# high. */
+#define I2C_QUARTER_SAMPLES    4
+#define I2C_FRAME_SLOTS        22
+#define I2C_ADDRESS            0x50
 
 /* Supported patterns which we can generate */
 enum {
@@ -51,8 +68,8 @@ enum {
 	PATTERN_RANDOM,
 
 	/**
-	 * Pattern which consists of incrementing numbers.
-	 * TODO: Better description.
+	 * Pattern which consists of incrementing numbers, i.e. each sample
+	 * holds its own sample number.
 	 */
 	PATTERN_INC,
 
@@ -61,19 +78,59 @@ enum {
 
 	/** Pattern where all probes have a high logic state. */
 	PATTERN_ALL_HIGH,
-};
 
-/* FIXME: Should not be global. */
+	/** UART (8N1) transmitting protocol_text on probe 0. */
+	PATTERN_UART,
 
+	/**
+	 * SPI (mode 0, MSB first) transfers of protocol_text, with CLK on
+	 * probe 0, MOSI on probe 1, MISO (inverted text) on probe 2 and CS#
+	 * on probe 3.
+	 */
+	PATTERN_SPI,
+
+	/**
+	 * I2C writes of protocol_text to address I2C_ADDRESS, one byte per
+	 * transaction, with SCL on probe 0 and SDA on probe 1.
+	 */
+	PATTERN_I2C,
+};
+
+/* Private, per-acquisition driver context. */
 struct context {
-	int pipe_fds[2];
-	GIOChannel *channels[2];
-	uint8_t sample_generator;
-	uint8_t thread_running;
-	uint64_t samples_counter;
-	int dev_index;
 	void *session_dev_id;
-	GTimer *timer;
+	int pattern;
+	int num_probes;
+	int unitsize;
+	uint64_t samplerate;
+	gboolean realtime;
+
+	/* Number of samples per packet. */
+	uint64_t packet_samples;
+	/* Number of samples and packets to send, 0 if not limited. */
+	uint64_t limit_samples;
+	uint64_t num_packets;
+	/* Wall clock limit, only used when not in realtime mode. */
+	uint64_t limit_msec;
+	gint64 start_time;
+
+	struct sr_buffer_pool *pool;
+	GThread *workers[NUM_WORKERS];
+	int num_workers;
+
+	/*
+	 * The workers generate packets in parallel, and leave them in
+	 * slots[] for the session thread, which sends them out in order.
+	 * Everything below is protected by the mutex, and the cond is
+	 * signalled whenever a packet is generated or a slot is freed.
+	 */
+	GMutex *mutex;
+	GCond *cond;
+	struct sr_buffer *slots[QUEUE_DEPTH];
+	uint64_t next_generate;
+	uint64_t next_send;
+	gboolean stopping;
+	gboolean failed;
 };
 
 static const int hwcaps[] = {
@@ -81,9 +138,13 @@ static const int hwcaps[] = {
 	SR_HWCAP_DEMO_DEV,
 	SR_HWCAP_SAMPLERATE,
 	SR_HWCAP_PATTERN_MODE,
+	SR_HWCAP_CAPTURE_NUM_PROBES,
+	SR_HWCAP_PACKET_SIZE,
+	SR_HWCAP_REALTIME,
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_LIMIT_MSEC,
 	SR_HWCAP_CONTINUOUS,
+	0,
 };
 
 static const struct sr_samplerates samplerates = {
@@ -99,19 +160,25 @@ static const char *pattern_strings[] = {
 	"incremental",
 	"all-low",
 	"all-high",
+	"uart",
+	"spi",
+	"i2c",
 	NULL,
 };
 
-/* We name the probes 0-7 on our demo driver. */
-static const char *probe_names[NUM_PROBES + 1] = {
-	"0",
-	"1",
-	"2",
-	"3",
-	"4",
-	"5",
-	"6",
-	"7",
+/*
+ * We name the probes 0-63 on our demo driver. Only the first num_probes
+ * of them are generated, see SR_HWCAP_CAPTURE_NUM_PROBES.
+ */
+static const char *probe_names[SR_MAX_NUM_PROBES + 1] = {
+	"0", "1", "2", "3", "4", "5", "6", "7",
+	"8", "9", "10", "11", "12", "13", "14", "15",
+	"16", "17", "18", "19", "20", "21", "22", "23",
+	"24", "25", "26", "27", "28", "29", "30", "31",
+	"32", "33", "34", "35", "36", "37", "38", "39",
+	"40", "41", "42", "43", "44", "45", "46", "47",
+	"48", "49", "50", "51", "52", "53", "54", "55",
+	"56", "57", "58", "59", "60", "61", "62", "63",
 	NULL,
 };
 
@@ -126,8 +193,8 @@ static uint8_t pattern_sigrok[] = {
 	0xbe, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
 };
 
-/* Private, per-device-instance driver context. */
-/* TODO: struct context as with the other drivers. */
+/* What the protocol patterns transmit, over and over again. */
+static const char protocol_text[] = "Hello, sigrok!\r\n";
 
 /* List of struct sr_dev_inst, maintained by dev_open()/dev_close(). */
 static GSList *dev_insts = NULL;
@@ -135,8 +202,9 @@ static uint64_t cur_samplerate = SR_KHZ(200);
 static uint64_t limit_samples = 0;
 static uint64_t limit_msec = 0;
 static int default_pattern = PATTERN_SIGROK;
-static GThread *my_thread;
-static int thread_running;
+static int num_probes = DEFAULT_NUM_PROBES;
+static uint64_t packet_size = DEFAULT_PACKET_SIZE;
+static gboolean realtime = TRUE;
 
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data);
 
@@ -199,7 +267,7 @@ static const void *hw_dev_info_get(int dev_index, int dev_info_id)
 		info = sdi;
 		break;
 	case SR_DI_NUM_PROBES:
-		info = GINT_TO_POINTER(NUM_PROBES);
+		info = GINT_TO_POINTER(SR_MAX_NUM_PROBES);
 		break;
 	case SR_DI_PROBE_NAMES:
 		info = probe_names;
@@ -231,17 +299,35 @@ static const int *hw_hwcap_get_all(void)
 	return hwcaps;
 }
 
+/*
+ * Probes past the ones we generate carry no data, so make sure the
+ * frontend (and its output modules) see them as disabled.
+ */
+static int configure_probes(const GSList *probes)
+{
+	const GSList *l;
+	struct sr_probe *probe;
+
+	for (l = probes; l; l = l->next) {
+		probe = (struct sr_probe *)l->data;
+		if (probe->index > num_probes)
+			probe->enabled = FALSE;
+	}
+
+	return SR_OK;
+}
+
 static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 {
-	int ret;
+	int ret, i;
+	uint64_t tmp_u64;
 	const char *stropt;
 
 	/* Avoid compiler warnings. */
 	(void)dev_index;
 
 	if (hwcap == SR_HWCAP_PROBECONFIG) {
-		/* Nothing to do, but must be supported */
-		ret = SR_OK;
+		ret = configure_probes(value);
 	} else if (hwcap == SR_HWCAP_SAMPLERATE) {
 		cur_samplerate = *(const uint64_t *)value;
 		sr_dbg("demo: %s: setting samplerate to %" PRIu64, __func__,
@@ -261,22 +347,42 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 		ret = SR_OK;
 	} else if (hwcap == SR_HWCAP_PATTERN_MODE) {
 		stropt = value;
-		ret = SR_OK;
-		if (!strcmp(stropt, "sigrok")) {
-			default_pattern = PATTERN_SIGROK;
-		} else if (!strcmp(stropt, "random")) {
-			default_pattern = PATTERN_RANDOM;
-		} else if (!strcmp(stropt, "incremental")) {
-			default_pattern = PATTERN_INC;
-		} else if (!strcmp(stropt, "all-low")) {
-			default_pattern = PATTERN_ALL_LOW;
-		} else if (!strcmp(stropt, "all-high")) {
-			default_pattern = PATTERN_ALL_HIGH;
-		} else {
-			ret = SR_ERR;
+		ret = SR_ERR;
+		for (i = 0; pattern_strings[i]; i++) {
+			if (!strcmp(stropt, pattern_strings[i])) {
+				default_pattern = i;
+				ret = SR_OK;
+				break;
+			}
 		}
 		sr_dbg("demo: %s: setting pattern to %d", __func__,
 		       default_pattern);
+	} else if (hwcap == SR_HWCAP_CAPTURE_NUM_PROBES) {
+		tmp_u64 = *(const uint64_t *)value;
+		if (tmp_u64 < 1 || tmp_u64 > SR_MAX_NUM_PROBES) {
+			sr_err("demo: %s: invalid number of probes %" PRIu64,
+			       __func__, tmp_u64);
+			return SR_ERR_ARG;
+		}
+		num_probes = tmp_u64;
+		sr_dbg("demo: %s: setting num_probes to %d", __func__,
+		       num_probes);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_PACKET_SIZE) {
+		tmp_u64 = *(const uint64_t *)value;
+		if (tmp_u64 < 1 || tmp_u64 > MAX_PACKET_SIZE) {
+			sr_err("demo: %s: invalid packet size %" PRIu64,
+			       __func__, tmp_u64);
+			return SR_ERR_ARG;
+		}
+		packet_size = tmp_u64;
+		sr_dbg("demo: %s: setting packet_size to %" PRIu64, __func__,
+		       packet_size);
+		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_REALTIME) {
+		realtime = GPOINTER_TO_INT(value);
+		sr_dbg("demo: %s: setting realtime to %d", __func__, realtime);
+		ret = SR_OK;
 	} else {
 		ret = SR_ERR;
 	}
@@ -284,30 +390,165 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
-static void samples_generator(uint8_t *buf, uint64_t size, void *data)
+/* Fill 'count' samples with the same value. */
+static void fill_samples(uint8_t *buf, uint64_t value, uint64_t count,
+			 int unitsize)
 {
-	static uint64_t p = 0;
-	struct context *ctx = data;
+	uint8_t unit[8];
 	uint64_t i;
+	int j;
+
+	if (unitsize == 1) {
+		memset(buf, value, count);
+		return;
+	}
+
+	/* Samples are little endian, probe 0 is bit 0 of the first byte. */
+	for (j = 0; j < unitsize; j++)
+		unit[j] = value >> (8 * j);
+	for (i = 0; i < count; i++, buf += unitsize)
+		memcpy(buf, unit, unitsize);
+}
+
+/*
+ * The protocol patterns: return the state of the probes at sample 's',
+ * and the number of samples it stays that way.
+ */
+typedef uint8_t (*protocol_func_t)(uint64_t s, uint64_t *run);
+
+static uint8_t protocol_char(uint64_t frame)
+{
+	return protocol_text[frame % (sizeof(protocol_text) - 1)];
+}
+
+static uint8_t uart_state(uint64_t s, uint64_t *run)
+{
+	uint64_t bit;
+	uint8_t c;
+
+	*run = UART_BIT_SAMPLES - s % UART_BIT_SAMPLES;
+	bit = s / UART_BIT_SAMPLES;
+	c = protocol_char(bit / UART_FRAME_BITS);
+	bit %= UART_FRAME_BITS;
+
+	/* Idle bit, so the line starts high, then start bit and data. */
+	if (bit == 1)
+		return 0;
+	if (bit >= 2 && bit <= 9)
+		return (c >> (bit - 2)) & 1;
+
+	return 1;
+}
+
+static uint8_t spi_state(uint64_t s, uint64_t *run)
+{
+	uint64_t bit;
+	uint8_t c, clk, mosi, miso;
+
+	*run = SPI_HALF_SAMPLES - s % SPI_HALF_SAMPLES;
+	bit = s / (2 * SPI_HALF_SAMPLES);
+	c = protocol_char(bit / SPI_FRAME_BITS);
+	bit %= SPI_FRAME_BITS;
+
+	/* CS# is high between the bytes. */
+	if (bit >= 8)
+		return 1 << 3;
+
+	/* Data changes on the falling edge, the clock idles low. */
+	clk = (s / SPI_HALF_SAMPLES) & 1;
+	mosi = (c >> (7 - bit)) & 1;
+	miso = (~c >> (7 - bit)) & 1;
+
+	return clk | (mosi << 1) | (miso << 2);
+}
+
+static uint8_t i2c_state(uint64_t s, uint64_t *run)
+{
+	/* SCL in bit 0, SDA in bit 1, per quarter of a bit. */
+	static const uint8_t start[4] = { 3, 1, 0, 0 };
+	static const uint8_t stop[4] = { 0, 1, 3, 3 };
+	uint64_t quarter, slot;
+	uint8_t c, byte, sda;
+	int q, bit;
+
+	*run = I2C_QUARTER_SAMPLES - s % I2C_QUARTER_SAMPLES;
+	quarter = s / I2C_QUARTER_SAMPLES;
+	q = quarter % 4;
+	slot = quarter / 4;
+	c = protocol_char(slot / I2C_FRAME_SLOTS);
+	slot %= I2C_FRAME_SLOTS;
+
+	/* START, address + ACK, data + ACK, STOP, 2 bits of idle bus. */
+	if (slot == 0)
+		return start[q];
+	if (slot == 19)
+		return stop[q];
+	if (slot > 19)
+		return 3;
+
+	if (slot < 10) {
+		byte = I2C_ADDRESS << 1;
+		bit = slot - 1;
+	} else {
+		byte = c;
+		bit = slot - 10;
+	}
+	/* The 9th bit is the slave's ACK. */
+	sda = bit < 8 ? (byte >> (7 - bit)) & 1 : 0;
+
+	return (sda << 1) | (q == 1 || q == 2);
+}
+
+static void protocol_generator(uint8_t *buf, uint64_t start, uint64_t count,
+			       int unitsize, protocol_func_t state)
+{
+	uint64_t i, run;
+	uint8_t value;
 
-	/* TODO: Needed? */
-	memset(buf, 0, size);
+	for (i = 0; i < count; i += run) {
+		value = state(start + i, &run);
+		run = MIN(run, count - i);
+		fill_samples(buf + i * unitsize, value, run, unitsize);
+	}
+}
 
-	switch (ctx->sample_generator) {
-	case PATTERN_SIGROK: /* sigrok pattern */
-		for (i = 0; i < size; i++) {
-			*(buf + i) = ~(pattern_sigrok[p] >> 1);
-			if (++p == 64)
-				p = 0;
+/*
+ * Generate 'count' samples, starting at sample number 'start'. Every
+ * sample only depends on its number, so packets can be generated in any
+ * order (and in parallel), and the output is always the same.
+ */
+static void samples_generator(const struct context *ctx, uint8_t *buf,
+			      uint64_t start, uint64_t count)
+{
+	uint64_t i, state, size, tmp;
+	uint8_t c;
+	int j;
+
+	size = count * ctx->unitsize;
+
+	switch (ctx->pattern) {
+	case PATTERN_SIGROK: /* sigrok pattern, repeated in every byte */
+		for (i = 0; i < count; i++) {
+			c = ~(pattern_sigrok[(start + i) % 64] >> 1);
+			memset(buf + i * ctx->unitsize, c, ctx->unitsize);
 		}
 		break;
 	case PATTERN_RANDOM: /* Random */
-		for (i = 0; i < size; i++)
-			*(buf + i) = (uint8_t)(rand() & 0xff);
+		/* xorshift64*, seeded from the packet's position. */
+		state = (start + 1) * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+		for (i = 0; i < size; i += 8) {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			tmp = state * G_GUINT64_CONSTANT(0x2545f4914f6cdd1d);
+			for (j = 0; j < 8 && i + j < size; j++)
+				buf[i + j] = tmp >> (8 * j);
+		}
 		break;
 	case PATTERN_INC: /* Simple increment */
-		for (i = 0; i < size; i++)
-			*(buf + i) = i;
+		for (i = 0; i < count; i++)
+			fill_samples(buf + i * ctx->unitsize, start + i, 1,
+				     ctx->unitsize);
 		break;
 	case PATTERN_ALL_LOW: /* All probes are low */
 		memset(buf, 0x00, size);
@@ -315,99 +556,187 @@ static void samples_generator(uint8_t *buf, uint64_t size, void *data)
 	case PATTERN_ALL_HIGH: /* All probes are high */
 		memset(buf, 0xff, size);
 		break;
+	case PATTERN_UART:
+		protocol_generator(buf, start, count, ctx->unitsize,
+				   uart_state);
+		break;
+	case PATTERN_SPI:
+		protocol_generator(buf, start, count, ctx->unitsize,
+				   spi_state);
+		break;
+	case PATTERN_I2C:
+		protocol_generator(buf, start, count, ctx->unitsize,
+				   i2c_state);
+		break;
 	default:
 		sr_err("demo: %s: unknown pattern %d", __func__,
-		       ctx->sample_generator);
+		       ctx->pattern);
+		memset(buf, 0x00, size);
 		break;
 	}
 }
 
-/* Thread function */
-static void thread_func(void *data)
+/* Number of samples in the given packet. */
+static uint64_t packet_samples(const struct context *ctx, uint64_t packet)
+{
+	if (ctx->num_packets && packet == ctx->num_packets - 1)
+		return ctx->limit_samples - packet * ctx->packet_samples;
+
+	return ctx->packet_samples;
+}
+
+/* Generator thread: keeps filling slots until the queue is full. */
+static gpointer worker_thread(gpointer data)
 {
 	struct context *ctx = data;
-	uint8_t buf[BUFSIZE];
-	uint64_t nb_to_send = 0;
-	int bytes_written;
-	double time_cur, time_last, time_diff;
+	struct sr_buffer *buf;
+	uint64_t packet;
+
+	g_mutex_lock(ctx->mutex);
+	while (!ctx->stopping) {
+		if (ctx->num_packets && ctx->next_generate >= ctx->num_packets)
+			break;
+		if (ctx->next_generate >= ctx->next_send + QUEUE_DEPTH) {
+			g_cond_wait(ctx->cond, ctx->mutex);
+			continue;
+		}
+		packet = ctx->next_generate++;
+		g_mutex_unlock(ctx->mutex);
+
+		if ((buf = sr_buffer_pool_get(ctx->pool)))
+			samples_generator(ctx, buf->data,
+					  packet * ctx->packet_samples,
+					  packet_samples(ctx, packet));
+
+		g_mutex_lock(ctx->mutex);
+		if (buf)
+			ctx->slots[packet % QUEUE_DEPTH] = buf;
+		else
+			ctx->failed = TRUE;
+		g_cond_broadcast(ctx->cond);
+	}
+	g_mutex_unlock(ctx->mutex);
 
-	time_last = g_timer_elapsed(ctx->timer, NULL);
+	return NULL;
+}
 
-	while (thread_running) {
-		/* Rate control */
-		time_cur = g_timer_elapsed(ctx->timer, NULL);
+static void stop_workers(struct context *ctx)
+{
+	int i;
 
-		time_diff = time_cur - time_last;
-		time_last = time_cur;
+	g_mutex_lock(ctx->mutex);
+	ctx->stopping = TRUE;
+	g_cond_broadcast(ctx->cond);
+	g_mutex_unlock(ctx->mutex);
 
-		nb_to_send = cur_samplerate * time_diff;
+	for (i = 0; i < ctx->num_workers; i++)
+		g_thread_join(ctx->workers[i]);
+	ctx->num_workers = 0;
+}
 
-		if (limit_samples) {
-			nb_to_send = MIN(nb_to_send,
-				      limit_samples - ctx->samples_counter);
-		}
+static void free_context(struct context *ctx)
+{
+	int i;
 
-		/* Make sure we don't overflow. */
-		nb_to_send = MIN(nb_to_send, BUFSIZE);
+	for (i = 0; i < QUEUE_DEPTH; i++) {
+		if (ctx->slots[i])
+			sr_buffer_unref(ctx->slots[i]);
+	}
+	if (ctx->pool)
+		sr_buffer_pool_destroy(ctx->pool);
+	if (ctx->cond)
+		g_cond_free(ctx->cond);
+	if (ctx->mutex)
+		g_mutex_free(ctx->mutex);
+	g_free(ctx);
+}
 
-		if (nb_to_send) {
-			samples_generator(buf, nb_to_send, data);
-			ctx->samples_counter += nb_to_send;
+static void finish_acquisition(struct sr_dev_inst *sdi)
+{
+	struct context *ctx = sdi->priv;
+	struct sr_datafeed_packet packet;
 
-			g_io_channel_write_chars(ctx->channels[1], (gchar *)&buf,
-				nb_to_send, (gsize *)&bytes_written, NULL);
-		}
+	stop_workers(ctx);
 
-		/* Check if we're done. */
-		if ((limit_msec && time_cur * 1000 > limit_msec) ||
-		    (limit_samples && ctx->samples_counter >= limit_samples))
-		{
-			close(ctx->pipe_fds[1]);
-			thread_running = 0;
-		}
+	packet.type = SR_DF_END;
+	sr_session_send(ctx->session_dev_id, &packet);
 
-		g_usleep(10);
-	}
+	free_context(ctx);
+	sdi->priv = NULL;
 }
 
-/* Callback handling data */
+/*
+ * Send out the packets the workers have finished, in order. Runs
+ * continuously, or every TICK ms in realtime mode.
+ */
 static int receive_data(int fd, int revents, void *cb_data)
 {
-	struct context *ctx = cb_data;
-	struct sr_datafeed_packet packet;
+	struct sr_dev_inst *sdi = cb_data;
+	struct context *ctx = sdi->priv;
 	struct sr_datafeed_logic logic;
-	static uint64_t samples_received = 0;
-	unsigned char c[BUFSIZE];
-	gsize z;
+	struct sr_buffer *buf;
+	GTimeVal deadline;
+	uint64_t packet, due;
+	double elapsed;
+	gboolean failed;
+	int sent;
 
 	/* Avoid compiler warnings. */
 	(void)fd;
 	(void)revents;
 
-	do {
-		g_io_channel_read_chars(ctx->channels[0],
-				        (gchar *)&c, BUFSIZE, &z, NULL);
-
-		if (z > 0) {
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = z;
-			logic.unitsize = 1;
-			logic.data = c;
-			sr_session_send(ctx->session_dev_id, &packet);
-			samples_received += z;
-		}
-	} while (z > 0);
+	elapsed = (g_get_monotonic_time() - ctx->start_time) / 1000000.0;
+	if (ctx->limit_msec && elapsed * 1000 >= ctx->limit_msec) {
+		finish_acquisition(sdi);
+		return FALSE;
+	}
 
-	if (!thread_running && z <= 0) {
-		/* Make sure we don't receive more packets. */
-		g_io_channel_shutdown(ctx->channels[0], FALSE, NULL);
+	/* In realtime mode, only send what the samplerate allows by now. */
+	due = ctx->realtime ? elapsed * ctx->samplerate : G_MAXUINT64;
 
-		/* Send last packet. */
-		packet.type = SR_DF_END;
-		sr_session_send(ctx->session_dev_id, &packet);
+	logic.unitsize = ctx->unitsize;
+	for (sent = 0; sent < QUEUE_DEPTH; sent++) {
+		packet = ctx->next_send;
+		if (ctx->num_packets && packet == ctx->num_packets) {
+			finish_acquisition(sdi);
+			return FALSE;
+		}
+		if (packet * ctx->packet_samples
+		    + packet_samples(ctx, packet) > due)
+			break;
+
+		g_mutex_lock(ctx->mutex);
+		buf = ctx->slots[packet % QUEUE_DEPTH];
+		if (!buf && !sent && !ctx->failed) {
+			/* Don't spin while the workers catch up. */
+			g_get_current_time(&deadline);
+			g_time_val_add(&deadline, TICK * 1000);
+			g_cond_timed_wait(ctx->cond, ctx->mutex, &deadline);
+			buf = ctx->slots[packet % QUEUE_DEPTH];
+		}
+		if (buf) {
+			ctx->slots[packet % QUEUE_DEPTH] = NULL;
+			ctx->next_send++;
+			g_cond_broadcast(ctx->cond);
+		}
+		failed = ctx->failed;
+		g_mutex_unlock(ctx->mutex);
+
+		if (!buf) {
+			if (!failed)
+				break;
+			sr_err("demo: %s: packet buffer malloc failed",
+			       __func__);
+			finish_acquisition(sdi);
+			return FALSE;
+		}
 
-		return FALSE;
+		logic.length = packet_samples(ctx, packet) * ctx->unitsize;
+		logic.data = buf->data;
+		logic.buffer = buf;
+		sr_session_stats_transfer(logic.length);
+		sr_session_send_logic(ctx->session_dev_id, &logic);
+		sr_buffer_unref(buf);
 	}
 
 	return TRUE;
@@ -415,94 +744,106 @@ static int receive_data(int fd, int revents, void *cb_data)
 
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
-	struct sr_datafeed_packet *packet;
-	struct sr_datafeed_header *header;
+	struct sr_dev_inst *sdi;
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_header header;
 	struct sr_datafeed_meta_logic meta;
 	struct context *ctx;
+	int i;
 
-	/* TODO: 'ctx' is never g_free()'d? */
-	if (!(ctx = g_try_malloc(sizeof(struct context)))) {
-		sr_err("demo: %s: ctx malloc failed", __func__);
-		return SR_ERR_MALLOC;
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
+		sr_err("demo: %s: sdi was NULL", __func__);
+		return SR_ERR_BUG;
 	}
 
-	ctx->sample_generator = default_pattern;
-	ctx->session_dev_id = cb_data;
-	ctx->dev_index = dev_index;
-	ctx->samples_counter = 0;
-
-	if (pipe(ctx->pipe_fds)) {
-		/* TODO: Better error message. */
-		sr_err("demo: %s: pipe() failed", __func__);
+	if (sdi->priv) {
+		sr_err("demo: %s: acquisition already running", __func__);
 		return SR_ERR;
 	}
 
-	ctx->channels[0] = g_io_channel_unix_new(ctx->pipe_fds[0]);
-	ctx->channels[1] = g_io_channel_unix_new(ctx->pipe_fds[1]);
-
-	g_io_channel_set_flags(ctx->channels[0], G_IO_FLAG_NONBLOCK, NULL);
-
-	/* Set channel encoding to binary (default is UTF-8). */
-	g_io_channel_set_encoding(ctx->channels[0], NULL, NULL);
-	g_io_channel_set_encoding(ctx->channels[1], NULL, NULL);
-
-	/* Make channels to unbuffered. */
-	g_io_channel_set_buffered(ctx->channels[0], FALSE);
-	g_io_channel_set_buffered(ctx->channels[1], FALSE);
-
-	sr_session_source_add_channel(ctx->channels[0], G_IO_IN | G_IO_ERR,
-		    40, receive_data, ctx);
-
-	/* Run the demo thread. */
-	g_thread_init(NULL);
-	/* This must to be done between g_thread_init() & g_thread_create(). */
-	ctx->timer = g_timer_new();
-	thread_running = 1;
-	my_thread =
-	    g_thread_create((GThreadFunc)thread_func, ctx, TRUE, NULL);
-	if (!my_thread) {
-		sr_err("demo: %s: g_thread_create failed", __func__);
-		return SR_ERR; /* TODO */
+	if (!(ctx = g_try_malloc0(sizeof(struct context)))) {
+		sr_err("demo: %s: ctx malloc failed", __func__);
+		return SR_ERR_MALLOC;
 	}
 
-	if (!(packet = g_try_malloc(sizeof(struct sr_datafeed_packet)))) {
-		sr_err("demo: %s: packet malloc failed", __func__);
+	ctx->session_dev_id = cb_data;
+	ctx->pattern = default_pattern;
+	ctx->num_probes = num_probes;
+	ctx->unitsize = (num_probes + 7) / 8;
+	ctx->samplerate = cur_samplerate;
+	ctx->realtime = realtime;
+	ctx->packet_samples = MAX(1, packet_size / ctx->unitsize);
+
+	/* In realtime mode, a time limit is just a number of samples. */
+	ctx->limit_samples = limit_samples;
+	if (realtime && limit_msec)
+		ctx->limit_samples = MAX(1, cur_samplerate * limit_msec / 1000);
+	else
+		ctx->limit_msec = limit_msec;
+	if (ctx->limit_samples)
+		ctx->num_packets = (ctx->limit_samples + ctx->packet_samples
+				    - 1) / ctx->packet_samples;
+
+	if (!(ctx->pool = sr_buffer_pool_new(ctx->packet_samples
+					* ctx->unitsize, QUEUE_DEPTH))) {
+		g_free(ctx);
 		return SR_ERR_MALLOC;
 	}
 
-	if (!(header = g_try_malloc(sizeof(struct sr_datafeed_header)))) {
-		sr_err("demo: %s: header malloc failed", __func__);
-		return SR_ERR_MALLOC;
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+	ctx->mutex = g_mutex_new();
+	ctx->cond = g_cond_new();
+
+	ctx->start_time = g_get_monotonic_time();
+	for (i = 0; i < (realtime ? 1 : NUM_WORKERS); i++) {
+		if (!(ctx->workers[i] = g_thread_create(worker_thread, ctx,
+							TRUE, NULL))) {
+			sr_err("demo: %s: g_thread_create failed", __func__);
+			stop_workers(ctx);
+			free_context(ctx);
+			return SR_ERR;
+		}
+		ctx->num_workers++;
 	}
 
-	packet->type = SR_DF_HEADER;
-	packet->payload = header;
-	header->feed_version = 1;
-	gettimeofday(&header->starttime, NULL);
-	sr_session_send(ctx->session_dev_id, packet);
+	sdi->priv = ctx;
+	sr_source_add(-1, 0, realtime ? TICK : 0, receive_data, sdi);
+
+	packet.type = SR_DF_HEADER;
+	packet.payload = &header;
+	header.feed_version = 1;
+	gettimeofday(&header.starttime, NULL);
+	sr_session_send(ctx->session_dev_id, &packet);
 
 	/* Send metadata about the SR_DF_LOGIC packets to come. */
-	packet->type = SR_DF_META_LOGIC;
-	packet->payload = &meta;
+	packet.type = SR_DF_META_LOGIC;
+	packet.payload = &meta;
 	meta.samplerate = cur_samplerate;
-	meta.num_probes = NUM_PROBES;
-	sr_session_send(ctx->session_dev_id, packet);
-
-	g_free(header);
-	g_free(packet);
+	meta.num_probes = num_probes;
+	sr_session_send(ctx->session_dev_id, &packet);
 
 	return SR_OK;
 }
 
-/* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 {
+	struct sr_dev_inst *sdi;
+
 	/* Avoid compiler warnings. */
-	(void)dev_index;
 	(void)cb_data;
 
-	/* Stop generate thread. */
-	thread_running = 0;
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
+		sr_err("demo: %s: sdi was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	/* Already done? */
+	if (!sdi->priv)
+		return SR_OK;
+
+	sr_source_remove(-1);
+	finish_acquisition(sdi);
 
 	return SR_OK;
 }
@@ -22,6 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#define pipe(fds) _pipe(fds, 4096, _O_BINARY)
+#endif
 #include <libusb.h>
 #include "config.h"
 #include "libsigrok.h"
@@ -89,6 +95,7 @@ static const int hwcaps[] = {
 	/* These are really implemented in the driver, not the hardware. */
 	SR_HWCAP_LIMIT_SAMPLES,
 	SR_HWCAP_CONTINUOUS,
+	SR_HWCAP_CAPTURE_RATIO,
 	0,
 };
 
@@ -328,7 +335,7 @@ static int configure_probes(struct context *ctx, GSList *probes)
 		ctx->trigger_value[i] = 0;
 	}
 
-	stage = -1;
+	ctx->num_trigger_stages = 0;
 	for (l = probes; l; l = l->next) {
 		probe = (struct sr_probe *)l->data;
 		if (probe->enabled == FALSE)
@@ -343,24 +350,16 @@ static int configure_probes(struct context *ctx, GSList *probes)
 
 		stage = 0;
 		for (tc = probe->trigger; *tc; tc++) {
+			if (stage == NUM_TRIGGER_STAGES)
+				return SR_ERR;
 			ctx->trigger_mask[stage] |= probe_bit;
 			if (*tc == '1')
 				ctx->trigger_value[stage] |= probe_bit;
 			stage++;
-			if (stage > NUM_TRIGGER_STAGES)
-				return SR_ERR;
 		}
+		ctx->num_trigger_stages = MAX(ctx->num_trigger_stages, stage);
 	}
 
-	if (stage == -1)
-		/*
-		 * We didn't configure any triggers, make sure acquisition
-		 * doesn't wait for any.
-		 */
-		ctx->trigger_stage = TRIGGER_FIRED;
-	else
-		ctx->trigger_stage = 0;
-
 	return SR_OK;
 }
 
@@ -645,6 +644,11 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	} else if (hwcap == SR_HWCAP_LIMIT_SAMPLES) {
 		ctx->limit_samples = *(const uint64_t *)value;
 		ret = SR_OK;
+	} else if (hwcap == SR_HWCAP_CAPTURE_RATIO) {
+		ctx->capture_ratio = *(const uint64_t *)value;
+		ret = ctx->capture_ratio > 100 ? SR_ERR_ARG : SR_OK;
+		if (ret != SR_OK)
+			ctx->capture_ratio = 0;
 	} else {
 		ret = SR_ERR;
 	}
@@ -652,51 +656,38 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
-static int receive_data(int fd, int revents, void *cb_data)
+/* Stop the event thread, and free what event_thread_start() set up. */
+static void event_thread_stop(struct context *ctx)
 {
-	struct timeval tv;
-
-	/* Avoid compiler warnings. */
-	(void)fd;
-	(void)revents;
-	(void)cb_data;
-
-	tv.tv_sec = tv.tv_usec = 0;
-	libusb_handle_events_timeout(usb_context, &tv);
-
-	return TRUE;
-}
-
-static void abort_acquisition(struct context *ctx)
-{
-	int i;
-
-	ctx->num_samples = -1;
-
-	for (i = ctx->num_transfers - 1; i >= 0; i--) {
-		if (ctx->transfers[i])
-			libusb_cancel_transfer(ctx->transfers[i]);
-	}
+	g_atomic_int_set(&ctx->event_thread_running, FALSE);
+	g_thread_join(ctx->event_thread);
+	ctx->event_thread = NULL;
+
+	sr_source_remove(ctx->wake_fds[0]);
+	close(ctx->wake_fds[0]);
+	close(ctx->wake_fds[1]);
+	g_async_queue_unref(ctx->done_transfers);
+	ctx->done_transfers = NULL;
+	g_async_queue_unref(ctx->spare_transfers);
+	ctx->spare_transfers = NULL;
 }
 
 static void finish_acquisition(struct context *ctx)
 {
 	struct sr_datafeed_packet packet;
-	int i;
 
 	/* Terminate session */
 	packet.type = SR_DF_END;
 	sr_session_send(ctx->session_dev_id, &packet);
 
-	/* Remove fds from polling */
-	const struct libusb_pollfd **const lupfd =
-		libusb_get_pollfds(usb_context);
-	for (i = 0; lupfd[i]; i++)
-		sr_source_remove(lupfd[i]->fd);
-	free(lupfd); /* NOT g_free()! */
+	/* All transfers are gone, the event thread has nothing left to do. */
+	event_thread_stop(ctx);
 
 	ctx->num_transfers = 0;
 	g_free(ctx->transfers);
+
+	g_free(ctx->pretrig_buf);
+	ctx->pretrig_buf = NULL;
 }
 
 static void free_transfer(struct libusb_transfer *transfer)
@@ -721,9 +712,53 @@ static void free_transfer(struct libusb_transfer *transfer)
 
 }
 
-static void resubmit_transfer(struct libusb_transfer *transfer)
+static void abort_acquisition(struct context *ctx)
 {
+	struct libusb_transfer *transfer;
+	int i;
+
+	ctx->num_samples = -1;
+	g_atomic_int_set(&ctx->aborted, TRUE);
+
+	for (i = ctx->num_transfers - 1; i >= 0; i--) {
+		if (ctx->transfers[i])
+			libusb_cancel_transfer(ctx->transfers[i]);
+	}
+
+	/* Spare transfers aren't submitted, so they won't come back. */
+	while (ctx->spare_transfers
+	       && (transfer = g_async_queue_try_pop(ctx->spare_transfers)))
+		free_transfer(transfer);
+}
+
+static int submit_transfer(struct libusb_transfer *transfer)
+{
+	struct context *ctx = transfer->user_data;
+
+	g_atomic_int_inc(&ctx->transfers_in_flight);
 	if (libusb_submit_transfer(transfer) != 0) {
+		g_atomic_int_add(&ctx->transfers_in_flight, -1);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Hand a transfer the session thread is done with back: resubmit it if the
+ * event thread ran out of spare transfers, otherwise make it a spare.
+ */
+static void resubmit_transfer(struct libusb_transfer *transfer)
+{
+	struct context *ctx = transfer->user_data;
+
+	if (g_atomic_int_get(&ctx->transfers_in_flight)
+	    >= (gint)ctx->num_simul_transfers) {
+		g_async_queue_push(ctx->spare_transfers, transfer);
+		return;
+	}
+
+	if (submit_transfer(transfer) != SR_OK) {
 		free_transfer(transfer);
 		/* TODO: Stop session? */
 		/* TODO: Better error message. */
@@ -731,11 +766,264 @@ static void resubmit_transfer(struct libusb_transfer *transfer)
 	}
 }
 
+/*
+ * Runs libusb event handling, so transfers are serviced (and replaced by
+ * spare ones) without waiting for the session thread.
+ */
+static gpointer event_thread(gpointer data)
+{
+	struct context *ctx = data;
+	struct timeval tv;
+
+	while (g_atomic_int_get(&ctx->event_thread_running)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = EVENT_THREAD_TIMEOUT_MS * 1000;
+		libusb_handle_events_timeout(usb_context, &tv);
+	}
+
+	return NULL;
+}
+
+/*
+ * Called by libusb on the event thread. Keeps the FX2 fed with a spare
+ * transfer, and queues the completed one for the session thread.
+ */
 static void receive_transfer(struct libusb_transfer *transfer)
 {
-	gboolean packet_has_error = FALSE;
-	struct sr_datafeed_packet packet;
+	struct context *ctx = transfer->user_data;
+	struct libusb_transfer *spare;
+	char wake = 0;
+
+	g_atomic_int_add(&ctx->transfers_in_flight, -1);
+
+	if ((transfer->status == LIBUSB_TRANSFER_COMPLETED
+	     || transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+	    && !g_atomic_int_get(&ctx->aborted)
+	    && (spare = g_async_queue_try_pop(ctx->spare_transfers))) {
+		if (submit_transfer(spare) != SR_OK)
+			g_async_queue_push(ctx->spare_transfers, spare);
+	}
+
+	g_async_queue_push(ctx->done_transfers, transfer);
+	if (write(ctx->wake_fds[1], &wake, 1) != 1)
+		sr_err("fx2lafw: %s: wake-up write failed.", __func__);
+}
+
+/* Repeat an 8 or 16 bit value in all lanes of a 64 bit word. */
+#define LANES8(x)	((uint64_t)(x) * 0x0101010101010101ULL)
+#define LANES16(x)	((uint64_t)(x) * 0x0001000100010001ULL)
+
+static void send_logic(struct context *ctx, void *data, uint64_t length)
+{
 	struct sr_datafeed_logic logic;
+
+	logic.length = length;
+	logic.unitsize = ctx->sample_wide ? 2 : 1;
+	logic.data = data;
+	logic.buffer = NULL;
+	sr_session_send_logic(ctx->session_dev_id, &logic);
+}
+
+static uint16_t sample_get(const struct context *ctx, const uint8_t *buf,
+			   int i)
+{
+	uint16_t sample;
+
+	if (!ctx->sample_wide)
+		return buf[i];
+
+	memcpy(&sample, buf + i * 2, sizeof(sample));
+	return sample;
+}
+
+/*
+ * Check whether all trigger stages match, starting at sample 'pos' of the
+ * trigger buffer (the previous transfer's tail) followed by 'buf'.
+ *
+ * Returns 1 on a match, 0 if there's none, or -1 if there aren't enough
+ * samples yet to tell.
+ */
+static int trigger_match_at(const struct context *ctx, const uint8_t *buf,
+			    int count, int pos)
+{
+	uint16_t sample;
+	int n, stage, i;
+
+	n = ctx->trigger_buffer_samples;
+	for (stage = 0; stage < ctx->num_trigger_stages; stage++) {
+		if ((i = pos + stage) >= n + count)
+			return -1;
+		if (i < n)
+			sample = sample_get(ctx, ctx->trigger_buffer, i);
+		else
+			sample = sample_get(ctx, buf, i - n);
+		if ((sample & ctx->trigger_mask[stage]) != ctx->trigger_value[stage])
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Keep the last (num_trigger_stages - 1) samples, a match may start there. */
+static void trigger_buffer_save(struct context *ctx, const uint8_t *buf,
+				int count)
+{
+	uint8_t tail[sizeof(ctx->trigger_buffer)];
+	int width, n, keep, from_old, from_new;
+
+	width = ctx->sample_wide ? 2 : 1;
+	n = ctx->trigger_buffer_samples;
+	keep = MIN(ctx->num_trigger_stages - 1, n + count);
+
+	/* Short transfers may not replace all of the old tail. */
+	from_old = MAX(0, keep - count);
+	from_new = keep - from_old;
+	memcpy(tail, ctx->trigger_buffer + (n - from_old) * width,
+	       from_old * width);
+	memcpy(tail + from_old * width, buf + (count - from_new) * width,
+	       from_new * width);
+
+	memcpy(ctx->trigger_buffer, tail, keep * width);
+	ctx->trigger_buffer_samples = keep;
+}
+
+/*
+ * Look for the first position where all trigger stages match.
+ *
+ * Returns the position, counting from the start of the trigger buffer, or
+ * -1 if the trigger didn't fire in this transfer.
+ */
+static int trigger_scan(struct context *ctx, const uint8_t *buf, int count)
+{
+	uint64_t word, mask, value, ones, highs;
+	int n, width, lanes, end, i, ret;
+
+	/* Matches which started in the previous transfer. */
+	n = ctx->trigger_buffer_samples;
+	for (i = 0; i < n; i++) {
+		if ((ret = trigger_match_at(ctx, buf, count, i)) == 1)
+			return i;
+		if (ret < 0)
+			break;
+	}
+
+	/*
+	 * Look for stage 0 matches a word (8 or 4 samples) at a time: after
+	 * XORing the masked samples with the stage 0 value, matching samples
+	 * are zero lanes, and (x - ones) & ~x & highs is non-zero if and only
+	 * if x has a zero lane. Only words with a candidate in them are
+	 * checked sample by sample.
+	 */
+	width = ctx->sample_wide ? 2 : 1;
+	lanes = sizeof(word) / width;
+	if (ctx->sample_wide) {
+		mask = LANES16(ctx->trigger_mask[0]);
+		value = LANES16(ctx->trigger_value[0]);
+		ones = LANES16(0x0001);
+		highs = LANES16(0x8000);
+	} else {
+		mask = LANES8(ctx->trigger_mask[0]);
+		value = LANES8(ctx->trigger_value[0]);
+		ones = LANES8(0x01);
+		highs = LANES8(0x80);
+	}
+
+	ret = 0;
+	for (i = 0; i < count && ret >= 0; ) {
+		end = MIN(i + lanes, count);
+		if (end - i == lanes) {
+			memcpy(&word, buf + i * width, sizeof(word));
+			word = (word & mask) ^ value;
+			if (!((word - ones) & ~word & highs)) {
+				i = end;
+				continue;
+			}
+		}
+		for (; i < end; i++) {
+			if ((ret = trigger_match_at(ctx, buf, count, n + i)) == 1)
+				return n + i;
+			/* Later candidates can't be complete either. */
+			if (ret < 0)
+				break;
+		}
+	}
+
+	trigger_buffer_save(ctx, buf, count);
+
+	return -1;
+}
+
+/* Keep the most recent pre-trigger samples in the ring buffer. */
+static void pretrig_append(struct context *ctx, const uint8_t *data,
+			   size_t length)
+{
+	size_t chunk;
+
+	if (!ctx->pretrig_size)
+		return;
+
+	if (length > ctx->pretrig_size) {
+		data += length - ctx->pretrig_size;
+		length = ctx->pretrig_size;
+	}
+	ctx->pretrig_len = MIN(ctx->pretrig_len + length, ctx->pretrig_size);
+
+	while (length) {
+		chunk = MIN(length, ctx->pretrig_size - ctx->pretrig_pos);
+		memcpy(ctx->pretrig_buf + ctx->pretrig_pos, data, chunk);
+		ctx->pretrig_pos = (ctx->pretrig_pos + chunk) % ctx->pretrig_size;
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+/*
+ * Send the pre-trigger samples, the trigger, and the samples of the match
+ * which came with the previous transfer.
+ *
+ * Returns the number of samples in 'buf' before the trigger point.
+ */
+static int trigger_fire(struct context *ctx, const uint8_t *buf, int pos)
+{
+	struct sr_datafeed_packet packet;
+	size_t width, held, length, start, chunk;
+	int before;
+
+	width = ctx->sample_wide ? 2 : 1;
+	before = MAX(0, pos - ctx->trigger_buffer_samples);
+	pretrig_append(ctx, buf, before * width);
+
+	/* The ring also holds the part of the match in the trigger buffer. */
+	held = MAX(0, ctx->trigger_buffer_samples - pos) * width;
+	length = ctx->pretrig_len > held ? ctx->pretrig_len - held : 0;
+	if (length) {
+		start = (ctx->pretrig_pos + ctx->pretrig_size - ctx->pretrig_len)
+			% ctx->pretrig_size;
+		chunk = MIN(length, ctx->pretrig_size - start);
+		send_logic(ctx, ctx->pretrig_buf + start, chunk);
+		if (length > chunk)
+			send_logic(ctx, ctx->pretrig_buf, length - chunk);
+		ctx->num_samples += length / width;
+	}
+
+	/* Tell the frontend we hit the trigger here. */
+	packet.type = SR_DF_TRIGGER;
+	packet.payload = NULL;
+	sr_session_send(ctx->session_dev_id, &packet);
+
+	if (held) {
+		send_logic(ctx, ctx->trigger_buffer + pos * width, held);
+		ctx->num_samples += held / width;
+	}
+
+	ctx->trigger_stage = TRIGGER_FIRED;
+
+	return before;
+}
+
+static void process_transfer(struct libusb_transfer *transfer)
+{
+	gboolean packet_has_error = FALSE;
 	struct context *ctx = transfer->user_data;
 	int trigger_offset, i;
 
@@ -748,7 +1036,7 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		return;
 	}
 
-	sr_info("fx2lafw: receive_transfer(): status %d received %d bytes.",
+	sr_info("fx2lafw: process_transfer(): status %d received %d bytes.",
 		transfer->status, transfer->actual_length);
 
 	/* Save incoming transfer before reusing the transfer struct. */
@@ -769,6 +1057,8 @@ static void receive_transfer(struct libusb_transfer *transfer)
 		break;
 	}
 
+	sr_session_stats_transfer(packet_has_error ? 0 : transfer->actual_length);
+
 	if (transfer->actual_length == 0 || packet_has_error) {
 		ctx->empty_transfer_count++;
 		if (ctx->empty_transfer_count > MAX_EMPTY_TRANSFERS) {
@@ -776,6 +1066,7 @@ static void receive_transfer(struct libusb_transfer *transfer)
 			 * The FX2 gave up. End the acquisition, the frontend
 			 * will work out that the samplecount is short.
 			 */
+			sr_session_stats_overrun();
 			abort_acquisition(ctx);
 			free_transfer(transfer);
 		} else {
@@ -788,115 +1079,92 @@ static void receive_transfer(struct libusb_transfer *transfer)
 
 	trigger_offset = 0;
 	if (ctx->trigger_stage >= 0) {
-		for (i = 0; i < cur_sample_count; i++) {
-
-			const uint16_t cur_sample = ctx->sample_wide ?
-				*((const uint16_t*)cur_buf + i) :
-				*((const uint8_t*)cur_buf + i);
-
-			if ((cur_sample & ctx->trigger_mask[ctx->trigger_stage]) ==
-				ctx->trigger_value[ctx->trigger_stage]) {
-				/* Match on this trigger stage. */
-				ctx->trigger_buffer[ctx->trigger_stage] = cur_sample;
-				ctx->trigger_stage++;
-
-				if (ctx->trigger_stage == NUM_TRIGGER_STAGES ||
-					ctx->trigger_mask[ctx->trigger_stage] == 0) {
-					/* Match on all trigger stages, we're done. */
-					trigger_offset = i + 1;
-
-					/*
-					 * TODO: Send pre-trigger buffer to session bus.
-					 * Tell the frontend we hit the trigger here.
-					 */
-					packet.type = SR_DF_TRIGGER;
-					packet.payload = NULL;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					/*
-					 * Send the samples that triggered it, since we're
-					 * skipping past them.
-					 */
-					packet.type = SR_DF_LOGIC;
-					packet.payload = &logic;
-					logic.unitsize = sizeof(*ctx->trigger_buffer);
-					logic.length = ctx->trigger_stage * logic.unitsize;
-					logic.data = ctx->trigger_buffer;
-					sr_session_send(ctx->session_dev_id, &packet);
-
-					ctx->trigger_stage = TRIGGER_FIRED;
-					break;
-				}
-			} else if (ctx->trigger_stage > 0) {
-				/*
-				 * We had a match before, but not in the next sample. However, we may
-				 * have a match on this stage in the next bit -- trigger on 0001 will
-				 * fail on seeing 00001, so we need to go back to stage 0 -- but at
-				 * the next sample from the one that matched originally, which the
-				 * counter increment at the end of the loop takes care of.
-				 */
-				i -= ctx->trigger_stage;
-				if (i < -1)
-					i = -1; /* Oops, went back past this buffer. */
-				/* Reset trigger stage. */
-				ctx->trigger_stage = 0;
-			}
+		if ((i = trigger_scan(ctx, cur_buf, cur_sample_count)) < 0) {
+			/* No trigger yet, these are all pre-trigger samples. */
+			pretrig_append(ctx, cur_buf, transfer->actual_length);
+			resubmit_transfer(transfer);
+			return;
 		}
+		trigger_offset = trigger_fire(ctx, cur_buf, i);
 	}
 
 	if (ctx->trigger_stage == TRIGGER_FIRED) {
 		/* Send the incoming transfer to the session bus. */
 		const int trigger_offset_bytes = trigger_offset * sample_width;
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = transfer->actual_length - trigger_offset_bytes;
-		logic.unitsize = sample_width;
-		logic.data = cur_buf + trigger_offset_bytes;
-		sr_session_send(ctx->session_dev_id, &packet);
-
-		ctx->num_samples += cur_sample_count;
+		send_logic(ctx, cur_buf + trigger_offset_bytes,
+			   transfer->actual_length - trigger_offset_bytes);
+
+		ctx->num_samples += cur_sample_count - trigger_offset;
 		if (ctx->limit_samples &&
 			(unsigned int)ctx->num_samples > ctx->limit_samples) {
 			abort_acquisition(ctx);
 			free_transfer(transfer);
 			return;
 		}
-	} else {
-		/*
-		 * TODO: Buffer pre-trigger data in capture
-		 * ratio-sized buffer.
-		 */
 	}
 
 	resubmit_transfer(transfer);
 }
 
-static unsigned int to_bytes_per_ms(unsigned int samplerate)
+static int receive_data(int fd, int revents, void *cb_data)
+{
+	struct context *ctx = cb_data;
+	struct libusb_transfer *transfer;
+	char wake[64];
+
+	/* The bytes are just wake-ups, the transfers are in the queue. */
+	if (revents & G_IO_IN && read(fd, wake, sizeof(wake)) < 0)
+		sr_err("fx2lafw: %s: wake-up read failed.", __func__);
+
+	/* The last transfer finishes the acquisition, and frees the queue. */
+	while (ctx->done_transfers
+	       && (transfer = g_async_queue_try_pop(ctx->done_transfers)))
+		process_transfer(transfer);
+
+	return TRUE;
+}
+
+static unsigned int to_bytes_per_ms(struct context *ctx)
 {
-	return samplerate / 1000;
+	uint64_t bytes;
+
+	/* At least one, the sizes and timeouts below divide by this. */
+	bytes = ctx->cur_samplerate * (ctx->sample_wide ? 2 : 1) / 1000;
+	return MAX(1, bytes);
 }
 
 static size_t get_buffer_size(struct context *ctx)
 {
 	size_t s;
 
-	/* The buffer should be large enough to hold 10ms of data and a multiple
-	 * of 512. */
-	s = 10 * to_bytes_per_ms(ctx->cur_samplerate);
-	return (s + 511) & ~511;
+	/*
+	 * The buffer should be large enough to hold TRANSFER_TIME_MS of data
+	 * and a multiple of 512.
+	 */
+	s = TRANSFER_TIME_MS * to_bytes_per_ms(ctx);
+	return MAX(512, (s + 511) & ~511);
 }
 
 static unsigned int get_number_of_transfers(struct context *ctx)
 {
 	unsigned int n;
 
-	/* Total buffer size should be able to hold about 500ms of data */
-	n = 500 * to_bytes_per_ms(ctx->cur_samplerate) / get_buffer_size(ctx);
+	/* The submitted transfers should hold about BUFFER_TIME_MS of data. */
+	n = (BUFFER_TIME_MS * to_bytes_per_ms(ctx) + get_buffer_size(ctx) - 1)
+	    / get_buffer_size(ctx);
 
-	if (n > NUM_SIMUL_TRANSFERS)
-		return NUM_SIMUL_TRANSFERS;
+	return CLAMP(n, MIN_SIMUL_TRANSFERS, NUM_SIMUL_TRANSFERS);
+}
 
-	return n;
+static unsigned int get_number_of_spares(struct context *ctx)
+{
+	unsigned int n;
+
+	/* Spare transfers cover SPARE_TIME_MS of session thread stalls. */
+	n = (SPARE_TIME_MS * to_bytes_per_ms(ctx) + get_buffer_size(ctx) - 1)
+	    / get_buffer_size(ctx);
+
+	return MIN(n, MAX_SPARE_TRANSFERS);
 }
 
 static unsigned int get_timeout(struct context *ctx)
@@ -905,10 +1173,89 @@ static unsigned int get_timeout(struct context *ctx)
 	unsigned int timeout;
 
 	total_size = get_buffer_size(ctx) * get_number_of_transfers(ctx);
-	timeout = total_size / to_bytes_per_ms(ctx->cur_samplerate);
+	timeout = total_size / to_bytes_per_ms(ctx);
 	return timeout + timeout / 4; /* Leave a headroom of 25% percent */
 }
 
+static int event_thread_start(struct context *ctx)
+{
+	if (pipe(ctx->wake_fds)) {
+		sr_err("fx2lafw: %s: pipe() failed.", __func__);
+		return SR_ERR;
+	}
+
+	ctx->done_transfers = g_async_queue_new();
+	ctx->spare_transfers = g_async_queue_new();
+	ctx->transfers_in_flight = 0;
+	ctx->aborted = FALSE;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	if (sr_source_add(ctx->wake_fds[0], G_IO_IN, -1, receive_data,
+			  ctx) != SR_OK) {
+		sr_err("fx2lafw: %s: sr_source_add failed.", __func__);
+		goto err_source;
+	}
+
+	/* The priority is only a hint, not all platforms support it. */
+	ctx->event_thread_running = TRUE;
+	if (!(ctx->event_thread = g_thread_create_full(event_thread, ctx, 0,
+			TRUE, FALSE, G_THREAD_PRIORITY_URGENT, NULL))) {
+		sr_err("fx2lafw: %s: g_thread_create failed.", __func__);
+		sr_source_remove(ctx->wake_fds[0]);
+		goto err_source;
+	}
+
+	return SR_OK;
+
+err_source:
+	g_async_queue_unref(ctx->done_transfers);
+	ctx->done_transfers = NULL;
+	g_async_queue_unref(ctx->spare_transfers);
+	ctx->spare_transfers = NULL;
+	close(ctx->wake_fds[0]);
+	close(ctx->wake_fds[1]);
+	return SR_ERR;
+}
+
+/*
+ * Undo a hw_dev_acquisition_start() which failed half way: get the
+ * submitted transfers back from the event thread, stop it, and free
+ * all transfers. Unlike abort_acquisition(), this doesn't need the
+ * session loop to run, nor does it send SR_DF_END.
+ */
+static void start_failed(struct context *ctx)
+{
+	struct libusb_transfer *transfer;
+	unsigned int i;
+
+	if (ctx->event_thread) {
+		g_atomic_int_set(&ctx->aborted, TRUE);
+		for (i = 0; i < ctx->num_transfers; i++) {
+			if (ctx->transfers[i])
+				libusb_cancel_transfer(ctx->transfers[i]);
+		}
+		while (g_atomic_int_get(&ctx->transfers_in_flight) > 0)
+			g_usleep(EVENT_THREAD_TIMEOUT_MS * 1000);
+		event_thread_stop(ctx);
+	}
+
+	for (i = 0; i < ctx->num_transfers; i++) {
+		if (!(transfer = ctx->transfers[i]))
+			continue;
+		g_free(transfer->buffer);
+		libusb_free_transfer(transfer);
+	}
+	g_free(ctx->transfers);
+	ctx->transfers = NULL;
+	ctx->num_transfers = 0;
+	ctx->submitted_transfers = 0;
+
+	g_free(ctx->pretrig_buf);
+	ctx->pretrig_buf = NULL;
+}
+
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
@@ -917,7 +1264,6 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	struct sr_datafeed_meta_logic meta;
 	struct context *ctx;
 	struct libusb_transfer *transfer;
-	const struct libusb_pollfd **lupfd;
 	unsigned int i;
 	int ret;
 	unsigned char *buf;
@@ -933,40 +1279,75 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->num_samples = 0;
 	ctx->empty_transfer_count = 0;
 
+	/* Arm the trigger, if any, and buffer the pre-trigger samples. */
+	ctx->trigger_stage = ctx->num_trigger_stages ? 0 : TRIGGER_FIRED;
+	ctx->trigger_buffer_samples = 0;
+	g_free(ctx->pretrig_buf);
+	ctx->pretrig_buf = NULL;
+	ctx->pretrig_size = ctx->pretrig_pos = ctx->pretrig_len = 0;
+	if (ctx->trigger_stage == 0 && ctx->capture_ratio && ctx->limit_samples) {
+		ctx->pretrig_size = ctx->limit_samples * ctx->capture_ratio / 100
+				    * (ctx->sample_wide ? 2 : 1);
+		if (!(ctx->pretrig_buf = g_try_malloc(ctx->pretrig_size))) {
+			sr_err("fx2lafw: %s: pre-trigger buffer malloc "
+			       "failed.", __func__);
+			ctx->pretrig_size = 0;
+			return SR_ERR_MALLOC;
+		}
+	}
+
 	const unsigned int timeout = get_timeout(ctx);
-	const unsigned int num_transfers = get_number_of_transfers(ctx);
+	const unsigned int num_simul = get_number_of_transfers(ctx);
+	const unsigned int num_transfers = num_simul + get_number_of_spares(ctx);
 	const size_t size = get_buffer_size(ctx);
 
+	sr_dbg("fx2lafw: %d transfers of %zu bytes, %d of them spare.",
+	       num_transfers, size, num_transfers - num_simul);
+
 	ctx->transfers = g_try_malloc0(sizeof(*ctx->transfers) * num_transfers);
 	if (!ctx->transfers)
 		return SR_ERR;
 
 	ctx->num_transfers = num_transfers;
+	ctx->num_simul_transfers = num_simul;
 
+	/* Set up all transfers before there's an event thread to stop. */
 	for (i = 0; i < num_transfers; i++) {
 		if (!(buf = g_try_malloc(size))) {
 			sr_err("fx2lafw: %s: buf malloc failed.", __func__);
+			start_failed(ctx);
+			return SR_ERR_MALLOC;
+		}
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			sr_err("fx2lafw: %s: transfer malloc failed.",
+			       __func__);
+			g_free(buf);
+			start_failed(ctx);
 			return SR_ERR_MALLOC;
 		}
-		transfer = libusb_alloc_transfer(0);
 		libusb_fill_bulk_transfer(transfer, ctx->usb->devhdl,
 				2 | LIBUSB_ENDPOINT_IN, buf, size,
 				receive_transfer, ctx, timeout);
-		if (libusb_submit_transfer(transfer) != 0) {
-			libusb_free_transfer(transfer);
-			g_free(buf);
-			abort_acquisition(ctx);
-			return SR_ERR;
-		}
 		ctx->transfers[i] = transfer;
-		ctx->submitted_transfers++;
 	}
 
-	lupfd = libusb_get_pollfds(usb_context);
-	for (i = 0; lupfd[i]; i++)
-		sr_source_add(lupfd[i]->fd, lupfd[i]->events,
-			      timeout, receive_data, NULL);
-	free(lupfd); /* NOT g_free()! */
+	if (event_thread_start(ctx) != SR_OK) {
+		start_failed(ctx);
+		return SR_ERR;
+	}
+
+	for (i = 0; i < num_transfers; i++) {
+		transfer = ctx->transfers[i];
+		if (i >= num_simul) {
+			g_async_queue_push(ctx->spare_transfers, transfer);
+		} else if (submit_transfer(transfer) != SR_OK) {
+			sr_err("fx2lafw: %s: libusb_submit_transfer error.",
+			       __func__);
+			start_failed(ctx);
+			return SR_ERR;
+		}
+	}
+	ctx->submitted_transfers = num_transfers;
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = &header;
@@ -983,7 +1364,9 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 
 	if ((ret = command_start_acquisition (ctx->usb->devhdl,
 		ctx->cur_samplerate, ctx->sample_wide)) != SR_OK) {
-		abort_acquisition(ctx);
+		start_failed(ctx);
+		packet.type = SR_DF_END;
+		sr_session_send(cb_data, &packet);
 		return ret;
 	}
 
@@ -29,9 +29,22 @@
 #define TRIGGER_TYPES		"01"
 
 #define MAX_RENUM_DELAY_MS	3000
+#define MIN_SIMUL_TRANSFERS	2
 #define NUM_SIMUL_TRANSFERS	32
+#define MAX_SPARE_TRANSFERS	64
 #define MAX_EMPTY_TRANSFERS	(NUM_SIMUL_TRANSFERS * 2)
 
+/*
+ * Transfers are sized to take TRANSFER_TIME_MS to fill. Enough of them are
+ * submitted to hold BUFFER_TIME_MS of data, with spares for SPARE_TIME_MS,
+ * which the event thread submits while the session thread is busy.
+ */
+#define TRANSFER_TIME_MS	10
+#define BUFFER_TIME_MS		100
+#define SPARE_TIME_MS		500
+
+#define EVENT_THREAD_TIMEOUT_MS	100
+
 #define FX2LAFW_REQUIRED_VERSION_MAJOR	1
 
 #define MAX_8BIT_SAMPLE_RATE	SR_MHZ(24)
@@ -79,8 +92,22 @@ struct context {
 
 	uint16_t trigger_mask[NUM_TRIGGER_STAGES];
 	uint16_t trigger_value[NUM_TRIGGER_STAGES];
+	int num_trigger_stages;
 	int trigger_stage;
-	uint16_t trigger_buffer[NUM_TRIGGER_STAGES];
+	/*
+	 * The last (num_trigger_stages - 1) samples of the previous transfer,
+	 * where a match may start which continues into the next transfer.
+	 */
+	uint8_t trigger_buffer[NUM_TRIGGER_STAGES * 2];
+	int trigger_buffer_samples;
+
+	/* Percentage of the samples to capture before the trigger. */
+	uint64_t capture_ratio;
+	/* Ring buffer holding the pre-trigger samples. */
+	uint8_t *pretrig_buf;
+	size_t pretrig_size;
+	size_t pretrig_pos;
+	size_t pretrig_len;
 
 	int num_samples;
 	int submitted_transfers;
@@ -92,6 +119,20 @@ struct context {
 
 	unsigned int num_transfers;
 	struct libusb_transfer **transfers;
+
+	/*
+	 * libusb events are handled on a separate thread, which passes
+	 * completed transfers to the session thread via 'done_transfers'
+	 * (writing a byte to wake_fds[1] for each one).
+	 */
+	GThread *event_thread;
+	volatile gint event_thread_running;
+	GAsyncQueue *done_transfers;
+	GAsyncQueue *spare_transfers;
+	int wake_fds[2];
+	unsigned int num_simul_transfers;
+	volatile gint transfers_in_flight;
+	volatile gint aborted;
 };
 
 #endif
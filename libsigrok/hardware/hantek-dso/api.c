@@ -557,46 +557,63 @@ static void send_chunk(struct context *ctx, unsigned char *buf,
 		int num_samples)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_analog analog;
-	float ch1, ch2, range;
-	int num_probes, data_offset, i;
+	struct sr_datafeed_analog_raw analog;
+	float range;
+	uint8_t *data;
+	int num_probes, i;
 
 	num_probes = (ctx->ch1_enabled && ctx->ch2_enabled) ? 2 : 1;
-	packet.type = SR_DF_ANALOG;
+	packet.type = SR_DF_ANALOG_RAW;
 	packet.payload = &analog;
 	/* TODO: support for 5xxx series 9-bit samples */
 	analog.num_samples = num_samples;
+	analog.num_probes = num_probes;
 	analog.mq = SR_MQ_VOLTAGE;
 	analog.unit = SR_UNIT_VOLT;
-	analog.data = g_try_malloc(analog.num_samples * sizeof(float) * num_probes);
-	data_offset = 0;
-	for (i = 0; i < analog.num_samples; i++) {
-		/* The device always sends data for both channels. If a channel
-		 * is disabled, it contains a copy of the enabled channel's
-		 * data. However, we only send the requested channels to the bus.
-		 *
-		 * Voltage values are encoded as a value 0-255 (0-512 on the 5200*),
-		 * where the value is a point in the range represented by the vdiv
-		 * setting. There are 8 vertical divs, so e.g. 500mV/div represents
-		 * 4V peak-to-peak where 0 = -2V and 255 = +2V.
-		 */
-		/* TODO: support for 5xxx series 9-bit samples */
-		if (ctx->ch1_enabled) {
-			range = ((float)vdivs[ctx->voltage_ch1].p / vdivs[ctx->voltage_ch1].q) * 8;
-			ch1 = range / 255 * *(buf + i * 2 + 1);
-			/* Value is centered around 0V. */
-			ch1 -= range / 2;
-			analog.data[data_offset++] = ch1;
-		}
-		if (ctx->ch2_enabled) {
-			range = ((float)vdivs[ctx->voltage_ch2].p / vdivs[ctx->voltage_ch2].q) * 8;
-			ch2 = range / 255 * *(buf + i * 2);
-			ch2 -= range / 2;
-			analog.data[data_offset++] = ch2;
+	analog.encoding = SR_ANALOG_U8;
+	if (!(analog.buffer = sr_session_buffer_get(num_samples * num_probes))) {
+		sr_err("hantek-dso: %s: buffer malloc failed", __func__);
+		return;
+	}
+	analog.data = data = analog.buffer->data;
+
+	/*
+	 * Voltage values are encoded as a value 0-255 (0-512 on the 5200*),
+	 * where the value is a point in the range represented by the vdiv
+	 * setting. There are 8 vertical divs, so e.g. 500mV/div represents
+	 * 4V peak-to-peak where 0 = -2V and 255 = +2V.
+	 */
+	i = 0;
+	if (ctx->ch1_enabled) {
+		range = ((float)vdivs[ctx->voltage_ch1].p / vdivs[ctx->voltage_ch1].q) * 8;
+		analog.scale[i] = range / 255;
+		/* Value is centered around 0V. */
+		analog.offset[i++] = -range / 2;
+	}
+	if (ctx->ch2_enabled) {
+		range = ((float)vdivs[ctx->voltage_ch2].p / vdivs[ctx->voltage_ch2].q) * 8;
+		analog.scale[i] = range / 255;
+		analog.offset[i++] = -range / 2;
+	}
+
+	/*
+	 * The device always sends data for both channels, channel 2 first.
+	 * If a channel is disabled, it contains a copy of the enabled
+	 * channel's data. However, we only send the requested channels to
+	 * the bus.
+	 */
+	if (num_probes == 2) {
+		for (i = 0; i < num_samples; i++) {
+			data[i * 2] = buf[i * 2 + 1];
+			data[i * 2 + 1] = buf[i * 2];
 		}
+	} else {
+		for (i = 0; i < num_samples; i++)
+			data[i] = buf[i * 2 + (ctx->ch1_enabled ? 1 : 0)];
 	}
-	sr_session_send(ctx->cb_data, &packet);
 
+	sr_session_send(ctx->cb_data, &packet);
+	sr_buffer_unref(analog.buffer);
 }
 
 /* Called by libusb (as triggered by handle_event()) when a transfer comes in.
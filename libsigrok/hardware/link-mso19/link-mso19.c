@@ -732,6 +732,7 @@ static int receive_data(int fd, int revents, void *cb_data)
 	logic.length = 1024;
 	logic.unitsize = 1;
 	logic.data = logic_out;
+	logic.buffer = NULL;
 	sr_session_send(ctx->session_dev_id, &packet);
 
 	// Dont bother fixing this yet, keep it "old style"
@@ -30,6 +30,7 @@
 #include <termios.h>
 #endif
 #include <string.h>
+#include <errno.h>
 #include <sys/time.h>
 #include <inttypes.h>
 #ifdef _WIN32
@@ -492,7 +493,8 @@ static int hw_dev_open(int dev_index)
 
 	ctx = sdi->priv;
 
-	ctx->serial->fd = serial_open(ctx->serial->port, O_RDWR);
+	/* Non-blocking, so receive_data() can read whatever is there. */
+	ctx->serial->fd = serial_open(ctx->serial->port, O_RDWR | O_NONBLOCK);
 	if (ctx->serial->fd == -1)
 		return SR_ERR;
 
@@ -692,15 +694,178 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	return ret;
 }
 
+static void sample_blocks_free(struct context *ctx)
+{
+	g_slist_free_full(ctx->sample_blocks, g_free);
+	ctx->sample_blocks = NULL;
+}
+
+/* Store 'count' repetitions of a (full) sample. */
+static int run_add(struct context *ctx, uint32_t value, uint32_t count)
+{
+	struct sample_block *block;
+	gboolean rle;
+
+	rle = (ctx->flag_reg & FLAG_RLE) != 0;
+	block = ctx->sample_blocks ? ctx->sample_blocks->data : NULL;
+	if (!block || block->num_runs == SAMPLE_BLOCK_RUNS) {
+		if (!(block = g_try_malloc(sizeof(struct sample_block) +
+				(rle ? SAMPLE_BLOCK_RUNS * sizeof(uint32_t) : 0)))) {
+			sr_err("ols: %s: sample block malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		block->num_runs = 0;
+		block->lengths = rle ? (uint32_t *)(block + 1) : NULL;
+		ctx->sample_blocks = g_slist_prepend(ctx->sample_blocks, block);
+	}
+
+	if (block->lengths)
+		block->lengths[block->num_runs] = count;
+	block->values[block->num_runs++] = value;
+
+	return SR_OK;
+}
+
+/* Handle a complete sample, as received from the device. */
+static int sample_in(struct context *ctx)
+{
+	uint32_t raw, value, count_flag;
+	int j;
+
+	raw = ctx->raw_sample;
+	ctx->raw_sample = 0;
+	ctx->num_bytes = 0;
+
+	if (ctx->flag_reg & FLAG_RLE) {
+		/*
+		 * In RLE mode -1 should never come in as a sample, because
+		 * the top bit is the "count" flag.
+		 */
+		count_flag = 0x80 << (8 * (ctx->num_channels - 1));
+		if (raw & count_flag) {
+			ctx->rle_count = raw & ~count_flag;
+			sr_dbg("ols: RLE count = %d", ctx->rle_count);
+			return SR_OK;
+		}
+	}
+
+	ctx->num_samples += ctx->rle_count + 1;
+	if (ctx->num_samples > ctx->limit_samples) {
+		/* Save us from overrunning the buffer. */
+		ctx->rle_count -= ctx->num_samples - ctx->limit_samples;
+		ctx->num_samples = ctx->limit_samples;
+	}
+
+	/*
+	 * Some channel groups may have been turned off, to speed up
+	 * transfer between the hardware and the PC. Expand that here
+	 * before submitting it over the session bus -- whatever is
+	 * listening on the bus will be expecting a full 32-bit sample,
+	 * based on the number of probes.
+	 */
+	value = 0;
+	for (j = 0; j < ctx->num_channels; j++)
+		value |= ((raw >> (8 * j)) & 0xff) << ctx->byte_shift[j];
+
+	count_flag = ctx->rle_count + 1;
+	ctx->rle_count = 0;
+
+	return run_add(ctx, value, count_flag);
+}
+
+static void send_chunk(void *cb_data, uint8_t *buf, unsigned int num_samples)
+{
+	struct sr_datafeed_logic logic;
+
+	if (!num_samples)
+		return;
+
+	logic.length = num_samples * 4;
+	logic.unitsize = 4;
+	logic.data = buf;
+	logic.buffer = NULL;
+	sr_session_send_logic(cb_data, &logic);
+}
+
+/*
+ * The OLS sends its sample buffer backwards. Walk the stored runs in
+ * reverse, and send the samples in order, a chunk at a time.
+ */
+static int send_samples(struct context *ctx, void *cb_data)
+{
+	struct sr_datafeed_packet packet;
+	struct sample_block *block;
+	GSList *l;
+	uint8_t *buf, *p;
+	uint64_t pos, trigger_at;
+	uint32_t value, count, n;
+	unsigned int fill;
+	int i;
+
+	if (!(buf = g_try_malloc(SEND_CHUNK_SAMPLES * 4))) {
+		sr_err("ols: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	packet.type = SR_DF_TRIGGER;
+	packet.payload = NULL;
+	trigger_at = ctx->trigger_at != -1 ? (uint64_t)ctx->trigger_at
+					   : UINT64_MAX;
+	pos = 0;
+	fill = 0;
+	for (l = ctx->sample_blocks; l; l = l->next) {
+		block = l->data;
+		for (i = block->num_runs - 1; i >= 0; i--) {
+			value = block->values[i];
+			count = block->lengths ? block->lengths[i] : 1;
+			while (count) {
+				if (pos == trigger_at) {
+					/* Pre-trigger samples go first. */
+					send_chunk(cb_data, buf, fill);
+					fill = 0;
+					sr_session_send(cb_data, &packet);
+					trigger_at = UINT64_MAX;
+				}
+
+				n = MIN(count, SEND_CHUNK_SAMPLES - fill);
+				if (pos < trigger_at)
+					n = MIN(n, trigger_at - pos);
+				for (p = buf + fill * 4; p < buf + (fill + n) * 4; p += 4) {
+					p[0] = value & 0xff;
+					p[1] = (value >> 8) & 0xff;
+					p[2] = (value >> 16) & 0xff;
+					p[3] = value >> 24;
+				}
+				fill += n;
+				pos += n;
+				count -= n;
+
+				if (fill == SEND_CHUNK_SAMPLES) {
+					send_chunk(cb_data, buf, fill);
+					fill = 0;
+				}
+			}
+		}
+	}
+	send_chunk(cb_data, buf, fill);
+
+	/* A trigger was set up, so we need to tell the frontend about it. */
+	if (trigger_at != UINT64_MAX)
+		sr_session_send(cb_data, &packet);
+
+	g_free(buf);
+
+	return SR_OK;
+}
+
 static int receive_data(int fd, int revents, void *cb_data)
 {
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
 	GSList *l;
-	int num_channels, offset, i, j;
-	unsigned char byte;
+	unsigned char buf[READ_BUF_SIZE];
+	int len, i;
 
 	/* Find this device's ctx struct by its fd. */
 	ctx = NULL;
@@ -725,143 +890,53 @@ static int receive_data(int fd, int revents, void *cb_data)
 		 */
 		sr_source_remove(fd);
 		sr_source_add(fd, G_IO_IN, 30, receive_data, cb_data);
-		ctx->raw_sample_buf = g_try_malloc(ctx->limit_samples * 4);
-		if (!ctx->raw_sample_buf) {
-			sr_err("ols: %s: ctx->raw_sample_buf malloc failed",
-			       __func__);
-			return FALSE;
-		}
-		/* fill with 1010... for debugging */
-		memset(ctx->raw_sample_buf, 0x82, ctx->limit_samples * 4);
-	}
+		sample_blocks_free(ctx);
 
-	num_channels = 0;
-	for (i = 0x20; i > 0x02; i /= 2) {
-		if ((ctx->flag_reg & i) == 0)
-			num_channels++;
+		ctx->num_channels = 0;
+		for (i = 0; i < 4; i++) {
+			if (!(ctx->flag_reg & (FLAG_CHANNELGROUP_1 << i)))
+				ctx->byte_shift[ctx->num_channels++] = 8 * i;
+		}
 	}
 
 	if (revents == G_IO_IN) {
-		if (serial_read(fd, &byte, 1) != 1)
-			return FALSE;
-
-		/* Ignore it if we've read enough. */
-		if (ctx->num_samples >= ctx->limit_samples)
+		/* Take whatever is there, up to a buffer full. */
+		len = serial_read(fd, buf, READ_BUF_SIZE);
+		if (len == 0 || (len < 0 && (errno == EAGAIN || errno == EINTR)))
+			/* Spurious wakeup, the port is non-blocking. */
 			return TRUE;
+		if (len < 0) {
+			sr_err("ols: serial port read failed: %s",
+			       strerror(errno));
+			sample_blocks_free(ctx);
+			serial_close(fd);
+			packet.type = SR_DF_END;
+			sr_session_send(cb_data, &packet);
+			return FALSE;
+		}
+		sr_session_stats_transfer(len);
 
-		ctx->sample[ctx->num_bytes++] = byte;
-		sr_dbg("ols: received byte 0x%.2x", byte);
-		if (ctx->num_bytes == num_channels) {
-			/* Got a full sample. */
-			sr_dbg("ols: received sample 0x%.*x",
-			       ctx->num_bytes * 2, *(int *)ctx->sample);
-			if (ctx->flag_reg & FLAG_RLE) {
-				/*
-				 * In RLE mode -1 should never come in as a
-				 * sample, because bit 31 is the "count" flag.
-				 */
-				if (ctx->sample[ctx->num_bytes - 1] & 0x80) {
-					ctx->sample[ctx->num_bytes - 1] &= 0x7f;
-					/*
-					 * FIXME: This will only work on
-					 * little-endian systems.
-					 */
-					ctx->rle_count = *(int *)(ctx->sample);
-					sr_dbg("ols: RLE count = %d", ctx->rle_count);
-					ctx->num_bytes = 0;
-					return TRUE;
-				}
-			}
-			ctx->num_samples += ctx->rle_count + 1;
-			if (ctx->num_samples > ctx->limit_samples) {
-				/* Save us from overrunning the buffer. */
-				ctx->rle_count -= ctx->num_samples - ctx->limit_samples;
-				ctx->num_samples = ctx->limit_samples;
-			}
+		for (i = 0; i < len; i++) {
+			/* Ignore it if we've read enough. */
+			if (ctx->num_samples >= ctx->limit_samples)
+				break;
 
-			if (num_channels < 4) {
-				/*
-				 * Some channel groups may have been turned
-				 * off, to speed up transfer between the
-				 * hardware and the PC. Expand that here before
-				 * submitting it over the session bus --
-				 * whatever is listening on the bus will be
-				 * expecting a full 32-bit sample, based on
-				 * the number of probes.
-				 */
-				j = 0;
-				memset(ctx->tmp_sample, 0, 4);
-				for (i = 0; i < 4; i++) {
-					if (((ctx->flag_reg >> 2) & (1 << i)) == 0) {
-						/*
-						 * This channel group was
-						 * enabled, copy from received
-						 * sample.
-						 */
-						ctx->tmp_sample[i] = ctx->sample[j++];
-					}
-				}
-				memcpy(ctx->sample, ctx->tmp_sample, 4);
-				sr_dbg("ols: full sample 0x%.8x", *(int *)ctx->sample);
-			}
+			ctx->raw_sample |= (uint32_t)buf[i] << (8 * ctx->num_bytes);
+			if (++ctx->num_bytes < ctx->num_channels)
+				continue;
 
-			/* the OLS sends its sample buffer backwards.
-			 * store it in reverse order here, so we can dump
-			 * this on the session bus later.
-			 */
-			offset = (ctx->limit_samples - ctx->num_samples) * 4;
-			for (i = 0; i <= ctx->rle_count; i++) {
-				memcpy(ctx->raw_sample_buf + offset + (i * 4),
-				       ctx->sample, 4);
-			}
-			memset(ctx->sample, 0, 4);
-			ctx->num_bytes = 0;
-			ctx->rle_count = 0;
+			/* Got a full sample. */
+			if (sample_in(ctx) != SR_OK)
+				return FALSE;
 		}
 	} else {
 		/*
 		 * This is the main loop telling us a timeout was reached, or
 		 * we've acquired all the samples we asked for -- we're done.
-		 * Send the (properly-ordered) buffer to the frontend.
+		 * Send the (properly-ordered) samples to the frontend.
 		 */
-		if (ctx->trigger_at != -1) {
-			/* a trigger was set up, so we need to tell the frontend
-			 * about it.
-			 */
-			if (ctx->trigger_at > 0) {
-				/* there are pre-trigger samples, send those first */
-				packet.type = SR_DF_LOGIC;
-				packet.payload = &logic;
-				logic.length = ctx->trigger_at * 4;
-				logic.unitsize = 4;
-				logic.data = ctx->raw_sample_buf +
-					(ctx->limit_samples - ctx->num_samples) * 4;
-				sr_session_send(cb_data, &packet);
-			}
-
-			/* send the trigger */
-			packet.type = SR_DF_TRIGGER;
-			sr_session_send(cb_data, &packet);
-
-			/* send post-trigger samples */
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = (ctx->num_samples * 4) - (ctx->trigger_at * 4);
-			logic.unitsize = 4;
-			logic.data = ctx->raw_sample_buf + ctx->trigger_at * 4 +
-				(ctx->limit_samples - ctx->num_samples) * 4;
-			sr_session_send(cb_data, &packet);
-		} else {
-			/* no trigger was used */
-			packet.type = SR_DF_LOGIC;
-			packet.payload = &logic;
-			logic.length = ctx->num_samples * 4;
-			logic.unitsize = 4;
-			logic.data = ctx->raw_sample_buf +
-				(ctx->limit_samples - ctx->num_samples) * 4;
-			sr_session_send(cb_data, &packet);
-		}
-		g_free(ctx->raw_sample_buf);
+		send_samples(ctx, cb_data);
+		sample_blocks_free(ctx);
 
 		serial_flush(fd);
 		serial_close(fd);
@@ -989,6 +1064,10 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	ctx->flag_reg |= ~(changrp_mask << 2) & 0x3c;
 	ctx->flag_reg |= FLAG_FILTER;
 	ctx->rle_count = 0;
+	ctx->num_transfers = 0;
+	ctx->num_samples = 0;
+	ctx->num_bytes = 0;
+	ctx->raw_sample = 0;
 	data = (ctx->flag_reg << 24) | ((ctx->flag_reg << 8) & 0xff0000);
 	if (send_longcommand(ctx->serial->fd, CMD_SET_FLAGS, data) != SR_OK)
 		return SR_ERR;
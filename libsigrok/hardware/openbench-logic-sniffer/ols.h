@@ -27,6 +27,13 @@
 #define CLOCK_RATE             SR_MHZ(100)
 #define MIN_NUM_SAMPLES        4
 
+/* Bytes read from the serial port at a time */
+#define READ_BUF_SIZE          4096
+/* Runs of samples per struct sample_block */
+#define SAMPLE_BLOCK_RUNS      4096
+/* Samples per SR_DF_LOGIC packet sent to the session bus */
+#define SEND_CHUNK_SAMPLES     16384
+
 /* Command opcodes */
 #define CMD_RESET                  0x00
 #define CMD_RUN                    0x01
@@ -59,6 +66,17 @@
 #define FLAG_CLOCK_INVERTED        0x80
 #define FLAG_RLE                   0x0100
 
+/*
+ * Samples as they were received, i.e. last sample first. In RLE mode
+ * lengths[i] is the number of times values[i] was seen, otherwise
+ * lengths is NULL and each value was seen once.
+ */
+struct sample_block {
+	unsigned int num_runs;
+	uint32_t *lengths;
+	uint32_t values[SAMPLE_BLOCK_RUNS];
+};
+
 /* Private, per-device-instance driver context. */
 struct context {
 	uint32_t max_samplerate;
@@ -85,9 +103,13 @@ struct context {
 	unsigned int num_samples;
 	int rle_count;
 	int num_bytes;
-	unsigned char sample[4];
-	unsigned char tmp_sample[4];
-	unsigned char *raw_sample_buf;
+	/* Enabled channel groups, i.e. bytes per received sample */
+	int num_channels;
+	/* Bit position in a full sample of each received byte */
+	int byte_shift[4];
+	uint32_t raw_sample;
+	/* struct sample_block, the most recently received one first */
+	GSList *sample_blocks;
 
 	struct sr_serial_dev_inst *serial;
 };
@@ -321,14 +321,18 @@ SR_PRIV void analyzer_initialize(libusb_device_handle *devh)
 	analyzer_write_status(devh, 1, STATUS_FLAG_NONE);
 }
 
-SR_PRIV void analyzer_wait(libusb_device_handle *devh, int set, int unset)
+static int analyzer_status_is(libusb_device_handle *devh, int set, int unset)
 {
 	int status;
-	while (1) {
-		status = gl_reg_read(devh, DEV_STATUS);
-		if ((status & set) && ((status & unset) == 0))
-			return;
-	}
+
+	status = gl_reg_read(devh, DEV_STATUS);
+	return (status & set) && ((status & unset) == 0);
+}
+
+SR_PRIV void analyzer_wait(libusb_device_handle *devh, int set, int unset)
+{
+	while (!analyzer_status_is(devh, set, unset))
+		;
 }
 
 SR_PRIV void analyzer_read_start(libusb_device_handle *devh)
@@ -347,6 +351,24 @@ SR_PRIV int analyzer_read_data(libusb_device_handle *devh, void *buffer,
 	return gl_read_bulk(devh, buffer, size);
 }
 
+/*
+ * Asynchronous readout: request 'size' bytes, then submit a transfer set up
+ * by analyzer_read_fill_transfer() to receive them. Transfers complete in
+ * the order they were submitted, so several can be in flight at once.
+ */
+SR_PRIV int analyzer_read_request(libusb_device_handle *devh,
+				  unsigned int size)
+{
+	return gl_read_bulk_request(devh, size);
+}
+
+SR_PRIV void analyzer_read_fill_transfer(struct libusb_transfer *transfer,
+		libusb_device_handle *devh, void *buffer, unsigned int size,
+		libusb_transfer_cb_fn callback, void *user_data)
+{
+	gl_read_bulk_fill(transfer, devh, buffer, size, callback, user_data);
+}
+
 SR_PRIV void analyzer_read_stop(libusb_device_handle *devh)
 {
 	analyzer_write_status(devh, 3, STATUS_FLAG_20);
@@ -549,6 +571,12 @@ SR_PRIV void analyzer_wait_data(libusb_device_handle *devh)
 	analyzer_wait(devh, STATUS_READY | 8, STATUS_BUSY);
 }
 
+/* Non-blocking analyzer_wait_data(): TRUE once the capture is done. */
+SR_PRIV int analyzer_has_data(libusb_device_handle *devh)
+{
+	return analyzer_status_is(devh, STATUS_READY | 8, STATUS_BUSY);
+}
+
 SR_PRIV int analyzer_decompress(void *input, unsigned int input_len,
 				void *output, unsigned int output_len)
 {
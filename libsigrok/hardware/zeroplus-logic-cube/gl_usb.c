@@ -89,19 +89,41 @@ static int gl_read_data(libusb_device_handle *devh)
 	return (ret == 1) ? packet[0] : ret;
 }
 
-SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
-			 unsigned int size)
+/* Tell the device to send 'size' bytes of sample memory on EP1. */
+SR_PRIV int gl_read_bulk_request(libusb_device_handle *devh,
+				 unsigned int size)
 {
 	unsigned char packet[8] =
 	    { 0, 0, 0, 0, size & 0xff, (size & 0xff00) >> 8,
 	      (size & 0xff0000) >> 16, (size & 0xff000000) >> 24 };
-	int ret, transferred = 0;
+	int ret;
 
 	ret = libusb_control_transfer(devh, CTRL_OUT, 0x4, REQ_READBULK,
 				      0, packet, 8, TIMEOUT);
-	if (ret != 8)
+	if (ret != 8) {
 		sr_err("zp: %s: libusb_control_transfer returned %d.",
 		       __func__, ret);
+		return -1;
+	}
+	return 0;
+}
+
+/* Set up an asynchronous read of data requested via gl_read_bulk_request(). */
+SR_PRIV void gl_read_bulk_fill(struct libusb_transfer *transfer,
+			       libusb_device_handle *devh, void *buffer,
+			       unsigned int size,
+			       libusb_transfer_cb_fn callback, void *user_data)
+{
+	libusb_fill_bulk_transfer(transfer, devh, EP1_BULK_IN, buffer, size,
+				  callback, user_data, TIMEOUT);
+}
+
+SR_PRIV int gl_read_bulk(libusb_device_handle *devh, void *buffer,
+			 unsigned int size)
+{
+	int ret, transferred = 0;
+
+	gl_read_bulk_request(devh, size);
 
 	ret = libusb_bulk_transfer(devh, EP1_BULK_IN, buffer, size,
 				   &transferred, TIMEOUT);
@@ -41,7 +41,26 @@
 #define NUM_TRIGGER_STAGES		4
 #define TRIGGER_TYPES			"01"
 
-#define PACKET_SIZE			2048	/* ?? */
+/*
+ * The sample memory is read out with NUM_TRANSFERS asynchronous bulk
+ * transfers of up to TRANSFER_SIZE bytes in flight, so the device never
+ * waits for the host to process the previous one.
+ */
+#define TRANSFER_SIZE			(64 * 1024)
+#define NUM_TRANSFERS			4
+
+/* How often to check whether the capture is done (in ms). */
+#define TICK				10
+
+enum {
+	STATE_IDLE,
+	/* Waiting for the device to fill its sample memory. */
+	STATE_CAPTURE,
+	/* Reading out the sample memory. */
+	STATE_DOWNLOAD,
+	/* Waiting for cancelled transfers to come back. */
+	STATE_ABORT,
+};
 
 typedef struct {
 	unsigned short pid;
@@ -155,6 +174,19 @@ struct context {
 	// uint8_t trigger_buffer[NUM_TRIGGER_STAGES];
 
 	struct sr_usb_dev_inst *usb;
+
+	/* Acquisition state, see handle_event(). */
+	int state;
+	void *session_dev_id;
+	gint64 last_poll;
+	uint64_t bytes_total;
+	uint64_t bytes_requested;
+	struct libusb_transfer *transfers[NUM_TRANSFERS];
+	int transfers_in_flight;
+	/* Set while receive_transfer() runs, i.e. libusb is handling events. */
+	gboolean in_transfer_cb;
+	/* Stopped from within receive_transfer(), see handle_event(). */
+	gboolean stop_deferred;
 };
 
 static int hw_dev_config_set(int dev_index, int hwcap, const void *value);
@@ -354,6 +386,10 @@ static int hw_init(const char *devinfo)
 	memset(ctx->trigger_mask, 0, NUM_TRIGGER_STAGES);
 	memset(ctx->trigger_value, 0, NUM_TRIGGER_STAGES);
 	// memset(ctx->trigger_buffer, 0, NUM_TRIGGER_STAGES);
+	ctx->state = STATE_IDLE;
+	ctx->session_dev_id = NULL;
+	memset(ctx->transfers, 0, sizeof(ctx->transfers));
+	ctx->transfers_in_flight = 0;
 
 	if (libusb_init(&usb_context) != 0) {
 		sr_err("zp: Failed to initialize USB.");
@@ -627,17 +663,254 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 	}
 }
 
+static int handle_event(int fd, int revents, void *cb_data);
+
+static int sources_add(struct context *ctx)
+{
+	const struct libusb_pollfd **lupfd;
+	int i;
+
+	if (!(lupfd = libusb_get_pollfds(usb_context))) {
+		sr_err("zp: %s: libusb_get_pollfds failed", __func__);
+		return SR_ERR;
+	}
+	for (i = 0; lupfd[i]; i++)
+		sr_source_add(lupfd[i]->fd, lupfd[i]->events, TICK,
+			      handle_event, ctx);
+	free(lupfd);
+
+	return SR_OK;
+}
+
+static void sources_remove(void)
+{
+	const struct libusb_pollfd **lupfd;
+	int i;
+
+	if (!(lupfd = libusb_get_pollfds(usb_context)))
+		return;
+	for (i = 0; lupfd[i]; i++)
+		sr_source_remove(lupfd[i]->fd);
+	free(lupfd);
+}
+
+static void free_transfers(struct context *ctx)
+{
+	int i;
+
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (!ctx->transfers[i])
+			continue;
+		g_free(ctx->transfers[i]->buffer);
+		libusb_free_transfer(ctx->transfers[i]);
+		ctx->transfers[i] = NULL;
+	}
+}
+
+static void finish_acquisition(struct context *ctx)
+{
+	struct sr_datafeed_packet packet;
+
+	sources_remove();
+	if (ctx->state != STATE_CAPTURE)
+		analyzer_read_stop(ctx->usb->devhdl);
+	free_transfers(ctx);
+	ctx->state = STATE_IDLE;
+
+	packet.type = SR_DF_END;
+	sr_session_send(ctx->session_dev_id, &packet);
+}
+
+static void cancel_transfers(struct context *ctx)
+{
+	int i;
+
+	ctx->state = STATE_ABORT;
+	for (i = 0; i < NUM_TRANSFERS; i++) {
+		if (ctx->transfers[i])
+			libusb_cancel_transfer(ctx->transfers[i]);
+	}
+}
+
+/*
+ * Handle libusb events until all cancelled transfers came back; the last
+ * one sends SR_DF_END. Must not be called from within a transfer callback,
+ * libusb event handling isn't reentrant.
+ */
+static void wait_transfers(struct context *ctx)
+{
+	struct timeval tv;
+
+	while (ctx->transfers_in_flight) {
+		tv.tv_sec = 0;
+		tv.tv_usec = TICK * 1000;
+		libusb_handle_events_timeout(usb_context, &tv);
+	}
+}
+
+static void receive_transfer(struct libusb_transfer *transfer);
+
+/* Request the next piece of the sample memory, and queue a transfer for it. */
+static int submit_transfer(struct context *ctx,
+			   struct libusb_transfer *transfer)
+{
+	unsigned int size;
+
+	size = MIN(ctx->bytes_total - ctx->bytes_requested, TRANSFER_SIZE);
+	if (analyzer_read_request(ctx->usb->devhdl, size) < 0)
+		return SR_ERR;
+
+	analyzer_read_fill_transfer(transfer, ctx->usb->devhdl,
+				    transfer->buffer, size, receive_transfer,
+				    ctx);
+	if (libusb_submit_transfer(transfer) != 0) {
+		sr_err("zp: %s: libusb_submit_transfer failed", __func__);
+		return SR_ERR;
+	}
+
+	ctx->bytes_requested += size;
+	ctx->transfers_in_flight++;
+
+	return SR_OK;
+}
+
+/* Called by libusb, from handle_event(). */
+static void receive_transfer(struct libusb_transfer *transfer)
+{
+	struct context *ctx = transfer->user_data;
+	struct sr_datafeed_logic logic;
+	gboolean completed;
+
+	ctx->transfers_in_flight--;
+	ctx->in_transfer_cb = TRUE;
+
+	completed = (transfer->status == LIBUSB_TRANSFER_COMPLETED);
+	sr_session_stats_transfer(completed ? transfer->actual_length : 0);
+
+	if (ctx->state == STATE_DOWNLOAD && completed) {
+		logic.length = transfer->actual_length & ~3;
+		logic.unitsize = 4;
+		logic.data = transfer->buffer;
+		logic.buffer = NULL;
+		if (logic.length)
+			sr_session_send_logic(ctx->session_dev_id, &logic);
+
+		/* The frontend may have stopped the acquisition meanwhile. */
+		if (ctx->state == STATE_DOWNLOAD
+		    && ctx->bytes_requested < ctx->bytes_total) {
+			if (submit_transfer(ctx, transfer) == SR_OK) {
+				ctx->in_transfer_cb = FALSE;
+				return;
+			}
+			cancel_transfers(ctx);
+		}
+	} else if (ctx->state == STATE_DOWNLOAD) {
+		sr_err("zp: %s: bulk transfer failed: %d", __func__,
+		       transfer->status);
+		cancel_transfers(ctx);
+	}
+
+	ctx->in_transfer_cb = FALSE;
+
+	/* This transfer is done for good; the last one out ends it all. */
+	if (ctx->transfers_in_flight == 0)
+		finish_acquisition(ctx);
+}
+
+static void start_download(struct context *ctx)
+{
+	libusb_device_handle *devh;
+	struct libusb_transfer *transfer;
+	unsigned char *buf;
+	int i;
+
+	devh = ctx->usb->devhdl;
+	sr_info("zp: Stop address    = 0x%x",
+		analyzer_get_stop_address(devh));
+	sr_info("zp: Now address     = 0x%x",
+		analyzer_get_now_address(devh));
+	sr_info("zp: Trigger address = 0x%x",
+		analyzer_get_trigger_address(devh));
+
+	ctx->state = STATE_DOWNLOAD;
+	ctx->bytes_total = ctx->memory_size * 4;
+	ctx->bytes_requested = 0;
+	analyzer_read_start(devh);
+
+	for (i = 0; i < NUM_TRANSFERS
+	     && ctx->bytes_requested < ctx->bytes_total; i++) {
+		if (!(buf = g_try_malloc(TRANSFER_SIZE))) {
+			sr_err("zp: %s: buf malloc failed", __func__);
+			break;
+		}
+		if (!(transfer = libusb_alloc_transfer(0))) {
+			sr_err("zp: %s: libusb_alloc_transfer failed",
+			       __func__);
+			g_free(buf);
+			break;
+		}
+		transfer->buffer = buf;
+		ctx->transfers[i] = transfer;
+		if (submit_transfer(ctx, transfer) != SR_OK)
+			break;
+	}
+
+	if (ctx->transfers_in_flight == 0)
+		finish_acquisition(ctx);
+}
+
+/*
+ * Runs on every libusb event, and at least every TICK ms: services the
+ * bulk transfers, and starts the readout once the capture is done.
+ */
+static int handle_event(int fd, int revents, void *cb_data)
+{
+	struct context *ctx;
+	struct timeval tv;
+	gint64 now;
+
+	/* Avoid compiler warnings. */
+	(void)fd;
+	(void)revents;
+
+	ctx = cb_data;
+
+	tv.tv_sec = tv.tv_usec = 0;
+	libusb_handle_events_timeout(usb_context, &tv);
+
+	/*
+	 * The session may be stopped from a datafeed callback, i.e. from
+	 * within libusb. Now that libusb returned, reap the cancelled
+	 * transfers: the session loop won't run again to do it.
+	 */
+	if (ctx->stop_deferred) {
+		ctx->stop_deferred = FALSE;
+		wait_transfers(ctx);
+		analyzer_reset(ctx->usb->devhdl);
+		return TRUE;
+	}
+
+	if (ctx->state != STATE_CAPTURE)
+		return TRUE;
+
+	/* Every libusb fd has a source; only poll the device once per tick. */
+	now = g_get_monotonic_time();
+	if (now - ctx->last_poll < TICK * 1000)
+		return TRUE;
+	ctx->last_poll = now;
+
+	if (analyzer_has_data(ctx->usb->devhdl))
+		start_download(ctx);
+
+	return TRUE;
+}
+
 static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 {
 	struct sr_dev_inst *sdi;
 	struct sr_datafeed_packet packet;
-	struct sr_datafeed_logic logic;
 	struct sr_datafeed_header header;
 	struct sr_datafeed_meta_logic meta;
-	uint64_t samples_read;
-	int res;
-	unsigned int packet_num;
-	unsigned char *buf;
 	struct context *ctx;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
@@ -650,19 +923,27 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 		return SR_ERR_ARG;
 	}
 
+	if (ctx->state != STATE_IDLE) {
+		sr_err("zp: %s: acquisition already running", __func__);
+		return SR_ERR;
+	}
+
 	/* push configured settings to device */
 	analyzer_configure(ctx->usb->devhdl);
 
 	analyzer_start(ctx->usb->devhdl);
 	sr_info("zp: Waiting for data");
-	analyzer_wait_data(ctx->usb->devhdl);
 
-	sr_info("zp: Stop address    = 0x%x",
-		analyzer_get_stop_address(ctx->usb->devhdl));
-	sr_info("zp: Now address     = 0x%x",
-		analyzer_get_now_address(ctx->usb->devhdl));
-	sr_info("zp: Trigger address = 0x%x",
-		analyzer_get_trigger_address(ctx->usb->devhdl));
+	ctx->session_dev_id = cb_data;
+	ctx->state = STATE_CAPTURE;
+	ctx->last_poll = 0;
+	ctx->transfers_in_flight = 0;
+	ctx->in_transfer_cb = FALSE;
+	ctx->stop_deferred = FALSE;
+	if (sources_add(ctx) != SR_OK) {
+		ctx->state = STATE_IDLE;
+		return SR_ERR;
+	}
 
 	packet.type = SR_DF_HEADER;
 	packet.payload = &header;
@@ -677,46 +958,17 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	meta.num_probes = ctx->num_channels;
 	sr_session_send(cb_data, &packet);
 
-	if (!(buf = g_try_malloc(PACKET_SIZE))) {
-		sr_err("zp: %s: buf malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	samples_read = 0;
-	analyzer_read_start(ctx->usb->devhdl);
-	/* Send the incoming transfer to the session bus. */
-	for (packet_num = 0; packet_num < (ctx->memory_size * 4 / PACKET_SIZE);
-	     packet_num++) {
-		res = analyzer_read_data(ctx->usb->devhdl, buf, PACKET_SIZE);
-		sr_info("zp: Tried to read %llx bytes, actually read %x bytes",
-			PACKET_SIZE, res);
-
-		packet.type = SR_DF_LOGIC;
-		packet.payload = &logic;
-		logic.length = PACKET_SIZE;
-		logic.unitsize = 4;
-		logic.data = buf;
-		sr_session_send(cb_data, &packet);
-		samples_read += res / 4;
-	}
-	analyzer_read_stop(ctx->usb->devhdl);
-	g_free(buf);
-
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
-
 	return SR_OK;
 }
 
 /* TODO: This stops acquisition on ALL devices, ignoring dev_index. */
 static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 {
-	struct sr_datafeed_packet packet;
 	struct sr_dev_inst *sdi;
 	struct context *ctx;
 
-	packet.type = SR_DF_END;
-	sr_session_send(cb_data, &packet);
+	/* Avoid compiler warnings. */
+	(void)cb_data;
 
 	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index))) {
 		sr_err("zp: %s: sdi was NULL", __func__);
@@ -728,8 +980,20 @@ static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
 		return SR_ERR_BUG;
 	}
 
+	if (ctx->state == STATE_CAPTURE) {
+		finish_acquisition(ctx);
+	} else if (ctx->state != STATE_IDLE) {
+		cancel_transfers(ctx);
+		if (ctx->in_transfer_cb) {
+			/* Can't re-enter libusb, leave it to handle_event(). */
+			ctx->stop_deferred = TRUE;
+			return SR_OK;
+		}
+		/* Wait for the cancelled transfers, the last one sends END. */
+		wait_transfers(ctx);
+	}
+
 	analyzer_reset(ctx->usb->devhdl);
-	/* TODO: Need to cancel and free any queued up transfers. */
 
 	return SR_OK;
 }
@@ -48,6 +48,10 @@ SR_API struct sr_hwcap_option sr_hwcap_options[] = {
 	{SR_HWCAP_MODEL, SR_T_KEYVALUE, "Model", "model"},
 	{SR_HWCAP_CONN, SR_T_CHAR, "Connection", "connect"},
 	{SR_HWCAP_SERIALCOMM, SR_T_CHAR, "Serial communication", "serialcomm"},
+	{SR_HWCAP_CAPTURE_NUM_PROBES, SR_T_UINT64, "Number of probes",
+			"numprobes"},
+	{SR_HWCAP_PACKET_SIZE, SR_T_UINT64, "Packet size", "packetsize"},
+	{SR_HWCAP_REALTIME, SR_T_BOOL, "Realtime", "realtime"},
 	{0, 0, NULL, NULL},
 };
 
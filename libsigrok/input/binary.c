@@ -121,6 +121,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 	packet.payload = &logic;
 	logic.unitsize = (num_probes + 7) / 8;
 	logic.data = buffer;
+	logic.buffer = NULL;
 	while ((size = read(fd, buffer, CHUNKSIZE)) > 0) {
 		logic.length = size;
 		sr_session_send(in->vdev, &packet);
@@ -175,6 +175,7 @@ static int loadfile(struct sr_input *in, const char *filename)
 	packet.payload = &logic;
 	logic.unitsize = (num_probes + 7) / 8;
 	logic.data = buf;
+	logic.buffer = NULL;
 
 	/* Send 8MB of total data to the session bus in small chunks. */
 	for (i = 0; i < NUM_PACKETS; i++) {
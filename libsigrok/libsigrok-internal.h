@@ -40,6 +40,27 @@
 /* Size of a datastore chunk in units */
 #define DATASTORE_CHUNKSIZE (512 * 1024)
 
+/*
+ * Number of samples per chunk member in version 2 session files. Equal to
+ * the datastore chunk size, so a datastore can be saved chunk by chunk.
+ */
+#define SESSION_FILE_CHUNKSIZE DATASTORE_CHUNKSIZE
+
+/* Size (in bytes) of an entry in a version 2 session file's chunk index */
+#define SESSION_FILE_INDEX_ENTRY_SIZE 40
+
+/* Size (in bytes) of the buffers in the session's datafeed buffer pool */
+#define SESSION_BUFFER_SIZE (512 * 1024)
+
+/* Max. number of unused buffers the session's buffer pool keeps around */
+#define SESSION_BUFFER_POOL_MAX_FREE 32
+
+/*
+ * sr_session_send_logic() only sends samples run-length encoded if there
+ * are at least this many samples per run on average.
+ */
+#define RLE_MIN_SAMPLES_PER_RUN 8
+
 #ifdef HAVE_LIBUSB_1_0
 struct sr_usb_dev_inst {
 	uint8_t bus;
@@ -81,10 +102,62 @@ SR_PRIV int sr_err(const char *format, ...);
 
 SR_PRIV void sr_hw_cleanup_all(void);
 
+/*--- rle.c -----------------------------------------------------------------*/
+
+SR_PRIV struct sr_buffer *sr_rle_buffer_get(uint64_t max_runs,
+		uint16_t unitsize, struct sr_datafeed_logic_rle *rle);
+
 /*--- session.c -------------------------------------------------------------*/
 
+SR_PRIV int sr_session_callback_accepts(sr_datafeed_callback_t cb);
+SR_PRIV void sr_session_deliver(sr_datafeed_callback_t cb, struct sr_dev *dev,
+				struct sr_datafeed_packet *packet, int accept);
 SR_PRIV int sr_session_send(struct sr_dev *dev,
 			    struct sr_datafeed_packet *packet);
+SR_PRIV int sr_session_send_logic(struct sr_dev *dev,
+				  struct sr_datafeed_logic *logic);
+SR_PRIV struct sr_buffer *sr_session_buffer_get(size_t size);
+
+/*--- session_bus.c ---------------------------------------------------------*/
+
+SR_PRIV int sr_session_bus_start(void);
+SR_PRIV int sr_session_bus_stop(void);
+SR_PRIV gboolean sr_session_bus_is_consumer(void);
+SR_PRIV int sr_session_bus_send(struct sr_dev *dev,
+				struct sr_datafeed_packet *packet);
+
+/*--- session_loop.c --------------------------------------------------------*/
+
+struct sr_session_loop;
+
+SR_PRIV struct sr_session_loop *sr_session_loop_new(void);
+SR_PRIV void sr_session_loop_destroy(struct sr_session_loop *loop);
+SR_PRIV int sr_session_loop_source_add(struct sr_session_loop *loop,
+		const GPollFD *pollfd, int timeout,
+		sr_receive_data_callback_t cb, void *cb_data,
+		gintptr poll_object);
+SR_PRIV int sr_session_loop_source_remove(struct sr_session_loop *loop,
+		gintptr poll_object);
+SR_PRIV int sr_session_loop_iterate(struct sr_session_loop *loop);
+
+/*--- session_stats.c -------------------------------------------------------*/
+
+SR_PRIV int sr_session_stats_callback_add(void);
+SR_PRIV void sr_session_stats_callbacks_free(void);
+SR_PRIV void sr_session_stats_start(void);
+SR_PRIV void sr_session_stats_stop(void);
+SR_PRIV void sr_session_stats_packet(const struct sr_datafeed_packet *packet);
+SR_PRIV void sr_session_stats_call(struct sr_stats_callback *s,
+				   gint64 queued, gint64 start, gint64 end);
+SR_PRIV void sr_session_stats_transfer(uint64_t bytes);
+SR_PRIV void sr_session_stats_overrun(void);
+
+/*--- session_file.c --------------------------------------------------------*/
+
+SR_PRIV void sr_session_file_index_entry_write(uint8_t *buf,
+		const struct sr_capture_chunk *chunk);
+SR_PRIV void sr_session_file_index_entry_read(const uint8_t *buf,
+		struct sr_capture_chunk *chunk);
 
 /* Generic device instances */
 SR_PRIV struct sr_dev_inst *sr_dev_inst_new(int index, int status,
@@ -134,6 +134,20 @@ enum {
 	SR_DF_META_ANALOG,
 	SR_DF_FRAME_BEGIN,
 	SR_DF_FRAME_END,
+	SR_DF_LOGIC_RLE,
+	SR_DF_ANALOG_RAW,
+};
+
+/* Number of sr_datafeed_packet.type values, keep in sync with the above. */
+#define SR_DF_NUM_TYPES (SR_DF_ANALOG_RAW + 1)
+
+/*
+ * Packet types a datafeed callback can take on top of the basic ones, see
+ * sr_session_datafeed_callback_add_full().
+ */
+enum {
+	SR_DF_ACCEPT_LOGIC_RLE = 1 << 0,
+	SR_DF_ACCEPT_ANALOG_RAW = 1 << 1,
 };
 
 /* sr_datafeed_analog.mq values */
@@ -159,6 +173,38 @@ enum {
 	SR_UNIT_PERCENTAGE,
 };
 
+/* sr_datafeed_analog_raw.encoding values, in host byte order */
+enum {
+	SR_ANALOG_U8,
+	SR_ANALOG_S8,
+	SR_ANALOG_S16,
+};
+
+/* Max. number of probes in an SR_DF_ANALOG_RAW packet */
+#define SR_ANALOG_RAW_MAX_PROBES 16
+
+/*
+ * A reference-counted data buffer, see buffer.c.
+ *
+ * Packets which carry an sr_buffer allow datafeed callbacks to keep the
+ * data after they return, by taking a reference via sr_buffer_ref().
+ */
+struct sr_buffer {
+	uint8_t *data;
+	size_t size;
+	volatile gint refcount;
+	/* The pool this buffer is recycled to, or NULL. */
+	struct sr_buffer_pool *pool;
+};
+
+struct sr_buffer_pool {
+	size_t buffer_size;
+	unsigned int max_free;
+	GAsyncQueue *free_buffers;
+	volatile gint refcount;
+	volatile gint destroyed;
+};
+
 struct sr_datafeed_packet {
 	uint16_t type;
 	void *payload;
@@ -178,6 +224,24 @@ struct sr_datafeed_logic {
 	uint64_t length;
 	uint16_t unitsize;
 	void *data;
+	/* The buffer 'data' points into, if any. Can be NULL. */
+	struct sr_buffer *buffer;
+};
+
+/*
+ * Run-length encoded logic samples, see rle.c: values[n] (of 'unitsize'
+ * bytes) was seen for lengths[n] consecutive samples.
+ *
+ * Only callbacks added with sr_session_datafeed_callback_add_rle() get
+ * these, all others get the same samples as SR_DF_LOGIC packets.
+ */
+struct sr_datafeed_logic_rle {
+	uint64_t num_runs;
+	uint16_t unitsize;
+	void *values;
+	uint32_t *lengths;
+	/* The buffer 'values' and 'lengths' point into, if any. Can be NULL. */
+	struct sr_buffer *buffer;
 };
 
 struct sr_datafeed_meta_analog {
@@ -189,6 +253,28 @@ struct sr_datafeed_analog {
 	int mq; /* Measured quantity (e.g. voltage, current, temperature) */
 	int unit; /* Unit in which the MQ is measured. */
 	float *data;
+	/* The buffer 'data' points into, if any. Can be NULL. */
+	struct sr_buffer *buffer;
+};
+
+/*
+ * Analog samples as the hardware delivers them, see analog.c: the value of
+ * probe p in sample n is data[n * num_probes + p] * scale[p] + offset[p].
+ *
+ * Only callbacks which accept SR_DF_ACCEPT_ANALOG_RAW get these, all others
+ * get the same samples converted, as SR_DF_ANALOG packets.
+ */
+struct sr_datafeed_analog_raw {
+	int num_samples;
+	int num_probes;
+	int mq;
+	int unit;
+	int encoding;
+	void *data;
+	float scale[SR_ANALOG_RAW_MAX_PROBES];
+	float offset[SR_ANALOG_RAW_MAX_PROBES];
+	/* The buffer 'data' points into, if any. Can be NULL. */
+	struct sr_buffer *buffer;
 };
 
 struct sr_input {
@@ -223,13 +309,65 @@ struct sr_output_format {
 		     uint64_t *length_out);
 	int (*event) (struct sr_output *o, int event_type, uint8_t **data_out,
 		      uint64_t *length_out);
+	/* Optional: like data(), for SR_DF_LOGIC_RLE samples. */
+	int (*data_rle) (struct sr_output *o,
+			 const struct sr_datafeed_logic_rle *rle,
+			 uint8_t **data_out, uint64_t *length_out);
+};
+
+/*
+ * A compiled probe list, see sr_filter_plan_new(). The 'lut' is only used
+ * by some of the filter kernels.
+ */
+struct sr_filter_plan {
+	int in_unitsize;
+	int out_unitsize;
+	int num_probes;
+	int kernel;
+	/* Bit mask of the enabled probes in an input sample */
+	uint64_t mask;
+	/* Output bits for every value of every input byte */
+	uint64_t lut[8][256];
+};
+
+/* sr_datastore.backend values */
+enum {
+	/** All chunks are kept on the heap. */
+	SR_DATASTORE_MEMORY,
+	/** Full chunks beyond a RAM budget are spilled to a temporary file. */
+	SR_DATASTORE_SPILL,
 };
 
 struct sr_datastore {
 	/* Size in bytes of the number of units stored in this datastore */
 	int ds_unitsize;
-	unsigned int num_units; /* TODO: uint64_t */
-	GSList *chunklist;
+	uint64_t num_units;
+	/* Chunk index, each chunk holds DATASTORE_CHUNKSIZE units. */
+	gpointer *chunks;
+	unsigned int num_chunks;
+	unsigned int chunks_allocated;
+	int backend;
+	/* SR_DATASTORE_SPILL only: max. number of chunks kept on the heap */
+	unsigned int max_resident;
+	/* SR_DATASTORE_SPILL only: chunks 0..num_spilled-1 are mmap()'ed */
+	unsigned int num_spilled;
+	int spill_fd;
+};
+
+/*
+ * Summary of one chunk of samples in a (version 2) session file. Bit n of
+ * the masks refers to bit n of the samples as stored in the file.
+ */
+struct sr_capture_chunk {
+	/* Number of the first sample in this chunk */
+	uint64_t start;
+	uint64_t num_samples;
+	/* Probes which are low throughout the chunk */
+	uint64_t zero_mask;
+	/* Probes which are high throughout the chunk */
+	uint64_t one_mask;
+	/* Probes which change at least once within the chunk */
+	uint64_t transition_mask;
 };
 
 /*
@@ -334,6 +472,12 @@ enum {
 	/** Coupling. */
 	SR_HWCAP_COUPLING,
 
+	/** Size (in bytes) of the logic packets the device sends. */
+	SR_HWCAP_PACKET_SIZE,
+
+	/** The device sends samples no faster than its samplerate. */
+	SR_HWCAP_REALTIME,
+
 
 	/*--- Special stuff -------------------------------------------------*/
 
@@ -349,6 +493,12 @@ enum {
 	/** The device supports setting the number of probes. */
 	SR_HWCAP_CAPTURE_NUM_PROBES,
 
+	/**
+	 * The device supports starting playback of the capturefile at a
+	 * given sample number, instead of at the beginning.
+	 */
+	SR_HWCAP_CAPTURE_START,
+
 
 	/*--- Acquisition modes ---------------------------------------------*/
 
@@ -448,6 +598,9 @@ enum {
 	SR_DI_VDIVS,
 	/* Coupling options */
 	SR_DI_COUPLING,
+	/* Chunk index of the capturefile, NULL if there is none
+	 * (GArray of struct sr_capture_chunk) */
+	SR_DI_CAPTURE_CHUNKS,
 };
 
 /*
@@ -481,24 +634,92 @@ struct sr_dev_driver {
 	int (*dev_acquisition_stop) (int dev_index, void *session_dev_id);
 };
 
+/* Overflow policies for asynchronous datafeed delivery */
+enum {
+	/** Wait until the datafeed callback has caught up. */
+	SR_BUS_OVERFLOW_BLOCK,
+	/** Drop (and count) sample data packets. */
+	SR_BUS_OVERFLOW_DROP,
+	/** Queue packets up in an unbounded backlog. */
+	SR_BUS_OVERFLOW_SPILL,
+};
+
+/* Number of buckets in a latency histogram, see struct sr_stats_callback. */
+#define SR_STATS_LATENCY_BUCKETS 20
+
+struct sr_stats_packets {
+	uint64_t count;
+	/* Sample data carried by these packets, in bytes. */
+	uint64_t bytes;
+};
+
+struct sr_stats_callback {
+	uint64_t calls;
+	/* Total and max. time spent in the callback, in us. */
+	uint64_t time_total;
+	uint64_t time_max;
+	/*
+	 * Time spent per call: latency[0] counts calls which took less than
+	 * 1us, latency[n] those which took 2^(n-1) up to 2^n - 1 us. The last
+	 * bucket also counts all calls which took longer.
+	 */
+	uint64_t latency[SR_STATS_LATENCY_BUCKETS];
+	/* Asynchronous delivery: time packets were queued for, in us. */
+	uint64_t queue_time_total;
+	uint64_t queue_time_max;
+	/* Asynchronous delivery: packets dropped (SR_BUS_OVERFLOW_DROP). */
+	uint64_t dropped;
+};
+
+/*
+ * Session statistics, see sr_session_stats_get(). All counters are reset
+ * by sr_session_start().
+ */
+struct sr_session_stats {
+	/* Time since the session was started (until it stopped), in us. */
+	uint64_t duration;
+	/* Packets sent, indexed by sr_datafeed_packet.type. */
+	struct sr_stats_packets packets[SR_DF_NUM_TYPES];
+	/* struct sr_stats_callback per datafeed callback, in the same order. */
+	GSList *callbacks;
+	/* Transfers received from the hardware, as reported by drivers. */
+	uint64_t transfers;
+	uint64_t transfer_bytes;
+	/* Transfers which came back without data, or with an error. */
+	uint64_t empty_transfers;
+	/* Data lost because the host didn't keep up with the hardware. */
+	uint64_t overruns;
+};
+
 struct sr_session {
 	/* List of struct sr_dev* */
 	GSList *devs;
 	/* list of sr_receive_data_callback_t */
 	GSList *datafeed_callbacks;
+	/* The subset of datafeed_callbacks which accept SR_DF_LOGIC_RLE. */
+	GSList *rle_callbacks;
+	/* The subset of datafeed_callbacks which accept SR_DF_ANALOG_RAW. */
+	GSList *analog_raw_callbacks;
 	GTimeVal starttime;
 	gboolean running;
 
-	unsigned int num_sources;
+	/* Event sources and their backend, see session_loop.c. */
+	struct sr_session_loop *loop;
 
-	/* Both "sources" and "pollfds" are of the same size and contain pairs of
-	 * descriptor and callback function. We can not embed the GPollFD into the
-	 * source struct since we want to be able to pass the array of all poll
-	 * descriptors to g_poll.
-	 */
-	struct source *sources;
-	GPollFD *pollfds;
-	int source_timeout;
+	/* Performance counters, see session_stats.c. */
+	struct sr_session_stats stats;
+	gint64 stats_start;
+	gint64 stats_end;
+	int stats_analog_probes;
+
+	/* Pool of datafeed buffers for drivers, see sr_session_buffer_get(). */
+	struct sr_buffer_pool *buffer_pool;
+
+	/* Asynchronous datafeed delivery, see session_bus.c. */
+	unsigned int bus_queue_size;
+	int bus_overflow;
+	GSList *bus_consumers;
+	gboolean stop_pending;
 };
 
 #include "proto.h"
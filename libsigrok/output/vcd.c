@@ -33,6 +33,7 @@ struct context {
 	int *prevbits;
 	GString *header;
 	uint64_t prevsample;
+	uint64_t samplecount;
 	int period;
 	uint64_t samplerate;
 };
@@ -157,18 +158,12 @@ static int event(struct sr_output *o, int event_type, uint8_t **data_out,
 	return SR_OK;
 }
 
-static int data(struct sr_output *o, const uint8_t *data_in,
-		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
+/* Start a chunk of output, with the header if this is the first one. */
+static GString *out_begin(struct context *ctx, const uint8_t *first_sample)
 {
-	struct context *ctx;
-	unsigned int i;
-	int p, curbit, prevbit;
-	uint64_t sample;
-	static uint64_t samplecount = 0;
 	GString *out;
-	int first_sample = 0;
+	uint64_t sample;
 
-	ctx = o->internal;
 	out = g_string_sized_new(512);
 
 	if (ctx->header) {
@@ -176,35 +171,98 @@ static int data(struct sr_output *o, const uint8_t *data_in,
 		g_string_append(out, ctx->header->str);
 		g_string_free(ctx->header, TRUE);
 		ctx->header = NULL;
-		first_sample = 1;
+
+		/* First packet. We neg to make sure sample is stored. */
+		sample = 0;
+		memcpy(&sample, first_sample, ctx->unitsize);
+		ctx->prevsample = ~sample;
 	}
 
-	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
-		samplecount++;
+	return out;
+}
+
+/* Output the changes from the previous sample to the next one. */
+static void sample_out(struct context *ctx, GString *out, uint64_t sample)
+{
+	int p, curbit, prevbit;
 
+	ctx->samplecount++;
+
+	for (p = 0; p < ctx->num_enabled_probes; p++) {
+		curbit = (sample & ((uint64_t) (1 << p))) >> p;
+		prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
+
+		/* VCD only contains deltas/changes of signals. */
+		if (prevbit == curbit)
+			continue;
+
+		/* Output which signal changed to which value. */
+		g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
+				(uint64_t)(((float)ctx->samplecount / ctx->samplerate)
+				* ctx->period), curbit, (char)('!' + p));
+	}
+
+	ctx->prevsample = sample;
+}
+
+static int data(struct sr_output *o, const uint8_t *data_in,
+		uint64_t length_in, uint8_t **data_out, uint64_t *length_out)
+{
+	struct context *ctx;
+	unsigned int i;
+	uint64_t sample;
+	GString *out;
+
+	ctx = o->internal;
+	if (length_in < (uint64_t)ctx->unitsize) {
+		*data_out = NULL;
+		*length_out = 0;
+		return SR_OK;
+	}
+
+	out = out_begin(ctx, data_in);
+
+	sample = 0;
+	for (i = 0; i <= length_in - ctx->unitsize; i += ctx->unitsize) {
 		memcpy(&sample, data_in + i, ctx->unitsize);
+		sample_out(ctx, out, sample);
+	}
 
-		if (first_sample) {
-			/* First packet. We neg to make sure sample is stored. */
-			ctx->prevsample = ~sample;
-			first_sample = 0;
-		}
+	*data_out = (uint8_t *)out->str;
+	*length_out = out->len;
+	g_string_free(out, FALSE);
 
-		for (p = 0; p < ctx->num_enabled_probes; p++) {
-			curbit = (sample & ((uint64_t) (1 << p))) >> p;
-			prevbit = (ctx->prevsample & ((uint64_t) (1 << p))) >> p;
+	return SR_OK;
+}
 
-			/* VCD only contains deltas/changes of signals. */
-			if (prevbit == curbit)
-				continue;
+/*
+ * Only the first sample of every run can be a change, so run-length
+ * encoded data is converted without expanding it.
+ */
+static int data_rle(struct sr_output *o,
+		    const struct sr_datafeed_logic_rle *rle,
+		    uint8_t **data_out, uint64_t *length_out)
+{
+	struct context *ctx;
+	const uint8_t *values;
+	uint64_t i, sample;
+	GString *out;
 
-			/* Output which signal changed to which value. */
-			g_string_append_printf(out, "#%" PRIu64 "\n%i%c\n",
-					(uint64_t)(((float)samplecount / ctx->samplerate)
-					* ctx->period), curbit, (char)('!' + p));
-		}
+	ctx = o->internal;
+	if (!rle->num_runs || rle->unitsize != ctx->unitsize) {
+		*data_out = NULL;
+		*length_out = 0;
+		return rle->num_runs ? SR_ERR_ARG : SR_OK;
+	}
+
+	values = rle->values;
+	out = out_begin(ctx, values);
 
-		ctx->prevsample = sample;
+	sample = 0;
+	for (i = 0; i < rle->num_runs; i++) {
+		memcpy(&sample, values + i * ctx->unitsize, ctx->unitsize);
+		sample_out(ctx, out, sample);
+		ctx->samplecount += rle->lengths[i] - 1;
 	}
 
 	*data_out = (uint8_t *)out->str;
@@ -221,4 +279,5 @@ struct sr_output_format output_vcd = {
 	.init = init,
 	.data = data,
 	.event = event,
+	.data_rle = data_rle,
 };
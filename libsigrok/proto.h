@@ -37,13 +37,33 @@ SR_API int sr_log_callback_set_default(void);
 SR_API int sr_log_logdomain_set(const char *logdomain);
 SR_API char *sr_log_logdomain_get(void);
 
+/*--- buffer.c --------------------------------------------------------------*/
+
+SR_API struct sr_buffer *sr_buffer_new(size_t size);
+SR_API int sr_buffer_ref(struct sr_buffer *buf);
+SR_API int sr_buffer_unref(struct sr_buffer *buf);
+SR_API struct sr_buffer_pool *sr_buffer_pool_new(size_t buffer_size,
+						 unsigned int max_free);
+SR_API int sr_buffer_pool_destroy(struct sr_buffer_pool *pool);
+SR_API struct sr_buffer *sr_buffer_pool_get(struct sr_buffer_pool *pool);
+
 /*--- datastore.c -----------------------------------------------------------*/
 
 SR_API int sr_datastore_new(int unitsize, struct sr_datastore **ds);
+SR_API int sr_datastore_new_spill(int unitsize, uint64_t ram_budget,
+				  struct sr_datastore **ds);
 SR_API int sr_datastore_destroy(struct sr_datastore *ds);
 SR_API int sr_datastore_put(struct sr_datastore *ds, void *data,
 			    unsigned int length, int in_unitsize,
 			    const int *probelist);
+SR_API int sr_datastore_put_rle(struct sr_datastore *ds,
+				const struct sr_datafeed_logic_rle *rle);
+SR_API int sr_datastore_get(const struct sr_datastore *ds,
+			    uint64_t start_unit, uint64_t num_units,
+			    void *buf);
+SR_API int sr_datastore_chunk_get(const struct sr_datastore *ds,
+				  unsigned int chunk_index, const void **data,
+				  uint64_t *num_units);
 
 /*--- device.c --------------------------------------------------------------*/
 
@@ -68,6 +88,13 @@ SR_API int sr_filter_probes(int in_unitsize, int out_unitsize,
 			    const int *probelist, const uint8_t *data_in,
 			    uint64_t length_in, uint8_t **data_out,
 			    uint64_t *length_out);
+SR_API int sr_filter_plan_new(int in_unitsize, int out_unitsize,
+			      const int *probelist,
+			      struct sr_filter_plan **plan);
+SR_API int sr_filter_plan_destroy(struct sr_filter_plan *plan);
+SR_API int sr_filter_plan_run(const struct sr_filter_plan *plan,
+			      const uint8_t *data_in, uint64_t length_in,
+			      uint8_t *data_out, uint64_t *length_out);
 
 /*--- hwdriver.c ------------------------------------------------------------*/
 
@@ -76,6 +103,26 @@ SR_API int sr_driver_init(struct sr_dev_driver *driver);
 SR_API gboolean sr_driver_hwcap_exists(struct sr_dev_driver *driver, int hwcap);
 SR_API const struct sr_hwcap_option *sr_hw_hwcap_get(int hwcap);
 
+/*--- rle.c -----------------------------------------------------------------*/
+
+SR_API int sr_rle_encode(const uint8_t *data_in, uint64_t length_in,
+			 uint16_t unitsize, struct sr_datafeed_logic_rle *rle,
+			 uint64_t max_runs);
+SR_API uint64_t sr_rle_num_samples(const struct sr_datafeed_logic_rle *rle);
+SR_API uint64_t sr_rle_expand(const struct sr_datafeed_logic_rle *rle,
+			      uint64_t *run, uint64_t *run_offset,
+			      uint8_t *data_out, uint64_t max_samples);
+SR_API int sr_rle_merge(struct sr_datafeed_logic_rle *rle);
+SR_API int sr_rle_truncate(struct sr_datafeed_logic_rle *rle,
+			   uint64_t num_samples);
+
+/*--- analog.c --------------------------------------------------------------*/
+
+SR_API int sr_analog_raw_unitsize(int encoding);
+SR_API int sr_analog_raw_to_float(const struct sr_datafeed_analog_raw *raw,
+				  uint64_t start, uint64_t num_samples,
+				  float *data_out);
+
 /*--- session.c -------------------------------------------------------------*/
 
 typedef void (*sr_datafeed_callback_t)(struct sr_dev *dev,
@@ -91,6 +138,11 @@ SR_API int sr_session_dev_add(struct sr_dev *dev);
 /* Datafeed setup */
 SR_API int sr_session_datafeed_callback_remove_all(void);
 SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb);
+SR_API int sr_session_datafeed_callback_add_rle(sr_datafeed_callback_t cb);
+SR_API int sr_session_datafeed_callback_add_full(sr_datafeed_callback_t cb,
+						 int accept);
+SR_API int sr_session_datafeed_async_set(unsigned int queue_size,
+					 int overflow);
 
 /* Session control */
 SR_API int sr_session_start(void);
@@ -98,6 +150,11 @@ SR_API int sr_session_run(void);
 SR_API int sr_session_halt(void);
 SR_API int sr_session_stop(void);
 SR_API int sr_session_save(const char *filename);
+SR_API int sr_session_save_begin(const char *filename, struct sr_dev *dev,
+				 int unitsize);
+SR_API int sr_session_save_append(const uint8_t *buf, uint64_t length);
+SR_API int sr_session_save_end(void);
+SR_API const struct sr_session_stats *sr_session_stats_get(void);
 SR_API int sr_session_source_add(int fd, int events, int timeout,
 		sr_receive_data_callback_t cb, void *cb_data);
 SR_API int sr_session_source_add_pollfd(GPollFD *pollfd, int timeout,
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Run-length encoded logic data (SR_DF_LOGIC_RLE).
+ *
+ * A struct sr_datafeed_logic_rle holds 'num_runs' sample values of
+ * 'unitsize' bytes each, and for every value the number of consecutive
+ * samples it was seen for. Slowly changing signals sampled at a high rate
+ * shrink by orders of magnitude this way.
+ */
+
+/* Round up to a multiple of 4, the lengths follow the values. */
+#define VALUES_SIZE(runs, unitsize) (((runs) * (unitsize) + 3) & ~(uint64_t)3)
+
+/* Repeat a 1, 2 or 4 byte sample over a 64 bit word. */
+static uint64_t sample_word(const uint8_t *sample, uint16_t unitsize)
+{
+	uint64_t word;
+	int i;
+
+	for (i = 0; i < 8; i += unitsize)
+		memcpy((uint8_t *)&word + i, sample, unitsize);
+
+	return word;
+}
+
+/* Find the first sample at or after 'i' which differs from sample 'i'. */
+static uint64_t run_end(const uint8_t *data, uint64_t num_samples,
+			uint16_t unitsize, uint64_t i)
+{
+	const uint8_t *sample;
+	uint64_t word, pattern, end;
+
+	sample = data + i * unitsize;
+	end = i + 1;
+
+	/* Compare 8 bytes at a time where the samples tile a word. */
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4 || unitsize == 8) {
+		pattern = sample_word(sample, unitsize);
+		while ((end + 8 / unitsize) <= num_samples) {
+			memcpy(&word, data + end * unitsize, sizeof(word));
+			if (word != pattern)
+				break;
+			end += 8 / unitsize;
+		}
+	}
+
+	while (end < num_samples
+	       && !memcmp(data + end * unitsize, sample, unitsize))
+		end++;
+
+	return end;
+}
+
+/**
+ * Run-length encode logic samples.
+ *
+ * @param data_in The samples.
+ * @param length_in The length of data_in, in bytes.
+ * @param unitsize The size of a sample, in bytes.
+ * @param rle Where to put the result. Its 'values' and 'lengths' must have
+ *            room for 'max_runs' runs.
+ * @param max_runs The maximum number of runs to produce.
+ *
+ * @return SR_OK upon success, SR_ERR if the samples need more than
+ *         'max_runs' runs (i.e. they don't compress well), or SR_ERR_ARG
+ *         upon invalid arguments.
+ */
+SR_API int sr_rle_encode(const uint8_t *data_in, uint64_t length_in,
+			 uint16_t unitsize, struct sr_datafeed_logic_rle *rle,
+			 uint64_t max_runs)
+{
+	uint8_t *values;
+	uint64_t num_samples, i, end, length, n;
+
+	if (!data_in || !rle || !unitsize) {
+		sr_err("rle: %s: invalid arguments", __func__);
+		return SR_ERR_ARG;
+	}
+
+	values = rle->values;
+	num_samples = length_in / unitsize;
+	n = 0;
+	for (i = 0; i < num_samples; i = end) {
+		end = run_end(data_in, num_samples, unitsize, i);
+		for (length = end - i; length; length -= rle->lengths[n++]) {
+			if (n == max_runs)
+				return SR_ERR;
+			memcpy(values + n * unitsize, data_in + i * unitsize,
+			       unitsize);
+			rle->lengths[n] = MIN(length, UINT32_MAX);
+		}
+	}
+
+	rle->num_runs = n;
+	rle->unitsize = unitsize;
+
+	return SR_OK;
+}
+
+/**
+ * Count the samples in run-length encoded logic data.
+ *
+ * @param rle The data. Must not be NULL.
+ *
+ * @return The number of samples.
+ */
+SR_API uint64_t sr_rle_num_samples(const struct sr_datafeed_logic_rle *rle)
+{
+	uint64_t i, num_samples;
+
+	num_samples = 0;
+	for (i = 0; i < rle->num_runs; i++)
+		num_samples += rle->lengths[i];
+
+	return num_samples;
+}
+
+/**
+ * Expand run-length encoded logic data into plain samples, a piece at a
+ * time.
+ *
+ * Start with *run and *run_offset set to 0, and call this until it
+ * returns 0 to get all samples.
+ *
+ * @param rle The data. Must not be NULL.
+ * @param run Index of the run to continue with, updated on return.
+ * @param run_offset Samples of that run already expanded, updated on return.
+ * @param data_out Where to put the samples.
+ * @param max_samples The maximum number of samples to put into data_out.
+ *
+ * @return The number of samples put into data_out.
+ */
+SR_API uint64_t sr_rle_expand(const struct sr_datafeed_logic_rle *rle,
+			      uint64_t *run, uint64_t *run_offset,
+			      uint8_t *data_out, uint64_t max_samples)
+{
+	const uint8_t *value;
+	uint64_t done, n, i;
+	uint16_t unitsize;
+
+	unitsize = rle->unitsize;
+	done = 0;
+	while (done < max_samples && *run < rle->num_runs) {
+		value = (const uint8_t *)rle->values + *run * unitsize;
+		n = MIN(rle->lengths[*run] - *run_offset, max_samples - done);
+		if (unitsize == 1) {
+			memset(data_out + done, *value, n);
+		} else {
+			for (i = 0; i < n; i++)
+				memcpy(data_out + (done + i) * unitsize, value,
+				       unitsize);
+		}
+		done += n;
+		*run_offset += n;
+		if (*run_offset == rle->lengths[*run]) {
+			(*run)++;
+			*run_offset = 0;
+		}
+	}
+
+	return done;
+}
+
+/**
+ * Merge adjacent runs with the same value, e.g. after sr_filter_plan_run()
+ * dropped the probes they differed in. Works in place.
+ *
+ * @param rle The data. Must not be NULL.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_rle_merge(struct sr_datafeed_logic_rle *rle)
+{
+	uint8_t *values;
+	uint64_t i, n;
+	uint16_t unitsize;
+
+	if (!rle->num_runs)
+		return SR_OK;
+
+	values = rle->values;
+	unitsize = rle->unitsize;
+	n = 0;
+	for (i = 1; i < rle->num_runs; i++) {
+		if (!memcmp(values + n * unitsize, values + i * unitsize, unitsize)
+		    && (uint64_t)rle->lengths[n] + rle->lengths[i] <= UINT32_MAX) {
+			rle->lengths[n] += rle->lengths[i];
+			continue;
+		}
+		n++;
+		if (n != i) {
+			memcpy(values + n * unitsize, values + i * unitsize,
+			       unitsize);
+			rle->lengths[n] = rle->lengths[i];
+		}
+	}
+	rle->num_runs = n + 1;
+
+	return SR_OK;
+}
+
+/**
+ * Drop all samples after the first 'num_samples' ones. Works in place.
+ *
+ * @param rle The data. Must not be NULL.
+ * @param num_samples The number of samples to keep.
+ *
+ * @return SR_OK upon success.
+ */
+SR_API int sr_rle_truncate(struct sr_datafeed_logic_rle *rle,
+			   uint64_t num_samples)
+{
+	uint64_t i;
+
+	for (i = 0; i < rle->num_runs; i++) {
+		if (rle->lengths[i] >= num_samples) {
+			rle->lengths[i] = num_samples;
+			rle->num_runs = num_samples ? i + 1 : i;
+			break;
+		}
+		num_samples -= rle->lengths[i];
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Get a datafeed buffer with room for 'max_runs' runs, and point an
+ * sr_datafeed_logic_rle at it.
+ *
+ * @param max_runs The number of runs to make room for.
+ * @param unitsize The size of a sample, in bytes.
+ * @param rle The struct to set up. Must not be NULL.
+ *
+ * @return The buffer (owned by the caller), or NULL upon errors.
+ */
+SR_PRIV struct sr_buffer *sr_rle_buffer_get(uint64_t max_runs,
+		uint16_t unitsize, struct sr_datafeed_logic_rle *rle)
+{
+	struct sr_buffer *buf;
+
+	buf = sr_session_buffer_get(VALUES_SIZE(max_runs, unitsize)
+				    + max_runs * sizeof(uint32_t));
+	if (!buf)
+		return NULL;
+
+	rle->num_runs = 0;
+	rle->unitsize = unitsize;
+	rle->values = buf->data;
+	rle->lengths = (uint32_t *)(buf->data
+				    + VALUES_SIZE(max_runs, unitsize));
+	rle->buffer = buf;
+
+	return buf;
+}
@@ -25,16 +25,7 @@
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
 
-struct source {
-	int timeout;
-	sr_receive_data_callback_t cb;
-	void *cb_data;
-
-	/* This is used to keep track of the object (fd, pollfd or channel) which is
-	 * being polled and will be used to match the source when removing it again.
-	 */
-	gintptr poll_object;
-};
+static void stop_devs(void);
 
 /* There can only be one session at a time. */
 /* 'session' is not static, it's used elsewhere (via 'extern'). */
@@ -55,7 +46,20 @@ SR_API struct sr_session *sr_session_new(void)
 		return NULL; /* TODO: SR_ERR_MALLOC? */
 	}
 
-	session->source_timeout = -1;
+	if (!(session->loop = sr_session_loop_new())) {
+		g_free(session);
+		session = NULL;
+		return NULL;
+	}
+
+	if (!(session->buffer_pool = sr_buffer_pool_new(SESSION_BUFFER_SIZE,
+				SESSION_BUFFER_POOL_MAX_FREE))) {
+		sr_err("session: %s: buffer pool creation failed", __func__);
+		sr_session_loop_destroy(session->loop);
+		g_free(session);
+		session = NULL;
+		return NULL;
+	}
 
 	return session;
 }
@@ -76,10 +80,18 @@ SR_API int sr_session_destroy(void)
 
 	sr_session_dev_remove_all();
 
+	if (session->bus_consumers)
+		sr_session_bus_stop();
+
 	/* TODO: Error checks needed? */
 
 	/* TODO: Loop over protocol decoders and free them. */
 
+	/* Buffers still referenced by frontends stay valid. */
+	sr_buffer_pool_destroy(session->buffer_pool);
+
+	sr_session_loop_destroy(session->loop);
+	sr_session_stats_callbacks_free();
 	g_free(session);
 	session = NULL;
 
@@ -175,6 +187,11 @@ SR_API int sr_session_datafeed_callback_remove_all(void)
 
 	g_slist_free(session->datafeed_callbacks);
 	session->datafeed_callbacks = NULL;
+	g_slist_free(session->rle_callbacks);
+	session->rle_callbacks = NULL;
+	g_slist_free(session->analog_raw_callbacks);
+	session->analog_raw_callbacks = NULL;
+	sr_session_stats_callbacks_free();
 
 	return SR_OK;
 }
@@ -199,6 +216,9 @@ SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
 		return SR_ERR_ARG;
 	}
 
+	if (sr_session_stats_callback_add() != SR_OK)
+		return SR_ERR_MALLOC;
+
 	session->datafeed_callbacks =
 	    g_slist_append(session->datafeed_callbacks, cb);
 
@@ -206,30 +226,51 @@ SR_API int sr_session_datafeed_callback_add(sr_datafeed_callback_t cb)
 }
 
 /**
- * TODO.
+ * Add a datafeed callback which understands SR_DF_LOGIC_RLE packets to the
+ * current session.
+ *
+ * Drivers send slowly changing logic data run-length encoded when there
+ * are such callbacks. Callbacks added via sr_session_datafeed_callback_add()
+ * get the same samples as SR_DF_LOGIC packets.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
  */
-static int sr_session_run_poll(void)
+SR_API int sr_session_datafeed_callback_add_rle(sr_datafeed_callback_t cb)
+{
+	return sr_session_datafeed_callback_add_full(cb, SR_DF_ACCEPT_LOGIC_RLE);
+}
+
+/**
+ * Add a datafeed callback which understands some packet types on top of
+ * the basic ones to the current session.
+ *
+ * Packets of types the callback doesn't take are converted for it:
+ * SR_DF_LOGIC_RLE to SR_DF_LOGIC, SR_DF_ANALOG_RAW to SR_DF_ANALOG.
+ *
+ * @param cb Function to call when a chunk of data is received.
+ *           Must not be NULL.
+ * @param accept The packet types it takes, a combination of
+ *               SR_DF_ACCEPT_* flags.
+ *
+ * @return SR_OK upon success, SR_ERR_BUG if no session exists.
+ */
+SR_API int sr_session_datafeed_callback_add_full(sr_datafeed_callback_t cb,
+						 int accept)
 {
-	unsigned int i;
 	int ret;
 
-	while (session->running) {
-		ret = g_poll(session->pollfds, session->num_sources, session->source_timeout);
-
-		for (i = 0; i < session->num_sources; i++) {
-			if (session->pollfds[i].revents > 0 || (ret == 0
-				&& session->source_timeout == session->sources[i].timeout)) {
-				/*
-				 * Invoke the source's callback on an event,
-				 * or if the poll timeout out and this source
-				 * asked for that timeout.
-				 */
-				if (!session->sources[i].cb(session->pollfds[i].fd, session->pollfds[i].revents,
-						  session->sources[i].cb_data))
-					sr_session_source_remove(session->sources[i].poll_object);
-			}
-		}
-	}
+	if ((ret = sr_session_datafeed_callback_add(cb)) != SR_OK)
+		return ret;
+
+	if (accept & SR_DF_ACCEPT_LOGIC_RLE)
+		session->rle_callbacks =
+			g_slist_append(session->rle_callbacks, cb);
+	if (accept & SR_DF_ACCEPT_ANALOG_RAW)
+		session->analog_raw_callbacks =
+			g_slist_append(session->analog_raw_callbacks, cb);
 
 	return SR_OK;
 }
@@ -264,6 +305,14 @@ SR_API int sr_session_start(void)
 
 	sr_info("session: starting");
 
+	sr_session_stats_start();
+
+	if ((ret = sr_session_bus_start()) != SR_OK) {
+		sr_err("session: %s: could not start the datafeed consumer "
+		       "threads (%d)", __func__, ret);
+		return ret;
+	}
+
 	for (l = session->devs; l; l = l->next) {
 		dev = l->data;
 		/* TODO: Check for dev != NULL. */
@@ -305,19 +354,42 @@ SR_API int sr_session_run(void)
 	sr_info("session: running");
 	session->running = TRUE;
 
-	/* Do we have real sources? */
-	if (session->num_sources == 1 && session->pollfds[0].fd == -1) {
-		/* Dummy source, freewheel over it. */
-		while (session->running)
-			session->sources[0].cb(-1, 0, session->sources[0].cb_data);
-	} else {
-		/* Real sources, use g_poll() main loop. */
-		sr_session_run_poll();
+	/* Sources without an fd or timeout are simply called continuously. */
+	while (session->running) {
+		if (sr_session_loop_iterate(session->loop) != SR_OK)
+			break;
+	}
+
+	/* A datafeed consumer thread asked us to stop the devices. */
+	if (session->stop_pending) {
+		session->stop_pending = FALSE;
+		stop_devs();
 	}
 
+	/* Make sure all queued packets are delivered before returning. */
+	if (session->bus_consumers)
+		sr_session_bus_stop();
+
+	sr_session_stats_stop();
+
 	return SR_OK;
 }
 
+static void stop_devs(void)
+{
+	struct sr_dev *dev;
+	GSList *l;
+
+	for (l = session->devs; l; l = l->next) {
+		dev = l->data;
+		/* Check for dev != NULL. */
+		if (dev->driver) {
+			if (dev->driver->dev_acquisition_stop)
+				dev->driver->dev_acquisition_stop(dev->driver_index, dev);
+		}
+	}
+}
+
 /**
  * Halt the current session.
  *
@@ -342,9 +414,6 @@ SR_API int sr_session_halt(void)
  */
 SR_API int sr_session_stop(void)
 {
-	struct sr_dev *dev;
-	GSList *l;
-
 	if (!session) {
 		sr_err("session: %s: session was NULL", __func__);
 		return SR_ERR_BUG;
@@ -353,15 +422,17 @@ SR_API int sr_session_stop(void)
 	sr_info("session: stopping");
 	session->running = FALSE;
 
-	for (l = session->devs; l; l = l->next) {
-		dev = l->data;
-		/* Check for dev != NULL. */
-		if (dev->driver) {
-			if (dev->driver->dev_acquisition_stop)
-				dev->driver->dev_acquisition_stop(dev->driver_index, dev);
-		}
+	/*
+	 * Drivers expect to be stopped from the session thread (and may send
+	 * packets while stopping), so leave that to sr_session_run().
+	 */
+	if (session->bus_consumers && sr_session_bus_is_consumer()) {
+		session->stop_pending = TRUE;
+		return SR_OK;
 	}
 
+	stop_devs();
+
 	return SR_OK;
 }
 
@@ -373,7 +444,9 @@ SR_API int sr_session_stop(void)
 static void datafeed_dump(struct sr_datafeed_packet *packet)
 {
 	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *logic_rle;
 	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *analog_raw;
 
 	switch (packet->type) {
 	case SR_DF_HEADER:
@@ -407,12 +480,131 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 	case SR_DF_FRAME_END:
 		sr_dbg("bus: received SR_DF_FRAME_END");
 		break;
+	case SR_DF_LOGIC_RLE:
+		logic_rle = packet->payload;
+		sr_dbg("bus: received SR_DF_LOGIC_RLE %" PRIu64 " runs",
+		       logic_rle->num_runs);
+		break;
+	case SR_DF_ANALOG_RAW:
+		analog_raw = packet->payload;
+		sr_dbg("bus: received SR_DF_ANALOG_RAW %d samples",
+		       analog_raw->num_samples);
+		break;
 	default:
 		sr_dbg("bus: received unknown packet type %d", packet->type);
 		break;
 	}
 }
 
+/*
+ * Expand an SR_DF_LOGIC_RLE packet for a callback which only understands
+ * SR_DF_LOGIC, one buffer of samples at a time.
+ */
+static void deliver_expanded(sr_datafeed_callback_t cb, struct sr_dev *dev,
+			     const struct sr_datafeed_logic_rle *rle)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic logic;
+	struct sr_buffer *buf;
+	uint64_t run, run_offset, num_samples;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = &logic;
+	logic.unitsize = rle->unitsize;
+
+	run = run_offset = 0;
+	while (run < rle->num_runs) {
+		if (!(buf = sr_session_buffer_get(SESSION_BUFFER_SIZE))) {
+			sr_err("session: %s: buffer malloc failed", __func__);
+			return;
+		}
+		num_samples = sr_rle_expand(rle, &run, &run_offset, buf->data,
+					    SESSION_BUFFER_SIZE / rle->unitsize);
+		logic.length = num_samples * rle->unitsize;
+		logic.data = buf->data;
+		logic.buffer = buf;
+		cb(dev, &packet);
+		sr_buffer_unref(buf);
+	}
+}
+
+/*
+ * Convert an SR_DF_ANALOG_RAW packet for a callback which only understands
+ * SR_DF_ANALOG, one buffer of samples at a time.
+ */
+static void deliver_converted(sr_datafeed_callback_t cb, struct sr_dev *dev,
+			      const struct sr_datafeed_analog_raw *raw)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_analog analog;
+	struct sr_buffer *buf;
+	uint64_t done, max_samples;
+
+	packet.type = SR_DF_ANALOG;
+	packet.payload = &analog;
+	analog.mq = raw->mq;
+	analog.unit = raw->unit;
+
+	max_samples = SESSION_BUFFER_SIZE / sizeof(float)
+		      / MAX(1, raw->num_probes);
+	for (done = 0; done < (uint64_t)raw->num_samples; done += max_samples) {
+		if (!(buf = sr_session_buffer_get(SESSION_BUFFER_SIZE))) {
+			sr_err("session: %s: buffer malloc failed", __func__);
+			return;
+		}
+		analog.num_samples = MIN(max_samples, raw->num_samples - done);
+		analog.data = (float *)buf->data;
+		analog.buffer = buf;
+		if (sr_analog_raw_to_float(raw, done, analog.num_samples,
+					   analog.data) == SR_OK)
+			cb(dev, &packet);
+		sr_buffer_unref(buf);
+	}
+}
+
+/**
+ * Find out which packet types on top of the basic ones a datafeed callback
+ * takes.
+ *
+ * @param cb The callback.
+ *
+ * @return A combination of SR_DF_ACCEPT_* flags.
+ */
+SR_PRIV int sr_session_callback_accepts(sr_datafeed_callback_t cb)
+{
+	int accept;
+
+	accept = 0;
+	if (g_slist_find(session->rle_callbacks, cb))
+		accept |= SR_DF_ACCEPT_LOGIC_RLE;
+	if (g_slist_find(session->analog_raw_callbacks, cb))
+		accept |= SR_DF_ACCEPT_ANALOG_RAW;
+
+	return accept;
+}
+
+/**
+ * Pass a packet to a datafeed callback.
+ *
+ * @param cb The callback.
+ * @param dev The device the packet comes from.
+ * @param packet The packet.
+ * @param accept The packet types the callback takes on top of the basic
+ *               ones (SR_DF_ACCEPT_* flags), others are converted for it.
+ */
+SR_PRIV void sr_session_deliver(sr_datafeed_callback_t cb, struct sr_dev *dev,
+				struct sr_datafeed_packet *packet, int accept)
+{
+	if (packet->type == SR_DF_LOGIC_RLE
+	    && !(accept & SR_DF_ACCEPT_LOGIC_RLE))
+		deliver_expanded(cb, dev, packet->payload);
+	else if (packet->type == SR_DF_ANALOG_RAW
+		 && !(accept & SR_DF_ACCEPT_ANALOG_RAW))
+		deliver_converted(cb, dev, packet->payload);
+	else
+		cb(dev, packet);
+}
+
 /**
  * Send a packet to whatever is listening on the datafeed bus.
  *
@@ -426,8 +618,9 @@ static void datafeed_dump(struct sr_datafeed_packet *packet)
 SR_PRIV int sr_session_send(struct sr_dev *dev,
 			    struct sr_datafeed_packet *packet)
 {
-	GSList *l;
+	GSList *l, *s;
 	sr_datafeed_callback_t cb;
+	gint64 start;
 
 	if (!dev) {
 		sr_err("session: %s: dev was NULL", __func__);
@@ -439,23 +632,96 @@ SR_PRIV int sr_session_send(struct sr_dev *dev,
 		return SR_ERR_ARG;
 	}
 
-	for (l = session->datafeed_callbacks; l; l = l->next) {
-		if (sr_log_loglevel_get() >= SR_LOG_DBG)
-			datafeed_dump(packet);
+	if (sr_log_loglevel_get() >= SR_LOG_DBG)
+		datafeed_dump(packet);
+	sr_session_stats_packet(packet);
+
+	if (session->bus_consumers)
+		return sr_session_bus_send(dev, packet);
+
+	s = session->stats.callbacks;
+	for (l = session->datafeed_callbacks; l; l = l->next, s = s->next) {
 		cb = l->data;
 		/* TODO: Check for cb != NULL. */
-		cb(dev, packet);
+		start = g_get_monotonic_time();
+		sr_session_deliver(cb, dev, packet,
+				   sr_session_callback_accepts(cb));
+		sr_session_stats_call(s->data, -1, start,
+				      g_get_monotonic_time());
 	}
 
 	return SR_OK;
 }
 
+/**
+ * Send logic samples, run-length encoded if anything listening on the
+ * datafeed bus understands that and the samples compress well enough.
+ *
+ * Drivers use this instead of sending SR_DF_LOGIC packets themselves.
+ *
+ * @param dev The device the samples come from.
+ * @param logic The samples, as for an SR_DF_LOGIC packet.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments.
+ */
+SR_PRIV int sr_session_send_logic(struct sr_dev *dev,
+				  struct sr_datafeed_logic *logic)
+{
+	struct sr_datafeed_packet packet;
+	struct sr_datafeed_logic_rle rle;
+	struct sr_buffer *buf;
+	uint64_t max_runs;
+	int ret;
+
+	packet.type = SR_DF_LOGIC;
+	packet.payload = logic;
+
+	if (!session->rle_callbacks || !logic->unitsize)
+		return sr_session_send(dev, &packet);
+
+	max_runs = logic->length / logic->unitsize / RLE_MIN_SAMPLES_PER_RUN;
+	if (!max_runs || !(buf = sr_rle_buffer_get(max_runs, logic->unitsize,
+						     &rle)))
+		return sr_session_send(dev, &packet);
+
+	if (sr_rle_encode(logic->data, logic->length, logic->unitsize, &rle,
+			  max_runs) == SR_OK) {
+		packet.type = SR_DF_LOGIC_RLE;
+		packet.payload = &rle;
+	}
+	ret = sr_session_send(dev, &packet);
+	sr_buffer_unref(buf);
+
+	return ret;
+}
+
+/**
+ * Get a datafeed buffer for a driver to fill.
+ *
+ * Buffers up to SESSION_BUFFER_SIZE bytes come from the session's buffer
+ * pool, so they're recycled once every consumer is done with them. Larger
+ * buffers are allocated individually.
+ *
+ * The caller owns one reference to the returned buffer, and should drop it
+ * via sr_buffer_unref() right after sending the packet which carries it.
+ * Datafeed callbacks which want to keep the data take their own reference.
+ *
+ * @param size The number of bytes needed.
+ *
+ * @return A buffer of at least 'size' bytes, or NULL upon errors.
+ */
+SR_PRIV struct sr_buffer *sr_session_buffer_get(size_t size)
+{
+	if (session && session->buffer_pool
+	    && size <= session->buffer_pool->buffer_size)
+		return sr_buffer_pool_get(session->buffer_pool);
+
+	return sr_buffer_new(size);
+}
+
 static int _sr_session_source_add(GPollFD *pollfd, int timeout,
 	sr_receive_data_callback_t cb, void *cb_data, gintptr poll_object)
 {
-	struct source *new_sources, *s;
-	GPollFD *new_pollfds;
-
 	if (!cb) {
 		sr_err("session: %s: cb was NULL", __func__);
 		return SR_ERR_ARG;
@@ -463,33 +729,8 @@ static int _sr_session_source_add(GPollFD *pollfd, int timeout,
 
 	/* Note: cb_data can be NULL, that's not a bug. */
 
-	new_pollfds = g_try_realloc(session->pollfds, sizeof(GPollFD) * (session->num_sources + 1));
-	if (!new_pollfds) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) *
-	(session->num_sources + 1));
-	if (!new_sources) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	new_pollfds[session->num_sources] = *pollfd;
-	s = &new_sources[session->num_sources++];
-	s->timeout = timeout;
-	s->cb = cb;
-	s->cb_data = cb_data;
-	s->poll_object = poll_object;
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
-
-	if (timeout != session->source_timeout && timeout > 0
-	    && (session->source_timeout == -1 || timeout < session->source_timeout))
-		session->source_timeout = timeout;
-
-	return SR_OK;
+	return sr_session_loop_source_add(session->loop, pollfd, timeout,
+					  cb, cb_data, poll_object);
 }
 
 /**
@@ -568,49 +809,7 @@ SR_API int sr_session_source_add_channel(GIOChannel *channel, int events,
 
 static int _sr_session_source_remove(gintptr poll_object)
 {
-	struct source *new_sources;
-	GPollFD *new_pollfds;
-	unsigned int old;
-
-	if (!session->sources || !session->num_sources) {
-		sr_err("session: %s: sources was NULL", __func__);
-		return SR_ERR_BUG;
-	}
-
-	for (old = 0; old < session->num_sources; old++) {
-		if (session->sources[old].poll_object == poll_object)
-			break;
-	}
-
-	/* fd not found, nothing to do */
-	if (old == session->num_sources)
-		return SR_OK;
-
-	session->num_sources -= 1;
-
-	if (old != session->num_sources) {
-		memmove(&session->pollfds[old], &session->pollfds[old+1],
-			(session->num_sources - old) * sizeof(GPollFD));
-		memmove(&session->sources[old], &session->sources[old+1],
-			(session->num_sources - old) * sizeof(struct source));
-	}
-
-	new_pollfds = g_try_realloc(session->pollfds, sizeof(GPollFD) * session->num_sources);
-	if (!new_pollfds && session->num_sources > 0) {
-		sr_err("session: %s: new_pollfds malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	new_sources = g_try_realloc(session->sources, sizeof(struct source) * session->num_sources);
-	if (!new_sources && session->num_sources > 0) {
-		sr_err("session: %s: new_sources malloc failed", __func__);
-		return SR_ERR_MALLOC;
-	}
-
-	session->pollfds = new_pollfds;
-	session->sources = new_sources;
-
-	return SR_OK;
+	return sr_session_loop_source_remove(session->loop, poll_object);
 }
 
 /*
@@ -0,0 +1,563 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Asynchronous datafeed delivery.
+ *
+ * In this mode every datafeed callback runs on its own consumer thread.
+ * sr_session_send() (always called from the session thread, which is the
+ * only producer) wraps the packet into a reference-counted bus_packet and
+ * pushes one reference into each consumer's single-producer/single-consumer
+ * ring. The rings are lock-free; the mutex/condition pairs are only used to
+ * put a thread to sleep when its ring is empty (consumer) or full (producer,
+ * with SR_BUS_OVERFLOW_BLOCK).
+ *
+ * Sample data which comes in an sr_buffer is passed on by reference, other
+ * data is copied into a buffer from the session's pool, since drivers reuse
+ * their memory as soon as sr_session_send() returns.
+ */
+
+extern struct sr_session *session;
+
+struct bus_packet {
+	volatile gint refcount;
+	struct sr_dev *dev;
+	struct sr_datafeed_packet packet;
+	union {
+		struct sr_datafeed_header header;
+		struct sr_datafeed_meta_logic meta_logic;
+		struct sr_datafeed_logic logic;
+		struct sr_datafeed_logic_rle logic_rle;
+		struct sr_datafeed_meta_analog meta_analog;
+		struct sr_datafeed_analog analog;
+		struct sr_datafeed_analog_raw analog_raw;
+	} payload;
+	/* Our reference to the packet's sample data, if any. */
+	struct sr_buffer *buffer;
+	/* When the packet was queued, for the session stats. */
+	gint64 queued;
+};
+
+struct bus_consumer {
+	sr_datafeed_callback_t cb;
+	/* Packet types the callback takes, see sr_session_deliver(). */
+	int accept;
+	struct sr_stats_callback *stats;
+	GThread *thread;
+
+	/* SPSC ring, 'size' is a power of two. head/tail only ever grow. */
+	struct bus_packet **ring;
+	unsigned int size;
+	volatile gint head;
+	volatile gint tail;
+
+	/* SR_BUS_OVERFLOW_SPILL: packets which didn't fit into the ring. */
+	GQueue *backlog;
+	volatile gint backlog_len;
+
+	GMutex *mutex;
+	GCond *data_cond;
+	GCond *space_cond;
+	volatile gint consumer_waiting;
+	volatile gint producer_waiting;
+
+	/* SR_BUS_OVERFLOW_DROP: number of packets dropped. */
+	uint64_t dropped;
+};
+
+/* Number of analog probes, needed to size copies of SR_DF_ANALOG data. */
+static int num_analog_probes = 1;
+
+static void bus_packet_unref(struct bus_packet *bp)
+{
+	if (!g_atomic_int_dec_and_test(&bp->refcount))
+		return;
+
+	if (bp->buffer)
+		sr_buffer_unref(bp->buffer);
+	g_free(bp);
+}
+
+/*
+ * Make the data of a packet's payload outlive the sr_session_send() call,
+ * either by taking a reference to its buffer or by copying it.
+ */
+static int bus_packet_hold_data(struct bus_packet *bp, void **data,
+				uint64_t length, struct sr_buffer *buffer)
+{
+	if (buffer) {
+		sr_buffer_ref(buffer);
+		bp->buffer = buffer;
+		return SR_OK;
+	}
+
+	if (!(bp->buffer = sr_session_buffer_get(length))) {
+		sr_err("bus: %s: buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	memcpy(bp->buffer->data, *data, length);
+	*data = bp->buffer->data;
+
+	return SR_OK;
+}
+
+/* Like bus_packet_hold_data(), for the two arrays of an RLE payload. */
+static int bus_packet_hold_rle(struct bus_packet *bp,
+			       struct sr_datafeed_logic_rle *rle)
+{
+	struct sr_datafeed_logic_rle copy;
+
+	if (rle->buffer) {
+		sr_buffer_ref(rle->buffer);
+		bp->buffer = rle->buffer;
+		return SR_OK;
+	}
+
+	if (!(bp->buffer = sr_rle_buffer_get(rle->num_runs, rle->unitsize,
+					     &copy))) {
+		sr_err("bus: %s: buffer malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	memcpy(copy.values, rle->values, rle->num_runs * rle->unitsize);
+	memcpy(copy.lengths, rle->lengths, rle->num_runs * sizeof(uint32_t));
+	copy.num_runs = rle->num_runs;
+	*rle = copy;
+
+	return SR_OK;
+}
+
+static struct bus_packet *bus_packet_new(struct sr_dev *dev,
+		struct sr_datafeed_packet *packet, int refcount)
+{
+	struct bus_packet *bp;
+	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *analog_raw;
+	struct sr_datafeed_logic *logic;
+	int ret;
+
+	if (!(bp = g_try_malloc0(sizeof(struct bus_packet)))) {
+		sr_err("bus: %s: bus packet malloc failed", __func__);
+		return NULL;
+	}
+
+	bp->refcount = refcount;
+	bp->dev = dev;
+	bp->queued = g_get_monotonic_time();
+	bp->packet.type = packet->type;
+	bp->packet.payload = &bp->payload;
+
+	ret = SR_OK;
+	switch (packet->type) {
+	case SR_DF_HEADER:
+		bp->payload.header = *(struct sr_datafeed_header *)packet->payload;
+		break;
+	case SR_DF_META_LOGIC:
+		bp->payload.meta_logic =
+			*(struct sr_datafeed_meta_logic *)packet->payload;
+		break;
+	case SR_DF_LOGIC:
+		logic = &bp->payload.logic;
+		*logic = *(struct sr_datafeed_logic *)packet->payload;
+		ret = bus_packet_hold_data(bp, &logic->data, logic->length,
+					   logic->buffer);
+		logic->buffer = bp->buffer;
+		break;
+	case SR_DF_LOGIC_RLE:
+		bp->payload.logic_rle =
+			*(struct sr_datafeed_logic_rle *)packet->payload;
+		ret = bus_packet_hold_rle(bp, &bp->payload.logic_rle);
+		break;
+	case SR_DF_META_ANALOG:
+		bp->payload.meta_analog =
+			*(struct sr_datafeed_meta_analog *)packet->payload;
+		num_analog_probes = MAX(1, bp->payload.meta_analog.num_probes);
+		break;
+	case SR_DF_ANALOG:
+		analog = &bp->payload.analog;
+		*analog = *(struct sr_datafeed_analog *)packet->payload;
+		ret = bus_packet_hold_data(bp, (void **)&analog->data,
+				analog->num_samples * num_analog_probes
+				* sizeof(float), analog->buffer);
+		analog->buffer = bp->buffer;
+		break;
+	case SR_DF_ANALOG_RAW:
+		analog_raw = &bp->payload.analog_raw;
+		*analog_raw = *(struct sr_datafeed_analog_raw *)packet->payload;
+		ret = bus_packet_hold_data(bp, &analog_raw->data,
+				(uint64_t)analog_raw->num_samples
+				* analog_raw->num_probes
+				* sr_analog_raw_unitsize(analog_raw->encoding),
+				analog_raw->buffer);
+		analog_raw->buffer = bp->buffer;
+		break;
+	default:
+		/* No payload. */
+		bp->packet.payload = NULL;
+		break;
+	}
+
+	if (ret != SR_OK) {
+		g_free(bp);
+		return NULL;
+	}
+
+	return bp;
+}
+
+static gboolean ring_full(struct bus_consumer *c)
+{
+	return (guint)(g_atomic_int_get(&c->head) - g_atomic_int_get(&c->tail))
+		== c->size;
+}
+
+static gboolean ring_empty(struct bus_consumer *c)
+{
+	return g_atomic_int_get(&c->head) == g_atomic_int_get(&c->tail);
+}
+
+static void wake(struct bus_consumer *c, volatile gint *waiting, GCond *cond)
+{
+	if (!g_atomic_int_get(waiting))
+		return;
+
+	g_mutex_lock(c->mutex);
+	g_cond_signal(cond);
+	g_mutex_unlock(c->mutex);
+}
+
+static void spill(struct bus_consumer *c, struct bus_packet *bp)
+{
+	g_mutex_lock(c->mutex);
+	g_queue_push_tail(c->backlog, bp);
+	g_atomic_int_inc(&c->backlog_len);
+	g_mutex_unlock(c->mutex);
+}
+
+/*
+ * Queue a packet reference for a consumer. A NULL packet tells the
+ * consumer thread to exit. Only the session thread calls this.
+ */
+static void consumer_push(struct bus_consumer *c, struct bus_packet *bp)
+{
+	gboolean droppable;
+	gint head;
+
+	droppable = bp && (bp->packet.type == SR_DF_LOGIC
+			   || bp->packet.type == SR_DF_LOGIC_RLE
+			   || bp->packet.type == SR_DF_ANALOG
+			   || bp->packet.type == SR_DF_ANALOG_RAW);
+
+	/* Once spilling started, keep going until the consumer caught up. */
+	if (g_atomic_int_get(&c->backlog_len)) {
+		spill(c, bp);
+		wake(c, &c->consumer_waiting, c->data_cond);
+		return;
+	}
+
+	if (ring_full(c)) {
+		if (session->bus_overflow == SR_BUS_OVERFLOW_DROP && droppable) {
+			c->dropped++;
+			bus_packet_unref(bp);
+			return;
+		} else if (session->bus_overflow == SR_BUS_OVERFLOW_SPILL) {
+			spill(c, bp);
+			wake(c, &c->consumer_waiting, c->data_cond);
+			return;
+		}
+
+		/* SR_BUS_OVERFLOW_BLOCK, or a packet we must not drop. */
+		g_mutex_lock(c->mutex);
+		g_atomic_int_set(&c->producer_waiting, TRUE);
+		while (ring_full(c))
+			g_cond_wait(c->space_cond, c->mutex);
+		g_atomic_int_set(&c->producer_waiting, FALSE);
+		g_mutex_unlock(c->mutex);
+	}
+
+	head = g_atomic_int_get(&c->head);
+	c->ring[(guint)head & (c->size - 1)] = bp;
+	g_atomic_int_set(&c->head, head + 1);
+
+	wake(c, &c->consumer_waiting, c->data_cond);
+}
+
+/* Get the next packet reference, sleeping until there is one. */
+static struct bus_packet *consumer_pop(struct bus_consumer *c)
+{
+	struct bus_packet *bp;
+	gint tail;
+
+	while (TRUE) {
+		if (!ring_empty(c)) {
+			tail = g_atomic_int_get(&c->tail);
+			bp = c->ring[(guint)tail & (c->size - 1)];
+			g_atomic_int_set(&c->tail, tail + 1);
+			wake(c, &c->producer_waiting, c->space_cond);
+			return bp;
+		}
+
+		/* The ring is drained, so the backlog is next in line. */
+		if (g_atomic_int_get(&c->backlog_len)) {
+			g_mutex_lock(c->mutex);
+			bp = g_queue_pop_head(c->backlog);
+			g_atomic_int_add(&c->backlog_len, -1);
+			g_mutex_unlock(c->mutex);
+			return bp;
+		}
+
+		g_mutex_lock(c->mutex);
+		g_atomic_int_set(&c->consumer_waiting, TRUE);
+		while (ring_empty(c) && !g_atomic_int_get(&c->backlog_len))
+			g_cond_wait(c->data_cond, c->mutex);
+		g_atomic_int_set(&c->consumer_waiting, FALSE);
+		g_mutex_unlock(c->mutex);
+	}
+}
+
+static gpointer consumer_thread(gpointer data)
+{
+	struct bus_consumer *c;
+	struct bus_packet *bp;
+	gint64 start;
+
+	c = data;
+	while ((bp = consumer_pop(c))) {
+		start = g_get_monotonic_time();
+		sr_session_deliver(c->cb, bp->dev, &bp->packet, c->accept);
+		sr_session_stats_call(c->stats, bp->queued, start,
+				      g_get_monotonic_time());
+		bus_packet_unref(bp);
+	}
+
+	return NULL;
+}
+
+static void consumer_free(struct bus_consumer *c)
+{
+	g_queue_free(c->backlog);
+	g_mutex_free(c->mutex);
+	g_cond_free(c->data_cond);
+	g_cond_free(c->space_cond);
+	g_free(c->ring);
+	g_free(c);
+}
+
+static struct bus_consumer *consumer_new(sr_datafeed_callback_t cb,
+		int accept, struct sr_stats_callback *stats,
+		unsigned int size)
+{
+	struct bus_consumer *c;
+
+	if (!(c = g_try_malloc0(sizeof(struct bus_consumer)))) {
+		sr_err("bus: %s: consumer malloc failed", __func__);
+		return NULL;
+	}
+
+	if (!(c->ring = g_try_malloc0(size * sizeof(struct bus_packet *)))) {
+		sr_err("bus: %s: ring malloc failed", __func__);
+		g_free(c);
+		return NULL;
+	}
+
+	c->cb = cb;
+	c->accept = accept;
+	c->stats = stats;
+	c->size = size;
+	c->backlog = g_queue_new();
+	c->mutex = g_mutex_new();
+	c->data_cond = g_cond_new();
+	c->space_cond = g_cond_new();
+
+	if (!(c->thread = g_thread_create(consumer_thread, c, TRUE, NULL))) {
+		sr_err("bus: %s: g_thread_create failed", __func__);
+		consumer_free(c);
+		return NULL;
+	}
+
+	return c;
+}
+
+/**
+ * Set up asynchronous datafeed delivery for the current session.
+ *
+ * When enabled, each datafeed callback runs on its own thread, fed through
+ * a bounded queue of 'queue_size' packets. This keeps slow consumers (file
+ * writers, protocol decoders) from stalling the drivers' USB or serial
+ * handling, and spreads the work over several cores.
+ *
+ * Callbacks must then be thread-safe with regard to the rest of the
+ * frontend. A callback may call sr_session_stop(); the drivers are stopped
+ * from the session thread once sr_session_run() notices.
+ *
+ * This must be called before sr_session_start().
+ *
+ * @param queue_size The number of packets each callback's queue can hold.
+ *                   This is rounded up to a power of two. 0 disables
+ *                   asynchronous delivery (the default).
+ * @param overflow What to do when a queue is full, one of
+ *                 SR_BUS_OVERFLOW_BLOCK (wait for the callback to catch up),
+ *                 SR_BUS_OVERFLOW_DROP (drop and count sample data packets)
+ *                 or SR_BUS_OVERFLOW_SPILL (queue them up in an unbounded
+ *                 backlog).
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_BUG if no session exists or it is already running.
+ */
+SR_API int sr_session_datafeed_async_set(unsigned int queue_size,
+					 int overflow)
+{
+	unsigned int size;
+
+	if (!session) {
+		sr_err("bus: %s: session was NULL", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (session->bus_consumers) {
+		sr_err("bus: %s: session is already running", __func__);
+		return SR_ERR_BUG;
+	}
+
+	if (overflow != SR_BUS_OVERFLOW_BLOCK && overflow != SR_BUS_OVERFLOW_DROP
+	    && overflow != SR_BUS_OVERFLOW_SPILL) {
+		sr_err("bus: %s: invalid overflow policy %d", __func__, overflow);
+		return SR_ERR_ARG;
+	}
+
+	for (size = queue_size ? 1 : 0; size && size < queue_size; size <<= 1)
+		;
+
+	session->bus_queue_size = size;
+	session->bus_overflow = overflow;
+
+	return SR_OK;
+}
+
+/**
+ * Start one consumer thread per datafeed callback, if the session is set
+ * up for asynchronous delivery.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon errors.
+ */
+SR_PRIV int sr_session_bus_start(void)
+{
+	struct bus_consumer *c;
+	GSList *l, *s;
+
+	if (!session->bus_queue_size || session->bus_consumers)
+		return SR_OK;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	s = session->stats.callbacks;
+	for (l = session->datafeed_callbacks; l; l = l->next, s = s->next) {
+		if (!(c = consumer_new(l->data,
+				       sr_session_callback_accepts(l->data),
+				       s->data, session->bus_queue_size))) {
+			sr_session_bus_stop();
+			return SR_ERR_MALLOC;
+		}
+		session->bus_consumers = g_slist_append(session->bus_consumers, c);
+	}
+
+	sr_dbg("bus: started %d consumer threads",
+	       g_slist_length(session->bus_consumers));
+
+	return SR_OK;
+}
+
+/**
+ * Deliver all queued packets, then stop the consumer threads.
+ *
+ * @return SR_OK upon success.
+ */
+SR_PRIV int sr_session_bus_stop(void)
+{
+	struct bus_consumer *c;
+	GSList *l;
+
+	for (l = session->bus_consumers; l; l = l->next) {
+		c = l->data;
+		consumer_push(c, NULL);
+		g_thread_join(c->thread);
+		c->stats->dropped = c->dropped;
+		if (c->dropped)
+			sr_warn("bus: dropped %" PRIu64 " packets for a slow "
+				"datafeed callback", c->dropped);
+		consumer_free(c);
+	}
+	g_slist_free(session->bus_consumers);
+	session->bus_consumers = NULL;
+
+	return SR_OK;
+}
+
+/**
+ * Check whether the calling thread is one of the consumer threads.
+ *
+ * @return TRUE if it is, FALSE otherwise.
+ */
+SR_PRIV gboolean sr_session_bus_is_consumer(void)
+{
+	struct bus_consumer *c;
+	GThread *self;
+	GSList *l;
+
+	self = g_thread_self();
+	for (l = session->bus_consumers; l; l = l->next) {
+		c = l->data;
+		if (c->thread == self)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Queue a packet for all consumer threads.
+ *
+ * @param dev The device the packet comes from.
+ * @param packet The packet. It's copied, or its data is referenced, so the
+ *               caller is free to reuse it when this returns.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon errors.
+ */
+SR_PRIV int sr_session_bus_send(struct sr_dev *dev,
+				struct sr_datafeed_packet *packet)
+{
+	struct bus_packet *bp;
+	GSList *l;
+
+	bp = bus_packet_new(dev, packet,
+			    g_slist_length(session->bus_consumers));
+	if (!bp)
+		return SR_ERR_MALLOC;
+
+	for (l = session->bus_consumers; l; l = l->next)
+		consumer_push(l->data, bp);
+
+	return SR_OK;
+}
@@ -29,6 +29,15 @@
 /* size of payloads sent across the session bus */
 #define CHUNKSIZE (512 * 1024)
 
+/* Number of payloads a reader thread may decompress ahead. */
+#define PREFETCH_DEPTH 8
+
+struct prefetch_item {
+	struct sr_buffer *buf;
+	uint64_t offset;
+	uint64_t length;
+};
+
 struct session_vdev {
 	char *capturefile;
 	struct zip *archive;
@@ -37,6 +46,33 @@ struct session_vdev {
 	uint64_t samplerate;
 	int unitsize;
 	int num_probes;
+	/* Playback range, set by SR_HWCAP_CAPTURE_START/LIMIT_SAMPLES. */
+	uint64_t start;
+	uint64_t limit_samples;
+	uint64_t skip_bytes;
+	uint64_t bytes_left;
+	/*
+	 * Version 2 session files store the capture file as chunk members
+	 * <capturefile>-1, <capturefile>-2, ... with an index in
+	 * <capturefile>-index. NULL for version 1 files.
+	 */
+	GArray *chunks;
+	unsigned int cur_chunk;
+	/*
+	 * Each capture file has a reader thread, which decompresses ahead
+	 * into a ring of PREFETCH_DEPTH payloads while receive_data() sends
+	 * them out. Once it runs, the capture file (archive, capfile,
+	 * chunks) and the playback range are only touched by the reader
+	 * thread. The ring is protected by 'mutex'.
+	 */
+	GThread *reader;
+	GMutex *mutex;
+	GCond *cond;
+	struct prefetch_item items[PREFETCH_DEPTH];
+	unsigned int head;
+	unsigned int count;
+	gboolean eof;
+	gboolean stop;
 };
 
 static char *sessionfile = NULL;
@@ -44,6 +80,8 @@ static GSList *dev_insts = NULL;
 static const int hwcaps[] = {
 	SR_HWCAP_CAPTUREFILE,
 	SR_HWCAP_CAPTURE_UNITSIZE,
+	SR_HWCAP_CAPTURE_START,
+	SR_HWCAP_LIMIT_SAMPLES,
 	0,
 };
 
@@ -72,6 +110,288 @@ static struct session_vdev *get_vdev_by_index(int dev_index)
 	return vdev;
 }
 
+static void reader_stop(struct session_vdev *vdev)
+{
+	struct prefetch_item *item;
+
+	if (!vdev->reader)
+		return;
+
+	g_mutex_lock(vdev->mutex);
+	vdev->stop = TRUE;
+	g_cond_signal(vdev->cond);
+	g_mutex_unlock(vdev->mutex);
+	g_thread_join(vdev->reader);
+	vdev->reader = NULL;
+
+	/* Drop whatever wasn't sent out. */
+	while (vdev->count > 0) {
+		item = &vdev->items[vdev->head];
+		sr_buffer_unref(item->buf);
+		vdev->head = (vdev->head + 1) % PREFETCH_DEPTH;
+		vdev->count--;
+	}
+}
+
+static void vdev_free(struct session_vdev *vdev)
+{
+	reader_stop(vdev);
+	if (vdev->mutex)
+		g_mutex_free(vdev->mutex);
+	if (vdev->cond)
+		g_cond_free(vdev->cond);
+	if (vdev->capfile)
+		zip_fclose(vdev->capfile);
+	if (vdev->archive)
+		zip_close(vdev->archive);
+	if (vdev->chunks)
+		g_array_free(vdev->chunks, TRUE);
+	g_free(vdev->capturefile);
+	g_free(vdev);
+}
+
+static int vdev_archive_open(struct session_vdev *vdev)
+{
+	int ret;
+
+	if (vdev->archive)
+		return SR_OK;
+
+	if (!(vdev->archive = zip_open(sessionfile, 0, &ret))) {
+		sr_err("session driver: Failed to open session file '%s': "
+		       "zip error %d\n", sessionfile, ret);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/*
+ * Load the capture file's chunk index, if it has one (i.e. the session file
+ * is version 2 or later).
+ */
+static int vdev_index_load(struct session_vdev *vdev)
+{
+	struct zip_stat zs;
+	struct zip_file *zf;
+	struct sr_capture_chunk chunk;
+	uint8_t *buf;
+	uint64_t i;
+	char *name;
+
+	if (vdev_archive_open(vdev) != SR_OK)
+		return SR_ERR;
+
+	if (vdev->chunks) {
+		g_array_free(vdev->chunks, TRUE);
+		vdev->chunks = NULL;
+	}
+
+	name = g_strdup_printf("%s-index", vdev->capturefile);
+	if (zip_stat(vdev->archive, name, 0, &zs) == -1) {
+		/* Version 1, the capture file is a single member. */
+		g_free(name);
+		return SR_OK;
+	}
+	g_free(name);
+
+	if (!(buf = g_try_malloc(zs.size + 1))) {
+		sr_err("session driver: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	if (!(zf = zip_fopen_index(vdev->archive, zs.index, 0))
+	    || zip_fread(zf, buf, zs.size) != (zip_int64_t)zs.size) {
+		sr_err("session driver: Failed to read the index of capture "
+		       "file '%s'.", vdev->capturefile);
+		if (zf)
+			zip_fclose(zf);
+		g_free(buf);
+		return SR_ERR;
+	}
+	zip_fclose(zf);
+
+	vdev->chunks = g_array_sized_new(FALSE, FALSE,
+			sizeof(struct sr_capture_chunk),
+			zs.size / SESSION_FILE_INDEX_ENTRY_SIZE);
+	for (i = 0; i + SESSION_FILE_INDEX_ENTRY_SIZE <= zs.size;
+	     i += SESSION_FILE_INDEX_ENTRY_SIZE) {
+		sr_session_file_index_entry_read(buf + i, &chunk);
+		g_array_append_val(vdev->chunks, chunk);
+	}
+	g_free(buf);
+
+	sr_dbg("session driver: capture file '%s' has %u chunks",
+	       vdev->capturefile, vdev->chunks->len);
+
+	return SR_OK;
+}
+
+/* Find the chunk holding the given sample, by binary search. */
+static unsigned int vdev_chunk_find(const struct session_vdev *vdev,
+				    uint64_t sample)
+{
+	const struct sr_capture_chunk *chunk;
+	unsigned int lo, hi, mid;
+
+	lo = 0;
+	hi = vdev->chunks->len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		chunk = &g_array_index(vdev->chunks, struct sr_capture_chunk, mid);
+		if (sample < chunk->start)
+			hi = mid;
+		else if (sample >= chunk->start + chunk->num_samples)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+
+	/* Past the end. */
+	return vdev->chunks->len;
+}
+
+/*
+ * Read the next part of the capture file. In version 2 files, this moves
+ * on to the next chunk member when the current one is done.
+ *
+ * Returns the number of bytes read, 0 at the end of the capture file, or
+ * -1 upon errors.
+ */
+static int vdev_read(struct session_vdev *vdev, uint8_t *buf, int len)
+{
+	char *name;
+	int ret;
+
+	while (TRUE) {
+		if (!vdev->capfile) {
+			if (!vdev->chunks || vdev->cur_chunk >= vdev->chunks->len)
+				return 0;
+			name = g_strdup_printf("%s-%u", vdev->capturefile,
+					       vdev->cur_chunk + 1);
+			vdev->capfile = zip_fopen(vdev->archive, name, 0);
+			if (!vdev->capfile) {
+				sr_err("session driver: Failed to open chunk "
+				       "'%s' in session file '%s'.", name,
+				       sessionfile);
+				g_free(name);
+				return -1;
+			}
+			g_free(name);
+		}
+
+		ret = zip_fread(vdev->capfile, buf, len);
+		if (ret != 0 || !vdev->chunks)
+			return ret;
+
+		/* Done with this chunk. */
+		zip_fclose(vdev->capfile);
+		vdev->capfile = NULL;
+		vdev->cur_chunk++;
+	}
+}
+
+static gpointer reader_thread(gpointer data)
+{
+	struct session_vdev *vdev;
+	struct prefetch_item *item;
+	struct sr_buffer *buf;
+	uint64_t skip, length;
+	gboolean stop;
+	int ret;
+
+	vdev = data;
+	while (vdev->bytes_left > 0) {
+		/* Wait for room in the ring. */
+		g_mutex_lock(vdev->mutex);
+		while (vdev->count == PREFETCH_DEPTH && !vdev->stop)
+			g_cond_wait(vdev->cond, vdev->mutex);
+		stop = vdev->stop;
+		g_mutex_unlock(vdev->mutex);
+		if (stop)
+			break;
+
+		if (!(buf = sr_session_buffer_get(CHUNKSIZE))) {
+			sr_err("session driver: %s: buf malloc failed",
+			       __func__);
+			break;
+		}
+
+		if ((ret = vdev_read(vdev, buf->data, CHUNKSIZE)) <= 0) {
+			/* done with this capture file */
+			sr_buffer_unref(buf);
+			break;
+		}
+
+		/* Drop whatever comes before the start sample. */
+		skip = MIN((uint64_t)ret, vdev->skip_bytes);
+		vdev->skip_bytes -= skip;
+		length = MIN(ret - skip, vdev->bytes_left);
+		vdev->bytes_left -= length;
+		if (length == 0) {
+			sr_buffer_unref(buf);
+			continue;
+		}
+
+		g_mutex_lock(vdev->mutex);
+		item = &vdev->items[(vdev->head + vdev->count) % PREFETCH_DEPTH];
+		item->buf = buf;
+		item->offset = skip;
+		item->length = length;
+		vdev->count++;
+		g_cond_signal(vdev->cond);
+		g_mutex_unlock(vdev->mutex);
+	}
+
+	g_mutex_lock(vdev->mutex);
+	vdev->eof = TRUE;
+	g_cond_signal(vdev->cond);
+	g_mutex_unlock(vdev->mutex);
+
+	return NULL;
+}
+
+/*
+ * Get the next payload from the capture file's reader thread, waiting for
+ * it if necessary. Returns FALSE once the capture file is done.
+ */
+static gboolean reader_pop(struct session_vdev *vdev,
+			   struct prefetch_item *item)
+{
+	gboolean ret;
+
+	g_mutex_lock(vdev->mutex);
+	while (vdev->count == 0 && !vdev->eof)
+		g_cond_wait(vdev->cond, vdev->mutex);
+	if ((ret = (vdev->count > 0))) {
+		*item = vdev->items[vdev->head];
+		vdev->head = (vdev->head + 1) % PREFETCH_DEPTH;
+		vdev->count--;
+		g_cond_signal(vdev->cond);
+	}
+	g_mutex_unlock(vdev->mutex);
+
+	return ret;
+}
+
+static int reader_start(struct session_vdev *vdev)
+{
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	vdev->mutex = g_mutex_new();
+	vdev->cond = g_cond_new();
+	vdev->head = vdev->count = 0;
+	vdev->eof = vdev->stop = FALSE;
+
+	if (!(vdev->reader = g_thread_create(reader_thread, vdev, TRUE,
+					     NULL))) {
+		sr_err("session driver: %s: g_thread_create failed", __func__);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
 /**
  * TODO.
  *
@@ -87,9 +407,9 @@ static int receive_data(int fd, int revents, void *cb_data)
 	struct session_vdev *vdev;
 	struct sr_datafeed_packet packet;
 	struct sr_datafeed_logic logic;
+	struct prefetch_item item;
 	GSList *l;
-	void *buf;
-	int ret, got_data;
+	int got_data;
 
 	/* Avoid compiler warnings. */
 	(void)fd;
@@ -105,27 +425,20 @@ static int receive_data(int fd, int revents, void *cb_data)
 			/* already done with this instance */
 			continue;
 
-		if (!(buf = g_try_malloc(CHUNKSIZE))) {
-			sr_err("session driver: %s: buf malloc failed",
-			       __func__);
-			return FALSE; /* TODO: SR_ERR_MALLOC */
-		}
-
-		ret = zip_fread(vdev->capfile, buf, CHUNKSIZE);
-		if (ret > 0) {
+		if (reader_pop(vdev, &item)) {
 			got_data = TRUE;
 			packet.type = SR_DF_LOGIC;
 			packet.payload = &logic;
-			logic.length = ret;
+			logic.length = item.length;
 			logic.unitsize = vdev->unitsize;
-			logic.data = buf;
-			vdev->bytes_read += ret;
+			logic.data = item.buf->data + item.offset;
+			logic.buffer = item.buf;
+			vdev->bytes_read += item.length;
 			sr_session_send(cb_data, &packet);
+			sr_buffer_unref(item.buf);
 		} else {
 			/* done with this capture file */
-			zip_fclose(vdev->capfile);
-			g_free(vdev->capturefile);
-			g_free(vdev);
+			vdev_free(vdev);
 			sdi->priv = NULL;
 		}
 	}
@@ -160,10 +473,17 @@ static int hw_init(const char *devinfo)
  */
 static int hw_cleanup(void)
 {
+	struct sr_dev_inst *sdi;
 	GSList *l;
 
-	for (l = dev_insts; l; l = l->next)
-		sr_dev_inst_free(l->data);
+	for (l = dev_insts; l; l = l->next) {
+		sdi = l->data;
+		if (sdi->priv) {
+			vdev_free(sdi->priv);
+			sdi->priv = NULL;
+		}
+		sr_dev_inst_free(sdi);
+	}
 	g_slist_free(dev_insts);
 	dev_insts = NULL;
 
@@ -198,13 +518,19 @@ static const void *hw_dev_info_get(int dev_index, int dev_info_id)
 	struct session_vdev *vdev;
 	void *info;
 
-	if (dev_info_id != SR_DI_CUR_SAMPLERATE)
-		return NULL;
-
 	if (!(vdev = get_vdev_by_index(dev_index)))
 		return NULL;
 
-	info = &vdev->samplerate;
+	switch (dev_info_id) {
+	case SR_DI_CUR_SAMPLERATE:
+		info = &vdev->samplerate;
+		break;
+	case SR_DI_CAPTURE_CHUNKS:
+		info = vdev->chunks;
+		break;
+	default:
+		info = NULL;
+	}
 
 	return info;
 }
@@ -247,10 +573,11 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 		        vdev->samplerate);
 		break;
 	case SR_HWCAP_CAPTUREFILE:
+		g_free(vdev->capturefile);
 		vdev->capturefile = g_strdup(value);
 		sr_info("session driver: setting capturefile to %s",
 		        vdev->capturefile);
-		break;
+		return vdev_index_load(vdev);
 	case SR_HWCAP_CAPTURE_UNITSIZE:
 		tmp_u64 = value;
 		vdev->unitsize = *tmp_u64;
@@ -259,6 +586,14 @@ static int hw_dev_config_set(int dev_index, int hwcap, const void *value)
 		tmp_u64 = value;
 		vdev->num_probes = *tmp_u64;
 		break;
+	case SR_HWCAP_CAPTURE_START:
+		tmp_u64 = value;
+		vdev->start = *tmp_u64;
+		break;
+	case SR_HWCAP_LIMIT_SAMPLES:
+		tmp_u64 = value;
+		vdev->limit_samples = *tmp_u64;
+		break;
 	default:
 		sr_err("session driver: %s: unknown capability %d requested",
 		       __func__, hwcap);
@@ -275,7 +610,7 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	struct sr_datafeed_header *header;
 	struct sr_datafeed_packet *packet;
 	struct sr_datafeed_meta_logic meta;
-	int ret;
+	const struct sr_capture_chunk *chunk;
 
 	if (!(vdev = get_vdev_by_index(dev_index)))
 		return SR_ERR;
@@ -283,23 +618,41 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	sr_info("session_driver: opening archive %s file %s", sessionfile,
 		vdev->capturefile);
 
-	if (!(vdev->archive = zip_open(sessionfile, 0, &ret))) {
-		sr_err("session driver: Failed to open session file '%s': "
-		       "zip error %d\n", sessionfile, ret);
+	if (vdev_archive_open(vdev) != SR_OK)
 		return SR_ERR;
-	}
 
-	if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
-		sr_err("session driver: Failed to check capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, sessionfile);
-		return SR_ERR;
+	vdev->skip_bytes = vdev->start * vdev->unitsize;
+	vdev->bytes_left = vdev->limit_samples ?
+			vdev->limit_samples * vdev->unitsize : UINT64_MAX;
+
+	if (vdev->chunks) {
+		/* Jump straight to the chunk holding the start sample. */
+		vdev->cur_chunk = vdev_chunk_find(vdev, vdev->start);
+		if (vdev->cur_chunk < vdev->chunks->len) {
+			chunk = &g_array_index(vdev->chunks,
+					struct sr_capture_chunk, vdev->cur_chunk);
+			vdev->skip_bytes = (vdev->start - chunk->start)
+					* vdev->unitsize;
+		}
+	} else {
+		if (zip_stat(vdev->archive, vdev->capturefile, 0, &zs) == -1) {
+			sr_err("session driver: Failed to check capture file "
+			       "'%s' in session file '%s'.", vdev->capturefile,
+			       sessionfile);
+			return SR_ERR;
+		}
+
+		if (!(vdev->capfile = zip_fopen(vdev->archive,
+						vdev->capturefile, 0))) {
+			sr_err("session driver: Failed to open capture file "
+			       "'%s' in session file '%s'.", vdev->capturefile,
+			       sessionfile);
+			return SR_ERR;
+		}
 	}
 
-	if (!(vdev->capfile = zip_fopen(vdev->archive, vdev->capturefile, 0))) {
-		sr_err("session driver: Failed to open capture file '%s' in "
-		       "session file '%s'.", vdev->capturefile, sessionfile);
+	if (reader_start(vdev) != SR_OK)
 		return SR_ERR;
-	}
 
 	/* freewheeling source */
 	sr_session_source_add(-1, 0, 0, receive_data, cb_data);
@@ -334,6 +687,25 @@ static int hw_dev_acquisition_start(int dev_index, void *cb_data)
 	return SR_OK;
 }
 
+static int hw_dev_acquisition_stop(int dev_index, void *cb_data)
+{
+	struct sr_dev_inst *sdi;
+
+	/* Avoid compiler warnings. */
+	(void)cb_data;
+
+	if (!(sdi = sr_dev_inst_get(dev_insts, dev_index)))
+		return SR_ERR;
+
+	/* Stops the reader thread; a no-op if replay is already done. */
+	if (sdi->priv) {
+		vdev_free(sdi->priv);
+		sdi->priv = NULL;
+	}
+
+	return SR_OK;
+}
+
 SR_PRIV struct sr_dev_driver session_driver = {
 	.name = "session",
 	.longname = "Session-emulating driver",
@@ -347,5 +719,5 @@ SR_PRIV struct sr_dev_driver session_driver = {
 	.hwcap_get_all = hw_hwcap_get_all,
 	.dev_config_set = hw_dev_config_set,
 	.dev_acquisition_start = hw_dev_acquisition_start,
-	.dev_acquisition_stop = NULL,
+	.dev_acquisition_stop = hw_dev_acquisition_stop,
 };
@@ -20,9 +20,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <zip.h>
 #include <glib.h>
 #include <glib/gstdio.h>
+#include <zlib.h>
 #include "config.h"
 #include "libsigrok.h"
 #include "libsigrok-internal.h"
@@ -69,8 +72,9 @@ SR_API int sr_session_load(const char *filename)
 		sr_dbg("session file: Not a sigrok session file.");
 		return SR_ERR;
 	}
+	/* Version 2 only adds chunked capture files, see session_driver.c. */
 	ret = zip_fread(zf, &c, 1);
-	if (ret != 1 || c != '1') {
+	if (ret != 1 || (c != '1' && c != '2')) {
 		sr_dbg("session file: Not a valid sigrok session file.");
 		return SR_ERR;
 	}
@@ -158,9 +162,431 @@ SR_API int sr_session_load(const char *filename)
 	return SR_OK;
 }
 
+/* Size of the buffer compressed data is staged in before writing it out. */
+#define SAVE_ZBUF_SIZE (64 * 1024)
+
+/* Compression runs while capturing, so speed matters more than size. */
+#define SAVE_COMPRESSION Z_BEST_SPEED
+
+/* zlib takes at most this many bytes of input per call. */
+#define SAVE_MAX_INPUT (1 << 30)
+
+/*
+ * A chunk member of a session file. While it's built up, 'or_mask' and
+ * 'and_mask' collect the summary of its samples.
+ */
+struct save_chunk {
+	uint64_t start;
+	uint64_t num_samples;
+	uint64_t or_mask;
+	uint64_t and_mask;
+	/* Streaming writer only: the deflated chunk in the temporary file. */
+	uint32_t crc;
+	uint64_t offset;
+	uint64_t comp_size;
+	uint64_t pos;
+};
+
+/*
+ * State of the session file being written by sr_session_save_begin() and
+ * friends. Like the session itself, there's only one of these.
+ */
+static struct {
+	struct zip *archive;
+	GString *meta;
+	int unitsize;
+	/* Deflated chunks, waiting for sr_session_save_end(). */
+	char *tmpname;
+	int tmpfd;
+	z_stream zs;
+	uint8_t *zbuf;
+	GArray *chunks;
+	struct save_chunk cur;
+	uint64_t size;
+	uint64_t comp_size;
+	int failed;
+	int error;
+} save;
+
+/* Feeds a datastore chunk to libzip, without copying it first. */
+struct ds_source {
+	const struct sr_datastore *ds;
+	unsigned int chunk;
+	uint64_t offset;
+};
+
+/**
+ * Store a chunk index entry, in the format used in session files.
+ *
+ * @param buf Where to store the entry; SESSION_FILE_INDEX_ENTRY_SIZE bytes.
+ * @param chunk The chunk summary.
+ */
+SR_PRIV void sr_session_file_index_entry_write(uint8_t *buf,
+		const struct sr_capture_chunk *chunk)
+{
+	uint64_t fields[5];
+	int i, j;
+
+	fields[0] = chunk->start;
+	fields[1] = chunk->num_samples;
+	fields[2] = chunk->zero_mask;
+	fields[3] = chunk->one_mask;
+	fields[4] = chunk->transition_mask;
+
+	/* All little-endian. */
+	for (i = 0; i < 5; i++)
+		for (j = 0; j < 8; j++)
+			*buf++ = fields[i] >> (j * 8);
+}
+
+/**
+ * Parse a chunk index entry, as stored in session files.
+ *
+ * @param buf The entry; SESSION_FILE_INDEX_ENTRY_SIZE bytes.
+ * @param chunk The chunk summary to fill in.
+ */
+SR_PRIV void sr_session_file_index_entry_read(const uint8_t *buf,
+		struct sr_capture_chunk *chunk)
+{
+	uint64_t fields[5];
+	int i, j;
+
+	for (i = 0; i < 5; i++) {
+		fields[i] = 0;
+		for (j = 0; j < 8; j++)
+			fields[i] |= (uint64_t)*buf++ << (j * 8);
+	}
+
+	chunk->start = fields[0];
+	chunk->num_samples = fields[1];
+	chunk->zero_mask = fields[2];
+	chunk->one_mask = fields[3];
+	chunk->transition_mask = fields[4];
+}
+
+static void chunk_init(struct save_chunk *chunk, uint64_t start)
+{
+	memset(chunk, 0, sizeof(struct save_chunk));
+	chunk->start = start;
+	chunk->and_mask = ~(uint64_t)0;
+}
+
+/*
+ * Add 'length' bytes of samples to the chunk's summary. The samples are
+ * OR'ed resp. AND'ed together, 8 bytes at a time where the unit size
+ * allows it, and then folded down to a single unit (of at most 8 bytes).
+ */
+static void chunk_summarize(struct save_chunk *chunk, const uint8_t *buf,
+			    uint64_t length, int unitsize)
+{
+	uint64_t w, or_w, and_w, i, or_mask, and_mask;
+	uint8_t or_b[8], and_b[8], tmp[8];
+	int b;
+
+	or_w = 0;
+	and_w = ~(uint64_t)0;
+	i = 0;
+	if (8 % unitsize == 0) {
+		for (; i + 8 <= length; i += 8) {
+			memcpy(&w, buf + i, 8);
+			or_w |= w;
+			and_w &= w;
+		}
+	}
+
+	memset(or_b, 0, sizeof(or_b));
+	memset(and_b, 0xff, sizeof(and_b));
+	/* 'i' is a multiple of the unit size here. */
+	memcpy(tmp, &or_w, 8);
+	for (b = 0; b < 8; b++)
+		or_b[b % unitsize] |= tmp[b];
+	memcpy(tmp, &and_w, 8);
+	for (b = 0; b < 8; b++)
+		and_b[b % unitsize] &= tmp[b];
+	for (b = 0; i < length; i++, b = (b + 1) % unitsize) {
+		or_b[b] |= buf[i];
+		and_b[b] &= buf[i];
+	}
+
+	or_mask = 0;
+	and_mask = 0;
+	for (b = 0; b < unitsize; b++) {
+		or_mask |= (uint64_t)or_b[b] << (b * 8);
+		and_mask |= (uint64_t)and_b[b] << (b * 8);
+	}
+	chunk->or_mask |= or_mask;
+	chunk->and_mask &= and_mask;
+	chunk->num_samples += length / unitsize;
+}
+
+static void chunk_summary_get(const struct save_chunk *chunk, int unitsize,
+			      struct sr_capture_chunk *summary)
+{
+	uint64_t probes;
+
+	probes = unitsize >= 8 ? ~(uint64_t)0
+			       : ((uint64_t)1 << (unitsize * 8)) - 1;
+	summary->start = chunk->start;
+	summary->num_samples = chunk->num_samples;
+	summary->zero_mask = ~chunk->or_mask & probes;
+	summary->one_mask = chunk->and_mask & probes;
+	summary->transition_mask = chunk->or_mask & ~chunk->and_mask & probes;
+}
+
+static struct zip *archive_create(const char *filename)
+{
+	struct zip *archive;
+	struct zip_source *versrc;
+	int ret;
+
+	/* Quietly delete it first, libzip wants replace ops otherwise. */
+	unlink(filename);
+	if (!(archive = zip_open(filename, ZIP_CREATE, &ret))) {
+		sr_err("session file: failed to create %s: zip error %d",
+		       filename, ret);
+		return NULL;
+	}
+
+	/* "version" */
+	if (!(versrc = zip_source_buffer(archive, "2", 1, 0))
+	    || zip_add(archive, "version", versrc) == -1) {
+		sr_err("session file: error saving version into zipfile: %s",
+		       zip_strerror(archive));
+		if (versrc)
+			zip_source_free(versrc);
+		zip_close(archive);
+		return NULL;
+	}
+
+	return archive;
+}
+
+/* libzip frees the buffer when it's done with it, or upon errors. */
+static int archive_add_buffer(struct zip *archive, const char *name,
+			      void *buf, uint64_t len)
+{
+	struct zip_source *src;
+
+	if (!(src = zip_source_buffer(archive, buf, len, TRUE))) {
+		g_free(buf);
+		return SR_ERR;
+	}
+	if (zip_add(archive, name, src) == -1) {
+		sr_err("session file: error saving %s into zipfile: %s",
+		       name, zip_strerror(archive));
+		zip_source_free(src);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+static int archive_add_meta(struct zip *archive, GString *meta)
+{
+	gsize len;
+
+	len = meta->len;
+
+	return archive_add_buffer(archive, "metadata",
+				  g_string_free(meta, FALSE), len);
+}
+
+/* Write the chunk index of capture file 'capturefile'. */
+static int archive_add_index(struct zip *archive, const char *capturefile,
+			     const struct sr_capture_chunk *chunks,
+			     unsigned int num_chunks)
+{
+	unsigned int i;
+	uint8_t *buf;
+	char name[32];
+
+	if (!(buf = g_try_malloc(num_chunks * SESSION_FILE_INDEX_ENTRY_SIZE + 1))) {
+		sr_err("session file: %s: buf malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	for (i = 0; i < num_chunks; i++)
+		sr_session_file_index_entry_write(
+			buf + i * SESSION_FILE_INDEX_ENTRY_SIZE, &chunks[i]);
+
+	snprintf(name, sizeof(name), "%s-index", capturefile);
+
+	return archive_add_buffer(archive, name, buf,
+				  num_chunks * SESSION_FILE_INDEX_ENTRY_SIZE);
+}
+
+static void meta_add_global(GString *meta)
+{
+	g_string_append(meta, "[global]\n");
+	g_string_append_printf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
+	/* TODO: save protocol decoders used */
+}
+
+/*
+ * Describe a device in the metadata. If 'unitsize' is 0, the device has no
+ * capture in this session file.
+ */
+static void meta_add_dev(GString *meta, const struct sr_dev *dev, int devcnt,
+			 int unitsize)
+{
+	const struct sr_probe *probe;
+	GSList *p;
+	uint64_t samplerate;
+	int probecnt;
+	char *s;
+
+	g_string_append_printf(meta, "[device %d]\n", devcnt);
+	if (dev->driver)
+		g_string_append_printf(meta, "driver = %s\n", dev->driver->name);
+
+	if (!unitsize)
+		return;
+
+	g_string_append_printf(meta, "capturefile = logic-%d\n", devcnt);
+	g_string_append_printf(meta, "unitsize = %d\n", unitsize);
+	g_string_append_printf(meta, "total probes = %d\n",
+			       g_slist_length(dev->probes));
+	if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
+		samplerate = *((uint64_t *) dev->driver->dev_info_get(
+				dev->driver_index, SR_DI_CUR_SAMPLERATE));
+		s = sr_samplerate_string(samplerate);
+		g_string_append_printf(meta, "samplerate = %s\n", s);
+		g_free(s);
+	}
+	probecnt = 1;
+	for (p = dev->probes; p; p = p->next) {
+		probe = p->data;
+		if (probe->enabled) {
+			if (probe->name)
+				g_string_append_printf(meta, "probe%d = %s\n",
+						       probecnt, probe->name);
+			if (probe->trigger)
+				g_string_append_printf(meta, " trigger%d = %s\n",
+						       probecnt, probe->trigger);
+			probecnt++;
+		}
+	}
+}
+
+static zip_int64_t ds_source_cb(void *state, void *data, zip_uint64_t len,
+				enum zip_source_cmd cmd)
+{
+	struct ds_source *src;
+	struct zip_stat *st;
+	const void *chunk;
+	uint64_t num_units, chunk_size;
+	int *err;
+
+	src = state;
+	switch (cmd) {
+	case ZIP_SOURCE_OPEN:
+		src->offset = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		/* Chunk pointers don't outlive puts, don't keep them. */
+		if (sr_datastore_chunk_get(src->ds, src->chunk, &chunk,
+					   &num_units) != SR_OK)
+			return -1;
+		chunk_size = num_units * src->ds->ds_unitsize;
+		len = MIN(len, chunk_size - src->offset);
+		memcpy(data, (const uint8_t *)chunk + src->offset, len);
+		src->offset += len;
+		return len;
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT:
+		if (len < sizeof(struct zip_stat))
+			return -1;
+		if (sr_datastore_chunk_get(src->ds, src->chunk, &chunk,
+					   &num_units) != SR_OK)
+			return -1;
+		st = data;
+		zip_stat_init(st);
+		st->valid |= ZIP_STAT_SIZE | ZIP_STAT_MTIME;
+		st->size = num_units * src->ds->ds_unitsize;
+		st->mtime = time(NULL);
+		return sizeof(struct zip_stat);
+	case ZIP_SOURCE_ERROR:
+		if (len < 2 * sizeof(int))
+			return -1;
+		err = data;
+		err[0] = err[1] = 0;
+		return 2 * sizeof(int);
+	case ZIP_SOURCE_FREE:
+		g_free(src);
+		return 0;
+	}
+
+	return -1;
+}
+
+/* Add a datastore's chunks to the archive, plus their index. */
+static int archive_add_datastore(struct zip *archive, int devcnt,
+				 const struct sr_datastore *ds)
+{
+	struct ds_source *src;
+	struct zip_source *logicsrc;
+	struct save_chunk chunk;
+	struct sr_capture_chunk *summaries;
+	const void *data;
+	uint64_t num_units;
+	unsigned int i;
+	int ret;
+	char name[32];
+
+	/* The chunk summaries have room for 64 probes. */
+	if (ds->ds_unitsize > 8) {
+		sr_err("session file: %s: unitsize %d too large", __func__,
+		       ds->ds_unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (!(summaries = g_try_malloc((ds->num_chunks + 1)
+				       * sizeof(struct sr_capture_chunk)))) {
+		sr_err("session file: %s: summaries malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+
+	for (i = 0; i < ds->num_chunks; i++) {
+		sr_datastore_chunk_get(ds, i, &data, &num_units);
+		chunk_init(&chunk, (uint64_t)i * SESSION_FILE_CHUNKSIZE);
+		chunk_summarize(&chunk, data, num_units * ds->ds_unitsize,
+				ds->ds_unitsize);
+		chunk_summary_get(&chunk, ds->ds_unitsize, &summaries[i]);
+
+		if (!(src = g_try_malloc0(sizeof(struct ds_source)))) {
+			sr_err("session file: %s: src malloc failed", __func__);
+			g_free(summaries);
+			return SR_ERR_MALLOC;
+		}
+		src->ds = ds;
+		src->chunk = i;
+		if (!(logicsrc = zip_source_function(archive, ds_source_cb,
+						     src))) {
+			g_free(src);
+			g_free(summaries);
+			return SR_ERR;
+		}
+		snprintf(name, sizeof(name), "logic-%d-%u", devcnt, i + 1);
+		if (zip_add(archive, name, logicsrc) == -1) {
+			zip_source_free(logicsrc);
+			g_free(summaries);
+			return SR_ERR;
+		}
+	}
+
+	snprintf(name, sizeof(name), "logic-%d", devcnt);
+	ret = archive_add_index(archive, name, summaries, ds->num_chunks);
+	g_free(summaries);
+
+	return ret;
+}
+
 /**
  * Save the current session to the specified file.
  *
+ * The devices' datastores are compressed straight into the file, so this
+ * needs no more memory than the datastores already take up.
+ *
  * @param filename The name of the file where to save the current session.
  *                 Must not be NULL.
  *
@@ -169,119 +595,405 @@ SR_API int sr_session_load(const char *filename)
  */
 int sr_session_save(const char *filename)
 {
-	GSList *l, *p, *d;
-	FILE *meta;
+	GSList *l;
+	GString *meta;
 	struct sr_dev *dev;
-	struct sr_probe *probe;
-	struct sr_datastore *ds;
 	struct zip *zipfile;
-	struct zip_source *versrc, *metasrc, *logicsrc;
-	int bufcnt, devcnt, tmpfile, ret, probecnt;
-	uint64_t samplerate;
-	char version[1], rawname[16], metafile[32], *buf, *s;
+	int devcnt;
 
 	if (!filename) {
 		sr_err("session file: %s: filename was NULL", __func__);
 		return SR_ERR_ARG;
 	}
 
-	/* Quietly delete it first, libzip wants replace ops otherwise. */
-	unlink(filename);
-	if (!(zipfile = zip_open(filename, ZIP_CREATE, &ret)))
+	if (!(zipfile = archive_create(filename)))
 		return SR_ERR;
 
-	/* "version" */
-	version[0] = '1';
-	if (!(versrc = zip_source_buffer(zipfile, version, 1, 0)))
+	meta = g_string_sized_new(1024);
+	meta_add_global(meta);
+
+	/* all datastores in all devices */
+	devcnt = 1;
+	for (l = session->devs; l; l = l->next) {
+		dev = l->data;
+		meta_add_dev(meta, dev, devcnt,
+			     dev->datastore ? dev->datastore->ds_unitsize : 0);
+
+		/* dump datastore into logic-n-1, logic-n-2, ... */
+		if (dev->datastore && archive_add_datastore(zipfile, devcnt,
+					dev->datastore) != SR_OK) {
+			g_string_free(meta, TRUE);
+			zip_unchange_all(zipfile);
+			zip_close(zipfile);
+			return SR_ERR;
+		}
+		devcnt++;
+	}
+
+	if (archive_add_meta(zipfile, meta) != SR_OK) {
+		zip_unchange_all(zipfile);
+		zip_close(zipfile);
 		return SR_ERR;
-	if (zip_add(zipfile, "version", versrc) == -1) {
-		sr_info("session file: error saving version into zipfile: %s",
+	}
+
+	if (zip_close(zipfile) == -1) {
+		sr_info("session file: error saving zipfile: %s",
 			zip_strerror(zipfile));
 		return SR_ERR;
 	}
 
-	/* init "metadata" */
-	strcpy(metafile, "sigrok-meta-XXXXXX");
-	if ((tmpfile = g_mkstemp(metafile)) == -1)
-		return SR_ERR;
-	close(tmpfile);
-	meta = g_fopen(metafile, "wb");
-	fprintf(meta, "[global]\n");
-	fprintf(meta, "sigrok version = %s\n", PACKAGE_VERSION);
-	/* TODO: save protocol decoders used */
+	return SR_OK;
+}
 
-	/* all datastores in all devices */
-	devcnt = 1;
-	for (l = session->devs; l; l = l->next) {
-		dev = l->data;
-		/* metadata */
-		fprintf(meta, "[device %d]\n", devcnt);
-		if (dev->driver)
-			fprintf(meta, "driver = %s\n", dev->driver->name);
-
-		ds = dev->datastore;
-		if (ds) {
-			/* metadata */
-			fprintf(meta, "capturefile = logic-%d\n", devcnt);
-			fprintf(meta, "unitsize = %d\n", ds->ds_unitsize);
-			fprintf(meta, "total probes = %d\n", g_slist_length(dev->probes));
-			if (sr_dev_has_hwcap(dev, SR_HWCAP_SAMPLERATE)) {
-				samplerate = *((uint64_t *) dev->driver->dev_info_get(
-						dev->driver_index, SR_DI_CUR_SAMPLERATE));
-				s = sr_samplerate_string(samplerate);
-				fprintf(meta, "samplerate = %s\n", s);
-				g_free(s);
+static void save_cleanup(void)
+{
+	if (save.meta)
+		g_string_free(save.meta, TRUE);
+	if (save.chunks)
+		g_array_free(save.chunks, TRUE);
+	if (save.tmpfd != -1) {
+		close(save.tmpfd);
+		g_unlink(save.tmpname);
+	}
+	g_free(save.tmpname);
+	g_free(save.zbuf);
+	deflateEnd(&save.zs);
+	memset(&save, 0, sizeof(save));
+	save.tmpfd = -1;
+}
+
+/*
+ * Compress 'length' bytes (which may be 0) into the current chunk, and
+ * write the result to the temporary file. With Z_FINISH, this also flushes
+ * out the end of the chunk's deflate stream.
+ */
+static int save_deflate(const uint8_t *buf, uint64_t length, int flush)
+{
+	uint64_t chunk;
+	ssize_t written, bytes, ret;
+	int last;
+
+	do {
+		chunk = MIN(length, SAVE_MAX_INPUT);
+		last = (chunk == length);
+		if (chunk)
+			save.cur.crc = crc32(save.cur.crc, buf, chunk);
+		save.zs.next_in = (Bytef *)buf;
+		save.zs.avail_in = chunk;
+		do {
+			save.zs.next_out = save.zbuf;
+			save.zs.avail_out = SAVE_ZBUF_SIZE;
+			if (deflate(&save.zs, last ? flush : Z_NO_FLUSH)
+			    == Z_STREAM_ERROR) {
+				sr_err("session file: deflate failed");
+				return SR_ERR;
 			}
-			probecnt = 1;
-			for (p = dev->probes; p; p = p->next) {
-				probe = p->data;
-				if (probe->enabled) {
-					if (probe->name)
-						fprintf(meta, "probe%d = %s\n", probecnt, probe->name);
-					if (probe->trigger)
-						fprintf(meta, " trigger%d = %s\n", probecnt, probe->trigger);
-					probecnt++;
+			bytes = SAVE_ZBUF_SIZE - save.zs.avail_out;
+			for (written = 0; written < bytes; written += ret) {
+				ret = write(save.tmpfd, save.zbuf + written,
+					    bytes - written);
+				if (ret == -1) {
+					sr_err("session file: failed to write "
+					       "temporary file: %s",
+					       g_strerror(errno));
+					return SR_ERR;
 				}
 			}
+			save.cur.comp_size += bytes;
+			save.comp_size += bytes;
+		} while (save.zs.avail_out == 0);
+		buf += chunk;
+		length -= chunk;
+	} while (!last);
 
-			/* dump datastore into logic-n */
-			buf = g_try_malloc(ds->num_units * ds->ds_unitsize +
-				   DATASTORE_CHUNKSIZE);
-			if (!buf) {
-				sr_err("session file: %s: buf malloc failed",
-				       __func__);
-				return SR_ERR_MALLOC;
-			}
+	return SR_OK;
+}
 
-			bufcnt = 0;
-			for (d = ds->chunklist; d; d = d->next) {
-				memcpy(buf + bufcnt, d->data,
-				       DATASTORE_CHUNKSIZE);
-				bufcnt += DATASTORE_CHUNKSIZE;
-			}
-			if (!(logicsrc = zip_source_buffer(zipfile, buf,
-				       ds->num_units * ds->ds_unitsize, TRUE)))
-				return SR_ERR;
-			snprintf(rawname, 15, "logic-%d", devcnt);
-			if (zip_add(zipfile, rawname, logicsrc) == -1)
-				return SR_ERR;
+/* Finish the current chunk, and start a new one. */
+static int save_chunk_end(void)
+{
+	if (save_deflate(NULL, 0, Z_FINISH) != SR_OK)
+		return SR_ERR;
+	g_array_append_val(save.chunks, save.cur);
+
+	chunk_init(&save.cur, save.cur.start + save.cur.num_samples);
+	save.cur.crc = crc32(0, NULL, 0);
+	save.cur.offset = save.comp_size;
+	deflateReset(&save.zs);
+
+	return SR_OK;
+}
+
+/*
+ * Hands a deflated chunk to libzip, which copies it into the archive
+ * as-is since we claim it's compressed already.
+ */
+static zip_int64_t save_source_cb(void *state, void *data, zip_uint64_t len,
+				  enum zip_source_cmd cmd)
+{
+	struct save_chunk *chunk;
+	struct zip_stat *st;
+	ssize_t ret;
+	int *err;
+
+	chunk = state;
+	switch (cmd) {
+	case ZIP_SOURCE_OPEN:
+		if (lseek(save.tmpfd, chunk->offset, SEEK_SET) == -1) {
+			save.error = errno;
+			return -1;
 		}
-		devcnt++;
+		chunk->pos = 0;
+		return 0;
+	case ZIP_SOURCE_READ:
+		len = MIN(len, chunk->comp_size - chunk->pos);
+		if ((ret = read(save.tmpfd, data, len)) == -1)
+			save.error = errno;
+		else
+			chunk->pos += ret;
+		return ret;
+	case ZIP_SOURCE_CLOSE:
+		return 0;
+	case ZIP_SOURCE_STAT:
+		if (len < sizeof(struct zip_stat))
+			return -1;
+		st = data;
+		zip_stat_init(st);
+		st->valid |= ZIP_STAT_SIZE | ZIP_STAT_COMP_SIZE
+			| ZIP_STAT_COMP_METHOD | ZIP_STAT_CRC | ZIP_STAT_MTIME;
+		st->size = chunk->num_samples * save.unitsize;
+		st->comp_size = chunk->comp_size;
+		st->comp_method = ZIP_CM_DEFLATE;
+		st->crc = chunk->crc;
+		st->mtime = time(NULL);
+		return sizeof(struct zip_stat);
+	case ZIP_SOURCE_ERROR:
+		if (len < 2 * sizeof(int))
+			return -1;
+		err = data;
+		err[0] = save.error ? ZIP_ER_READ : 0;
+		err[1] = save.error;
+		return 2 * sizeof(int);
+	case ZIP_SOURCE_FREE:
+		return 0;
 	}
-	fclose(meta);
 
-	if (!(metasrc = zip_source_file(zipfile, metafile, 0, -1)))
+	return -1;
+}
+
+/**
+ * Start saving a capture to a session file, while it's being captured.
+ *
+ * Sample data passed to sr_session_save_append() is compressed right away,
+ * and sr_session_save_end() only has to write out the (already compressed)
+ * result. Neither the time this takes at the end of the capture nor the
+ * memory used depends on how long the capture is.
+ *
+ * Only one session file can be written at a time, and it holds only the
+ * capture of a single device.
+ *
+ * @param filename The name of the file to save to. Must not be NULL.
+ *                 An existing file by that name is replaced.
+ * @param dev The device the capture comes from. Its driver, probes and
+ *            samplerate are saved in the file. Must not be NULL.
+ * @param unitsize The size (>= 1) in bytes of a sample, after filtering
+ *                 out disabled probes.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments,
+ *         SR_ERR_MALLOC upon memory allocation errors, or SR_ERR upon
+ *         other errors.
+ */
+SR_API int sr_session_save_begin(const char *filename, struct sr_dev *dev,
+				 int unitsize)
+{
+	if (!filename || !dev) {
+		sr_err("session file: %s: filename/dev was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (unitsize < 1 || unitsize > 8) {
+		sr_err("session file: %s: unitsize %d out of range",
+		       __func__, unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (save.archive) {
+		sr_err("session file: %s: already saving a session", __func__);
 		return SR_ERR;
-	if (zip_add(zipfile, "metadata", metasrc) == -1)
+	}
+
+	memset(&save, 0, sizeof(save));
+	save.tmpfd = -1;
+	if (deflateInit2(&save.zs, SAVE_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+			 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		sr_err("session file: %s: deflateInit2 failed", __func__);
 		return SR_ERR;
+	}
+	chunk_init(&save.cur, 0);
+	save.cur.crc = crc32(0, NULL, 0);
+	save.unitsize = unitsize;
+	save.chunks = g_array_new(FALSE, FALSE, sizeof(struct save_chunk));
 
-	if ((ret = zip_close(zipfile)) == -1) {
-		sr_info("session file: error saving zipfile: %s",
-			zip_strerror(zipfile));
+	if (!(save.zbuf = g_try_malloc(SAVE_ZBUF_SIZE))) {
+		sr_err("session file: %s: zbuf malloc failed", __func__);
+		save_cleanup();
+		return SR_ERR_MALLOC;
+	}
+
+	if ((save.tmpfd = g_file_open_tmp("sigrok-save-XXXXXX",
+					  &save.tmpname, NULL)) == -1) {
+		sr_err("session file: %s: failed to create temporary file",
+		       __func__);
+		save_cleanup();
+		return SR_ERR;
+	}
+
+	save.meta = g_string_sized_new(1024);
+	meta_add_global(save.meta);
+	meta_add_dev(save.meta, dev, 1, unitsize);
+
+	/* Done last, so a failure above doesn't leave a file behind. */
+	if (!(save.archive = archive_create(filename))) {
+		save_cleanup();
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Append sample data to the session file being saved.
+ *
+ * @param buf The samples, packed into the unit size which was passed to
+ *            sr_session_save_begin(). Must not be NULL.
+ * @param length The length of the data in bytes. Must be a multiple of
+ *               the unit size.
+ *
+ * @return SR_OK upon success, SR_ERR_ARG upon invalid arguments, or SR_ERR
+ *         upon other errors (including sr_session_save_begin() not having
+ *         been called).
+ */
+SR_API int sr_session_save_append(const uint8_t *buf, uint64_t length)
+{
+	uint64_t chunk_bytes;
+
+	if (!save.archive) {
+		sr_err("session file: %s: not saving a session", __func__);
+		return SR_ERR;
+	}
+
+	if (!buf) {
+		sr_err("session file: %s: buf was NULL", __func__);
+		return SR_ERR_ARG;
+	}
+
+	if (length % save.unitsize) {
+		sr_err("session file: %s: length %" PRIu64 " is not a multiple "
+		       "of the unitsize %d", __func__, length, save.unitsize);
+		return SR_ERR_ARG;
+	}
+
+	if (save.failed)
 		return SR_ERR;
+
+	while (length > 0) {
+		chunk_bytes = MIN(length, (SESSION_FILE_CHUNKSIZE
+			- save.cur.num_samples) * save.unitsize);
+		chunk_summarize(&save.cur, buf, chunk_bytes, save.unitsize);
+		if (save_deflate(buf, chunk_bytes, Z_NO_FLUSH) != SR_OK
+		    || (save.cur.num_samples == SESSION_FILE_CHUNKSIZE
+			&& save_chunk_end() != SR_OK)) {
+			/* The deflate stream is broken now, don't write it out. */
+			save.failed = TRUE;
+			return SR_ERR;
+		}
+		save.size += chunk_bytes;
+		buf += chunk_bytes;
+		length -= chunk_bytes;
 	}
 
-	unlink(metafile);
+	return SR_OK;
+}
+
+/**
+ * Finish saving the session file started with sr_session_save_begin().
+ *
+ * This is also what has to be done if an error occurred during saving;
+ * in that case the session file is not written.
+ *
+ * @return SR_OK upon success, SR_ERR upon errors.
+ */
+SR_API int sr_session_save_end(void)
+{
+	struct zip_source *logicsrc;
+	struct save_chunk *chunk;
+	struct sr_capture_chunk *summaries;
+	unsigned int i;
+	int ret;
+	char name[32];
+
+	if (!save.archive) {
+		sr_err("session file: %s: not saving a session", __func__);
+		return SR_ERR;
+	}
+
+	if (save.failed)
+		goto fail;
+	if (save.cur.num_samples > 0 && save_chunk_end() != SR_OK)
+		goto fail;
+
+	if (!(summaries = g_try_malloc((save.chunks->len + 1)
+				       * sizeof(struct sr_capture_chunk)))) {
+		sr_err("session file: %s: summaries malloc failed", __func__);
+		goto fail;
+	}
+	for (i = 0; i < save.chunks->len; i++) {
+		chunk = &g_array_index(save.chunks, struct save_chunk, i);
+		chunk_summary_get(chunk, save.unitsize, &summaries[i]);
+		if (!(logicsrc = zip_source_function(save.archive,
+					save_source_cb, chunk))) {
+			g_free(summaries);
+			goto fail;
+		}
+		snprintf(name, sizeof(name), "logic-1-%u", i + 1);
+		if (zip_add(save.archive, name, logicsrc) == -1) {
+			sr_err("session file: error saving %s into zipfile: %s",
+			       name, zip_strerror(save.archive));
+			zip_source_free(logicsrc);
+			g_free(summaries);
+			goto fail;
+		}
+	}
+	ret = archive_add_index(save.archive, "logic-1", summaries,
+				save.chunks->len);
+	g_free(summaries);
+	if (ret != SR_OK)
+		goto fail;
+
+	/* The metadata buffer now belongs to libzip. */
+	ret = archive_add_meta(save.archive, save.meta);
+	save.meta = NULL;
+	if (ret != SR_OK)
+		goto fail;
+
+	if (zip_close(save.archive) == -1) {
+		sr_err("session file: error saving zipfile: %s",
+		       zip_strerror(save.archive));
+		goto fail;
+	}
+	save.archive = NULL;
+	sr_dbg("session file: saved %" PRIu64 " bytes in %u chunks, %" PRIu64
+	       " compressed", save.size, save.chunks->len, save.comp_size);
+	save_cleanup();
 
 	return SR_OK;
+
+fail:
+	/* Throw away everything added so far, no file gets written. */
+	zip_unchange_all(save.archive);
+	zip_close(save.archive);
+	save.archive = NULL;
+	save_cleanup();
+
+	return SR_ERR;
 }
@@ -0,0 +1,800 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include "config.h"
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#define HAVE_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+
+/*
+ * The session's event loop.
+ *
+ * Sources (file descriptors with an optional timeout) are kept in an array
+ * plus a hash table on their poll object, so adding and removing one is
+ * O(1). Sources with a timeout are also kept in a binary heap on their
+ * deadline; each one fires 'timeout' ms after its callback was last run,
+ * independent of all other sources.
+ *
+ * Waiting for events is left to a backend: g_poll() everywhere, or epoll
+ * plus a timerfd for the earliest deadline on Linux. With epoll, the cost
+ * of a wake-up only depends on the number of sources which are ready.
+ */
+
+/* Initial size of the sources array and deadline heap */
+#define LOOP_INITIAL_SIZE 8
+
+/* Max. number of events fetched by a single epoll_wait() */
+#define LOOP_MAX_EVENTS 32
+
+struct source {
+	int timeout;
+	sr_receive_data_callback_t cb;
+	void *cb_data;
+
+	/* This is used to keep track of the object (fd, pollfd or channel) which is
+	 * being polled and will be used to match the source when removing it again.
+	 */
+	gintptr poll_object;
+	GPollFD pollfd;
+	/* Next source with the same poll object, in the order they were added. */
+	struct source *same_next;
+
+	/* Position in the sources array. */
+	unsigned int index;
+	/* Position in the deadline heap, -1 if the source has no timeout. */
+	int heap_index;
+	/* Monotonic time (in us) at which the timeout fires. */
+	gint64 due;
+
+	/*
+	 * Position in the always_ready array (sources called on every
+	 * iteration: fd-less ones without timeout), -1 if not in there.
+	 */
+	int always_index;
+	/* Queued for the current dispatch, with these revents. */
+	gboolean pending;
+	gushort revents;
+	/* Removed while dispatching, freed afterwards. */
+	gboolean removed;
+
+	/* epoll backend: the fd registered (a dup() if shared), or -1. */
+	int epoll_fd;
+	gboolean epoll_dup;
+};
+
+struct sr_session_loop;
+
+struct loop_backend {
+	const char *name;
+	int (*init)(struct sr_session_loop *loop);
+	void (*cleanup)(struct sr_session_loop *loop);
+	int (*source_add)(struct sr_session_loop *loop, struct source *s);
+	void (*source_remove)(struct sr_session_loop *loop, struct source *s);
+	/*
+	 * Wait until a source is ready, or until 'due' (monotonic time in us,
+	 * -1 for none) has passed. Ready sources are queued with queue_source().
+	 */
+	int (*wait)(struct sr_session_loop *loop, gint64 due, gboolean block);
+};
+
+struct sr_session_loop {
+	const struct loop_backend *backend;
+
+	/* All sources, and their pollfds at the same indices (for g_poll). */
+	struct source **sources;
+	GPollFD *pollfds;
+	unsigned int num_sources;
+	unsigned int sources_allocated;
+	/* poll_object -> first source with that poll object */
+	GHashTable *objects;
+
+	/* Sources with a timeout, as a binary min-heap on 'due'. */
+	struct source **heap;
+	unsigned int heap_size;
+	unsigned int heap_allocated;
+
+	/* Sources called on every iteration, in no particular order. */
+	struct source **always_ready;
+	unsigned int num_always_ready;
+	unsigned int always_ready_allocated;
+	/* Sources to run in the current iteration. */
+	GPtrArray *ready;
+	gboolean dispatching;
+	GSList *removed;
+
+	/* epoll backend */
+	int epfd;
+	int timerfd;
+	gint64 timer_due;
+};
+
+static void queue_source(struct sr_session_loop *loop, struct source *s,
+			 gushort revents)
+{
+	if (s->removed)
+		return;
+
+	s->revents |= revents;
+	if (!s->pending) {
+		s->pending = TRUE;
+		g_ptr_array_add(loop->ready, s);
+	}
+}
+
+/*--- Deadline heap ---------------------------------------------------------*/
+
+static void heap_swap(struct sr_session_loop *loop, unsigned int a,
+		      unsigned int b)
+{
+	struct source *tmp;
+
+	tmp = loop->heap[a];
+	loop->heap[a] = loop->heap[b];
+	loop->heap[b] = tmp;
+	loop->heap[a]->heap_index = a;
+	loop->heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(struct sr_session_loop *loop, unsigned int i)
+{
+	unsigned int parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (loop->heap[parent]->due <= loop->heap[i]->due)
+			break;
+		heap_swap(loop, i, parent);
+		i = parent;
+	}
+}
+
+static void heap_sift_down(struct sr_session_loop *loop, unsigned int i)
+{
+	unsigned int child;
+
+	while ((child = 2 * i + 1) < loop->heap_size) {
+		if (child + 1 < loop->heap_size
+		    && loop->heap[child + 1]->due < loop->heap[child]->due)
+			child++;
+		if (loop->heap[i]->due <= loop->heap[child]->due)
+			break;
+		heap_swap(loop, i, child);
+		i = child;
+	}
+}
+
+static int heap_insert(struct sr_session_loop *loop, struct source *s)
+{
+	struct source **new_heap;
+	unsigned int new_size;
+
+	if (loop->heap_size == loop->heap_allocated) {
+		new_size = MAX(LOOP_INITIAL_SIZE, loop->heap_allocated * 2);
+		if (!(new_heap = g_try_realloc(loop->heap,
+					new_size * sizeof(struct source *)))) {
+			sr_err("session: %s: heap malloc failed", __func__);
+			return SR_ERR_MALLOC;
+		}
+		loop->heap = new_heap;
+		loop->heap_allocated = new_size;
+	}
+
+	s->heap_index = loop->heap_size;
+	loop->heap[loop->heap_size++] = s;
+	heap_sift_up(loop, s->heap_index);
+
+	return SR_OK;
+}
+
+static void heap_remove(struct sr_session_loop *loop, struct source *s)
+{
+	unsigned int i;
+
+	i = s->heap_index;
+	s->heap_index = -1;
+	if (i == --loop->heap_size)
+		return;
+
+	loop->heap[i] = loop->heap[loop->heap_size];
+	loop->heap[i]->heap_index = i;
+	heap_sift_down(loop, i);
+	heap_sift_up(loop, i);
+}
+
+static int always_ready_add(struct sr_session_loop *loop, struct source *s)
+{
+	struct source **new_always;
+	unsigned int new_size;
+
+	if (loop->num_always_ready == loop->always_ready_allocated) {
+		new_size = MAX(LOOP_INITIAL_SIZE,
+			       loop->always_ready_allocated * 2);
+		if (!(new_always = g_try_realloc(loop->always_ready,
+					new_size * sizeof(struct source *)))) {
+			sr_err("session: %s: always_ready malloc failed",
+			       __func__);
+			return SR_ERR_MALLOC;
+		}
+		loop->always_ready = new_always;
+		loop->always_ready_allocated = new_size;
+	}
+
+	s->always_index = loop->num_always_ready;
+	loop->always_ready[loop->num_always_ready++] = s;
+
+	return SR_OK;
+}
+
+static void always_ready_remove(struct sr_session_loop *loop,
+				struct source *s)
+{
+	unsigned int i;
+
+	/* Move the last one into the gap. */
+	i = s->always_index;
+	s->always_index = -1;
+	if (i == --loop->num_always_ready)
+		return;
+
+	loop->always_ready[i] = loop->always_ready[loop->num_always_ready];
+	loop->always_ready[i]->always_index = i;
+}
+
+/* Restart a source's timeout, counting from 'now'. */
+static void source_rearm(struct sr_session_loop *loop, struct source *s,
+			 gint64 now)
+{
+	if (s->heap_index < 0)
+		return;
+
+	/* The deadline only ever moves later. */
+	s->due = now + (gint64)s->timeout * 1000;
+	heap_sift_down(loop, s->heap_index);
+}
+
+/*--- g_poll() backend ------------------------------------------------------*/
+
+static int poll_wait(struct sr_session_loop *loop, gint64 due, gboolean block)
+{
+	gint64 now;
+	unsigned int i;
+	int timeout, ret;
+
+	if (!block) {
+		timeout = 0;
+	} else if (due < 0) {
+		timeout = -1;
+	} else {
+		/* Round up, so we don't wake up before the deadline. */
+		now = g_get_monotonic_time();
+		timeout = due > now ? (due - now + 999) / 1000 : 0;
+	}
+
+	ret = g_poll(loop->pollfds, loop->num_sources, timeout);
+	if (ret <= 0)
+		return SR_OK;
+
+	for (i = 0; i < loop->num_sources; i++) {
+		if (loop->pollfds[i].revents)
+			queue_source(loop, loop->sources[i],
+				     loop->pollfds[i].revents);
+	}
+
+	return SR_OK;
+}
+
+static const struct loop_backend poll_backend = {
+	.name = "poll",
+	.wait = poll_wait,
+};
+
+/*--- epoll backend ---------------------------------------------------------*/
+
+#ifdef HAVE_EPOLL
+
+static uint32_t events_to_epoll(gushort events)
+{
+	uint32_t ret;
+
+	ret = 0;
+	if (events & G_IO_IN)
+		ret |= EPOLLIN;
+	if (events & G_IO_PRI)
+		ret |= EPOLLPRI;
+	if (events & G_IO_OUT)
+		ret |= EPOLLOUT;
+
+	/* EPOLLERR and EPOLLHUP are always reported. */
+	return ret;
+}
+
+static gushort events_from_epoll(uint32_t events)
+{
+	gushort ret;
+
+	ret = 0;
+	if (events & EPOLLIN)
+		ret |= G_IO_IN;
+	if (events & EPOLLPRI)
+		ret |= G_IO_PRI;
+	if (events & EPOLLOUT)
+		ret |= G_IO_OUT;
+	if (events & EPOLLERR)
+		ret |= G_IO_ERR;
+	if (events & EPOLLHUP)
+		ret |= G_IO_HUP;
+
+	return ret;
+}
+
+static int epoll_init(struct sr_session_loop *loop)
+{
+	struct epoll_event ev;
+
+	if ((loop->epfd = epoll_create(LOOP_MAX_EVENTS)) == -1) {
+		sr_dbg("session: epoll_create failed: %s", g_strerror(errno));
+		return SR_ERR;
+	}
+
+	if ((loop->timerfd = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+		sr_dbg("session: timerfd_create failed: %s",
+		       g_strerror(errno));
+		close(loop->epfd);
+		return SR_ERR;
+	}
+	loop->timer_due = -1;
+
+	/* The timerfd is the only event without a source. */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) == -1) {
+		sr_dbg("session: adding timerfd failed: %s", g_strerror(errno));
+		close(loop->timerfd);
+		close(loop->epfd);
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+static void epoll_cleanup(struct sr_session_loop *loop)
+{
+	close(loop->timerfd);
+	close(loop->epfd);
+}
+
+static int epoll_source_add(struct sr_session_loop *loop, struct source *s)
+{
+	struct epoll_event ev;
+	int fd;
+
+	s->epoll_fd = -1;
+	s->epoll_dup = FALSE;
+	if (s->pollfd.fd < 0)
+		return SR_OK;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events_to_epoll(s->pollfd.events);
+	ev.data.ptr = s;
+	fd = s->pollfd.fd;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+		s->epoll_fd = fd;
+		return SR_OK;
+	}
+
+	if (errno == EEXIST) {
+		/* Another source polls this fd; epoll wants one per fd. */
+		if ((fd = dup(fd)) != -1
+		    && epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+			s->epoll_fd = fd;
+			s->epoll_dup = TRUE;
+			return SR_OK;
+		}
+		if (fd != -1)
+			close(fd);
+	} else if (errno == EPERM) {
+		/* Regular files are always ready, poll() says as much. */
+		return always_ready_add(loop, s);
+	}
+
+	sr_err("session: %s: epoll_ctl failed for fd %d: %s", __func__,
+	       s->pollfd.fd, g_strerror(errno));
+
+	return SR_ERR;
+}
+
+static void epoll_source_remove(struct sr_session_loop *loop,
+				struct source *s)
+{
+	if (s->epoll_fd == -1)
+		return;
+
+	/* Fails harmlessly if the driver closed the fd already. */
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->epoll_fd, NULL);
+	if (s->epoll_dup)
+		close(s->epoll_fd);
+	s->epoll_fd = -1;
+}
+
+static int epoll_wait_events(struct sr_session_loop *loop, gint64 due,
+			     gboolean block)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	struct itimerspec its;
+	struct source *s;
+	uint64_t expirations;
+	int num_events, i;
+
+	/* Arm the timerfd for the earliest deadline, if that changed. */
+	if (due != loop->timer_due) {
+		memset(&its, 0, sizeof(its));
+		if (due >= 0) {
+			/* A zero it_value would disarm the timer. */
+			its.it_value.tv_sec = due / G_USEC_PER_SEC;
+			its.it_value.tv_nsec = MAX(1, (due % G_USEC_PER_SEC) * 1000);
+		}
+		if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME,
+				    &its, NULL) == -1) {
+			sr_err("session: %s: timerfd_settime failed: %s",
+			       __func__, g_strerror(errno));
+			return SR_ERR;
+		}
+		loop->timer_due = due;
+	}
+
+	num_events = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS,
+				block ? -1 : 0);
+	if (num_events == -1) {
+		if (errno == EINTR)
+			return SR_OK;
+		sr_err("session: %s: epoll_wait failed: %s", __func__,
+		       g_strerror(errno));
+		return SR_ERR;
+	}
+
+	for (i = 0; i < num_events; i++) {
+		if (!(s = events[i].data.ptr)) {
+			/* Expired deadlines are picked up by the caller. */
+			if (read(loop->timerfd, &expirations,
+				 sizeof(expirations)) == -1)
+				sr_dbg("session: timerfd read failed");
+			continue;
+		}
+		queue_source(loop, s, events_from_epoll(events[i].events));
+	}
+
+	return SR_OK;
+}
+
+static const struct loop_backend epoll_backend = {
+	.name = "epoll",
+	.init = epoll_init,
+	.cleanup = epoll_cleanup,
+	.source_add = epoll_source_add,
+	.source_remove = epoll_source_remove,
+	.wait = epoll_wait_events,
+};
+
+#endif
+
+/* Backends to try, best first. The last one must always work. */
+static const struct loop_backend *backends[] = {
+#ifdef HAVE_EPOLL
+	&epoll_backend,
+#endif
+	&poll_backend,
+};
+
+/*--- Generic part ----------------------------------------------------------*/
+
+/**
+ * Create a new session event loop.
+ *
+ * @return The new loop, or NULL upon memory allocation errors.
+ */
+SR_PRIV struct sr_session_loop *sr_session_loop_new(void)
+{
+	struct sr_session_loop *loop;
+	unsigned int i;
+
+	if (!(loop = g_try_malloc0(sizeof(struct sr_session_loop)))) {
+		sr_err("session: %s: loop malloc failed", __func__);
+		return NULL;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(backends); i++) {
+		if (!backends[i]->init || backends[i]->init(loop) == SR_OK) {
+			loop->backend = backends[i];
+			break;
+		}
+	}
+	sr_dbg("session: using the %s event loop", loop->backend->name);
+
+	loop->objects = g_hash_table_new(g_direct_hash, g_direct_equal);
+	loop->ready = g_ptr_array_new();
+
+	return loop;
+}
+
+static void source_free(struct source *s)
+{
+	g_free(s);
+}
+
+/**
+ * Destroy a session event loop, and all sources still in it.
+ *
+ * @param loop The loop. Must not be NULL.
+ */
+SR_PRIV void sr_session_loop_destroy(struct sr_session_loop *loop)
+{
+	unsigned int i;
+
+	for (i = 0; i < loop->num_sources; i++) {
+		if (loop->backend->source_remove)
+			loop->backend->source_remove(loop, loop->sources[i]);
+		source_free(loop->sources[i]);
+	}
+	g_slist_free_full(loop->removed, (GDestroyNotify)source_free);
+	g_free(loop->always_ready);
+
+	if (loop->backend->cleanup)
+		loop->backend->cleanup(loop);
+
+	g_hash_table_destroy(loop->objects);
+	g_ptr_array_free(loop->ready, TRUE);
+	g_free(loop->sources);
+	g_free(loop->pollfds);
+	g_free(loop->heap);
+	g_free(loop);
+}
+
+static int sources_grow(struct sr_session_loop *loop)
+{
+	struct source **new_sources;
+	GPollFD *new_pollfds;
+	unsigned int new_size;
+
+	new_size = MAX(LOOP_INITIAL_SIZE, loop->sources_allocated * 2);
+
+	if (!(new_pollfds = g_try_realloc(loop->pollfds,
+					  new_size * sizeof(GPollFD)))) {
+		sr_err("session: %s: pollfds malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	loop->pollfds = new_pollfds;
+
+	if (!(new_sources = g_try_realloc(loop->sources,
+					  new_size * sizeof(struct source *)))) {
+		sr_err("session: %s: sources malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	loop->sources = new_sources;
+	loop->sources_allocated = new_size;
+
+	return SR_OK;
+}
+
+/**
+ * Add an event source to a session event loop.
+ *
+ * @param loop The loop. Must not be NULL.
+ * @param pollfd The fd and events to poll for. The fd may be negative, for
+ *               a source which only has a timeout (or, without a timeout,
+ *               whose callback is called continuously).
+ * @param timeout Max time (in ms) to wait before the callback is called,
+ *                ignored if <= 0.
+ * @param cb Callback function to add. Must not be NULL.
+ * @param cb_data Data for the callback function. Can be NULL.
+ * @param poll_object The object this source is removed by.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors,
+ *         or SR_ERR if the backend can't poll this fd.
+ */
+SR_PRIV int sr_session_loop_source_add(struct sr_session_loop *loop,
+		const GPollFD *pollfd, int timeout,
+		sr_receive_data_callback_t cb, void *cb_data,
+		gintptr poll_object)
+{
+	struct source *s, *first;
+
+	if (loop->num_sources == loop->sources_allocated
+	    && sources_grow(loop) != SR_OK)
+		return SR_ERR_MALLOC;
+
+	if (!(s = g_try_malloc0(sizeof(struct source)))) {
+		sr_err("session: %s: source malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	s->timeout = timeout;
+	s->cb = cb;
+	s->cb_data = cb_data;
+	s->poll_object = poll_object;
+	s->pollfd = *pollfd;
+	s->pollfd.revents = 0;
+	s->heap_index = -1;
+	s->always_index = -1;
+
+	if (timeout > 0) {
+		s->due = g_get_monotonic_time() + (gint64)timeout * 1000;
+		if (heap_insert(loop, s) != SR_OK) {
+			g_free(s);
+			return SR_ERR_MALLOC;
+		}
+	} else if (pollfd->fd < 0) {
+		/* No fd and no timeout: freewheeling source. */
+		if (always_ready_add(loop, s) != SR_OK) {
+			g_free(s);
+			return SR_ERR_MALLOC;
+		}
+	}
+
+	if (loop->backend->source_add
+	    && loop->backend->source_add(loop, s) != SR_OK) {
+		if (s->heap_index >= 0)
+			heap_remove(loop, s);
+		if (s->always_index >= 0)
+			always_ready_remove(loop, s);
+		g_free(s);
+		return SR_ERR;
+	}
+
+	s->index = loop->num_sources++;
+	loop->sources[s->index] = s;
+	loop->pollfds[s->index] = s->pollfd;
+
+	/* Sources sharing a poll object are removed in the order added. */
+	if ((first = g_hash_table_lookup(loop->objects,
+					 (gpointer)poll_object))) {
+		while (first->same_next)
+			first = first->same_next;
+		first->same_next = s;
+	} else {
+		g_hash_table_insert(loop->objects, (gpointer)poll_object, s);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Remove the (first added) source with the given poll object.
+ *
+ * This may be called from within a source's callback.
+ *
+ * @param loop The loop. Must not be NULL.
+ * @param poll_object The poll object the source was added with.
+ *
+ * @return SR_OK upon success (also if there is no such source).
+ */
+SR_PRIV int sr_session_loop_source_remove(struct sr_session_loop *loop,
+		gintptr poll_object)
+{
+	struct source *s, *last;
+	unsigned int i;
+
+	/* fd not found, nothing to do */
+	if (!(s = g_hash_table_lookup(loop->objects, (gpointer)poll_object)))
+		return SR_OK;
+
+	if (s->same_next)
+		g_hash_table_insert(loop->objects, (gpointer)poll_object,
+				    s->same_next);
+	else
+		g_hash_table_remove(loop->objects, (gpointer)poll_object);
+
+	if (loop->backend->source_remove)
+		loop->backend->source_remove(loop, s);
+	if (s->heap_index >= 0)
+		heap_remove(loop, s);
+	if (s->always_index >= 0)
+		always_ready_remove(loop, s);
+
+	/* Move the last source into the gap. */
+	i = s->index;
+	last = loop->sources[--loop->num_sources];
+	loop->sources[i] = last;
+	loop->pollfds[i] = loop->pollfds[loop->num_sources];
+	last->index = i;
+
+	if (loop->dispatching) {
+		/* It may still be in the ready list. */
+		s->removed = TRUE;
+		loop->removed = g_slist_prepend(loop->removed, s);
+	} else {
+		source_free(s);
+	}
+
+	return SR_OK;
+}
+
+/**
+ * Run one iteration of a session event loop: wait for sources to become
+ * ready or time out, and run their callbacks.
+ *
+ * @param loop The loop. Must not be NULL.
+ *
+ * @return SR_OK upon success, SR_ERR upon errors, or SR_ERR_ARG if there
+ *         are no sources left (nothing would ever happen).
+ */
+SR_PRIV int sr_session_loop_iterate(struct sr_session_loop *loop)
+{
+	struct source *s;
+	gint64 due, now;
+	unsigned int i;
+	int ret;
+
+	if (loop->num_sources == 0)
+		return SR_ERR_ARG;
+
+	/* Don't bother the backend if all sources are freewheeling. */
+	if (loop->num_always_ready != loop->num_sources) {
+		due = loop->heap_size ? loop->heap[0]->due : -1;
+		ret = loop->backend->wait(loop, due,
+					  loop->num_always_ready == 0);
+		if (ret != SR_OK)
+			return ret;
+	}
+
+	/* Expired deadlines. */
+	now = g_get_monotonic_time();
+	while (loop->heap_size && loop->heap[0]->due <= now) {
+		s = loop->heap[0];
+		queue_source(loop, s, 0);
+		source_rearm(loop, s, now);
+	}
+
+	for (i = 0; i < loop->num_always_ready; i++)
+		queue_source(loop, loop->always_ready[i], 0);
+
+	loop->dispatching = TRUE;
+	for (i = 0; i < loop->ready->len; i++) {
+		s = g_ptr_array_index(loop->ready, i);
+		if (s->removed)
+			continue;
+		s->pending = FALSE;
+		/* Any call restarts the timeout, like it always did. */
+		if (s->revents)
+			source_rearm(loop, s, now);
+		/*
+		 * Invoke the source's callback on an event, or if its timeout
+		 * has passed.
+		 */
+		if (!s->cb(s->pollfd.fd, s->revents, s->cb_data) && !s->removed)
+			sr_session_loop_source_remove(loop, s->poll_object);
+		s->revents = 0;
+	}
+	loop->dispatching = FALSE;
+	g_ptr_array_set_size(loop->ready, 0);
+
+	g_slist_free_full(loop->removed, (GDestroyNotify)source_free);
+	loop->removed = NULL;
+
+	return SR_OK;
+}
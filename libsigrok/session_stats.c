@@ -0,0 +1,223 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "libsigrok.h"
+#include "libsigrok-internal.h"
+
+/*
+ * Session performance counters.
+ *
+ * Packet counters and driver counters are only updated from the session
+ * thread. Each struct sr_stats_callback is only updated by the thread which
+ * runs that callback (the session thread, or its consumer thread with
+ * asynchronous delivery).
+ */
+
+extern struct sr_session *session;
+
+/**
+ * Add a set of counters for a newly added datafeed callback.
+ *
+ * @return SR_OK upon success, SR_ERR_MALLOC upon memory allocation errors.
+ */
+SR_PRIV int sr_session_stats_callback_add(void)
+{
+	struct sr_stats_callback *s;
+
+	if (!(s = g_try_malloc0(sizeof(struct sr_stats_callback)))) {
+		sr_err("session: %s: stats malloc failed", __func__);
+		return SR_ERR_MALLOC;
+	}
+	session->stats.callbacks = g_slist_append(session->stats.callbacks, s);
+
+	return SR_OK;
+}
+
+/**
+ * Free the counters of all datafeed callbacks.
+ */
+SR_PRIV void sr_session_stats_callbacks_free(void)
+{
+	g_slist_free_full(session->stats.callbacks, g_free);
+	session->stats.callbacks = NULL;
+}
+
+/**
+ * Reset all counters, and start the session's clock.
+ */
+SR_PRIV void sr_session_stats_start(void)
+{
+	GSList *callbacks, *l;
+
+	callbacks = session->stats.callbacks;
+	memset(&session->stats, 0, sizeof(struct sr_session_stats));
+	session->stats.callbacks = callbacks;
+	for (l = callbacks; l; l = l->next)
+		memset(l->data, 0, sizeof(struct sr_stats_callback));
+
+	session->stats_analog_probes = 1;
+	session->stats_start = g_get_monotonic_time();
+	session->stats_end = 0;
+}
+
+/**
+ * Stop the session's clock.
+ */
+SR_PRIV void sr_session_stats_stop(void)
+{
+	session->stats_end = g_get_monotonic_time();
+}
+
+/**
+ * Count a packet sent by a driver.
+ *
+ * @param packet The packet. Must not be NULL.
+ */
+SR_PRIV void sr_session_stats_packet(const struct sr_datafeed_packet *packet)
+{
+	const struct sr_datafeed_logic *logic;
+	const struct sr_datafeed_logic_rle *logic_rle;
+	const struct sr_datafeed_meta_analog *meta_analog;
+	const struct sr_datafeed_analog *analog;
+	const struct sr_datafeed_analog_raw *analog_raw;
+	struct sr_stats_packets *s;
+
+	if (packet->type >= SR_DF_NUM_TYPES)
+		return;
+
+	s = &session->stats.packets[packet->type];
+	s->count++;
+
+	switch (packet->type) {
+	case SR_DF_LOGIC:
+		logic = packet->payload;
+		s->bytes += logic->length;
+		break;
+	case SR_DF_LOGIC_RLE:
+		logic_rle = packet->payload;
+		s->bytes += logic_rle->num_runs
+			    * (logic_rle->unitsize + sizeof(uint32_t));
+		break;
+	case SR_DF_META_ANALOG:
+		meta_analog = packet->payload;
+		session->stats_analog_probes = MAX(1, meta_analog->num_probes);
+		break;
+	case SR_DF_ANALOG:
+		analog = packet->payload;
+		s->bytes += (uint64_t)analog->num_samples
+			    * session->stats_analog_probes * sizeof(float);
+		break;
+	case SR_DF_ANALOG_RAW:
+		analog_raw = packet->payload;
+		s->bytes += (uint64_t)analog_raw->num_samples
+			    * analog_raw->num_probes
+			    * sr_analog_raw_unitsize(analog_raw->encoding);
+		break;
+	}
+}
+
+/**
+ * Account for one run of a datafeed callback.
+ *
+ * @param s The callback's counters.
+ * @param queued When the packet was queued for the callback (monotonic
+ *               time in us), or -1 if it wasn't.
+ * @param start When the callback was called.
+ * @param end When the callback returned.
+ */
+SR_PRIV void sr_session_stats_call(struct sr_stats_callback *s,
+				   gint64 queued, gint64 start, gint64 end)
+{
+	uint64_t elapsed, wait;
+	unsigned int bucket;
+
+	elapsed = end > start ? end - start : 0;
+	s->calls++;
+	s->time_total += elapsed;
+	if (elapsed > s->time_max)
+		s->time_max = elapsed;
+
+	/* Bucket n holds 2^(n-1) <= elapsed < 2^n. */
+	bucket = elapsed ? g_bit_storage(elapsed) : 0;
+	s->latency[MIN(bucket, SR_STATS_LATENCY_BUCKETS - 1)]++;
+
+	if (queued >= 0) {
+		wait = start > queued ? start - queued : 0;
+		s->queue_time_total += wait;
+		if (wait > s->queue_time_max)
+			s->queue_time_max = wait;
+	}
+}
+
+/**
+ * Count a transfer received from the hardware.
+ *
+ * Drivers call this once for every block of data they receive, before
+ * processing it. Transfers without data (or with an error) are counted
+ * as empty transfers.
+ *
+ * @param bytes The number of bytes received.
+ */
+SR_PRIV void sr_session_stats_transfer(uint64_t bytes)
+{
+	if (!session)
+		return;
+
+	session->stats.transfers++;
+	session->stats.transfer_bytes += bytes;
+	if (!bytes)
+		session->stats.empty_transfers++;
+}
+
+/**
+ * Count an overrun, i.e. samples which were lost because the host didn't
+ * keep up with the hardware.
+ */
+SR_PRIV void sr_session_stats_overrun(void)
+{
+	if (session)
+		session->stats.overruns++;
+}
+
+/**
+ * Get the current session's performance counters.
+ *
+ * The counters are reset by sr_session_start(), and can be read at any
+ * time; they are final once sr_session_run() has returned. The returned
+ * struct is owned by the session, and valid until sr_session_destroy().
+ *
+ * @return The counters, or NULL if no session exists.
+ */
+SR_API const struct sr_session_stats *sr_session_stats_get(void)
+{
+	if (!session) {
+		sr_err("session: %s: session was NULL", __func__);
+		return NULL;
+	}
+
+	if (session->stats_start)
+		session->stats.duration = (session->stats_end ?
+				session->stats_end : g_get_monotonic_time())
+				- session->stats_start;
+
+	return &session->stats;
+}
@@ -24,6 +24,13 @@
 #include <glib.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * Number of samples expanded at a time, for decoders which can't take
+ * runs (see srd_session_send_rle()).
+ */
+#define RLE_EXPAND_SAMPLES (64 * 1024)
 
 /* List of decoder instances. */
 static GSList *di_list = NULL;
@@ -31,6 +38,41 @@ static GSList *di_list = NULL;
 /* List of frontend callbacks to receive decoder output. */
 static GSList *callbacks = NULL;
 
+/* See srd_pd_output_batch_callback_add(). */
+static srd_pd_output_batch_callback_t batch_cb = NULL;
+static void *batch_cb_data = NULL;
+/* Annotations (struct srd_proto_data) waiting for the batch callback. */
+static GArray *batch = NULL;
+
+/* One decoder stack's share of a parallel srd_session_send() call. */
+struct session_job {
+	struct srd_decoder_inst *di;
+	uint64_t start_samplenum;
+	const uint8_t *inbuf;
+	uint64_t inbuflen;
+	/* The run lengths if inbuf holds the values of runs, or NULL. */
+	const uint32_t *lengths;
+	uint64_t num_runs;
+	int ret;
+	/* Annotations sent by the stack (struct srd_proto_data), in order. */
+	GArray *anns;
+	/* Index of the next one to deliver. */
+	guint next;
+};
+
+/* Worker threads for parallel sessions, see srd_session_threads_set(). */
+static GThreadPool *session_pool = NULL;
+static GMutex *session_mutex = NULL;
+static GCond *session_cond = NULL;
+/* Number of jobs which the workers haven't finished yet. */
+static int session_pending = 0;
+/* The job of the stack running on the current thread, if any. */
+static GStaticPrivate session_job = G_STATIC_PRIVATE_INIT;
+
+static void session_threads_free(void);
+static void batch_flush(void);
+static void batch_clear(void);
+
 /* decoder.c */
 extern SRD_PRIV GSList *pd_list;
 
@@ -120,6 +162,12 @@ SRD_API int srd_exit(void)
 {
 	srd_dbg("Exiting libsigrokdecode.");
 
+	session_threads_free();
+	if (batch) {
+		batch_clear();
+		g_array_free(batch, TRUE);
+		batch = NULL;
+	}
 	srd_decoder_unload_all();
 	g_slist_free(pd_list);
 	pd_list = NULL;
@@ -198,6 +246,39 @@ SRD_PRIV int srd_decoder_searchpath_add(const char *path)
 	return SRD_OK;
 }
 
+/* Set the options of a native decoder instance, see srd_inst_option_set(). */
+static int native_option_set(struct srd_decoder_inst *di,
+			     GHashTable *options)
+{
+	const struct srd_decoder_native *nd;
+	const struct srd_native_option *o;
+	const char *value;
+	int ret;
+
+	nd = di->decoder->native;
+	if (!nd->options || !nd->options->id) {
+		/* Decoder has no options. */
+		if (g_hash_table_size(options) == 0)
+			return SRD_OK;
+		srd_err("Protocol decoder has no options.");
+		return SRD_ERR_ARG;
+	}
+
+	for (o = nd->options; o->id; o++) {
+		/* Use the default, unless an override was provided. */
+		if (!(value = g_hash_table_lookup(options, o->id)))
+			value = o->def;
+		if ((ret = nd->option_set(di, o->id, value)) != SRD_OK) {
+			srd_err("Option %s has invalid value %s.",
+				o->id, value);
+			return ret;
+		}
+		g_hash_table_remove(options, o->id);
+	}
+
+	return SRD_OK;
+}
+
 /**
  * Set one or more options in a decoder instance.
  *
@@ -218,6 +299,9 @@ SRD_API int srd_inst_option_set(struct srd_decoder_inst *di,
 	int num_optkeys, ret, size, i;
 	char *key, *value;
 
+	if (di->decoder->native)
+		return native_option_set(di, options);
+
 	if (!PyObject_HasAttrString(di->decoder->py_dec, "options")) {
 		/* Decoder has no options. */
 		if (g_hash_table_size(options) == 0) {
@@ -428,7 +512,7 @@ SRD_API int srd_inst_probe_set_all(struct srd_decoder_inst *di,
 SRD_API struct srd_decoder_inst *srd_inst_new(const char *decoder_id,
 					      GHashTable *options)
 {
-	int i;
+	int i, ret;
 	struct srd_decoder *dec;
 	struct srd_decoder_inst *di;
 	char *inst_id;
@@ -467,18 +551,31 @@ SRD_API struct srd_decoder_inst *srd_inst_new(const char *decoder_id,
 			di->dec_probemap[i] = i;
 	}
 
-	/* Create a new instance of this decoder class. */
-	if (!(di->py_inst = PyObject_CallObject(dec->py_dec, NULL))) {
-		if (PyErr_Occurred())
-			srd_exception_catch("failed to create %s instance: ",
-					    decoder_id);
-		g_free(di->dec_probemap);
-		g_free(di);
-		return NULL;
+	if (dec->native) {
+		/* Native decoders keep their state in di->priv. */
+		ret = dec->native->inst_new ? dec->native->inst_new(di) : SRD_OK;
+		if (ret != SRD_OK) {
+			srd_err("Failed to create %s instance.", decoder_id);
+			g_free(di->dec_probemap);
+			g_free(di);
+			return NULL;
+		}
+	} else {
+		/* Create a new instance of this decoder class. */
+		if (!(di->py_inst = PyObject_CallObject(dec->py_dec, NULL))) {
+			if (PyErr_Occurred())
+				srd_exception_catch("failed to create %s "
+						    "instance: ", decoder_id);
+			g_free(di->dec_probemap);
+			g_free(di);
+			return NULL;
+		}
+		/* Lets Decoder.put() and add() find the instance. */
+		((srd_Decoder *)di->py_inst)->di = di;
 	}
 
 	if (srd_inst_option_set(di, options) != SRD_OK) {
-		g_free(di->dec_probemap);
+		srd_inst_free(di);
 		g_free(di);
 		return NULL;
 	}
@@ -543,36 +640,25 @@ SRD_API struct srd_decoder_inst *srd_inst_find_by_id(const char *inst_id)
 	return di;
 }
 
-/**
- * Find a decoder instance by its Python object.
- *
- * I.e. find that instance's instantiation of the sigrokdecode.Decoder class.
- * This will recurse to find the instance anywhere in the stack tree.
- *
- * @param stack Pointer to a GSList of struct srd_decoder_inst, indicating the
- *              stack to search. To start searching at the bottom level of
- *              decoder instances, pass NULL.
- * @param obj The Python class instantiation.
- *
- * @return Pointer to struct srd_decoder_inst, or NULL if not found.
- */
-SRD_PRIV struct srd_decoder_inst *srd_inst_find_by_obj(const GSList *stack,
-						       const PyObject *obj)
+/* Call a native decoder's start(), with the metadata from args. */
+static int native_inst_start(struct srd_decoder_inst *di, PyObject *args)
 {
-// TODO?
-	const GSList *l;
-	struct srd_decoder_inst *tmp, *di;
+	PyObject *py_samplerate;
+	uint64_t samplerate;
+	int ret;
 
-	di = NULL;
-	for (l = stack ? stack : di_list; di == NULL && l != NULL; l = l->next) {
-		tmp = l->data;
-		if (tmp->py_inst == obj)
-			di = tmp;
-		else if (tmp->next_di)
-			di = srd_inst_find_by_obj(tmp->next_di, obj);
-	}
+	if (!di->decoder->native->start)
+		return SRD_OK;
 
-	return di;
+	samplerate = 0;
+	if ((py_samplerate = PyDict_GetItemString(args, "samplerate")))
+		samplerate = PyLong_AsUnsignedLongLong(py_samplerate);
+
+	if ((ret = di->decoder->native->start(di, samplerate)) != SRD_OK)
+		srd_err("Protocol decoder instance %s failed to start.",
+			di->inst_id);
+
+	return ret;
 }
 
 SRD_PRIV int srd_inst_start(struct srd_decoder_inst *di, PyObject *args)
@@ -580,26 +666,33 @@ SRD_PRIV int srd_inst_start(struct srd_decoder_inst *di, PyObject *args)
 	PyObject *py_name, *py_res;
 	GSList *l;
 	struct srd_decoder_inst *next_di;
+	int ret;
 
 	srd_dbg("Calling start() method on protocol decoder instance %s.",
 		di->inst_id);
 
-	if (!(py_name = PyUnicode_FromString("start"))) {
-		srd_err("Unable to build Python object for 'start'.");
-		srd_exception_catch("Protocol decoder instance %s: ",
-				    di->inst_id);
-		return SRD_ERR_PYTHON;
-	}
+	if (di->decoder->native) {
+		if ((ret = native_inst_start(di, args)) != SRD_OK)
+			return ret;
+	} else {
+		if (!(py_name = PyUnicode_FromString("start"))) {
+			srd_err("Unable to build Python object for 'start'.");
+			srd_exception_catch("Protocol decoder instance %s: ",
+					    di->inst_id);
+			return SRD_ERR_PYTHON;
+		}
 
-	if (!(py_res = PyObject_CallMethodObjArgs(di->py_inst,
-						  py_name, args, NULL))) {
-		srd_exception_catch("Protocol decoder instance %s: ",
-				    di->inst_id);
-		return SRD_ERR_PYTHON;
-	}
+		py_res = PyObject_CallMethodObjArgs(di->py_inst, py_name,
+						    args, NULL);
+		if (!py_res) {
+			srd_exception_catch("Protocol decoder instance %s: ",
+					    di->inst_id);
+			return SRD_ERR_PYTHON;
+		}
 
-	Py_DecRef(py_res);
-	Py_DecRef(py_name);
+		Py_DecRef(py_res);
+		Py_DecRef(py_name);
+	}
 
 	/*
 	 * Start all the PDs stacked on top of this one. Pass along the
@@ -614,6 +707,38 @@ SRD_PRIV int srd_inst_start(struct srd_decoder_inst *di, PyObject *args)
 	return SRD_OK;
 }
 
+/* Hand a whole chunk to the decoder's decode_chunk() method. */
+static int inst_decode_chunk(uint64_t start_samplenum,
+			     struct srd_decoder_inst *di,
+			     const uint8_t *inbuf, uint64_t inbuflen)
+{
+	PyObject *py_res;
+	srd_chunk *chunk;
+	uint64_t end_samplenum;
+	int ret;
+
+	if (!(chunk = srd_chunk_new(di, start_samplenum, inbuf, inbuflen))) {
+		srd_exception_catch("Protocol decoder instance %s: ",
+				    di->inst_id);
+		return SRD_ERR_PYTHON;
+	}
+
+	ret = SRD_OK;
+	end_samplenum = start_samplenum + chunk->num_samples;
+	if (!(py_res = PyObject_CallMethod(di->py_inst, "decode_chunk",
+					   "KKO", start_samplenum,
+					   end_samplenum, chunk))) {
+		srd_exception_catch("Protocol decoder instance %s: ",
+				    di->inst_id);
+		ret = SRD_ERR_PYTHON;
+	}
+	Py_XDECREF(py_res);
+	if (srd_chunk_release(chunk) != SRD_OK)
+		ret = SRD_ERR_PYTHON;
+
+	return ret;
+}
+
 /**
  * Run the specified decoder function.
  *
@@ -631,7 +756,8 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 {
 	PyObject *py_res;
 	srd_logic *logic;
-	uint64_t end_samplenum;
+	uint64_t end_samplenum, num_samples, first, last;
+	int ret;
 
 	srd_dbg("Calling decode() on instance %s with %d bytes starting "
 		"at sample %d.", di->inst_id, inbuflen, start_samplenum);
@@ -650,6 +776,49 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 		return SRD_ERR_ARG;
 	}
 
+	/* Native decoders go through the samples themselves. */
+	if (di->decoder->native) {
+		if (!di->decoder->native->decode) {
+			srd_err("Protocol decoder %s takes no logic input.",
+				di->decoder->name);
+			return SRD_ERR_ARG;
+		}
+		return di->decoder->native->decode((struct srd_decoder_inst *)di,
+						   start_samplenum, inbuf,
+						   inbuflen);
+	}
+
+	/*
+	 * Decoders which only want the changes don't need to run at all if
+	 * none of their probes changed in this chunk. Otherwise, iteration
+	 * starts at the first change.
+	 */
+	first = 0;
+	if (di->decoder->edges_only && di->edge_started && !di->rle_lengths) {
+		num_samples = inbuflen / di->data_unitsize;
+		first = srd_logic_next_edge(di, inbuf, num_samples, 0);
+		if (first == num_samples) {
+			srd_spew("No edges for instance %s, skipping.",
+				 di->inst_id);
+			return SRD_OK;
+		}
+	}
+
+	/* Decoders which can, get the whole chunk in one go. */
+	if (di->decoder->chunked) {
+		ret = inst_decode_chunk(start_samplenum,
+					(struct srd_decoder_inst *)di,
+					inbuf, inbuflen);
+		if (di->decoder->edges_only) {
+			num_samples = inbuflen / di->data_unitsize;
+			last = srd_logic_sample(di, inbuf, num_samples - 1);
+			((struct srd_decoder_inst *)di)->edge_last =
+						last & di->edge_mask;
+			((struct srd_decoder_inst *)di)->edge_started = TRUE;
+		}
+		return ret;
+	}
+
 	/*
 	 * Create new srd_logic object. Each iteration around the PD's loop
 	 * will fill one sample into this object.
@@ -658,7 +827,7 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 	Py_INCREF(logic);
 	logic->di = (struct srd_decoder_inst *)di;
 	logic->start_samplenum = start_samplenum;
-	logic->itercnt = 0;
+	logic->itercnt = first;
 	logic->inbuf = (uint8_t *)inbuf;
 	logic->inbuflen = inbuflen;
 	logic->sample = PyList_New(2);
@@ -678,23 +847,91 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 	return SRD_OK;
 }
 
+/*
+ * Run the specified decoder on runs of samples. Decoders which go through
+ * srd_logic_next() walk the runs directly, those with a decode_chunk()
+ * method get the samples expanded, a piece at a time.
+ */
+static int inst_decode_rle(uint64_t start_samplenum,
+			   struct srd_decoder_inst *di, const uint8_t *values,
+			   const uint32_t *lengths, uint64_t num_runs)
+{
+	uint8_t *buf;
+	uint64_t num_samples, run, offset, n, m, i;
+	int unitsize, ret;
+
+	num_samples = 0;
+	for (run = 0; run < num_runs; run++)
+		num_samples += lengths[run];
+	if (num_samples == 0)
+		return SRD_OK;
+
+	unitsize = di->data_unitsize;
+	if (!di->decoder->chunked) {
+		di->rle_lengths = lengths;
+		di->rle_num_runs = num_runs;
+		di->rle_run = 0;
+		di->rle_start = 0;
+		ret = srd_inst_decode(start_samplenum, di, values,
+				      num_samples * unitsize);
+		di->rle_lengths = NULL;
+		return ret;
+	}
+
+	if (!(buf = g_try_malloc(MIN(num_samples, RLE_EXPAND_SAMPLES)
+				 * unitsize))) {
+		srd_err("Failed to g_malloc() sample buffer.");
+		return SRD_ERR_MALLOC;
+	}
+
+	ret = SRD_OK;
+	run = offset = 0;
+	while (ret == SRD_OK && run < num_runs) {
+		n = 0;
+		while (n < RLE_EXPAND_SAMPLES && run < num_runs) {
+			m = MIN(lengths[run] - offset, RLE_EXPAND_SAMPLES - n);
+			for (i = 0; i < m; i++)
+				memcpy(buf + (n + i) * unitsize,
+				       values + run * unitsize, unitsize);
+			n += m;
+			offset += m;
+			if (offset == lengths[run]) {
+				run++;
+				offset = 0;
+			}
+		}
+		if (n > 0)
+			ret = srd_inst_decode(start_samplenum, di, buf,
+					      n * unitsize);
+		start_samplenum += n;
+	}
+	g_free(buf);
+
+	return ret;
+}
+
 SRD_PRIV void srd_inst_free(struct srd_decoder_inst *di)
 {
-	GSList *l;
 	struct srd_pd_output *pdo;
+	guint i;
 
 	srd_dbg("Freeing instance %s", di->inst_id);
 
+	if (di->decoder->native && di->decoder->native->inst_free)
+		di->decoder->native->inst_free(di);
+	if (di->py_inst)
+		((srd_Decoder *)di->py_inst)->di = NULL;
 	Py_DecRef(di->py_inst);
 	g_free(di->inst_id);
 	g_free(di->dec_probemap);
 	g_slist_free(di->next_di);
-	for (l = di->pd_output; l; l = l->next) {
-		pdo = l->data;
+	for (i = 0; di->pd_output && i < di->pd_output->len; i++) {
+		pdo = g_ptr_array_index(di->pd_output, i);
 		g_free(pdo->proto_id);
 		g_free(pdo);
 	}
-	g_slist_free(di->pd_output);
+	if (di->pd_output)
+		g_ptr_array_free(di->pd_output, TRUE);
 }
 
 SRD_PRIV void srd_inst_free_all(GSList *stack)
@@ -715,11 +952,40 @@ SRD_PRIV void srd_inst_free_all(GSList *stack)
 	}
 }
 
+/*
+ * The data bits a decoder instance's probes are mapped to, or all of them
+ * if it has no probes.
+ */
+static uint64_t probe_mask(const struct srd_decoder_inst *di)
+{
+	uint64_t mask;
+	int i;
+
+	mask = 0;
+	for (i = 0; i < di->dec_num_probes; i++) {
+		/* A probemap value of -1 means "unused optional probe". */
+		if (di->dec_probemap[i] != -1)
+			mask |= (uint64_t)1 << di->dec_probemap[i];
+	}
+
+	if (!mask) {
+		if (di->data_num_probes >= 64)
+			mask = ~(uint64_t)0;
+		else
+			mask = ((uint64_t)1 << di->data_num_probes) - 1;
+	}
+
+	return mask;
+}
+
 /**
  * Start a decoding session.
  *
  * Decoders, instances and stack must have been prepared beforehand.
  *
+ * If a batch callback is registered, it gets all annotations which the
+ * decoders sent from their start() method before this returns.
+ *
  * @param num_probes The number of probes which the incoming feed will contain.
  * @param unitsize The number of bytes per sample in the incoming feed.
  * @param samplerate The samplerate of the incoming feed.
@@ -751,18 +1017,252 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 		di->data_num_probes = num_probes;
 		di->data_unitsize = unitsize;
 		di->data_samplerate = samplerate;
+		di->edge_mask = probe_mask(di);
+		di->edge_started = FALSE;
 		if ((ret = srd_inst_start(di, args)) != SRD_OK)
 			break;
 	}
 
 	Py_DecRef(args);
 
+	/* Annotations sent from start() shouldn't wait for the first chunk. */
+	batch_flush();
+
+	return ret;
+}
+
+/* Run one decoder stack, queueing its annotations. */
+static void session_job_run(struct session_job *job)
+{
+	g_static_private_set(&session_job, job, NULL);
+	if (job->lengths)
+		job->ret = inst_decode_rle(job->start_samplenum, job->di,
+					   job->inbuf, job->lengths,
+					   job->num_runs);
+	else
+		job->ret = srd_inst_decode(job->start_samplenum, job->di,
+					   job->inbuf, job->inbuflen);
+	g_static_private_set(&session_job, NULL, NULL);
+}
+
+static void session_worker(gpointer data, gpointer user_data)
+{
+	(void)user_data;
+
+	session_job_run(data);
+
+	g_mutex_lock(session_mutex);
+	if (--session_pending == 0)
+		g_cond_signal(session_cond);
+	g_mutex_unlock(session_mutex);
+}
+
+static void session_threads_free(void)
+{
+	if (!session_pool)
+		return;
+
+	/* Wait for running jobs, there shouldn't be any. */
+	g_thread_pool_free(session_pool, FALSE, TRUE);
+	session_pool = NULL;
+	g_mutex_free(session_mutex);
+	session_mutex = NULL;
+	g_cond_free(session_cond);
+	session_cond = NULL;
+}
+
+/* Hand an annotation to the frontend. */
+static void ann_callback(struct srd_proto_data *pdata)
+{
+	GSList *l;
+	struct srd_pd_callback *pd_cb;
+
+	for (l = callbacks; l; l = l->next) {
+		pd_cb = l->data;
+		if (pd_cb->output_type == SRD_OUTPUT_ANN) {
+			pd_cb->cb(pdata, pd_cb->cb_data);
+			break;
+		}
+	}
+}
+
+/*
+ * Deliver an annotation whose strings (pdata->data) were allocated for
+ * it: add it to the batch, or hand it to the callback and free it.
+ */
+static void ann_deliver(struct srd_proto_data *pdata)
+{
+	if (batch_cb) {
+		g_array_append_val(batch, *pdata);
+		return;
+	}
+
+	ann_callback(pdata);
+	g_strfreev(pdata->data);
+}
+
+/* Hand the batch of annotations to the frontend, and empty it. */
+static void batch_flush(void)
+{
+	if (!batch || !batch->len)
+		return;
+
+	srd_spew("Delivering a batch of %u annotations.", batch->len);
+	batch_cb((struct srd_proto_data *)batch->data, batch->len,
+		 batch_cb_data);
+
+	batch_clear();
+}
+
+/* Free the annotations in the batch, and empty it. */
+static void batch_clear(void)
+{
+	guint i;
+
+	for (i = 0; i < batch->len; i++)
+		g_strfreev(g_array_index(batch, struct srd_proto_data, i).data);
+	/* Keep the memory for the next chunk. */
+	g_array_set_size(batch, 0);
+}
+
+/*
+ * Deliver the queued annotations of all jobs, by start sample. Those of
+ * one stack keep their order, and on equal start samples the stack which
+ * was created first goes first.
+ */
+static void session_anns_deliver(struct session_job *jobs, guint num_jobs)
+{
+	struct session_job *job;
+	struct srd_proto_data *pdata, *first;
+	guint i;
+
+	while (TRUE) {
+		job = NULL;
+		first = NULL;
+		for (i = 0; i < num_jobs; i++) {
+			if (jobs[i].next == jobs[i].anns->len)
+				continue;
+			pdata = &g_array_index(jobs[i].anns,
+					       struct srd_proto_data,
+					       jobs[i].next);
+			if (!first ||
+			    pdata->start_sample < first->start_sample) {
+				job = &jobs[i];
+				first = pdata;
+			}
+		}
+		if (!job)
+			break;
+
+		job->next++;
+		ann_deliver(first);
+	}
+}
+
+/*
+ * Send a chunk to all stacks: the native ones on the worker threads, the
+ * Python ones here. The chunk is shared by all of them, not copied.
+ */
+static int session_send_parallel(uint64_t start_samplenum,
+				 const uint8_t *inbuf, uint64_t inbuflen,
+				 const uint32_t *lengths, uint64_t num_runs)
+{
+	struct session_job *jobs;
+	GSList *d;
+	guint num_jobs, i;
+	int ret;
+
+	num_jobs = g_slist_length(di_list);
+	if (!(jobs = g_try_malloc0(num_jobs * sizeof(struct session_job)))) {
+		srd_err("Failed to g_malloc() session jobs.");
+		return SRD_ERR_MALLOC;
+	}
+
+	session_pending = 0;
+	for (d = di_list, i = 0; d; d = d->next, i++) {
+		jobs[i].di = d->data;
+		jobs[i].start_samplenum = start_samplenum;
+		jobs[i].inbuf = inbuf;
+		jobs[i].inbuflen = inbuflen;
+		jobs[i].lengths = lengths;
+		jobs[i].num_runs = num_runs;
+		jobs[i].anns = g_array_new(FALSE, FALSE,
+					   sizeof(struct srd_proto_data));
+		if (jobs[i].di->decoder->native)
+			session_pending++;
+	}
+
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].di->decoder->native)
+			g_thread_pool_push(session_pool, &jobs[i], NULL);
+	}
+
+	for (i = 0; i < num_jobs; i++) {
+		if (!jobs[i].di->decoder->native)
+			session_job_run(&jobs[i]);
+	}
+
+	/* Let the workers have the GIL while waiting for them. */
+	Py_BEGIN_ALLOW_THREADS
+	g_mutex_lock(session_mutex);
+	while (session_pending > 0)
+		g_cond_wait(session_cond, session_mutex);
+	g_mutex_unlock(session_mutex);
+	Py_END_ALLOW_THREADS
+
+	session_anns_deliver(jobs, num_jobs);
+
+	ret = SRD_OK;
+	for (i = 0; i < num_jobs; i++) {
+		if (ret == SRD_OK)
+			ret = jobs[i].ret;
+		g_array_free(jobs[i].anns, TRUE);
+	}
+	g_free(jobs);
+
+	return ret;
+}
+
+/*
+ * Send a chunk to all stacks. 'lengths' is NULL for plain samples,
+ * otherwise inbuf holds the values of 'num_runs' runs.
+ */
+static int session_send(uint64_t start_samplenum, const uint8_t *inbuf,
+			uint64_t inbuflen, const uint32_t *lengths,
+			uint64_t num_runs)
+{
+	GSList *d;
+	int ret;
+
+	/* Stacks only run in parallel if there is more than one. */
+	if (session_pool && di_list && di_list->next) {
+		ret = session_send_parallel(start_samplenum, inbuf, inbuflen,
+					    lengths, num_runs);
+	} else {
+		ret = SRD_OK;
+		for (d = di_list; d && ret == SRD_OK; d = d->next) {
+			if (lengths)
+				ret = inst_decode_rle(start_samplenum, d->data,
+						      inbuf, lengths,
+						      num_runs);
+			else
+				ret = srd_inst_decode(start_samplenum, d->data,
+						      inbuf, inbuflen);
+		}
+	}
+
+	/* Whatever was decoded, the frontend gets it. */
+	batch_flush();
+
 	return ret;
 }
 
 /**
  * Send a chunk of logic sample data to a running decoder session.
  *
+ * If a batch callback is registered, it gets all annotations which were
+ * sent while decoding the chunk before this returns.
+ *
  * @param start_samplenum The sample number of the first sample in this chunk.
  * @param inbuf Pointer to sample data.
  * @param inbuflen Length in bytes of the buffer.
@@ -772,19 +1272,99 @@ SRD_API int srd_session_start(int num_probes, int unitsize, uint64_t samplerate)
 SRD_API int srd_session_send(uint64_t start_samplenum, const uint8_t *inbuf,
 			     uint64_t inbuflen)
 {
-	GSList *d;
-	int ret;
-
 	srd_dbg("Calling decode() on all instances with starting sample "
 		"number %" PRIu64 ", %" PRIu64 " bytes at 0x%p",
 		start_samplenum, inbuflen, inbuf);
 
-	for (d = di_list; d; d = d->next) {
-		if ((ret = srd_inst_decode(start_samplenum, d->data, inbuf,
-					   inbuflen)) != SRD_OK)
-			return ret;
+	return session_send(start_samplenum, inbuf, inbuflen, NULL, 0);
+}
+
+/**
+ * Send a chunk of run-length encoded logic sample data to a running decoder
+ * session.
+ *
+ * Run n is lengths[n] consecutive samples of the value values[n], with
+ * the unit size passed to srd_session_start(). Decoders walk the runs
+ * directly, so an edges_only one only looks at the first sample of every
+ * run. Decoders with a decode_chunk() method get the samples expanded.
+ *
+ * If a batch callback is registered, it gets all annotations which were
+ * sent while decoding the chunk before this returns.
+ *
+ * @param start_samplenum The sample number of the first sample in this chunk.
+ * @param values The values of the runs. Must not be NULL.
+ * @param lengths The lengths of the runs, in samples. Must not be NULL.
+ * @param num_runs The number of runs.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_session_send_rle(uint64_t start_samplenum,
+				 const uint8_t *values,
+				 const uint32_t *lengths, uint64_t num_runs)
+{
+	if (!values || !lengths) {
+		srd_err("Invalid run-length encoded chunk.");
+		return SRD_ERR_ARG;
 	}
 
+	srd_dbg("Calling decode() on all instances with starting sample "
+		"number %" PRIu64 ", %" PRIu64 " runs at 0x%p",
+		start_samplenum, num_runs, values);
+
+	return session_send(start_samplenum, values, 0, lengths, num_runs);
+}
+
+/**
+ * Set the number of threads a decoding session may use.
+ *
+ * With more than one thread, srd_session_send() runs every decoder stack
+ * whose bottom decoder is a native one on a pool of worker threads. The
+ * stacks of Python decoders meanwhile run on the calling thread, since they
+ * all share one Python interpreter. All annotations of the chunk are then
+ * sent to the callback on the calling thread, in order of their start
+ * sample, before srd_session_send() returns.
+ *
+ * Log messages may come from the worker threads.
+ *
+ * This must be called after srd_init(), and not from within a callback.
+ *
+ * @param num_threads The maximum number of worker threads. With 0 or 1
+ *                    (the default), all stacks are run one after another
+ *                    on the calling thread.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_session_threads_set(int num_threads)
+{
+	GError *error;
+
+	if (num_threads < 0) {
+		srd_err("Invalid number of threads %d.", num_threads);
+		return SRD_ERR_ARG;
+	}
+
+	session_threads_free();
+	if (num_threads <= 1)
+		return SRD_OK;
+
+	if (!g_thread_supported())
+		g_thread_init(NULL);
+
+	/* Workers take the GIL to pass protocol data up their stack. */
+	PyEval_InitThreads();
+
+	error = NULL;
+	if (!(session_pool = g_thread_pool_new(session_worker, NULL,
+					       num_threads, FALSE, &error))) {
+		srd_err("Failed to create thread pool: %s.", error->message);
+		g_error_free(error);
+		return SRD_ERR;
+	}
+	session_mutex = g_mutex_new();
+	session_cond = g_cond_new();
+
+	srd_dbg("Decoding with up to %d threads.", num_threads);
+
 	return SRD_OK;
 }
 
@@ -838,9 +1418,57 @@ SRD_PRIV void *srd_pd_output_callback_find(int output_type)
 	return cb;
 }
 
-/* This is the backend function to Python sigrokdecode.add() call. */
-SRD_PRIV int srd_inst_pd_output_add(struct srd_decoder_inst *di,
-				    int output_type, const char *proto_id)
+/**
+ * Register the callback for batches of annotations.
+ *
+ * Annotations are then collected while srd_session_send() decodes a chunk,
+ * and delivered in one call to this callback at the end of it, instead of
+ * one call per annotation to the SRD_OUTPUT_ANN callback. Only one batch
+ * callback can be registered.
+ *
+ * @param cb The function to call. Must not be NULL.
+ * @param cb_data Private data for the callback function. Can be NULL.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_pd_output_batch_callback_add(srd_pd_output_batch_callback_t cb,
+					     void *cb_data)
+{
+	srd_dbg("Registering new callback for annotation batches.");
+
+	if (!cb) {
+		srd_err("Invalid batch callback.");
+		return SRD_ERR_ARG;
+	}
+
+	if (!batch)
+		batch = g_array_new(FALSE, FALSE, sizeof(struct srd_proto_data));
+	batch_cb = cb;
+	batch_cb_data = cb_data;
+
+	return SRD_OK;
+}
+
+/* Whether the frontend takes annotations at all. */
+SRD_PRIV gboolean srd_pd_output_ann_wanted(void)
+{
+	return batch_cb || srd_pd_output_callback_find(SRD_OUTPUT_ANN);
+}
+
+/**
+ * Create a new output stream for a decoder instance.
+ *
+ * This is the backend function to Python sigrokdecode.add() call, and what
+ * native decoders call in their start() callback.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param output_type The output type (SRD_OUTPUT_ANN, SRD_OUTPUT_PROTO, ...).
+ * @param proto_id The ID of the protocol on this output. Must not be NULL.
+ *
+ * @return The output ID (>= 0) upon success, -1 otherwise.
+ */
+SRD_API int srd_inst_pd_output_add(struct srd_decoder_inst *di,
+				   int output_type, const char *proto_id)
 {
 	struct srd_pd_output *pdo;
 
@@ -852,12 +1480,193 @@ SRD_PRIV int srd_inst_pd_output_add(struct srd_decoder_inst *di,
 		return -1;
 	}
 
+	if (!di->pd_output)
+		di->pd_output = g_ptr_array_new();
+
 	/* pdo_id is just a simple index, nothing is deleted from this list anyway. */
-	pdo->pdo_id = g_slist_length(di->pd_output);
+	pdo->pdo_id = di->pd_output->len;
 	pdo->output_type = output_type;
 	pdo->di = di;
 	pdo->proto_id = g_strdup(proto_id);
-	di->pd_output = g_slist_append(di->pd_output, pdo);
+	g_ptr_array_add(di->pd_output, pdo);
 
 	return pdo->pdo_id;
 }
+
+/* The output of a decoder instance, or NULL if there's no such output. */
+SRD_PRIV struct srd_pd_output *srd_inst_output_get(
+		const struct srd_decoder_inst *di, int output_id)
+{
+	if (!di->pd_output || output_id < 0 ||
+	    (guint)output_id >= di->pd_output->len)
+		return NULL;
+
+	return g_ptr_array_index(di->pd_output, output_id);
+}
+
+/* Find the output of a decoder instance, and check its type. */
+static struct srd_pd_output *output_find(struct srd_decoder_inst *di,
+					 int output_id, int output_type)
+{
+	struct srd_pd_output *pdo;
+
+	if (!(pdo = srd_inst_output_get(di, output_id))) {
+		srd_err("Protocol decoder %s submitted invalid output ID %d.",
+			di->decoder->name, output_id);
+		return NULL;
+	}
+
+	if (pdo->output_type != output_type) {
+		srd_err("Protocol decoder %s submitted output type %d to "
+			"output ID %d, which has type %d.", di->decoder->name,
+			output_type, output_id, pdo->output_type);
+		return NULL;
+	}
+
+	return pdo;
+}
+
+/*
+ * Send an annotation to the frontend. If take is TRUE, ann was allocated
+ * for this (as with g_strdupv()), and is freed when no longer needed.
+ */
+static int inst_put_ann(struct srd_decoder_inst *di, int output_id,
+			uint64_t start_sample, uint64_t end_sample,
+			int ann_format, char **ann, gboolean take)
+{
+	struct srd_pd_output *pdo;
+	struct srd_proto_data pdata;
+	struct session_job *job;
+
+	if (!(pdo = output_find(di, output_id, SRD_OUTPUT_ANN))) {
+		if (take)
+			g_strfreev(ann);
+		return SRD_ERR_ARG;
+	}
+
+	if (ann_format < 0 || ann_format >= di->decoder->num_annotations) {
+		srd_err("Protocol decoder %s submitted data to unregistered "
+			"annotation format %d.", di->decoder->name, ann_format);
+		if (take)
+			g_strfreev(ann);
+		return SRD_ERR_ARG;
+	}
+
+	pdata.start_sample = start_sample;
+	pdata.end_sample = end_sample;
+	pdata.pdo = pdo;
+	pdata.ann_format = ann_format;
+
+	/* Stacks running in parallel queue theirs, see srd_session_send(). */
+	job = session_pool ? g_static_private_get(&session_job) : NULL;
+
+	if (!job && !batch_cb) {
+		/* Annotations are only fed to callbacks. */
+		pdata.data = ann;
+		ann_callback(&pdata);
+		if (take)
+			g_strfreev(ann);
+		return SRD_OK;
+	}
+
+	/* Keep the annotation until the end of srd_session_send(). */
+	pdata.data = take ? ann : g_strdupv(ann);
+	if (job)
+		g_array_append_val(job->anns, pdata);
+	else
+		g_array_append_val(batch, pdata);
+
+	return SRD_OK;
+}
+
+/**
+ * Send an annotation to the frontend.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param output_id The annotation output, see srd_inst_pd_output_add().
+ * @param start_sample The first sample the annotation is about.
+ * @param end_sample The last sample the annotation is about.
+ * @param ann_format The annotation format, i.e. its index in the decoder's
+ *                   list of annotations.
+ * @param ann A NULL-terminated list of annotation strings, longest first.
+ *            It's only used during the call, and must not be NULL.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_inst_put_ann(struct srd_decoder_inst *di, int output_id,
+			     uint64_t start_sample, uint64_t end_sample,
+			     int ann_format, const char **ann)
+{
+	return inst_put_ann(di, output_id, start_sample, end_sample,
+			    ann_format, (char **)ann, FALSE);
+}
+
+/*
+ * Like srd_inst_put_ann(), but takes over ann, which must have been
+ * allocated as with g_strdupv(). This saves copying it for the batch.
+ */
+SRD_PRIV int srd_inst_put_ann_take(struct srd_decoder_inst *di, int output_id,
+				   uint64_t start_sample, uint64_t end_sample,
+				   int ann_format, char **ann)
+{
+	return inst_put_ann(di, output_id, start_sample, end_sample,
+			    ann_format, ann, TRUE);
+}
+
+/* Pass protocol data on to a decoder instance stacked on top of another. */
+static void inst_decode_proto(struct srd_decoder_inst *di,
+			      uint64_t start_sample, uint64_t end_sample,
+			      PyObject *data)
+{
+	PyObject *py_res;
+
+	srd_spew("Sending %" PRIu64 "-%" PRIu64 " to instance %s",
+		 start_sample, end_sample, di->inst_id);
+
+	if (di->decoder->native) {
+		if (!di->decoder->native->decode_proto) {
+			srd_err("Protocol decoder %s takes no protocol input.",
+				di->decoder->name);
+			return;
+		}
+		di->decoder->native->decode_proto(di, start_sample,
+						  end_sample, data);
+		return;
+	}
+
+	if (!(py_res = PyObject_CallMethod(di->py_inst, "decode", "KKO",
+					   start_sample, end_sample, data))) {
+		srd_exception_catch("Calling %s decode(): ", di->inst_id);
+	}
+	Py_XDECREF(py_res);
+}
+
+/**
+ * Send protocol data to the decoder instances stacked on top of this one.
+ *
+ * Since nothing is done with the data if there are none (di->next_di is
+ * NULL), decoders don't need to build it in that case.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param output_id The protocol output, see srd_inst_pd_output_add().
+ * @param start_sample The first sample the data is about.
+ * @param end_sample The last sample the data is about.
+ * @param data The data, in the form the protocol's decoders expect it.
+ *             The caller keeps its reference. Must not be NULL.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_inst_put_proto(struct srd_decoder_inst *di, int output_id,
+			       uint64_t start_sample, uint64_t end_sample,
+			       PyObject *data)
+{
+	GSList *l;
+
+	if (!output_find(di, output_id, SRD_OUTPUT_PROTO))
+		return SRD_ERR_ARG;
+
+	for (l = di->next_di; l; l = l->next)
+		inst_decode_proto(l->data, start_sample, end_sample, data);
+
+	return SRD_OK;
+}
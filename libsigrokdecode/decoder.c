@@ -22,6 +22,7 @@
 #include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
 #include "sigrokdecode-internal.h"
 #include <glib.h>
+#include <stdlib.h>
 
 /* The list of protocol decoders. */
 SRD_PRIV GSList *pd_list = NULL;
@@ -62,6 +63,25 @@ SRD_API struct srd_decoder *srd_decoder_get_by_id(const char *id)
 	return NULL;
 }
 
+/*
+ * Find the built-in native decoder for a module name, unless they were
+ * disabled (for comparing them to the Python decoders, say).
+ */
+static const struct srd_decoder_native *native_find(const char *module_name)
+{
+	const struct srd_decoder_native **nd;
+
+	if (getenv("SIGROKDECODE_NO_NATIVE"))
+		return NULL;
+
+	for (nd = srd_native_decoder_list(); *nd; nd++) {
+		if (!strcmp((*nd)->id, module_name))
+			return *nd;
+	}
+
+	return NULL;
+}
+
 static int get_probes(const struct srd_decoder *d, const char *attr,
 		      GSList **pl)
 {
@@ -136,6 +156,11 @@ SRD_API int srd_decoder_load(const char *module_name)
 	char **ann;
 	struct srd_probe *p;
 	GSList *l;
+	const struct srd_decoder_native *nd;
+
+	/* A native implementation takes precedence. */
+	if ((nd = native_find(module_name)))
+		return srd_decoder_native_register(nd);
 
 	srd_dbg("Loading protocol decoder '%s'.", module_name);
 
@@ -190,19 +215,41 @@ SRD_API int srd_decoder_load(const char *module_name)
 	}
 	Py_CLEAR(py_method);
 
-	/* Check for a proper decode() method. */
-	if (!PyObject_HasAttrString(d->py_dec, "decode")) {
+	/*
+	 * Check for a proper decode() method, or a decode_chunk() method
+	 * (which takes precedence for logic input), or both.
+	 */
+	d->chunked = PyObject_HasAttrString(d->py_dec, "decode_chunk");
+	if (!d->chunked && !PyObject_HasAttrString(d->py_dec, "decode")) {
 		srd_err("Protocol decoder %s has no decode() method Decoder "
 			"class.", module_name);
 		goto err_out;
 	}
-	py_method = PyObject_GetAttrString(d->py_dec, "decode");
-	if (!PyFunction_Check(py_method)) {
-		srd_err("Protocol decoder %s Decoder class attribute 'decode' "
-			"is not a method.", module_name);
-		goto err_out;
+	if (PyObject_HasAttrString(d->py_dec, "decode")) {
+		py_method = PyObject_GetAttrString(d->py_dec, "decode");
+		if (!PyFunction_Check(py_method)) {
+			srd_err("Protocol decoder %s Decoder class attribute "
+				"'decode' is not a method.", module_name);
+			goto err_out;
+		}
+		Py_CLEAR(py_method);
+	}
+	if (d->chunked) {
+		py_method = PyObject_GetAttrString(d->py_dec, "decode_chunk");
+		if (!PyFunction_Check(py_method)) {
+			srd_err("Protocol decoder %s Decoder class attribute "
+				"'decode_chunk' is not a method.", module_name);
+			goto err_out;
+		}
+		Py_CLEAR(py_method);
+	}
+
+	/* If present, edges_only turns on edge-only sample delivery. */
+	if (PyObject_HasAttrString(d->py_dec, "edges_only")) {
+		py_attr = PyObject_GetAttrString(d->py_dec, "edges_only");
+		d->edges_only = PyObject_IsTrue(py_attr) == 1;
+		Py_DecRef(py_attr);
 	}
-	Py_CLEAR(py_method);
 
 	/* If present, options must be a dictionary. */
 	if (PyObject_HasAttrString(d->py_dec, "options")) {
@@ -276,6 +323,7 @@ SRD_API int srd_decoder_load(const char *module_name)
 				goto err_out;
 			}
 			d->annotations = g_slist_append(d->annotations, ann);
+			d->num_annotations++;
 		}
 	}
 
@@ -309,6 +357,9 @@ SRD_API char *srd_decoder_doc_get(const struct srd_decoder *dec)
 	PyObject *py_str;
 	char *doc;
 
+	if (dec->native)
+		return g_strdup(dec->native->doc);
+
 	if (!PyObject_HasAttrString(dec->py_mod, "__doc__"))
 		return NULL;
 
@@ -343,6 +394,115 @@ static void free_probes(GSList *probelist)
 	g_slist_free(probelist);
 }
 
+/* Copy a native decoder's probes into a list of struct srd_probe. */
+static int native_probes(const struct srd_native_probe *np, int order,
+			 GSList **pl)
+{
+	struct srd_probe *p;
+
+	for (; np && np->id; np++) {
+		if (!(p = g_try_malloc(sizeof(struct srd_probe)))) {
+			srd_err("Failed to g_malloc() struct srd_probe.");
+			return SRD_ERR_MALLOC;
+		}
+		p->id = g_strdup(np->id);
+		p->name = g_strdup(np->name);
+		p->desc = g_strdup(np->desc);
+		p->order = order++;
+		*pl = g_slist_append(*pl, p);
+	}
+
+	return SRD_OK;
+}
+
+/**
+ * Register a protocol decoder implemented in C.
+ *
+ * It's added to the list of loaded decoders, just like srd_decoder_load()
+ * does for Python decoders. The built-in native decoders are registered by
+ * srd_decoder_load() itself, instead of the Python decoder of the same name
+ * (unless the SIGROKDECODE_NO_NATIVE environment variable is set).
+ *
+ * @param nd The decoder. It isn't copied, so it must stay around until the
+ *           decoder is unloaded. Must not be NULL.
+ *
+ * @return SRD_OK upon success, a (negative) error code otherwise.
+ */
+SRD_API int srd_decoder_native_register(const struct srd_decoder_native *nd)
+{
+	struct srd_decoder *d;
+	char **ann;
+	int ret, i;
+
+	if (!nd->id || !nd->name || !nd->longname || !nd->desc
+	    || !nd->license) {
+		srd_err("Native protocol decoder %s lacks a required field.",
+			nd->id ? nd->id : "(unknown)");
+		return SRD_ERR_ARG;
+	}
+	if (!nd->decode && !nd->decode_proto) {
+		srd_err("Native protocol decoder %s has no decode callback.",
+			nd->id);
+		return SRD_ERR_ARG;
+	}
+	if (nd->options && nd->options->id && !nd->option_set) {
+		srd_err("Native protocol decoder %s has options, but no "
+			"option_set callback.", nd->id);
+		return SRD_ERR_ARG;
+	}
+
+	srd_dbg("Registering native protocol decoder '%s'.", nd->id);
+
+	if (!(d = g_try_malloc0(sizeof(struct srd_decoder)))) {
+		srd_err("Failed to g_malloc() struct srd_decoder.");
+		return SRD_ERR_MALLOC;
+	}
+	d->id = g_strdup(nd->id);
+	d->name = g_strdup(nd->name);
+	d->longname = g_strdup(nd->longname);
+	d->desc = g_strdup(nd->desc);
+	d->license = g_strdup(nd->license);
+	d->edges_only = nd->edges_only;
+	d->native = nd;
+
+	/* Optional probes are numbered after the required ones. */
+	if ((ret = native_probes(nd->probes, 0, &d->probes)) != SRD_OK)
+		goto err_out;
+	if ((ret = native_probes(nd->opt_probes, g_slist_length(d->probes),
+				 &d->opt_probes)) != SRD_OK)
+		goto err_out;
+
+	for (i = 0; nd->annotations && nd->annotations[i][0]; i++) {
+		if (!(ann = g_try_malloc0(3 * sizeof(char *)))) {
+			srd_err("Failed to g_malloc() annotation.");
+			ret = SRD_ERR_MALLOC;
+			goto err_out;
+		}
+		ann[0] = g_strdup(nd->annotations[i][0]);
+		ann[1] = g_strdup(nd->annotations[i][1]);
+		d->annotations = g_slist_append(d->annotations, ann);
+		d->num_annotations++;
+	}
+
+	/* Append it to the list of supported/loaded decoders. */
+	pd_list = g_slist_append(pd_list, d);
+
+	return SRD_OK;
+
+err_out:
+	free_probes(d->probes);
+	free_probes(d->opt_probes);
+	g_slist_free_full(d->annotations, (GDestroyNotify)g_strfreev);
+	g_free(d->id);
+	g_free(d->name);
+	g_free(d->longname);
+	g_free(d->desc);
+	g_free(d->license);
+	g_free(d);
+
+	return ret;
+}
+
 /**
  * Unload decoder module.
  *
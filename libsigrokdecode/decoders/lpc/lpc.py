@@ -106,6 +106,7 @@ class Decoder(srd.Decoder):
     license = 'gplv2+'
     inputs = ['logic']
     outputs = ['lpc']
+    edges_only = True
     probes = [
         {'id': 'lframe', 'name': 'LFRAME#', 'desc': 'TODO'},
         {'id': 'lreset', 'name': 'LRESET#', 'desc': 'TODO'},
@@ -137,7 +138,6 @@ class Decoder(srd.Decoder):
         self.addr = 0
         self.cur_nibble = 0
         self.cycle_type = -1
-        self.oldpins = (-1, -1, -1, -1, -1, -1, -1)
 
     def start(self, metadata):
         self.out_proto = self.add(srd.OUTPUT_PROTO, 'lpc')
@@ -298,13 +298,6 @@ class Decoder(srd.Decoder):
     def decode(self, ss, es, data):
         for (samplenum, pins) in data:
 
-            # If none of the pins changed, there's nothing to do.
-            if self.oldpins == pins:
-                continue
-
-            # Store current pin values for the next round.
-            self.oldpins = pins
-
             # Get individual pin values into local variables.
             # TODO: Handle optional pins.
             (lframe, lreset, lclk, lad0, lad1, lad2, lad3) = pins
@@ -40,7 +40,7 @@ class Decoder(srd.Decoder):
 
     def __init__(self, **kwargs):
         self.channels = -1
-        self.lastsample = None
+        self.oldbit = None
 
     def start(self, metadata):
         # self.out_proto = self.add(srd.OUTPUT_PROTO, 'transitioncounter')
@@ -49,43 +49,34 @@ class Decoder(srd.Decoder):
     def report(self):
         pass
 
-    def decode(self, ss, es, data):
-
-        for (samplenum, s) in data:
-
-            # ...
-            if self.channels == -1:
-                self.channels = len(s)
-                self.oldbit = [0] * self.channels
-                self.transitions = [0] * self.channels
-                self.rising = [0] * self.channels
-                self.falling = [0] * self.channels
-
-            # Optimization: Skip identical samples (no transitions).
-            if self.lastsample == s:
-                continue
-
-            # Upon the first sample, store the initial values.
-            if self.lastsample == None:
-                self.lastsample = s
-                for i in range(self.channels):
-                    self.oldbit[i] = self.lastsample[i]
-
-            # Iterate over all channels/probes in this sample.
-            # Count rising and falling edges for each channel.
-            for i in range(self.channels):
-                curbit = s[i]
-                # Optimization: Skip identical bits (no transitions).
-                if self.oldbit[i] == curbit:
-                    continue
-                elif (self.oldbit[i] == 0 and curbit == 1):
+    def decode_chunk(self, ss, es, chunk):
+
+        if self.channels == -1:
+            self.channels = chunk.num_probes
+            self.transitions = [0] * self.channels
+            self.rising = [0] * self.channels
+            self.falling = [0] * self.channels
+
+        if chunk.num_samples == 0:
+            return
+
+        # Count rising and falling edges for each channel/probe, on a
+        # bytes object with one 0/1 byte per sample. The edge patterns
+        # can't overlap, so bytes.count() finds all of them.
+        for i in range(self.channels):
+            plane = chunk.bitplane(i)
+            self.rising[i] += plane.count(b'\x00\x01')
+            self.falling[i] += plane.count(b'\x01\x00')
+
+            # Edges between the last chunk and this one.
+            if self.oldbit != None:
+                if self.oldbit[i] == 0 and plane[0] == 1:
                     self.rising[i] += 1
-                elif (self.oldbit[i] == 1 and curbit == 0):
+                elif self.oldbit[i] == 1 and plane[0] == 0:
                     self.falling[i] += 1
-                self.oldbit[i] = curbit
 
-            # Save the current sample as 'lastsample' for the next round.
-            self.lastsample = s
+        # Save the last sample's bits for the next round.
+        self.oldbit = [chunk.bitplane(i)[-1] for i in range(self.channels)]
 
         # Total number of transitions = rising + falling edges.
         for i in range(self.channels):
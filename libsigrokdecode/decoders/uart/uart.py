@@ -65,6 +65,7 @@ class Decoder(srd.Decoder):
     license = 'gplv2+'
     inputs = ['logic']
     outputs = ['uart']
+    edges_only = True
     probes = [
         # Allow specifying only one of the signals, e.g. if only one data
         # direction exists (or is relevant).
@@ -103,7 +104,6 @@ class Decoder(srd.Decoder):
         self.startsample = [-1, -1]
         self.state = ['WAIT FOR START BIT', 'WAIT FOR START BIT']
         self.oldbit = [None, None]
-        self.oldpins = None
 
     def start(self, metadata):
         self.samplerate = metadata['samplerate']
@@ -267,11 +267,7 @@ class Decoder(srd.Decoder):
     def decode(self, ss, es, data):
         # TODO: Either RX or TX could be omitted (optional probe).
         for (self.samplenum, pins) in data:
-
-            # Ignore identical samples early on (for performance reasons).
-            if self.oldpins == pins:
-                continue
-            self.oldpins, (rx, tx) = pins, pins
+            (rx, tx) = pins
 
             # First sample: Save RX/TX value.
             if self.oldbit[RX] == None:
@@ -26,6 +26,7 @@ extern SRD_PRIV PyTypeObject srd_Decoder_type;
 
 /* type_logic.c */
 extern SRD_PRIV PyTypeObject srd_logic_type;
+extern SRD_PRIV PyTypeObject srd_chunk_type;
 
 /*
  * When initialized, a reference to this module inside the Python interpreter
@@ -54,6 +55,9 @@ PyMODINIT_FUNC PyInit_sigrokdecode(void)
 	if (PyType_Ready(&srd_logic_type) < 0)
 		return NULL;
 
+	if (PyType_Ready(&srd_chunk_type) < 0)
+		return NULL;
+
 	mod = PyModule_Create(&sigrokdecode_module);
 	Py_INCREF(&srd_Decoder_type);
 	if (PyModule_AddObject(mod, "Decoder",
@@ -63,6 +67,10 @@ PyMODINIT_FUNC PyInit_sigrokdecode(void)
 	if (PyModule_AddObject(mod, "srd_logic",
 	    (PyObject *)&srd_logic_type) == -1)
 		return NULL;
+	Py_INCREF(&srd_chunk_type);
+	if (PyModule_AddObject(mod, "srd_chunk",
+	    (PyObject *)&srd_chunk_type) == -1)
+		return NULL;
 
 	/* expose output types as symbols in the sigrokdecode module */
 	if (PyModule_AddIntConstant(mod, "OUTPUT_ANN", SRD_OUTPUT_ANN) == -1)
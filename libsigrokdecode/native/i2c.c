@@ -0,0 +1,368 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2010-2011 Uwe Hermann <uwe@hermann-uwe.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * I2C protocol decoder.
+ *
+ * This is a port of decoders/i2c, with the same probes, options and output.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
+#include "config.h"
+#include <string.h>
+
+/* Probes, in the order of i2c_probes[]. */
+#define SCL 0
+#define SDA 1
+
+/* Annotation feed formats */
+#define ANN_SHIFTED       0
+#define ANN_SHIFTED_SHORT 1
+#define ANN_RAW           2
+
+enum {
+	FIND_START,
+	FIND_ADDRESS,
+	FIND_DATA,
+	FIND_ACK,
+};
+
+/* Commands, with their verbose and short annotation. */
+enum {
+	CMD_START,
+	CMD_START_REPEAT,
+	CMD_STOP,
+	CMD_ACK,
+	CMD_NACK,
+	CMD_ADDRESS_READ,
+	CMD_ADDRESS_WRITE,
+	CMD_DATA_READ,
+	CMD_DATA_WRITE,
+};
+
+static const char *proto[][2] = {
+	[CMD_START] = {"START", "S"},
+	[CMD_START_REPEAT] = {"START REPEAT", "Sr"},
+	[CMD_STOP] = {"STOP", "P"},
+	[CMD_ACK] = {"ACK", "A"},
+	[CMD_NACK] = {"NACK", "N"},
+	[CMD_ADDRESS_READ] = {"ADDRESS READ", "AR"},
+	[CMD_ADDRESS_WRITE] = {"ADDRESS WRITE", "AW"},
+	[CMD_DATA_READ] = {"DATA READ", "DR"},
+	[CMD_DATA_WRITE] = {"DATA WRITE", "DW"},
+};
+
+struct i2c {
+	int out_proto;
+	int out_ann;
+
+	int state;
+	uint64_t samplenum;
+	int64_t startsample;
+	int bitcount;
+	unsigned int databyte;
+	int wr;
+	gboolean is_repeat_start;
+	/* The previous values of SCL and SDA, or -1 before the first sample. */
+	int oldscl;
+	int oldsda;
+};
+
+static const struct srd_native_probe i2c_probes[] = {
+	{"scl", "SCL", "Serial clock line"},
+	{"sda", "SDA", "Serial data line"},
+	{NULL, NULL, NULL},
+};
+
+static const struct srd_native_option i2c_options[] = {
+	{"addressing", "Slave addressing (in bits)", "7"},
+	{NULL, NULL, NULL},
+};
+
+static const char *i2c_annotations[][2] = {
+	{"7-bit shifted hex",
+	 "Read/write bit shifted out from the 8-bit I2C slave address"},
+	{"7-bit shifted hex (short)",
+	 "Read/write bit shifted out from the 8-bit I2C slave address"},
+	{"Raw hex", "Unaltered raw data"},
+	{NULL, NULL},
+};
+
+static int i2c_inst_new(struct srd_decoder_inst *di)
+{
+	struct i2c *c;
+
+	if (!(c = g_try_malloc0(sizeof(struct i2c)))) {
+		srd_err("Failed to g_malloc() struct i2c.");
+		return SRD_ERR_MALLOC;
+	}
+	c->state = FIND_START;
+	c->startsample = -1;
+	c->wr = -1;
+	c->oldscl = c->oldsda = -1;
+	di->priv = c;
+
+	return SRD_OK;
+}
+
+static int i2c_option_set(struct srd_decoder_inst *di, const char *key,
+			  const char *value)
+{
+	int64_t addressing;
+
+	(void)di;
+
+	/* Only 7-bit addressing is implemented, as in the Python decoder. */
+	if (!strcmp(key, "addressing"))
+		return srd_native_option_int(value, 7, 10, &addressing);
+
+	return SRD_OK;
+}
+
+static int i2c_start(struct srd_decoder_inst *di, uint64_t samplerate)
+{
+	struct i2c *c;
+
+	(void)samplerate;
+
+	c = di->priv;
+	c->out_proto = srd_inst_pd_output_add(di, SRD_OUTPUT_PROTO, "i2c");
+	c->out_ann = srd_inst_pd_output_add(di, SRD_OUTPUT_ANN, "i2c");
+
+	return SRD_OK;
+}
+
+/* Send a command (with or without data byte) over the sample range. */
+static void put_cmd(struct srd_decoder_inst *di, struct i2c *c, int cmd,
+		    int data)
+{
+	const char *ann[] = {NULL, NULL, NULL};
+	char str[8];
+
+	if (data < 0)
+		srd_native_put_proto(di, c->out_proto, c->startsample,
+				     c->samplenum, "[sO]", proto[cmd][0],
+				     Py_None);
+	else
+		srd_native_put_proto(di, c->out_proto, c->startsample,
+				     c->samplenum, "[si]", proto[cmd][0],
+				     data);
+
+	if (data >= 0) {
+		g_snprintf(str, sizeof(str), "0x%02x", data);
+		ann[1] = str;
+	}
+	ann[0] = proto[cmd][0];
+	srd_inst_put_ann(di, c->out_ann, c->startsample, c->samplenum,
+			 ANN_SHIFTED, ann);
+	ann[0] = proto[cmd][1];
+	srd_inst_put_ann(di, c->out_ann, c->startsample, c->samplenum,
+			 ANN_SHIFTED_SHORT, ann);
+}
+
+static void found_start(struct srd_decoder_inst *di, struct i2c *c)
+{
+	c->startsample = c->samplenum;
+
+	put_cmd(di, c, c->is_repeat_start ? CMD_START_REPEAT : CMD_START, -1);
+
+	c->state = FIND_ADDRESS;
+	c->bitcount = c->databyte = 0;
+	c->is_repeat_start = TRUE;
+	c->wr = -1;
+}
+
+/* Gather 8 bits of data plus the ACK/NACK bit. */
+static void found_address_or_data(struct srd_decoder_inst *di,
+				  struct i2c *c, int sda)
+{
+	const char *ann[] = {NULL, NULL};
+	char str[8];
+	int cmd, d;
+
+	/* Address and data are transmitted MSB-first. */
+	c->databyte <<= 1;
+	c->databyte |= sda;
+
+	if (c->bitcount == 0)
+		c->startsample = c->samplenum;
+
+	/* Return if we haven't collected all 8 + 1 bits, yet. */
+	if (++c->bitcount != 8)
+		return;
+
+	/*
+	 * We triggered on the ACK/NACK bit, but won't report that
+	 * until later.
+	 */
+	c->startsample--;
+
+	/*
+	 * Send raw output annotation before we start shifting out
+	 * read/write and ACK/NACK bits.
+	 */
+	g_snprintf(str, sizeof(str), "0x%.2x", c->databyte);
+	ann[0] = str;
+	srd_inst_put_ann(di, c->out_ann, c->startsample, c->samplenum,
+			 ANN_RAW, ann);
+
+	if (c->state == FIND_ADDRESS) {
+		/* The READ/WRITE bit is only in address bytes. */
+		c->wr = (c->databyte & 1) ? 0 : 1;
+		d = c->databyte >> 1;
+		cmd = c->wr ? CMD_ADDRESS_WRITE : CMD_ADDRESS_READ;
+	} else {
+		d = c->databyte;
+		cmd = c->wr ? CMD_DATA_WRITE : CMD_DATA_READ;
+	}
+
+	put_cmd(di, c, cmd, d);
+
+	/* Done with this packet. */
+	c->startsample = -1;
+	c->bitcount = c->databyte = 0;
+	c->state = FIND_ACK;
+}
+
+static void get_ack(struct srd_decoder_inst *di, struct i2c *c, int sda)
+{
+	c->startsample = c->samplenum;
+	put_cmd(di, c, (sda == 1) ? CMD_NACK : CMD_ACK, -1);
+
+	/*
+	 * There could be multiple data bytes in a row, so either find
+	 * another data byte or a STOP condition next.
+	 */
+	c->state = FIND_DATA;
+}
+
+static void found_stop(struct srd_decoder_inst *di, struct i2c *c)
+{
+	c->startsample = c->samplenum;
+	put_cmd(di, c, CMD_STOP, -1);
+
+	c->state = FIND_START;
+	c->is_repeat_start = FALSE;
+	c->wr = -1;
+}
+
+static int i2c_decode(struct srd_decoder_inst *di, uint64_t start_samplenum,
+		      const uint8_t *inbuf, uint64_t inbuflen)
+{
+	struct i2c *c;
+	uint64_t num_samples, i, sample;
+	int scl, sda;
+	gboolean start, data_bit, stop;
+
+	c = di->priv;
+	num_samples = inbuflen / di->data_unitsize;
+
+	/* Only the samples where SCL or SDA changed come through here. */
+	for (i = 0; srd_logic_next(di, inbuf, num_samples, &i, &sample); i++) {
+		c->samplenum = start_samplenum + i;
+		scl = srd_logic_probe(di, sample, SCL);
+		sda = srd_logic_probe(di, sample, SDA);
+
+		/* First sample: Save SCL/SDA value. */
+		if (c->oldscl == -1) {
+			c->oldscl = scl;
+			c->oldsda = sda;
+			continue;
+		}
+
+		/* START condition (S): SDA = falling, SCL = high */
+		start = c->oldsda == 1 && sda == 0 && scl == 1;
+		/* Data sampling of receiver: SCL = rising */
+		data_bit = c->oldscl == 0 && scl == 1;
+		/* STOP condition (P): SDA = rising, SCL = high */
+		stop = c->oldsda == 0 && sda == 1 && scl == 1;
+
+		/* State machine. */
+		switch (c->state) {
+		case FIND_START:
+			if (start)
+				found_start(di, c);
+			break;
+		case FIND_ADDRESS:
+			if (data_bit)
+				found_address_or_data(di, c, sda);
+			break;
+		case FIND_DATA:
+			if (data_bit)
+				found_address_or_data(di, c, sda);
+			else if (start)
+				found_start(di, c);
+			else if (stop)
+				found_stop(di, c);
+			break;
+		case FIND_ACK:
+			if (data_bit)
+				get_ack(di, c, sda);
+			break;
+		}
+
+		/* Save current SDA/SCL values for the next round. */
+		c->oldscl = scl;
+		c->oldsda = sda;
+	}
+
+	return SRD_OK;
+}
+
+static void i2c_inst_free(struct srd_decoder_inst *di)
+{
+	g_free(di->priv);
+	di->priv = NULL;
+}
+
+SRD_PRIV const struct srd_decoder_native srd_native_i2c = {
+	.id = "i2c",
+	.name = "I2C",
+	.longname = "Inter-Integrated Circuit",
+	.desc = "Two-wire, multi-master, serial bus.",
+	.license = "gplv2+",
+	.doc = "I2C protocol decoder (native).\n"
+	       "\n"
+	       "Protocol output format:\n"
+	       "\n"
+	       "I2C packet:\n"
+	       "[<cmd>, <data>]\n"
+	       "\n"
+	       "<cmd> is one of 'START', 'START REPEAT', 'ADDRESS READ', "
+	       "'ADDRESS WRITE',\n"
+	       "'DATA READ', 'DATA WRITE', 'STOP', 'ACK' and 'NACK'.\n"
+	       "\n"
+	       "<data> is the data or address byte associated with the "
+	       "'ADDRESS*' and 'DATA*'\n"
+	       "command. Slave addresses do not include bit 0 (the READ/WRITE "
+	       "indication bit).\n"
+	       "For 'START', 'START REPEAT', 'STOP', 'ACK', and 'NACK' <data> "
+	       "is None.\n",
+	.probes = i2c_probes,
+	.options = i2c_options,
+	.annotations = i2c_annotations,
+	.edges_only = TRUE,
+	.inst_new = i2c_inst_new,
+	.option_set = i2c_option_set,
+	.start = i2c_start,
+	.decode = i2c_decode,
+	.inst_free = i2c_inst_free,
+};
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2012 Bert Vermeulen <bert@biot.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
+#include "config.h"
+#include <stdarg.h>
+#include <stdlib.h>
+
+/*
+ * The built-in native decoders. srd_decoder_load() uses these instead of
+ * the Python decoders with the same ID.
+ */
+
+extern SRD_PRIV const struct srd_decoder_native srd_native_i2c;
+extern SRD_PRIV const struct srd_decoder_native srd_native_spi;
+extern SRD_PRIV const struct srd_decoder_native srd_native_uart;
+
+static const struct srd_decoder_native *native_decoder_list[] = {
+	&srd_native_i2c,
+	&srd_native_spi,
+	&srd_native_uart,
+	NULL,
+};
+
+SRD_PRIV const struct srd_decoder_native **srd_native_decoder_list(void)
+{
+	return native_decoder_list;
+}
+
+/**
+ * Parse an integer option value, the way Python decoders' options are.
+ *
+ * @param value The value. Must not be NULL.
+ * @param min The lowest valid value.
+ * @param max The highest valid value.
+ * @param out Upon success, the value. Must not be NULL.
+ *
+ * @return SRD_OK upon success, SRD_ERR_ARG if the value isn't an integer
+ *         between min and max.
+ */
+SRD_PRIV int srd_native_option_int(const char *value, int64_t min,
+				   int64_t max, int64_t *out)
+{
+	char *end;
+	long long val;
+
+	val = strtoll(value, &end, 0);
+	if (!*value || *end || val < min || val > max)
+		return SRD_ERR_ARG;
+	*out = val;
+
+	return SRD_OK;
+}
+
+/**
+ * Send protocol data to the decoders stacked on top of a native decoder.
+ *
+ * The data is only built (as with Py_BuildValue()) if there are any. The
+ * Python GIL is taken for this, so it can be called from any thread.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param output_id The protocol output.
+ * @param start_sample The first sample the data is about.
+ * @param end_sample The last sample the data is about.
+ * @param format The Py_BuildValue() format of the data, followed by its
+ *               arguments.
+ */
+SRD_PRIV void srd_native_put_proto(struct srd_decoder_inst *di, int output_id,
+				   uint64_t start_sample, uint64_t end_sample,
+				   const char *format, ...)
+{
+	PyObject *data;
+	PyGILState_STATE gstate;
+	va_list args;
+
+	if (!di->next_di)
+		return;
+
+	/* This may run on a session worker thread, see srd_session_send(). */
+	gstate = PyGILState_Ensure();
+
+	va_start(args, format);
+	data = Py_VaBuildValue(format, args);
+	va_end(args);
+	if (!data) {
+		srd_exception_catch("Protocol decoder instance %s: ",
+				    di->inst_id);
+		PyGILState_Release(gstate);
+		return;
+	}
+
+	srd_inst_put_proto(di, output_id, start_sample, end_sample, data);
+	Py_DecRef(data);
+
+	PyGILState_Release(gstate);
+}
@@ -0,0 +1,277 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011 Gareth McMullin <gareth@blacksphere.co.nz>
+ * Copyright (C) 2012 Uwe Hermann <uwe@hermann-uwe.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * SPI protocol decoder.
+ *
+ * This is a port of decoders/spi, with the same probes, options and output.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
+#include "config.h"
+#include <inttypes.h>
+#include <string.h>
+
+/* Probes, in the order of spi_probes[]. */
+#define MISO 0
+#define MOSI 1
+#define SCK  2
+#define CS   3
+
+/* Annotation formats */
+#define ANN_HEX 0
+
+struct spi {
+	/* Options */
+	gboolean cs_active_low;
+	int64_t cpol;
+	int64_t cpha;
+	gboolean msb_first;
+	int64_t wordsize;
+
+	int out_proto;
+	int out_ann;
+	/* The clock level (0/1) on which data is sampled. */
+	int sample_sck;
+
+	int oldsck;
+	int oldcs;
+	int bitcount;
+	uint64_t mosidata;
+	uint64_t misodata;
+	uint64_t start_sample;
+	gboolean cs_was_deasserted_during_data_word;
+};
+
+static const struct srd_native_probe spi_probes[] = {
+	{"miso", "MISO", "SPI MISO line (Master in, slave out)"},
+	{"mosi", "MOSI", "SPI MOSI line (Master out, slave in)"},
+	{"sck", "CLK", "SPI clock line"},
+	{"cs", "CS#", "SPI CS (chip select) line"},
+	{NULL, NULL, NULL},
+};
+
+static const struct srd_native_option spi_options[] = {
+	{"cs_polarity", "CS# polarity", "active-low"},
+	{"cpol", "Clock polarity", "0"},
+	{"cpha", "Clock phase", "0"},
+	{"bitorder", "Bit order within the SPI data", "msb-first"},
+	{"wordsize", "Word size of SPI data", "8"},
+	{NULL, NULL, NULL},
+};
+
+static const char *spi_annotations[][2] = {
+	{"Hex", "SPI data bytes in hex format"},
+	{NULL, NULL},
+};
+
+static int spi_inst_new(struct srd_decoder_inst *di)
+{
+	struct spi *s;
+
+	if (!(s = g_try_malloc0(sizeof(struct spi)))) {
+		srd_err("Failed to g_malloc() struct spi.");
+		return SRD_ERR_MALLOC;
+	}
+	s->oldsck = 1;
+	s->oldcs = -1;
+	di->priv = s;
+
+	return SRD_OK;
+}
+
+static int spi_option_set(struct srd_decoder_inst *di, const char *key,
+			  const char *value)
+{
+	struct spi *s;
+
+	s = di->priv;
+
+	if (!strcmp(key, "cs_polarity"))
+		s->cs_active_low = !strcmp(value, "active-low");
+	else if (!strcmp(key, "cpol"))
+		return srd_native_option_int(value, 0, 1, &s->cpol);
+	else if (!strcmp(key, "cpha"))
+		return srd_native_option_int(value, 0, 1, &s->cpha);
+	else if (!strcmp(key, "bitorder"))
+		s->msb_first = !strcmp(value, "msb-first");
+	else if (!strcmp(key, "wordsize"))
+		return srd_native_option_int(value, 1, 64, &s->wordsize);
+
+	return SRD_OK;
+}
+
+static int spi_start(struct srd_decoder_inst *di, uint64_t samplerate)
+{
+	struct spi *s;
+
+	(void)samplerate;
+
+	s = di->priv;
+	s->out_proto = srd_inst_pd_output_add(di, SRD_OUTPUT_PROTO, "spi");
+	s->out_ann = srd_inst_pd_output_add(di, SRD_OUTPUT_ANN, "spi");
+
+	/*
+	 * Sample data on rising/falling clock edge (depends on mode): modes
+	 * 0 and 3 (CPOL == CPHA) on rising edges, modes 1 and 2 on falling
+	 * ones.
+	 */
+	s->sample_sck = (s->cpol == s->cpha) ? 1 : 0;
+
+	return SRD_OK;
+}
+
+static void put_data(struct srd_decoder_inst *di, struct spi *s,
+		     uint64_t samplenum)
+{
+	const char *ann[] = {NULL, NULL};
+	char str[64];
+
+	srd_native_put_proto(di, s->out_proto, s->start_sample, samplenum,
+			     "[sKK]", "DATA", (unsigned long long)s->mosidata,
+			     (unsigned long long)s->misodata);
+
+	g_snprintf(str, sizeof(str), "MOSI: 0x%02" PRIx64 ", MISO: 0x%02"
+		   PRIx64, s->mosidata, s->misodata);
+	ann[0] = str;
+	srd_inst_put_ann(di, s->out_ann, s->start_sample, samplenum, ANN_HEX,
+			 ann);
+
+	if (s->cs_was_deasserted_during_data_word) {
+		ann[0] = "WARNING: CS# was deasserted during this SPI data "
+			 "byte!";
+		srd_inst_put_ann(di, s->out_ann, s->start_sample, samplenum,
+				 ANN_HEX, ann);
+	}
+}
+
+static int spi_decode(struct srd_decoder_inst *di, uint64_t start_samplenum,
+		      const uint8_t *inbuf, uint64_t inbuflen)
+{
+	struct spi *s;
+	const char *ann[] = {NULL, NULL};
+	char str[64];
+	uint64_t num_samples, samplenum, i, sample;
+	int miso, mosi, sck, cs, shift;
+	gboolean deasserted;
+
+	s = di->priv;
+	num_samples = inbuflen / di->data_unitsize;
+
+	/* Only the samples where one of the probes changed come through. */
+	for (i = 0; srd_logic_next(di, inbuf, num_samples, &i, &sample); i++) {
+		samplenum = start_samplenum + i;
+		miso = srd_logic_probe(di, sample, MISO);
+		mosi = srd_logic_probe(di, sample, MOSI);
+		sck = srd_logic_probe(di, sample, SCK);
+		cs = srd_logic_probe(di, sample, CS);
+
+		if (s->oldcs != cs) {
+			/* Send all CS# pin value changes. */
+			srd_native_put_proto(di, s->out_proto, samplenum,
+					     samplenum, "[sii]", "CS-CHANGE",
+					     s->oldcs, cs);
+			g_snprintf(str, sizeof(str), "CS-CHANGE: %d->%d",
+				   s->oldcs, cs);
+			ann[0] = str;
+			srd_inst_put_ann(di, s->out_ann, samplenum,
+					 samplenum, ANN_HEX, ann);
+			s->oldcs = cs;
+		}
+
+		/* Ignore sample if the clock pin hasn't changed. */
+		if (sck == s->oldsck)
+			continue;
+
+		s->oldsck = sck;
+
+		/* Only sample data on the right clock edge. */
+		if (sck != s->sample_sck && (sck == 0 || sck == 1))
+			continue;
+
+		/* If this is the first bit, save its sample number. */
+		if (s->bitcount == 0) {
+			s->start_sample = samplenum;
+			deasserted = s->cs_active_low ? cs != 0 : cs == 0;
+			if (deasserted)
+				s->cs_was_deasserted_during_data_word = TRUE;
+		}
+
+		/* Receive MOSI and MISO bits into our shift registers. */
+		if (s->msb_first)
+			shift = s->wordsize - 1 - s->bitcount;
+		else
+			shift = s->bitcount;
+		s->mosidata |= (uint64_t)mosi << shift;
+		s->misodata |= (uint64_t)miso << shift;
+
+		s->bitcount++;
+
+		/* Continue to receive if not enough bits were received, yet. */
+		if (s->bitcount != s->wordsize)
+			continue;
+
+		put_data(di, s, samplenum);
+
+		/* Reset decoder state. */
+		s->mosidata = 0;
+		s->misodata = 0;
+		s->bitcount = 0;
+	}
+
+	return SRD_OK;
+}
+
+static void spi_inst_free(struct srd_decoder_inst *di)
+{
+	g_free(di->priv);
+	di->priv = NULL;
+}
+
+SRD_PRIV const struct srd_decoder_native srd_native_spi = {
+	.id = "spi",
+	.name = "SPI",
+	.longname = "Serial Peripheral Interface",
+	.desc = "Full-duplex, synchronous, serial bus.",
+	.license = "gplv2+",
+	.doc = "Serial Peripheral Interface protocol decoder (native).\n"
+	       "\n"
+	       "Protocol output format:\n"
+	       "\n"
+	       "SPI packet:\n"
+	       "[<cmd>, <data1>, <data2>]\n"
+	       "\n"
+	       "Commands:\n"
+	       " - 'DATA': <data1> contains the MOSI data, <data2> contains "
+	       "the MISO data.\n"
+	       " - 'CS-CHANGE': <data1> is the old CS# pin value, <data2> is "
+	       "the new value.\n",
+	.probes = spi_probes,
+	.options = spi_options,
+	.annotations = spi_annotations,
+	.edges_only = TRUE,
+	.inst_new = spi_inst_new,
+	.option_set = spi_option_set,
+	.start = spi_start,
+	.decode = spi_decode,
+	.inst_free = spi_inst_free,
+};
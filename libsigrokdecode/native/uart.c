@@ -0,0 +1,518 @@
+/*
+ * This file is part of the sigrok project.
+ *
+ * Copyright (C) 2011-2012 Uwe Hermann <uwe@hermann-uwe.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+/*
+ * UART protocol decoder.
+ *
+ * This is a port of decoders/uart, with the same probes, options, output
+ * and sampling behaviour.
+ */
+
+#include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
+#include "config.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Used for differentiating between the two data directions. */
+#define RX 0
+#define TX 1
+
+/* Annotation feed formats */
+#define ANN_ASCII 0
+#define ANN_DEC   1
+#define ANN_HEX   2
+#define ANN_OCT   3
+#define ANN_BITS  4
+
+enum {
+	WAIT_FOR_START_BIT,
+	GET_START_BIT,
+	GET_DATA_BITS,
+	GET_PARITY_BIT,
+	GET_STOP_BITS,
+};
+
+enum {
+	PARITY_NONE,
+	PARITY_ODD,
+	PARITY_EVEN,
+	PARITY_ZERO,
+	PARITY_ONE,
+};
+
+struct uart {
+	/* Options */
+	int64_t baudrate;
+	int64_t num_data_bits;
+	int parity_type;
+	gboolean msb_first;
+
+	int out_proto;
+	int out_ann;
+	/* The width of one UART bit in number of samples. */
+	double bit_width;
+	uint64_t samplenum;
+
+	/* Per data direction. */
+	int state[2];
+	uint64_t frame_start[2];
+	int64_t startsample[2];
+	int cur_data_bit[2];
+	uint64_t databyte[2];
+	/* The previous value of the signal, or -1 before the first sample. */
+	int oldbit[2];
+};
+
+static const struct srd_native_probe uart_probes[] = {
+	{"rx", "RX", "UART receive line"},
+	{"tx", "TX", "UART transmit line"},
+	{NULL, NULL, NULL},
+};
+
+static const struct srd_native_option uart_options[] = {
+	{"baudrate", "Baud rate", "115200"},
+	{"num_data_bits", "Data bits", "8"},
+	{"parity_type", "Parity type", "none"},
+	{"parity_check", "Check parity?", "yes"},
+	{"num_stop_bits", "Stop bit(s)", "1"},
+	{"bit_order", "Bit order", "lsb-first"},
+	{NULL, NULL, NULL},
+};
+
+static const char *uart_annotations[][2] = {
+	{"ASCII", "Data bytes as ASCII characters"},
+	{"Decimal", "Databytes as decimal, integer values"},
+	{"Hex", "Data bytes in hex format"},
+	{"Octal", "Data bytes as octal numbers"},
+	{"Bits", "Data bytes in bit notation (sequence of 0/1 digits)"},
+	{NULL, NULL},
+};
+
+static const char *parity_types[] = {
+	[PARITY_NONE] = "none",
+	[PARITY_ODD] = "odd",
+	[PARITY_EVEN] = "even",
+	[PARITY_ZERO] = "zero",
+	[PARITY_ONE] = "one",
+};
+
+/*
+ * Given the value of the parity bit and of the data, return TRUE if the
+ * parity is correct, FALSE otherwise.
+ */
+static gboolean parity_ok(int parity_type, int parity_bit, uint64_t data)
+{
+	int ones;
+
+	/* Handle easy cases first (parity bit is always 1 or 0). */
+	if (parity_type == PARITY_ZERO)
+		return parity_bit == 0;
+	else if (parity_type == PARITY_ONE)
+		return parity_bit == 1;
+
+	/* Count number of 1 (high) bits in the data (and the parity bit!). */
+	ones = parity_bit;
+	for (; data; data >>= 1)
+		ones += data & 1;
+
+	if (parity_type == PARITY_ODD)
+		return (ones % 2) == 1;
+	else
+		return (ones % 2) == 0;
+}
+
+static int uart_inst_new(struct srd_decoder_inst *di)
+{
+	struct uart *u;
+	int rxtx;
+
+	if (!(u = g_try_malloc0(sizeof(struct uart)))) {
+		srd_err("Failed to g_malloc() struct uart.");
+		return SRD_ERR_MALLOC;
+	}
+
+	for (rxtx = RX; rxtx <= TX; rxtx++) {
+		u->state[rxtx] = WAIT_FOR_START_BIT;
+		u->startsample[rxtx] = -1;
+		u->oldbit[rxtx] = -1;
+	}
+	di->priv = u;
+
+	return SRD_OK;
+}
+
+static int uart_option_set(struct srd_decoder_inst *di, const char *key,
+			   const char *value)
+{
+	struct uart *u;
+	unsigned int i;
+
+	u = di->priv;
+
+	if (!strcmp(key, "baudrate"))
+		return srd_native_option_int(value, 1, G_MAXINT64,
+					     &u->baudrate);
+
+	if (!strcmp(key, "num_data_bits"))
+		return srd_native_option_int(value, 5, 9, &u->num_data_bits);
+
+	if (!strcmp(key, "parity_type")) {
+		for (i = 0; i < G_N_ELEMENTS(parity_types); i++) {
+			if (!strcmp(value, parity_types[i])) {
+				u->parity_type = i;
+				return SRD_OK;
+			}
+		}
+		return SRD_ERR_ARG;
+	}
+
+	if (!strcmp(key, "bit_order")) {
+		if (!strcmp(value, "lsb-first"))
+			u->msb_first = FALSE;
+		else if (!strcmp(value, "msb-first"))
+			u->msb_first = TRUE;
+		else
+			return SRD_ERR_ARG;
+		return SRD_OK;
+	}
+
+	/* parity_check and num_stop_bits aren't used (yet). */
+	return SRD_OK;
+}
+
+static int uart_start(struct srd_decoder_inst *di, uint64_t samplerate)
+{
+	struct uart *u;
+
+	u = di->priv;
+	u->out_proto = srd_inst_pd_output_add(di, SRD_OUTPUT_PROTO, "uart");
+	u->out_ann = srd_inst_pd_output_add(di, SRD_OUTPUT_ANN, "uart");
+
+	/* The width of one UART bit in number of samples. */
+	u->bit_width = (double)samplerate / (double)u->baudrate;
+
+	return SRD_OK;
+}
+
+/* Return TRUE if we reached the middle of the desired bit, FALSE otherwise. */
+static gboolean reached_bit(const struct uart *u, int rxtx, int bitnum)
+{
+	double bitpos;
+
+	/*
+	 * bitpos is the samplenumber which is in the middle of the
+	 * specified UART bit (0 = start bit, 1..x = data, x+1 = parity bit
+	 * (if used) or the first stop bit, and so on).
+	 */
+	bitpos = u->frame_start[rxtx] + (u->bit_width / 2.0);
+	bitpos += bitnum * u->bit_width;
+
+	return u->samplenum >= bitpos;
+}
+
+static void wait_for_start_bit(struct uart *u, int rxtx, int old_signal,
+			       int signal)
+{
+	/*
+	 * The start bit is always 0 (low). As the idle UART (and the stop bit)
+	 * level is 1 (high), the beginning of a start bit is a falling edge.
+	 */
+	if (!(old_signal == 1 && signal == 0))
+		return;
+
+	/* Save the sample number where the start bit begins. */
+	u->frame_start[rxtx] = u->samplenum;
+
+	u->state[rxtx] = GET_START_BIT;
+}
+
+static void get_start_bit(struct srd_decoder_inst *di, struct uart *u,
+			  int rxtx, int signal)
+{
+	const char *ann[] = {"Start bit", "Start", "S", NULL};
+
+	/* Skip samples until we're in the middle of the start bit. */
+	if (!reached_bit(u, rxtx, 0))
+		return;
+
+	/* The startbit must be 0. If not, we report an error. */
+	if (signal != 0)
+		srd_native_put_proto(di, u->out_proto, u->frame_start[rxtx],
+				     u->samplenum, "[sii]", "INVALID STARTBIT",
+				     rxtx, signal);
+
+	u->cur_data_bit[rxtx] = 0;
+	u->databyte[rxtx] = 0;
+	u->startsample[rxtx] = -1;
+
+	u->state[rxtx] = GET_DATA_BITS;
+
+	srd_native_put_proto(di, u->out_proto, u->frame_start[rxtx],
+			     u->samplenum, "[sii]", "STARTBIT", rxtx, signal);
+	srd_inst_put_ann(di, u->out_ann, u->frame_start[rxtx], u->samplenum,
+			 ANN_ASCII, ann);
+}
+
+/* Format a value like Python's bin() does, i.e. without leading zeroes. */
+static void format_bin(char *buf, uint64_t value)
+{
+	int bit;
+
+	for (bit = 63; bit > 0 && !(value >> bit); bit--)
+		;
+	for (; bit >= 0; bit--)
+		*buf++ = '0' + ((value >> bit) & 1);
+	*buf = '\0';
+}
+
+static void put_data(struct srd_decoder_inst *di, struct uart *u, int rxtx)
+{
+	const char *s, *ann[3];
+	char str[2][80], bits[65];
+	uint64_t ss, es, b;
+	int len;
+
+	s = (rxtx == RX) ? "RX: " : "TX: ";
+	b = u->databyte[rxtx];
+	ss = u->startsample[rxtx];
+	es = u->samplenum - 1;
+	ann[1] = ann[2] = NULL;
+
+	srd_native_put_proto(di, u->out_proto, ss, es, "[siK]", "DATA", rxtx,
+			     (unsigned long long)b);
+
+	/* The data bits are at most 9, so this is chr() in Python. */
+	len = g_snprintf(str[0], sizeof(str[0]), "%s", s);
+	str[0][len + g_unichar_to_utf8(b, str[0] + len)] = '\0';
+	ann[0] = str[0];
+	srd_inst_put_ann(di, u->out_ann, ss, es, ANN_ASCII, ann);
+
+	g_snprintf(str[0], sizeof(str[0]), "%s%" PRIu64, s, b);
+	srd_inst_put_ann(di, u->out_ann, ss, es, ANN_DEC, ann);
+
+	ann[1] = str[1];
+	g_snprintf(str[0], sizeof(str[0]), "%s0x%" PRIx64, s, b);
+	g_snprintf(str[1], sizeof(str[1]), "%s%" PRIx64, s, b);
+	srd_inst_put_ann(di, u->out_ann, ss, es, ANN_HEX, ann);
+
+	g_snprintf(str[0], sizeof(str[0]), "%s0o%" PRIo64, s, b);
+	g_snprintf(str[1], sizeof(str[1]), "%s%" PRIo64, s, b);
+	srd_inst_put_ann(di, u->out_ann, ss, es, ANN_OCT, ann);
+
+	format_bin(bits, b);
+	g_snprintf(str[0], sizeof(str[0]), "%s0b%s", s, bits);
+	g_snprintf(str[1], sizeof(str[1]), "%s%s", s, bits);
+	srd_inst_put_ann(di, u->out_ann, ss, es, ANN_BITS, ann);
+}
+
+static void get_data_bits(struct srd_decoder_inst *di, struct uart *u,
+			  int rxtx, int signal)
+{
+	/* Skip samples until we're in the middle of the desired data bit. */
+	if (!reached_bit(u, rxtx, u->cur_data_bit[rxtx] + 1))
+		return;
+
+	/* Save the sample number where the data byte starts. */
+	if (u->startsample[rxtx] == -1)
+		u->startsample[rxtx] = u->samplenum;
+
+	/* Get the next data bit in LSB-first or MSB-first fashion. */
+	if (!u->msb_first) {
+		u->databyte[rxtx] >>= 1;
+		u->databyte[rxtx] |=
+			((uint64_t)signal << (u->num_data_bits - 1));
+	} else {
+		u->databyte[rxtx] <<= 1;
+		u->databyte[rxtx] |= ((uint64_t)signal << 0);
+	}
+
+	/* Return here, unless we already received all data bits. */
+	if (u->cur_data_bit[rxtx] < u->num_data_bits - 1) {
+		u->cur_data_bit[rxtx]++;
+		return;
+	}
+
+	u->state[rxtx] = GET_PARITY_BIT;
+
+	put_data(di, u, rxtx);
+}
+
+static void get_parity_bit(struct srd_decoder_inst *di, struct uart *u,
+			   int rxtx, int signal)
+{
+	const char *ann_ok[] = {"Parity bit", "Parity", "P", NULL};
+	const char *ann_err[] = {"Parity error", "Parity err", "PE", NULL};
+
+	/* If no parity is used/configured, skip to the next state at once. */
+	if (u->parity_type == PARITY_NONE) {
+		u->state[rxtx] = GET_STOP_BITS;
+		return;
+	}
+
+	/* Skip samples until we're in the middle of the parity bit. */
+	if (!reached_bit(u, rxtx, u->num_data_bits + 1))
+		return;
+
+	u->state[rxtx] = GET_STOP_BITS;
+
+	if (parity_ok(u->parity_type, signal, u->databyte[rxtx])) {
+		srd_native_put_proto(di, u->out_proto, u->samplenum,
+				     u->samplenum, "[sii]", "PARITYBIT", rxtx,
+				     signal);
+		srd_inst_put_ann(di, u->out_ann, u->samplenum, u->samplenum,
+				 ANN_ASCII, ann_ok);
+	} else {
+		/* TODO: Return expected/actual parity values. */
+		srd_native_put_proto(di, u->out_proto, u->samplenum,
+				     u->samplenum, "[si(ii)]", "PARITY ERROR",
+				     rxtx, 0, 1);
+		srd_inst_put_ann(di, u->out_ann, u->samplenum, u->samplenum,
+				 ANN_ASCII, ann_err);
+	}
+}
+
+/* TODO: Currently only supports 1 stop bit. */
+static void get_stop_bits(struct srd_decoder_inst *di, struct uart *u,
+			  int rxtx, int signal)
+{
+	const char *ann[] = {"Stop bit", "Stop", "P", NULL};
+	int b;
+
+	/* Skip samples until we're in the middle of the stop bit(s). */
+	b = u->num_data_bits + 1 + (u->parity_type == PARITY_NONE ? 0 : 1);
+	if (!reached_bit(u, rxtx, b))
+		return;
+
+	/* Stop bits must be 1. If not, we report an error. */
+	if (signal != 1)
+		srd_native_put_proto(di, u->out_proto, u->frame_start[rxtx],
+				     u->samplenum, "[sii]", "INVALID STOPBIT",
+				     rxtx, signal);
+
+	u->state[rxtx] = WAIT_FOR_START_BIT;
+
+	srd_native_put_proto(di, u->out_proto, u->samplenum, u->samplenum,
+			     "[sii]", "STOPBIT", rxtx, signal);
+	srd_inst_put_ann(di, u->out_ann, u->samplenum, u->samplenum,
+			 ANN_ASCII, ann);
+}
+
+static int uart_decode(struct srd_decoder_inst *di, uint64_t start_samplenum,
+		       const uint8_t *inbuf, uint64_t inbuflen)
+{
+	struct uart *u;
+	uint64_t num_samples, i, sample;
+	int rxtx, signal[2];
+
+	u = di->priv;
+	num_samples = inbuflen / di->data_unitsize;
+
+	/* Only the samples where RX or TX changed come through here. */
+	for (i = 0; srd_logic_next(di, inbuf, num_samples, &i, &sample); i++) {
+		u->samplenum = start_samplenum + i;
+		signal[RX] = srd_logic_probe(di, sample, RX);
+		signal[TX] = srd_logic_probe(di, sample, TX);
+
+		/* First sample: Save RX/TX value. */
+		if (u->oldbit[RX] == -1) {
+			u->oldbit[RX] = signal[RX];
+			continue;
+		}
+		if (u->oldbit[TX] == -1) {
+			u->oldbit[TX] = signal[TX];
+			continue;
+		}
+
+		/* State machine. */
+		for (rxtx = RX; rxtx <= TX; rxtx++) {
+			switch (u->state[rxtx]) {
+			case WAIT_FOR_START_BIT:
+				wait_for_start_bit(u, rxtx, u->oldbit[rxtx],
+						   signal[rxtx]);
+				break;
+			case GET_START_BIT:
+				get_start_bit(di, u, rxtx, signal[rxtx]);
+				break;
+			case GET_DATA_BITS:
+				get_data_bits(di, u, rxtx, signal[rxtx]);
+				break;
+			case GET_PARITY_BIT:
+				get_parity_bit(di, u, rxtx, signal[rxtx]);
+				break;
+			case GET_STOP_BITS:
+				get_stop_bits(di, u, rxtx, signal[rxtx]);
+				break;
+			}
+
+			/* Save current RX/TX values for the next round. */
+			u->oldbit[rxtx] = signal[rxtx];
+		}
+	}
+
+	return SRD_OK;
+}
+
+static void uart_inst_free(struct srd_decoder_inst *di)
+{
+	g_free(di->priv);
+	di->priv = NULL;
+}
+
+SRD_PRIV const struct srd_decoder_native srd_native_uart = {
+	.id = "uart",
+	.name = "UART",
+	.longname = "Universal Asynchronous Receiver/Transmitter",
+	.desc = "Asynchronous, serial bus.",
+	.license = "gplv2+",
+	.doc = "UART protocol decoder (native).\n"
+	       "\n"
+	       "Protocol output format:\n"
+	       "\n"
+	       "UART packet:\n"
+	       "[<packet-type>, <rxtx>, <packet-data>]\n"
+	       "\n"
+	       "This is the list of <packet-type>s and their respective "
+	       "<packet-data>:\n"
+	       " - 'STARTBIT': The data is the (integer) value of the start "
+	       "bit (0/1).\n"
+	       " - 'DATA': The data is the (integer) value of the UART data.\n"
+	       " - 'PARITYBIT': The data is the (integer) value of the parity "
+	       "bit (0/1).\n"
+	       " - 'STOPBIT': The data is the (integer) value of the stop bit "
+	       "(0 or 1).\n"
+	       " - 'INVALID STARTBIT': The data is the (integer) value of the "
+	       "start bit (0/1).\n"
+	       " - 'INVALID STOPBIT': The data is the (integer) value of the "
+	       "stop bit (0/1).\n"
+	       " - 'PARITY ERROR': The data is a tuple with two entries.\n"
+	       "\n"
+	       "The <rxtx> field is 0 for RX packets, 1 for TX packets.\n",
+	.probes = uart_probes,
+	.options = uart_options,
+	.annotations = uart_annotations,
+	.edges_only = TRUE,
+	.inst_new = uart_inst_new,
+	.option_set = uart_option_set,
+	.start = uart_start,
+	.decode = uart_decode,
+	.inst_free = uart_inst_free,
+};
@@ -33,8 +33,12 @@ SRD_PRIV int srd_inst_decode(uint64_t start_samplenum,
 			     const uint8_t *inbuf, uint64_t inbuflen);
 SRD_PRIV void srd_inst_free(struct srd_decoder_inst *di);
 SRD_PRIV void srd_inst_free_all(GSList *stack);
-SRD_PRIV int srd_inst_pd_output_add(struct srd_decoder_inst *di,
-				    int output_type, const char *output_id);
+SRD_PRIV struct srd_pd_output *srd_inst_output_get(
+		const struct srd_decoder_inst *di, int output_id);
+SRD_PRIV int srd_inst_put_ann_take(struct srd_decoder_inst *di, int output_id,
+				   uint64_t start_sample, uint64_t end_sample,
+				   int ann_format, char **ann);
+SRD_PRIV gboolean srd_pd_output_ann_wanted(void);
 
 /*--- decoder.c -------------------------------------------------------------*/
 
@@ -53,6 +57,27 @@ SRD_PRIV int srd_info(const char *format, ...);
 SRD_PRIV int srd_warn(const char *format, ...);
 SRD_PRIV int srd_err(const char *format, ...);
 
+/*--- native/native.c -------------------------------------------------------*/
+
+SRD_PRIV const struct srd_decoder_native **srd_native_decoder_list(void);
+SRD_PRIV int srd_native_option_int(const char *value, int64_t min,
+				   int64_t max, int64_t *out);
+SRD_PRIV void srd_native_put_proto(struct srd_decoder_inst *di, int output_id,
+				   uint64_t start_sample, uint64_t end_sample,
+				   const char *format, ...);
+
+/*--- type_logic.c ----------------------------------------------------------*/
+
+SRD_PRIV srd_chunk *srd_chunk_new(struct srd_decoder_inst *di,
+				  uint64_t start_samplenum,
+				  const uint8_t *inbuf, uint64_t inbuflen);
+SRD_PRIV int srd_chunk_release(srd_chunk *chunk);
+SRD_PRIV uint64_t srd_logic_sample(const struct srd_decoder_inst *di,
+				  const uint8_t *inbuf, uint64_t samplenum);
+SRD_PRIV uint64_t srd_logic_next_edge(const struct srd_decoder_inst *di,
+				      const uint8_t *inbuf,
+				      uint64_t num_samples, uint64_t start);
+
 /*--- util.c ----------------------------------------------------------------*/
 
 SRD_PRIV int py_attr_as_str(const PyObject *py_obj, const char *attr,
@@ -61,7 +86,5 @@ SRD_PRIV int py_dictitem_as_str(const PyObject *py_obj, const char *key,
 				char **outstr);
 SRD_PRIV int py_str_as_str(const PyObject *py_str, char **outstr);
 SRD_PRIV int py_strlist_to_char(const PyObject *py_strlist, char ***outstr);
-SRD_PRIV struct srd_decoder_inst *srd_inst_find_by_obj(const GSList *stack,
-						       const PyObject *obj);
 
 #endif
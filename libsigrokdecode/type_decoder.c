@@ -33,8 +33,6 @@ static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
 			 int *ann_format, char ***ann)
 {
 	PyObject *py_tmp;
-	struct srd_pd_output *pdo;
-	int ann_id;
 
 	/* Should be a list of [annotation format, [string, ...]]. */
 	if (!PyList_Check(obj) && !PyTuple_Check(obj)) {
@@ -52,8 +50,8 @@ static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
 	}
 
 	/*
-	 * The first element should be an integer matching a previously
-	 * registered annotation format.
+	 * The first element should be an integer, matching a previously
+	 * registered annotation format (srd_inst_put_ann_take() checks that).
 	 */
 	py_tmp = PyList_GetItem(obj, 0);
 	if (!PyLong_Check(py_tmp)) {
@@ -61,14 +59,7 @@ static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
 			"first element was not an integer.", di->decoder->name);
 		return SRD_ERR_PYTHON;
 	}
-
-	ann_id = PyLong_AsLong(py_tmp);
-	if (!(pdo = g_slist_nth_data(di->decoder->annotations, ann_id))) {
-		srd_err("Protocol decoder %s submitted data to unregistered "
-			"annotation format %d.", di->decoder->name, ann_id);
-		return SRD_ERR_PYTHON;
-	}
-	*ann_format = ann_id;
+	*ann_format = PyLong_AsLong(py_tmp);
 
 	/* Second element must be a list. */
 	py_tmp = PyList_GetItem(obj, 1);
@@ -88,16 +79,14 @@ static int convert_pyobj(struct srd_decoder_inst *di, PyObject *obj,
 
 static PyObject *Decoder_put(PyObject *self, PyObject *args)
 {
-	GSList *l;
-	PyObject *data, *py_res;
-	struct srd_decoder_inst *di, *next_di;
+	PyObject *data;
+	struct srd_decoder_inst *di;
 	struct srd_pd_output *pdo;
-	struct srd_proto_data *pdata;
 	uint64_t start_sample, end_sample;
-	int output_id;
-	void (*cb)();
+	int output_id, ann_format;
+	char **ann;
 
-	if (!(di = srd_inst_find_by_obj(NULL, self))) {
+	if (!(di = ((srd_Decoder *)self)->di)) {
 		/* Shouldn't happen. */
 		srd_dbg("put(): self instance not found.");
 		return NULL;
@@ -113,54 +102,32 @@ static PyObject *Decoder_put(PyObject *self, PyObject *args)
 		return NULL;
 	}
 
-	if (!(l = g_slist_nth(di->pd_output, output_id))) {
+	if (!(pdo = srd_inst_output_get(di, output_id))) {
 		srd_err("Protocol decoder %s submitted invalid output ID %d.",
 			di->decoder->name, output_id);
 		return NULL;
 	}
-	pdo = l->data;
 
 	srd_spew("Instance %s put %" PRIu64 "-%" PRIu64 " %s on oid %d.",
 		 di->inst_id, start_sample, end_sample,
 		 OUTPUT_TYPES[pdo->output_type], output_id);
 
-	if (!(pdata = g_try_malloc0(sizeof(struct srd_proto_data)))) {
-		srd_err("Failed to g_malloc() struct srd_proto_data.");
-		return NULL;
-	}
-	pdata->start_sample = start_sample;
-	pdata->end_sample = end_sample;
-	pdata->pdo = pdo;
-
 	switch (pdo->output_type) {
 	case SRD_OUTPUT_ANN:
 		/* Annotations are only fed to callbacks. */
-		if ((cb = srd_pd_output_callback_find(pdo->output_type))) {
-			/* Annotations need converting from PyObject. */
-			if (convert_pyobj(di, data, &pdata->ann_format,
-					  (char ***)&pdata->data) != SRD_OK) {
-				/* An error was already logged. */
-				break;
-			}
-			cb(pdata);
+		if (!srd_pd_output_ann_wanted())
+			break;
+		/* Annotations need converting from PyObject. */
+		if (convert_pyobj(di, data, &ann_format, &ann) != SRD_OK) {
+			/* An error was already logged. */
+			break;
 		}
+		srd_inst_put_ann_take(di, output_id, start_sample, end_sample,
+				      ann_format, ann);
 		break;
 	case SRD_OUTPUT_PROTO:
-		for (l = di->next_di; l; l = l->next) {
-			next_di = l->data;
-			/* TODO: Is this needed? */
-			Py_XINCREF(next_di->py_inst);
-			srd_spew("Sending %d-%d to instance %s",
-				 start_sample, end_sample,
-				 next_di->inst_id);
-			if (!(py_res = PyObject_CallMethod(
-			    next_di->py_inst, "decode", "KKO", start_sample,
-			    end_sample, data))) {
-				srd_exception_catch("Calling %s decode(): ",
-						    next_di->inst_id);
-			}
-			Py_XDECREF(py_res);
-		}
+		srd_inst_put_proto(di, output_id, start_sample, end_sample,
+				   data);
 		break;
 	case SRD_OUTPUT_BINARY:
 		srd_err("SRD_OUTPUT_BINARY not yet supported.");
@@ -171,8 +138,6 @@ static PyObject *Decoder_put(PyObject *self, PyObject *args)
 		break;
 	}
 
-	g_free(pdata);
-
 	Py_RETURN_NONE;
 }
 
@@ -183,7 +148,7 @@ static PyObject *Decoder_add(PyObject *self, PyObject *args)
 	char *proto_id;
 	int output_type, pdo_id;
 
-	if (!(di = srd_inst_find_by_obj(NULL, self))) {
+	if (!(di = ((srd_Decoder *)self)->di)) {
 		PyErr_SetString(PyExc_Exception, "decoder instance not found");
 		return NULL;
 	}
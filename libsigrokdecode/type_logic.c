@@ -18,9 +18,188 @@
  */
 
 #include "sigrokdecode.h" /* First, so we avoid a _POSIX_C_SOURCE warning. */
+#include "sigrokdecode-internal.h"
 #include "config.h"
 #include <inttypes.h>
 #include <string.h>
+#include <structmember.h>
+
+/**
+ * Get a sample out of a buffer of packed samples.
+ *
+ * @param di The decoder instance the samples are for. Must not be NULL.
+ * @param inbuf The samples. Must not be NULL.
+ * @param samplenum The number of the sample in inbuf.
+ *
+ * @return The sample, with probe n in bit n.
+ */
+SRD_PRIV uint64_t srd_logic_sample(const struct srd_decoder_inst *di,
+				  const uint8_t *inbuf, uint64_t samplenum)
+{
+	uint64_t sample;
+
+	sample = 0;
+	memcpy(&sample, inbuf + samplenum * di->data_unitsize,
+	       di->data_unitsize);
+
+	return sample;
+}
+
+/**
+ * Find the next sample where one of the decoder's probes changed, relative
+ * to the last sample it was given (di->edge_last).
+ *
+ * For unitsizes of 1, 2 and 4, whole 64-bit words of samples are compared
+ * at once, against the last sample (and the mask) repeated across the word.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param inbuf The samples. Must not be NULL.
+ * @param num_samples The number of samples in inbuf.
+ * @param start The sample to start searching at.
+ *
+ * @return The number of the first changed sample at or after 'start', or
+ *         num_samples if there is none.
+ */
+SRD_PRIV uint64_t srd_logic_next_edge(const struct srd_decoder_inst *di,
+				      const uint8_t *inbuf,
+				      uint64_t num_samples, uint64_t start)
+{
+	uint64_t i, word, last, mask, per_word;
+	int unitsize, bits;
+
+	unitsize = di->data_unitsize;
+	i = start;
+
+	if (unitsize == 1 || unitsize == 2 || unitsize == 4) {
+		/* Repeat the last sample and the mask across a word. */
+		last = di->edge_last;
+		mask = di->edge_mask;
+		for (bits = unitsize * 8; bits < 64; bits *= 2) {
+			last |= last << bits;
+			mask |= mask << bits;
+		}
+		per_word = 8 / unitsize;
+		for (; i + per_word <= num_samples; i += per_word) {
+			memcpy(&word, inbuf + i * unitsize, sizeof(word));
+			if ((word ^ last) & mask)
+				break;
+		}
+	}
+
+	/* Pinpoint the change within the word (or do it the slow way). */
+	for (; i < num_samples; i++) {
+		if ((srd_logic_sample(di, inbuf, i) ^ di->edge_last)
+		    & di->edge_mask)
+			break;
+	}
+
+	return i;
+}
+
+/* Move on to the run which holds sample 'pos'. */
+static void rle_seek(struct srd_decoder_inst *di, uint64_t pos)
+{
+	while (di->rle_run < di->rle_num_runs
+	       && di->rle_start + di->rle_lengths[di->rle_run] <= pos) {
+		di->rle_start += di->rle_lengths[di->rle_run];
+		di->rle_run++;
+	}
+}
+
+/* Like srd_logic_next(), with inbuf holding the values of the runs. */
+static gboolean rle_next(struct srd_decoder_inst *di, const uint8_t *inbuf,
+			 uint64_t *pos, uint64_t *sample)
+{
+	rle_seek(di, *pos);
+
+	/* Nothing changes within a run, only its first sample can. */
+	if (di->decoder->edges_only && di->edge_started) {
+		if (di->rle_run < di->rle_num_runs && *pos > di->rle_start)
+			rle_seek(di, di->rle_start
+				 + di->rle_lengths[di->rle_run]);
+		while (di->rle_run < di->rle_num_runs
+		       && !((srd_logic_sample(di, inbuf, di->rle_run)
+			     ^ di->edge_last) & di->edge_mask))
+			rle_seek(di, di->rle_start
+				 + di->rle_lengths[di->rle_run]);
+		*pos = di->rle_start;
+	}
+
+	if (di->rle_run >= di->rle_num_runs)
+		return FALSE;
+
+	*sample = srd_logic_sample(di, inbuf, di->rle_run);
+
+	return TRUE;
+}
+
+/**
+ * Get the next sample to pass to a decoder.
+ *
+ * That's simply the sample at *pos, unless the decoder is edges_only: then
+ * it's the first one at or after *pos in which one of the decoder's probes
+ * changed.
+ *
+ * When the samples came in as runs (srd_session_send_rle()), inbuf holds
+ * the values of the runs, while *pos and num_samples still count samples.
+ * An edges_only decoder then only looks at the first sample of every run.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param inbuf The samples. Must not be NULL.
+ * @param num_samples The number of samples in inbuf.
+ * @param pos The number of the sample in inbuf to start at. Upon return,
+ *            the number of the sample returned. Must not be NULL.
+ * @param sample Upon return, the sample, with probe n in bit n. Must not be
+ *               NULL.
+ *
+ * @return TRUE if a sample was returned, FALSE at the end of inbuf.
+ */
+SRD_API gboolean srd_logic_next(struct srd_decoder_inst *di,
+				const uint8_t *inbuf, uint64_t num_samples,
+				uint64_t *pos, uint64_t *sample)
+{
+	if (di->rle_lengths) {
+		if (*pos >= num_samples || !rle_next(di, inbuf, pos, sample))
+			return FALSE;
+	} else {
+		/* Skip the samples where none of the decoder's probes changed. */
+		if (di->decoder->edges_only && di->edge_started)
+			*pos = srd_logic_next_edge(di, inbuf, num_samples,
+						   *pos);
+
+		if (*pos >= num_samples)
+			return FALSE;
+
+		*sample = srd_logic_sample(di, inbuf, *pos);
+	}
+
+	if (di->decoder->edges_only) {
+		di->edge_last = *sample & di->edge_mask;
+		di->edge_started = TRUE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Get the value of one of a decoder's probes out of a sample.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param sample The sample, as returned by srd_logic_next().
+ * @param probe The index of the probe in the decoder's probe list.
+ *
+ * @return The probe's value (0 or 1), or 42 if the probe isn't used, as
+ *         for Python decoders.
+ */
+SRD_API int srd_logic_probe(const struct srd_decoder_inst *di,
+			    uint64_t sample, int probe)
+{
+	/* A probemap value of -1 means "unused optional probe". */
+	if (di->dec_probemap[probe] == -1)
+		return 42;
+
+	return (sample >> di->dec_probemap[probe]) & 1;
+}
 
 static PyObject *srd_logic_iter(PyObject *self)
 {
@@ -32,11 +211,17 @@ static PyObject *srd_logic_iternext(PyObject *self)
 	int i;
 	PyObject *py_samplenum, *py_samples;
 	srd_logic *logic;
-	uint64_t sample;
+	struct srd_decoder_inst *di;
+	uint64_t sample, num_samples;
 	uint8_t probe_samples[SRD_MAX_NUM_PROBES + 1];
 
 	logic = (srd_logic *)self;
-	if (logic->itercnt >= logic->inbuflen / logic->di->data_unitsize) {
+	di = logic->di;
+	num_samples = logic->inbuflen / di->data_unitsize;
+
+	/* Get probe bits into the 'sample' variable. */
+	if (!srd_logic_next(di, logic->inbuf, num_samples, &logic->itercnt,
+			    &sample)) {
 		/* End iteration loop. */
 		return NULL;
 	}
@@ -46,11 +231,6 @@ static PyObject *srd_logic_iternext(PyObject *self)
 	 * and 0x00 values, so the PD doesn't need to do any bitshifting.
 	 */
 
-	/* Get probe bits into the 'sample' variable. */
-	memcpy(&sample,
-	       logic->inbuf + logic->itercnt * logic->di->data_unitsize,
-	       logic->di->data_unitsize);
-
 	/* All probe values (required + optional) are pre-set to 42. */
 	memset(probe_samples, 42, logic->di->dec_num_probes);
 	/* TODO: None or -1 in Python would be better. */
@@ -89,3 +269,283 @@ SRD_PRIV PyTypeObject srd_logic_type = {
 	.tp_iter = srd_logic_iter,
 	.tp_iternext = srd_logic_iternext,
 };
+
+/*
+ * srd_chunk: the input of decode_chunk(), i.e. a whole chunk of logic
+ * samples at once.
+ *
+ * The packed samples are in chunk.data, a memoryview of the frontend's
+ * buffer (no copy). The controller owns that memoryview, and releases it
+ * after decode_chunk() returned; views the PD derived from it (or made of
+ * the chunk itself) must be gone by then, otherwise the decode fails.
+ * Alternatively, plane() and bitplane() return the samples of a single
+ * probe as a bytes object, with one 0x00 or 0x01 byte per sample.
+ */
+
+static void srd_chunk_dealloc(PyObject *self)
+{
+	srd_chunk *chunk;
+	int i;
+
+	chunk = (srd_chunk *)self;
+	Py_XDECREF(chunk->data);
+	for (i = 0; i < SRD_MAX_NUM_PROBES; i++)
+		Py_XDECREF(chunk->planes[i]);
+	PyObject_Del(self);
+}
+
+static int srd_chunk_getbuffer(PyObject *self, Py_buffer *view, int flags)
+{
+	srd_chunk *chunk;
+
+	chunk = (srd_chunk *)self;
+	if (!chunk->inbuf) {
+		PyErr_SetString(PyExc_BufferError,
+				"chunk is only valid during decode_chunk()");
+		view->obj = NULL;
+		return -1;
+	}
+
+	if (PyBuffer_FillInfo(view, self, (void *)chunk->inbuf,
+			      chunk->inbuflen, 1, flags) < 0)
+		return -1;
+	chunk->exports++;
+
+	return 0;
+}
+
+static void srd_chunk_releasebuffer(PyObject *self, Py_buffer *view)
+{
+	/* Avoid compiler warnings. */
+	(void)view;
+
+	((srd_chunk *)self)->exports--;
+}
+
+/* Return the samples of one bit of the packed samples, one byte each. */
+static PyObject *chunk_plane(srd_chunk *chunk, int bit)
+{
+	PyObject *py_plane;
+	const uint8_t *in;
+	char *out;
+	uint64_t i;
+	int shift;
+
+	if (!chunk->inbuf) {
+		PyErr_SetString(PyExc_ValueError,
+				"chunk is only valid during decode_chunk()");
+		return NULL;
+	}
+
+	if (bit < 0 || bit >= chunk->unitsize * 8
+	    || bit >= SRD_MAX_NUM_PROBES) {
+		PyErr_Format(PyExc_IndexError, "no probe %d in the input",
+			     bit);
+		return NULL;
+	}
+
+	if (!chunk->planes[bit]) {
+		if (!(py_plane = PyBytes_FromStringAndSize(NULL,
+						chunk->num_samples)))
+			return NULL;
+		out = PyBytes_AS_STRING(py_plane);
+		in = chunk->inbuf + bit / 8;
+		shift = bit % 8;
+		for (i = 0; i < chunk->num_samples; i++) {
+			out[i] = (*in >> shift) & 1;
+			in += chunk->unitsize;
+		}
+		chunk->planes[bit] = py_plane;
+	}
+
+	Py_INCREF(chunk->planes[bit]);
+
+	return chunk->planes[bit];
+}
+
+static PyObject *Chunk_plane(PyObject *self, PyObject *args)
+{
+	srd_chunk *chunk;
+	int probe, bit;
+
+	chunk = (srd_chunk *)self;
+	if (!PyArg_ParseTuple(args, "i", &probe))
+		return NULL;
+
+	if (probe < 0 || probe >= chunk->di->dec_num_probes) {
+		PyErr_Format(PyExc_IndexError, "decoder has no probe %d",
+			     probe);
+		return NULL;
+	}
+
+	/* A probemap value of -1 means "unused optional probe". */
+	if ((bit = chunk->di->dec_probemap[probe]) == -1)
+		Py_RETURN_NONE;
+
+	return chunk_plane(chunk, bit);
+}
+
+static PyObject *Chunk_bitplane(PyObject *self, PyObject *args)
+{
+	int bit;
+
+	if (!PyArg_ParseTuple(args, "i", &bit))
+		return NULL;
+
+	return chunk_plane((srd_chunk *)self, bit);
+}
+
+static PyObject *Chunk_get_probemap(PyObject *self, void *closure)
+{
+	srd_chunk *chunk;
+	PyObject *py_probemap, *py_bit;
+	int i;
+
+	/* Avoid compiler warnings. */
+	(void)closure;
+
+	chunk = (srd_chunk *)self;
+	if (!(py_probemap = PyTuple_New(chunk->di->dec_num_probes)))
+		return NULL;
+	for (i = 0; i < chunk->di->dec_num_probes; i++) {
+		if (!(py_bit = PyLong_FromLong(chunk->di->dec_probemap[i]))) {
+			Py_DECREF(py_probemap);
+			return NULL;
+		}
+		PyTuple_SET_ITEM(py_probemap, i, py_bit);
+	}
+
+	return py_probemap;
+}
+
+static PyMethodDef Chunk_methods[] = {
+	{"plane", Chunk_plane, METH_VARARGS,
+	 "Samples of the given decoder probe, one 0/1 byte each (bytes), "
+	 "or None if the probe isn't used"},
+	{"bitplane", Chunk_bitplane, METH_VARARGS,
+	 "Samples of the given bit of the packed samples, one 0/1 byte each"},
+	{NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Chunk_members[] = {
+	{"data", T_OBJECT, offsetof(srd_chunk, data), READONLY,
+	 "memoryview of the packed samples, only valid during decode_chunk()"},
+	{"samplenum", T_ULONGLONG, offsetof(srd_chunk, start_samplenum),
+	 READONLY, "Sample number of the first sample"},
+	{"num_samples", T_ULONGLONG, offsetof(srd_chunk, num_samples),
+	 READONLY, "Number of samples"},
+	{"unitsize", T_INT, offsetof(srd_chunk, unitsize),
+	 READONLY, "Bytes per packed sample"},
+	{"num_probes", T_INT, offsetof(srd_chunk, num_probes),
+	 READONLY, "Number of probes in the packed samples"},
+	{NULL, 0, 0, 0, NULL}
+};
+
+static PyGetSetDef Chunk_getset[] = {
+	{"probemap", Chunk_get_probemap, NULL,
+	 "Bit in the packed samples for each decoder probe, -1 if unused",
+	 NULL},
+	{NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyBufferProcs Chunk_as_buffer = {
+	.bf_getbuffer = srd_chunk_getbuffer,
+	.bf_releasebuffer = srd_chunk_releasebuffer,
+};
+
+SRD_PRIV PyTypeObject srd_chunk_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "srd_chunk",
+	.tp_basicsize = sizeof(srd_chunk),
+	.tp_dealloc = srd_chunk_dealloc,
+	.tp_as_buffer = &Chunk_as_buffer,
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_doc = "Sigrokdecode logic sample chunk object",
+	.tp_methods = Chunk_methods,
+	.tp_members = Chunk_members,
+	.tp_getset = Chunk_getset,
+};
+
+/**
+ * Create a chunk object for a decode_chunk() call.
+ *
+ * @param di The decoder instance. Must not be NULL.
+ * @param start_samplenum The sample number of the first sample in inbuf.
+ * @param inbuf The samples. Must stay valid until srd_chunk_release().
+ * @param inbuflen Length of inbuf in bytes.
+ *
+ * @return A new reference to the chunk, or NULL upon errors.
+ */
+SRD_PRIV srd_chunk *srd_chunk_new(struct srd_decoder_inst *di,
+				  uint64_t start_samplenum,
+				  const uint8_t *inbuf, uint64_t inbuflen)
+{
+	srd_chunk *chunk;
+
+	if (!(chunk = PyObject_New(srd_chunk, &srd_chunk_type)))
+		return NULL;
+
+	chunk->di = di;
+	chunk->start_samplenum = start_samplenum;
+	chunk->unitsize = di->data_unitsize;
+	chunk->num_samples = inbuflen / di->data_unitsize;
+	chunk->num_probes = di->data_num_probes;
+	chunk->inbuf = inbuf;
+	chunk->inbuflen = inbuflen;
+	chunk->exports = 0;
+	chunk->data = NULL;
+	memset(chunk->planes, 0, sizeof(chunk->planes));
+
+	/* The PD's view of the samples, which srd_chunk_release() revokes. */
+	if (!(chunk->data = PyMemoryView_FromObject((PyObject *)chunk))) {
+		Py_DECREF(chunk);
+		return NULL;
+	}
+
+	return chunk;
+}
+
+/**
+ * Drop the controller's reference to a chunk, after decode_chunk() returned.
+ *
+ * The chunk's memoryview is released, and the chunk is cut off from its
+ * samples, since the PD may still hold references to either; unpacked
+ * planes it fetched stay valid.
+ *
+ * Any buffer view the PD still holds would point into the frontend's
+ * buffer after it has been freed or reused, so that is an error.
+ *
+ * @param chunk The chunk. Must not be NULL.
+ *
+ * @return SRD_OK upon success, SRD_ERR_PYTHON if the PD kept views of the
+ *         samples.
+ */
+SRD_PRIV int srd_chunk_release(srd_chunk *chunk)
+{
+	PyObject *py_res;
+	int ret;
+
+	ret = SRD_OK;
+
+	/* This fails if the PD made views of the memoryview. */
+	if (!(py_res = PyObject_CallMethod(chunk->data, "release", NULL))) {
+		srd_exception_catch("Protocol decoder instance %s: ",
+				    chunk->di->inst_id);
+		ret = SRD_ERR_PYTHON;
+	}
+	Py_XDECREF(py_res);
+	Py_CLEAR(chunk->data);
+
+	/* Slices of it, or views of the chunk itself, keep exports up. */
+	if (chunk->exports) {
+		srd_err("Instance %s kept %d buffer views of its input after "
+			"decode_chunk().", chunk->di->inst_id, chunk->exports);
+		ret = SRD_ERR_PYTHON;
+	}
+
+	chunk->inbuf = NULL;
+	chunk->inbuflen = 0;
+	Py_DECREF(chunk);
+
+	return ret;
+}
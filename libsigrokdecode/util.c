@@ -181,9 +181,12 @@ SRD_PRIV int py_strlist_to_char(const PyObject *py_strlist, char ***outstr)
 		if (!(py_str = PyUnicode_AsEncodedString(
 		    PyList_GetItem((PyObject *)py_strlist, i), "utf-8", NULL)))
 			return SRD_ERR_PYTHON;
-		if (!(str = PyBytes_AS_STRING(py_str)))
+		if (!(str = PyBytes_AS_STRING(py_str))) {
+			Py_DecRef(py_str);
 			return SRD_ERR_PYTHON;
+		}
 		out[i] = g_strdup(str);
+		Py_DecRef(py_str);
 	}
 	out[i] = NULL;
 	*outstr = out;
@@ -36,14 +36,27 @@
 
 #define DEFAULT_OUTPUT_FORMAT "bits:width=64"
 
+/* Number of samples run-length encoded data is expanded in at a time. */
+#define RLE_EXPAND_SAMPLES (64 * 1024)
+
+/* Number of samples raw analog data is converted in at a time. */
+#define ANALOG_CONVERT_SAMPLES (16 * 1024)
+
+/* Packet types datafeed_in() takes on top of the basic ones. */
+#define DATAFEED_ACCEPT (SR_DF_ACCEPT_LOGIC_RLE | SR_DF_ACCEPT_ANALOG_RAW)
+
 extern struct sr_hwcap_option sr_hwcap_options[];
 
 static uint64_t limit_samples = 0;
 static uint64_t limit_frames = 0;
+static uint64_t datastore_ram = 0;
 static struct sr_output_format *output_format = NULL;
 static int default_output_format = FALSE;
 static char *output_format_param = NULL;
 static GHashTable *pd_ann_visible = NULL;
+static int logic_probelist[SR_MAX_NUM_PROBES] = { 0 };
+/* With --datastore-ram, the session file is saved from this when done. */
+static struct sr_datastore *save_datastore = NULL;
 
 static gboolean opt_version = FALSE;
 static gint opt_loglevel = SR_LOG_WARN; /* Show errors+warnings per default. */
@@ -57,12 +70,15 @@ static gchar *opt_triggers = NULL;
 static gchar *opt_pds = NULL;
 static gchar *opt_pd_stack = NULL;
 static gchar *opt_pd_annotations = NULL;
+static gint opt_pd_threads = 0;
 static gchar *opt_input_format = NULL;
 static gchar *opt_output_format = NULL;
 static gchar *opt_time = NULL;
 static gchar *opt_samples = NULL;
 static gchar *opt_frames = NULL;
 static gchar *opt_continuous = NULL;
+static gboolean opt_stats = FALSE;
+static gchar *opt_datastore_ram = NULL;
 
 static GOptionEntry optargs[] = {
 	{"version", 'V', 0, G_OPTION_ARG_NONE, &opt_version,
@@ -93,6 +109,8 @@ static GOptionEntry optargs[] = {
 			"Protocol decoder stack", NULL},
 	{"protocol-decoder-annotations", 'A', 0, G_OPTION_ARG_STRING, &opt_pd_annotations,
 			"Protocol decoder annotation(s) to show", NULL},
+	{"protocol-decoder-threads", 0, 0, G_OPTION_ARG_INT, &opt_pd_threads,
+			"Number of threads to run protocol decoders on", NULL},
 	{"time", 0, 0, G_OPTION_ARG_STRING, &opt_time,
 			"How long to sample (ms)", NULL},
 	{"samples", 0, 0, G_OPTION_ARG_STRING, &opt_samples,
@@ -101,6 +119,10 @@ static GOptionEntry optargs[] = {
 			"Number of frames to acquire", NULL},
 	{"continuous", 0, 0, G_OPTION_ARG_NONE, &opt_continuous,
 			"Sample continuously", NULL},
+	{"stats", 0, 0, G_OPTION_ARG_NONE, &opt_stats,
+			"Show session statistics when done", NULL},
+	{"datastore-ram", 0, 0, G_OPTION_ARG_STRING, &opt_datastore_ram,
+			"Max. sample data to keep in RAM when saving", NULL},
 	{NULL, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -419,24 +441,134 @@ static void show_pd_detail(void)
 	g_strfreev(pdtokens);
 }
 
+/* (Re)build the probe filter if the input unit size changed. */
+static int filter_plan_check(struct sr_filter_plan **plan, int in_unitsize,
+			     int out_unitsize, const int *probelist)
+{
+	if (*plan && (*plan)->in_unitsize != in_unitsize) {
+		sr_filter_plan_destroy(*plan);
+		*plan = NULL;
+	}
+	if (!*plan && sr_filter_plan_new(in_unitsize, out_unitsize,
+					 probelist, plan) != SR_OK) {
+		g_critical("Failed to set up probe filter.");
+		return SR_ERR;
+	}
+
+	return SR_OK;
+}
+
+/* Grow a buffer to at least 'size' bytes. */
+static uint8_t *buf_reserve(uint8_t **buf, uint64_t *buf_size, uint64_t size)
+{
+	uint8_t *p;
+
+	if (size > *buf_size) {
+		if (!(p = g_try_realloc(*buf, size))) {
+			g_critical("Buffer malloc failed.");
+			return NULL;
+		}
+		*buf = p;
+		*buf_size = size;
+	}
+
+	return *buf;
+}
+
+static void output_write(FILE *outfile, uint8_t *output_buf,
+			 uint64_t output_len)
+{
+	if (!output_buf)
+		return;
+
+	fwrite(output_buf, 1, output_len, outfile);
+	fflush(outfile);
+	g_free(output_buf);
+}
+
+/*
+ * Pass filtered logic samples on to the session file, the protocol
+ * decoders or the output module.
+ */
+static void logic_out(struct sr_output *o, FILE *outfile, int saving,
+		      uint64_t samplenum, uint8_t *data, uint64_t length)
+{
+	uint64_t output_len;
+	uint8_t *output_buf;
+	int ret;
+
+	if (saving) {
+		/* saving to a session file, don't need to do anything else
+		 * to this data. */
+		if (save_datastore)
+			ret = sr_datastore_put(save_datastore, data, length,
+					save_datastore->ds_unitsize,
+					logic_probelist);
+		else
+			ret = sr_session_save_append(data, length);
+		if (ret != SR_OK) {
+			g_critical("Failed to save session.");
+			sr_session_stop();
+		}
+	} else if (opt_pds) {
+		if (srd_session_send(samplenum, data, length) != SRD_OK)
+			sr_session_stop();
+	} else if (o->format->data && o->format->df_type == SR_DF_LOGIC) {
+		output_buf = NULL;
+		output_len = 0;
+		o->format->data(o, data, length, &output_buf, &output_len);
+		output_write(outfile, output_buf, output_len);
+	}
+}
+
+/* Pass analog samples on to the output module. */
+static void analog_out(struct sr_output *o, FILE *outfile, const float *data,
+		       int num_samples, int num_probes)
+{
+	uint64_t output_len;
+	uint8_t *output_buf;
+
+	if (!o->format->data || o->format->df_type != SR_DF_ANALOG)
+		return;
+
+	output_buf = NULL;
+	output_len = 0;
+	o->format->data(o, (const uint8_t *)data,
+			(uint64_t)num_samples * num_probes * sizeof(float),
+			&output_buf, &output_len);
+	output_write(outfile, output_buf, output_len);
+}
+
 static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 {
 	static struct sr_output *o = NULL;
-	static int logic_probelist[SR_MAX_NUM_PROBES] = { 0 };
 	static struct sr_probe *analog_probelist[SR_MAX_NUM_PROBES];
 	static uint64_t received_samples = 0;
 	static int unitsize = 0;
 	static int triggered = 0;
+	static struct sr_filter_plan *filter_plan = NULL;
+	static uint8_t *filter_buf = NULL;
+	static uint64_t filter_buf_size = 0;
+	static uint8_t *lengths_buf = NULL;
+	static uint64_t lengths_buf_size = 0;
+	static uint8_t *expand_buf = NULL;
+	static uint64_t expand_buf_size = 0;
+	static uint8_t *float_buf = NULL;
+	static uint64_t float_buf_size = 0;
 	static FILE *outfile = NULL;
+	static int saving = FALSE;
 	static int num_analog_probes = 0;
 	struct sr_probe *probe;
 	struct sr_datafeed_logic *logic;
+	struct sr_datafeed_logic_rle *logic_rle, rle;
 	struct sr_datafeed_meta_logic *meta_logic;
 	struct sr_datafeed_analog *analog;
+	struct sr_datafeed_analog_raw *analog_raw;
 	struct sr_datafeed_meta_analog *meta_analog;
 	static int num_enabled_analog_probes = 0;
 	int num_enabled_probes, sample_size, ret, i;
-	uint64_t output_len, filter_out_len;
+	uint64_t output_len, filter_out_len, num_samples, samplenum;
+	uint64_t run, run_offset, n;
 	uint8_t *output_buf, *filter_out;
 
 	/* If the first packet to come in isn't a header, don't even try. */
@@ -485,10 +617,38 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 			g_warning("Device stopped after %" PRIu64 " samples.",
 			       received_samples);
 		sr_session_stop();
+		if (saving) {
+			if (save_datastore) {
+				ret = sr_session_save(opt_output_file);
+				sr_datastore_destroy(save_datastore);
+				dev->datastore = save_datastore = NULL;
+			} else {
+				ret = sr_session_save_end();
+			}
+			if (ret != SR_OK)
+				g_critical("Failed to save session.");
+			saving = FALSE;
+		}
 		if (outfile && outfile != stdout)
 			fclose(outfile);
 		g_free(o);
 		o = NULL;
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
+		g_free(filter_buf);
+		filter_buf = NULL;
+		filter_buf_size = 0;
+		g_free(lengths_buf);
+		lengths_buf = NULL;
+		lengths_buf_size = 0;
+		g_free(expand_buf);
+		expand_buf = NULL;
+		expand_buf_size = 0;
+		g_free(float_buf);
+		float_buf = NULL;
+		float_buf_size = 0;
 		break;
 
 	case SR_DF_TRIGGER:
@@ -510,19 +670,35 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
+		/* The probe list changed, the filter plan has to be redone. */
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
 
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
 				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				 * compress everything into it as it comes in. */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
-				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
+				if (datastore_ram) {
+					/* Unless the samples should go into a
+					 * datastore first, which spills to disk
+					 * beyond --datastore-ram. */
+					if (!save_datastore && sr_datastore_new_spill(
+							unitsize, datastore_ram,
+							&save_datastore) != SR_OK) {
+						g_critical("Failed to create datastore.");
+						exit(1);
+					}
+					dev->datastore = save_datastore;
+				} else if (sr_session_save_begin(opt_output_file,
+						dev, unitsize) != SR_OK) {
+					g_critical("Failed to save session.");
 					exit(1);
 				}
+				saving = TRUE;
 			} else {
 				/* saving to a file in whatever format was set
 				 * with --format, so all we need is a filehandle */
@@ -548,9 +724,18 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (limit_samples && received_samples >= limit_samples)
 			break;
 
-		ret = sr_filter_probes(sample_size, unitsize, logic_probelist,
-					   logic->data, logic->length,
-					   &filter_out, &filter_out_len);
+		/* The input unit size is only known once data comes in. */
+		if (filter_plan_check(&filter_plan, sample_size, unitsize,
+				      logic_probelist) != SR_OK)
+			break;
+
+		filter_out_len = logic->length / sample_size * unitsize;
+		if (!(filter_out = buf_reserve(&filter_buf, &filter_buf_size,
+					       filter_out_len)))
+			break;
+
+		ret = sr_filter_plan_run(filter_plan, logic->data, logic->length,
+					 filter_out, &filter_out_len);
 		if (ret != SR_OK)
 			break;
 
@@ -560,36 +745,93 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		 * the buffer of the last packet according to the sample limit.
 		 */
 		if (limit_samples && (received_samples + logic->length / sample_size >
-				limit_samples * sample_size))
-			filter_out_len = limit_samples * sample_size - received_samples;
+				limit_samples))
+			filter_out_len = (limit_samples - received_samples) * unitsize;
 
-		if (dev->datastore)
-			sr_datastore_put(dev->datastore, filter_out,
-					 filter_out_len, sample_size, logic_probelist);
+		logic_out(o, outfile, saving, received_samples, filter_out,
+			  filter_out_len);
 
-		if (opt_output_file && default_output_format)
-			/* saving to a session file, don't need to do anything else
-			 * to this data for now. */
-			goto cleanup;
+		received_samples += logic->length / sample_size;
+		break;
 
-		if (opt_pds) {
-			if (srd_session_send(received_samples, (uint8_t*)filter_out,
-					filter_out_len) != SRD_OK)
-				sr_session_stop();
-		} else {
+	case SR_DF_LOGIC_RLE:
+		logic_rle = packet->payload;
+		g_message("cli: received SR_DF_LOGIC_RLE, %"PRIu64" runs",
+			  logic_rle->num_runs);
+		sample_size = logic_rle->unitsize;
+		if (logic_rle->num_runs == 0)
+			break;
+
+		/* Don't store any samples until triggered. */
+		if (opt_wait_trigger && !triggered)
+			break;
+
+		if (limit_samples && received_samples >= limit_samples)
+			break;
+
+		if (filter_plan_check(&filter_plan, sample_size, unitsize,
+				      logic_probelist) != SR_OK)
+			break;
+
+		/*
+		 * Filter the run values, then merge the runs which only
+		 * differed in probes that were filtered out.
+		 */
+		rle.num_runs = logic_rle->num_runs;
+		rle.unitsize = unitsize;
+		rle.buffer = NULL;
+		if (!(rle.values = buf_reserve(&filter_buf, &filter_buf_size,
+					       rle.num_runs * unitsize)))
+			break;
+		if (!(rle.lengths = (uint32_t *)buf_reserve(&lengths_buf,
+				&lengths_buf_size, rle.num_runs * sizeof(uint32_t))))
+			break;
+		ret = sr_filter_plan_run(filter_plan, logic_rle->values,
+					 rle.num_runs * sample_size, rle.values,
+					 &filter_out_len);
+		if (ret != SR_OK)
+			break;
+		memcpy(rle.lengths, logic_rle->lengths,
+		       rle.num_runs * sizeof(uint32_t));
+		sr_rle_merge(&rle);
+
+		num_samples = sr_rle_num_samples(&rle);
+		if (limit_samples && received_samples + num_samples > limit_samples)
+			sr_rle_truncate(&rle, limit_samples - received_samples);
+
+		if (!saving && !opt_pds && o->format->data_rle
+		    && o->format->df_type == SR_DF_LOGIC) {
+			/* The output module can take the runs as they are. */
+			output_buf = NULL;
 			output_len = 0;
-			if (o->format->data && packet->type == o->format->df_type)
-				o->format->data(o, filter_out, filter_out_len, &output_buf, &output_len);
-			if (output_buf) {
-				fwrite(output_buf, 1, output_len, outfile);
-				fflush(outfile);
-				g_free(output_buf);
+			o->format->data_rle(o, &rle, &output_buf, &output_len);
+			output_write(outfile, output_buf, output_len);
+		} else if (saving && save_datastore) {
+			/* So can the datastore. */
+			if (sr_datastore_put_rle(save_datastore, &rle) != SR_OK) {
+				g_critical("Failed to save session.");
+				sr_session_stop();
+			}
+		} else if (!saving && opt_pds) {
+			/* So can the decoders. */
+			if (srd_session_send_rle(received_samples, rle.values,
+						 rle.lengths, rle.num_runs)
+			    != SRD_OK)
+				sr_session_stop();
+		} else if (buf_reserve(&expand_buf, &expand_buf_size,
+				       RLE_EXPAND_SAMPLES * unitsize)) {
+			/* Everything else gets plain samples. */
+			run = run_offset = 0;
+			samplenum = received_samples;
+			while ((n = sr_rle_expand(&rle, &run, &run_offset,
+						  expand_buf, RLE_EXPAND_SAMPLES))) {
+				logic_out(o, outfile, saving, samplenum,
+					  expand_buf, n * unitsize);
+				samplenum += n;
 			}
 		}
 
-		cleanup:
-		g_free(filter_out);
-		received_samples += logic->length / sample_size;
+		received_samples += num_samples;
 		break;
 
 	case SR_DF_META_ANALOG:
@@ -606,15 +848,10 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		outfile = stdout;
 		if (opt_output_file) {
 			if (default_output_format) {
-				/* output file is in session format, which means we'll
-				 * dump everything in the datastore as it comes in,
-				 * and save from there after the session. */
+				/* session files only hold logic data */
 				outfile = NULL;
-				ret = sr_datastore_new(unitsize, &(dev->datastore));
-				if (ret != SR_OK) {
-					printf("Failed to create datastore.\n");
-					exit(1);
-				}
+				g_warning("Analog data can't be saved in session "
+					  "files.");
 			} else {
 				/* saving to a file in whatever format was set
 				 * with --format, so all we need is a filehandle */
@@ -632,18 +869,42 @@ static void datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (limit_samples && received_samples >= limit_samples)
 			break;
 
-		if (o->format->data && packet->type == o->format->df_type) {
-			o->format->data(o, (const uint8_t *)analog->data,
-					analog->num_samples * sizeof(float),
-					&output_buf, &output_len);
-			if (output_buf) {
-				fwrite(output_buf, 1, output_len, outfile);
-				fflush(outfile);
-				g_free(output_buf);
+		analog_out(o, outfile, analog->data, analog->num_samples,
+			   MAX(1, num_enabled_analog_probes));
+
+		received_samples += analog->num_samples;
+		break;
+
+	case SR_DF_ANALOG_RAW:
+		analog_raw = packet->payload;
+		g_message("cli: received SR_DF_ANALOG_RAW, %d samples",
+			  analog_raw->num_samples);
+		if (analog_raw->num_samples == 0)
+			break;
+
+		if (limit_samples && received_samples >= limit_samples)
+			break;
+
+		/* Only convert to floats if the output module wants them. */
+		if (o->format->data && o->format->df_type == SR_DF_ANALOG
+		    && buf_reserve(&float_buf, &float_buf_size,
+				   ANALOG_CONVERT_SAMPLES * sizeof(float)
+				   * analog_raw->num_probes)) {
+			for (samplenum = 0;
+			     samplenum < (uint64_t)analog_raw->num_samples;
+			     samplenum += n) {
+				n = MIN(ANALOG_CONVERT_SAMPLES,
+					analog_raw->num_samples - samplenum);
+				if (sr_analog_raw_to_float(analog_raw,
+						samplenum, n,
+						(float *)float_buf) != SR_OK)
+					break;
+				analog_out(o, outfile, (float *)float_buf, n,
+					   analog_raw->num_probes);
 			}
 		}
 
-		received_samples += analog->num_samples;
+		received_samples += analog_raw->num_samples;
 		break;
 
 	case SR_DF_FRAME_BEGIN:
@@ -898,18 +1159,12 @@ int setup_output_format(void)
 	return 0;
 }
 
-void show_pd_annotations(struct srd_proto_data *pdata, void *cb_data)
+static void show_pd_annotation(struct srd_proto_data *pdata)
 {
 	int i;
 	char **annotations;
 	gpointer ann_format;
 
-	/* 'cb_data' is not used in this specific callback. */
-	(void)cb_data;
-
-	if (!pd_ann_visible)
-		return;
-
 	if (!g_hash_table_lookup_extended(pd_ann_visible, pdata->pdo->di->inst_id,
 			NULL, &ann_format))
 		/* Not in the list of PDs whose annotations we're showing. */
@@ -926,6 +1181,21 @@ void show_pd_annotations(struct srd_proto_data *pdata, void *cb_data)
 	for (i = 0; annotations[i]; i++)
 		printf("\"%s\" ", annotations[i]);
 	printf("\n");
+}
+
+void show_pd_annotations(struct srd_proto_data *pdata, unsigned int num_pdata,
+			 void *cb_data)
+{
+	unsigned int i;
+
+	/* 'cb_data' is not used in this specific callback. */
+	(void)cb_data;
+
+	if (!pd_ann_visible)
+		return;
+
+	for (i = 0; i < num_pdata; i++)
+		show_pd_annotation(&pdata[i]);
 	fflush(stdout);
 }
 
@@ -1021,6 +1291,76 @@ static struct sr_input_format *determine_input_file_format(
 	return inputs[i];
 }
 
+static void show_stats(void)
+{
+	static const char *packet_types[SR_DF_NUM_TYPES] = {
+		[SR_DF_HEADER] = "header",
+		[SR_DF_END] = "end",
+		[SR_DF_TRIGGER] = "trigger",
+		[SR_DF_LOGIC] = "logic",
+		[SR_DF_META_LOGIC] = "meta logic",
+		[SR_DF_ANALOG] = "analog",
+		[SR_DF_META_ANALOG] = "meta analog",
+		[SR_DF_FRAME_BEGIN] = "frame begin",
+		[SR_DF_FRAME_END] = "frame end",
+		[SR_DF_LOGIC_RLE] = "logic rle",
+		[SR_DF_ANALOG_RAW] = "analog raw",
+	};
+	const struct sr_session_stats *stats;
+	const struct sr_stats_callback *cs;
+	GSList *l;
+	double secs;
+	int i, n;
+
+	if (!(stats = sr_session_stats_get()))
+		return;
+
+	/* stdout may carry the output data. */
+	secs = stats->duration / 1000000.0;
+	fprintf(stderr, "Session statistics (%.3f s):\n", secs);
+
+	fprintf(stderr, "  Packets:\n");
+	for (i = 0; i < SR_DF_NUM_TYPES; i++) {
+		if (!stats->packets[i].count)
+			continue;
+		fprintf(stderr, "    %-12s %10" PRIu64, packet_types[i]
+			? packet_types[i] : "unknown", stats->packets[i].count);
+		if (stats->packets[i].bytes)
+			fprintf(stderr, " %14" PRIu64 " bytes",
+				stats->packets[i].bytes);
+		fprintf(stderr, "\n");
+	}
+
+	fprintf(stderr, "  Transfers: %" PRIu64 " (%" PRIu64 " bytes",
+		stats->transfers, stats->transfer_bytes);
+	if (secs > 0)
+		fprintf(stderr, ", %.2f MB/s",
+			stats->transfer_bytes / secs / 1000000.0);
+	fprintf(stderr, "), %" PRIu64 " empty, %" PRIu64 " overruns\n",
+		stats->empty_transfers, stats->overruns);
+
+	for (l = stats->callbacks, n = 1; l; l = l->next, n++) {
+		cs = l->data;
+		fprintf(stderr, "  Datafeed callback %d: %" PRIu64 " calls, "
+			"%" PRIu64 " us total, %" PRIu64 " us max\n",
+			n, cs->calls, cs->time_total, cs->time_max);
+		if (cs->queue_time_total || cs->dropped)
+			fprintf(stderr, "    queued %" PRIu64 " us total, "
+				"%" PRIu64 " us max, %" PRIu64 " dropped\n",
+				cs->queue_time_total, cs->queue_time_max,
+				cs->dropped);
+		for (i = 0; i < SR_STATS_LATENCY_BUCKETS; i++) {
+			if (!cs->latency[i])
+				continue;
+			if (i == SR_STATS_LATENCY_BUCKETS - 1)
+				fprintf(stderr, "    >= %7u us", 1U << (i - 1));
+			else
+				fprintf(stderr, "    <  %7u us", 1U << i);
+			fprintf(stderr, " %10" PRIu64 "\n", cs->latency[i]);
+		}
+	}
+}
+
 static void load_input_file_format(void)
 {
 	GHashTable *fmtargs = NULL;
@@ -1067,7 +1407,7 @@ static void load_input_file_format(void)
             return;
 
 	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_datafeed_callback_add_full(datafeed_in, DATAFEED_ACCEPT);
 	if (sr_session_dev_add(in->vdev) != SR_OK) {
 		g_critical("Failed to use device.");
 		sr_session_destroy();
@@ -1075,10 +1415,8 @@ static void load_input_file_format(void)
 	}
 
 	input_format->loadfile(in, opt_input_file);
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	if (opt_stats)
+		show_stats();
 	sr_session_destroy();
 
 	if (fmtargs)
@@ -1090,10 +1428,13 @@ static void load_input_file(void)
 
 	if (sr_session_load(opt_input_file) == SR_OK) {
 		/* sigrok session file */
-		sr_session_datafeed_callback_add(datafeed_in);
+		sr_session_datafeed_callback_add_full(datafeed_in,
+						      DATAFEED_ACCEPT);
 		sr_session_start();
 		sr_session_run();
 		sr_session_stop();
+		if (opt_stats)
+			show_stats();
 	}
 	else {
 		/* fall back on input modules */
@@ -1233,7 +1574,7 @@ static void run_session(void)
 	}
 
 	sr_session_new();
-	sr_session_datafeed_callback_add(datafeed_in);
+	sr_session_datafeed_callback_add_full(datafeed_in, DATAFEED_ACCEPT);
 
 	if (sr_session_dev_add(dev) != SR_OK) {
 		g_critical("Failed to use device.");
@@ -1361,10 +1702,9 @@ static void run_session(void)
 	if (opt_continuous)
 		clear_anykey();
 
-	if (opt_output_file && default_output_format) {
-		if (sr_session_save(opt_output_file) != SR_OK)
-			g_critical("Failed to save session.");
-	}
+	if (opt_stats)
+		show_stats();
+
 	sr_session_destroy();
 }
 
@@ -1413,13 +1753,25 @@ int main(int argc, char **argv)
 	if (sr_init() != SR_OK)
 		return 1;
 
+	if (opt_datastore_ram) {
+		if ((sr_parse_sizestring(opt_datastore_ram, &datastore_ram) != SR_OK)
+				|| (datastore_ram == 0)) {
+			g_critical("Invalid datastore RAM size '%s'.",
+				   opt_datastore_ram);
+			return 1;
+		}
+	}
+
 	if (opt_pds) {
 		if (srd_init(NULL) != SRD_OK)
 			return 1;
+		if (opt_pd_threads
+		    && srd_session_threads_set(opt_pd_threads) != SRD_OK)
+			return 1;
 		if (register_pds(NULL, opt_pds) != 0)
 			return 1;
-		if (srd_pd_output_callback_add(SRD_OUTPUT_ANN,
-				show_pd_annotations, NULL) != SRD_OK)
+		if (srd_pd_output_batch_callback_add(show_pd_annotations,
+				NULL) != SRD_OK)
 			return 1;
 		if (setup_pd_stack() != 0)
 			return 1;
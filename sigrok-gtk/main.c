@@ -38,12 +38,13 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 {
 	static int logic_probelist[SR_MAX_NUM_PROBES + 1] = { 0 };
 	static int unitsize = 0;
+	static struct sr_filter_plan *filter_plan = NULL;
 	struct sr_probe *probe;
 	struct sr_datafeed_logic *logic = NULL;
 	struct sr_datafeed_meta_logic *meta_logic;
 	int num_enabled_probes, sample_size, i;
 	uint64_t filter_out_len;
-	uint8_t *filter_out;
+	guint old_len;
 	GArray *data;
 
 	switch (packet->type) {
@@ -54,6 +55,10 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		sigview_zoom(sigview, 1, 0);
 		g_message("fe: Received SR_DF_END");
 		sr_session_stop();
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
 		break;
 	case SR_DF_TRIGGER:
 		g_message("fe: received SR_DF_TRIGGER");
@@ -78,6 +83,10 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		}
 		/* How many bytes we need to store num_enabled_probes bits */
 		unitsize = (num_enabled_probes + 7) / 8;
+		if (filter_plan) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
 		data = g_array_new(FALSE, FALSE, unitsize);
 		g_object_set_data(G_OBJECT(siglist), "sampledata", data);
 		break;
@@ -89,17 +98,23 @@ datafeed_in(struct sr_dev *dev, struct sr_datafeed_packet *packet)
 		if (!logic)
 			break;
 
-		if (sr_filter_probes(sample_size, unitsize, logic_probelist,
-					   logic->data, logic->length,
-					   &filter_out, &filter_out_len) != SR_OK)
+		if (filter_plan && filter_plan->in_unitsize != sample_size) {
+			sr_filter_plan_destroy(filter_plan);
+			filter_plan = NULL;
+		}
+		if (!filter_plan && sr_filter_plan_new(sample_size, unitsize,
+				logic_probelist, &filter_plan) != SR_OK)
 			break;
 
 		data = g_object_get_data(G_OBJECT(siglist), "sampledata");
 		g_return_if_fail(data != NULL);
 
-		g_array_append_vals(data, filter_out, filter_out_len/unitsize);
-
-		g_free(filter_out);
+		/* Filter straight into the sample array, no copies. */
+		old_len = data->len;
+		g_array_set_size(data, old_len + logic->length / sample_size);
+		sr_filter_plan_run(filter_plan, logic->data, logic->length,
+				   (uint8_t *)data->data + old_len * unitsize,
+				   &filter_out_len);
 		break;
 	default:
 		g_message("fw: received unknown packet type %d", packet->type);